@@ -0,0 +1,23 @@
+#ifndef MD5BUILDER_H
+#define MD5BUILDER_H
+
+// Host version of the Arduino MD5Builder, just the parts we use.
+#include <stdint.h>
+#include <stddef.h>
+
+class MD5Builder {
+public:
+    void begin();
+    void add(const uint8_t *data, size_t len);
+    void calculate();
+    void getBytes(uint8_t *output);
+    void getChars(char *output); // 33 bytes, lowercase hex
+private:
+    void transform(const uint8_t block[64]);
+    uint32_t _state[4];
+    uint64_t _count;
+    uint8_t _buffer[64];
+    uint8_t _digest[16];
+};
+
+#endif // MD5BUILDER_H
@@ -0,0 +1,128 @@
+/**
+ * @file file_flash_dev.cpp
+ * @brief File-backed flash device for the Linux build.
+ */
+
+#include "file_flash_dev.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+FileFlashDev::FileFlashDev(const flash_latency_t &latency) : _latency(latency) {
+}
+
+FileFlashDev::~FileFlashDev() {
+    close();
+}
+
+bool FileFlashDev::open(const char *path, size_t size) {
+    close();
+    _fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) return false;
+    struct stat st;
+    if (fstat(_fd, &st) != 0) { close(); return false; }
+    size_t old_size = st.st_size;
+    if (size == 0) size = old_size;
+    if (size == 0 || size % SPI_FLASH_SEC_SIZE != 0) { close(); return false; }
+    if (size != old_size && ftruncate(_fd, size) != 0) { close(); return false; }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) { close(); return false; }
+    _data = (uint8_t *)p;
+    _size = size;
+    if (size > old_size) memset(_data + old_size, 0xFF, size - old_size);
+    return true;
+}
+
+void FileFlashDev::close() {
+    if (_data != NULL) munmap(_data, _size);
+    if (_fd >= 0) ::close(_fd);
+    _data = NULL; _fd = -1; _size = 0;
+}
+
+void FileFlashDev::set_power_cut(uint32_t op, size_t spare_addr) {
+    _power_cut_op = op;
+    _power_ops = 0;
+    _power_spare = spare_addr;
+}
+
+void FileFlashDev::set_bad_write(uint32_t n, size_t spare_addr) {
+    _bad_write = n;
+    _writes = 0;
+    _bad_spare = spare_addr;
+}
+
+// counts a write/erase; true if the power goes now, with len cut to what
+// still makes it to the chip (half of it; the rest is left as it was)
+bool FileFlashDev::power_cut_now(size_t addr, size_t &len) {
+    if (addr / SPI_FLASH_SEC_SIZE == _power_spare / SPI_FLASH_SEC_SIZE) return false;
+    _power_ops++;
+    if (_power_ops != _power_cut_op) return false;
+    host_power_set(false);
+    len = (len / 2) & ~(size_t)(FLASH_PAGE_SIZE - 1);
+    return true;
+}
+
+esp_err_t FileFlashDev::do_read(size_t addr, void *buf, size_t len) {
+    if (!in_range(addr, len)) return ESP_ERR_INVALID_ARG;
+    memcpy(buf, _data + addr, len);
+    host_clock_advance(((uint64_t)len * _latency.read_4k_us) / SPI_FLASH_SEC_SIZE);
+    return ESP_OK;
+}
+
+// the image is mmap'ed anyway; the cache still has to fetch it all once
+const void *FileFlashDev::do_map(size_t addr, size_t len, uint32_t &handle) {
+    if (!in_range(addr, len)) return NULL;
+    host_clock_advance(((uint64_t)len * _latency.read_4k_us) / SPI_FLASH_SEC_SIZE);
+    handle = 0;
+    return _data + addr;
+}
+
+esp_err_t FileFlashDev::do_write(size_t addr, const void *buf, size_t len) {
+    if (!in_range(addr, len)) return ESP_ERR_INVALID_ARG;
+    if (!host_power_on()) return ESP_FAIL;
+    bool cut = power_cut_now(addr, len);
+    bool dropped = (addr / SPI_FLASH_SEC_SIZE != _bad_spare / SPI_FLASH_SEC_SIZE && ++_writes == _bad_write);
+    const uint8_t *src = (const uint8_t *)buf;
+    for (size_t i = 0; i < len && !dropped; i++) _data[addr + i] &= src[i]; // NOR: only 1 -> 0
+    if (len > 0) {
+        size_t pages = (addr + len - 1) / FLASH_PAGE_SIZE - addr / FLASH_PAGE_SIZE + 1;
+        host_clock_advance((uint64_t)pages * _latency.program_page_us);
+    }
+    return cut ? ESP_FAIL : ESP_OK;
+}
+
+// like spi_flash_erase_range: 64K blocks where aligned, 4K sectors elsewhere
+esp_err_t FileFlashDev::do_erase_range(size_t addr, size_t len) {
+    if (!in_range(addr, len)) return ESP_ERR_INVALID_ARG;
+    if (addr % SPI_FLASH_SEC_SIZE != 0 || len % SPI_FLASH_SEC_SIZE != 0) return ESP_ERR_INVALID_SIZE;
+    if (!host_power_on()) return ESP_FAIL;
+    if (power_cut_now(addr, len)) {
+        memset(_data + addr, 0xFF, len); // a half-erased sector
+        return ESP_FAIL;
+    }
+    memset(_data + addr, 0xFF, len);
+    uint64_t cost = 0;
+    while (len > 0) {
+        if (addr % FLASH_BLOCK_SIZE == 0 && len >= FLASH_BLOCK_SIZE) {
+            cost += _latency.erase_64k_us;
+            addr += FLASH_BLOCK_SIZE; len -= FLASH_BLOCK_SIZE;
+        } else {
+            cost += _latency.erase_4k_us;
+            addr += SPI_FLASH_SEC_SIZE; len -= SPI_FLASH_SEC_SIZE;
+        }
+    }
+    host_clock_advance(cost);
+    return ESP_OK;
+}
+
+bool flash_latency_parse_arg(const char *name, const char *value, flash_latency_t &latency) {
+    uint32_t *field = NULL;
+    if (strcmp(name, "--erase-4k") == 0) field = &latency.erase_4k_us;
+    else if (strcmp(name, "--erase-64k") == 0) field = &latency.erase_64k_us;
+    else if (strcmp(name, "--program") == 0) field = &latency.program_page_us;
+    else if (strcmp(name, "--read-4k") == 0) field = &latency.read_4k_us;
+    if (field == NULL || value == NULL) return false;
+    *field = strtoul(value, NULL, 0);
+    return true;
+}
@@ -0,0 +1,62 @@
+#ifndef FILE_FLASH_DEV_H
+#define FILE_FLASH_DEV_H
+
+// A flash chip backed by an image file, with NOR semantics (program can only
+// clear bits, erase sets 0xFF) and a latency model for the timing numbers.
+#include "flash_dev.h"
+
+#define FLASH_BLOCK_SIZE    0x10000     // 64K block erase
+#define FLASH_PAGE_SIZE     0x100       // program page
+
+typedef struct {
+    uint32_t erase_4k_us;               /*!< sector erase */
+    uint32_t erase_64k_us;              /*!< block erase */
+    uint32_t program_page_us;           /*!< program one 256 byte page */
+    uint32_t read_4k_us;                /*!< read 4K */
+} flash_latency_t;
+
+// typical-ish numbers from common 4MB SPI NOR datasheets, DOUT @ 40MHz
+#define FLASH_LATENCY_DEFAULT { 45000, 150000, 700, 800 }
+
+// handle --erase-4k / --erase-64k / --program / --read-4k <us>; false if not one of ours
+bool flash_latency_parse_arg(const char *name, const char *value, flash_latency_t &latency);
+
+class FileFlashDev : public FlashDev {
+public:
+    FileFlashDev(const flash_latency_t &latency);
+    ~FileFlashDev();
+    // open an image; if size is nonzero, (re)size it, filling new space with 0xFF
+    bool open(const char *path, size_t size);
+    void close();
+    size_t size() override { return _size; }
+    uint8_t *data() { return _data; } // direct access, for building & checking images
+    // power cut tests: cut the power in the middle of write/erase number `op`
+    // (counted from now, 1-based, 0 = never). Ops on the sector at `spare_addr`
+    // aren't counted or cut; a cut there would just be a brick.
+    void set_power_cut(uint32_t op, size_t spare_addr);
+    uint32_t power_ops() { return _power_ops; } // write/erase ops counted since set_power_cut()
+    // bad chip tests: write number `n` (counted from now, 1-based, 0 = never)
+    // says it worked but programs nothing. The spare sector is left out too.
+    void set_bad_write(uint32_t n, size_t spare_addr);
+    uint32_t writes() { return _writes; } // writes counted since set_bad_write()
+protected:
+    esp_err_t do_read(size_t addr, void *buf, size_t len) override;
+    esp_err_t do_write(size_t addr, const void *buf, size_t len) override;
+    esp_err_t do_erase_range(size_t addr, size_t len) override;
+    const void *do_map(size_t addr, size_t len, uint32_t &handle) override;
+private:
+    bool in_range(size_t addr, size_t len) { return addr <= _size && len <= _size - addr; }
+    bool power_cut_now(size_t addr, size_t &len);
+    flash_latency_t _latency;
+    int _fd = -1;
+    uint8_t *_data = NULL;
+    size_t _size = 0;
+    uint32_t _power_cut_op = 0;
+    uint32_t _power_ops = 0;
+    size_t _power_spare = (size_t)-1;
+    uint32_t _bad_write = 0;
+    uint32_t _writes = 0;
+    size_t _bad_spare = (size_t)-1;
+};
+
+#endif // FILE_FLASH_DEV_H
@@ -0,0 +1,67 @@
+/**
+ * @file host_device_info.cpp
+ * @brief device_info.h for the Linux build: describes the image instead of a chip.
+ */
+
+#include "device_info.h"
+#include "part_mgr.h"
+#include "flash_dev.h"
+#include "digest_cache.h"
+#include "sector_pool.h"
+#include "main.h"
+#include <MD5Builder.h>
+
+void getDeviceInfoData(device_info_t &info) {
+    memset(&info, 0, sizeof(info));
+    info.build = FIRMWARE_VERSION;
+    info.build_date = __DATE__ " " __TIME__;
+    info.sdk = "host";
+    info.chip_model = "flash image";
+    info.flash_size = flash_dev().size();
+}
+
+void getDeviceInfo(char* info, size_t infoSize) {
+    device_info_t d;
+    getDeviceInfoData(d);
+    snprintf(info, infoSize,
+             "Build %s - %s (host)\n"
+             "Flash image size: %u KB",
+             d.build, d.build_date, (unsigned)(d.flash_size/1024));
+}
+
+// get MD5 of bootloader; from the digest cache if it has it
+void getBootloaderMd5(char *output_buffer, size_t output_buffer_size) {
+  if (output_buffer_size < (ESP_ROM_MD5_DIGEST_LEN * 2 + 4)) {
+    snprintf(output_buffer, output_buffer_size, "Buffer too small\n");
+    return;
+  }
+  uint8_t md5_buf[ESP_ROM_MD5_DIGEST_LEN];
+  if (!digest_cache_get("bootloader", md5_buf)) {
+    MD5Builder _md5 = MD5Builder();
+    _md5.begin();
+
+    SectorBuffer sector;
+    uint8_t *partition_buffer = sector.data();
+    if (partition_buffer == NULL) {
+      snprintf(output_buffer, output_buffer_size, "Out of memory\n");
+      return;
+    }
+    for (uint32_t addr = 0x1000; addr < getPartitionTableAddr(); addr += SPI_FLASH_SEC_SIZE) {
+      if (flash_dev().read(addr, partition_buffer, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+        snprintf(output_buffer, output_buffer_size, "Failed to read flash at offset 0x%x\n", addr);
+        return;
+      }
+      _md5.add(partition_buffer, SPI_FLASH_SEC_SIZE);
+    }
+    _md5.calculate();
+    _md5.getBytes(md5_buf);
+  }
+
+  // same grouping as on the device
+  char *p = output_buffer;
+  for (int i = 0; i < 16; i++) {
+    p += sprintf(p, "%02x", md5_buf[i]);
+    if ((i + 1) % 4 == 0 && i != 15) *p++ = ' ';
+  }
+  *p = '\0';
+}
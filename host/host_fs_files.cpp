@@ -0,0 +1,157 @@
+/**
+ * @file host_fs_files.cpp
+ * @brief fs_files.h for the Linux build: a stand-in filesystem, not LittleFS or SPIFFS.
+ *
+ * Block 0 has the signature fs_carry_detect() looks for (so it's found as the
+ * kind it was formatted as), then a directory: name, offset & size of each
+ * file. Files start on a sector of their own, in the order they're written.
+ * Nothing is ever freed, which is plenty for formatting & filling it once.
+ */
+
+#include "fs_files.h"
+#include "fs_carry.h"
+#include "flash_dev.h"
+#include "part_mgr.h"
+#include "part_table.h"
+
+#define HOST_FS_MAGIC           0x30534648 // "HFS0"
+#define HOST_FS_DIR_OFFSET      0x100
+#define HOST_FS_MAX_FILES       ((SPI_FLASH_SEC_SIZE - HOST_FS_DIR_OFFSET - 4) / sizeof(_host_fs_entry_t))
+
+typedef struct {
+    char path[64];
+    uint32_t offset;                    // from the start of the partition
+    uint32_t size;
+} _host_fs_entry_t;
+
+static struct {
+    fs_kind_t kind;
+    uint32_t address, size;
+    uint8_t block0[SPI_FLASH_SEC_SIZE];
+    int file;                           // open file, -1 = none
+    bool writing;
+    uint32_t pos;
+} _fs = {FS_KIND_NONE, 0, 0, {}, -1, false, 0};
+
+static uint32_t &_count() { return *(uint32_t *)(_fs.block0 + HOST_FS_DIR_OFFSET); }
+static _host_fs_entry_t *_entries() { return (_host_fs_entry_t *)(_fs.block0 + HOST_FS_DIR_OFFSET + 4); }
+
+// where the table on flash has the partition
+static bool _find(const char *label) {
+    uint8_t data[PART_TABLE_MAX_SIZE];
+    part_table_t table;
+    char error[64];
+    if (getPartitionTableAddr() == 0 || flash_dev().read(getPartitionTableAddr(), data, sizeof(data)) != ESP_OK ||
+        !part_table_parse_bin(data, sizeof(data), table, error, sizeof(error))) {
+        return false;
+    }
+    int i = part_table_find_label(table, label);
+    if (i < 0) return false;
+    _fs.address = table.entries[i].address;
+    _fs.size = table.entries[i].size;
+    return true;
+}
+
+bool fs_files_mount(fs_kind_t kind, const char *label) {
+    fs_files_unmount();
+    uint32_t magic;
+    if (kind == FS_KIND_NONE || !_find(label) ||
+        flash_dev().read(_fs.address, _fs.block0, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+        return false;
+    }
+    memcpy(&magic, _fs.block0, sizeof(magic));
+    if (magic != HOST_FS_MAGIC || _count() > HOST_FS_MAX_FILES) return false;
+    _fs.kind = kind;
+    return true;
+}
+
+bool fs_files_format(fs_kind_t kind, const char *label) {
+    fs_files_unmount();
+    if (kind == FS_KIND_NONE || !_find(label) || flash_dev().erase_range(_fs.address, _fs.size) != ESP_OK) {
+        return false;
+    }
+    memset(_fs.block0, 0xFF, sizeof(_fs.block0));
+    uint32_t magic = HOST_FS_MAGIC;
+    memcpy(_fs.block0, &magic, sizeof(magic));
+    if (kind == FS_KIND_LITTLEFS) {
+        memcpy(_fs.block0 + 8, "littlefs", 8);
+    } else {
+        // what SPIFFS keeps at the end of the lookup page of block 0
+        uint16_t spiffs_magic = FS_SPIFFS_MAGIC(_fs.size / SPI_FLASH_SEC_SIZE, 0);
+        memcpy(_fs.block0 + FS_SPIFFS_MAGIC_PADDR(0), &spiffs_magic, sizeof(spiffs_magic));
+    }
+    _count() = 0;
+    if (flash_dev().write(_fs.address, _fs.block0, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+    _fs.kind = kind;
+    return true;
+}
+
+void fs_files_unmount() {
+    fs_files_close();
+    _fs.kind = FS_KIND_NONE;
+}
+
+bool fs_files_list(fs_files_each_t each, void *ctx) {
+    if (_fs.kind == FS_KIND_NONE) return false;
+    for (uint32_t n = 0; n < _count(); n++) {
+        if (!each(ctx, _entries()[n].path, _entries()[n].size)) return false;
+    }
+    return true;
+}
+
+bool fs_files_open(const char *path, bool write) {
+    fs_files_close();
+    if (_fs.kind == FS_KIND_NONE || strlen(path) >= sizeof(_entries()[0].path)) return false;
+    _fs.pos = 0;
+    _fs.writing = write;
+    if (!write) {
+        for (uint32_t n = 0; n < _count(); n++) {
+            if (strcmp(_entries()[n].path, path) == 0) _fs.file = n;
+        }
+        return _fs.file >= 0;
+    }
+    if (_count() >= HOST_FS_MAX_FILES) return false;
+    uint32_t end = SPI_FLASH_SEC_SIZE;
+    for (uint32_t n = 0; n < _count(); n++) {
+        uint32_t e = (_entries()[n].offset + _entries()[n].size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+        if (e > end) end = e;
+    }
+    _fs.file = _count();
+    _host_fs_entry_t &entry = _entries()[_fs.file];
+    memset(entry.path, 0, sizeof(entry.path));
+    strcpy(entry.path, path);
+    entry.offset = end;
+    entry.size = 0;
+    return true;
+}
+
+int fs_files_read(uint8_t *data, size_t len) {
+    if (_fs.file < 0 || _fs.writing) return -1;
+    const _host_fs_entry_t &entry = _entries()[_fs.file];
+    if (len > entry.size - _fs.pos) len = entry.size - _fs.pos;
+    if (len > 0 && flash_dev().read(_fs.address + entry.offset + _fs.pos, data, len) != ESP_OK) return -1;
+    _fs.pos += len;
+    return len;
+}
+
+bool fs_files_write(const uint8_t *data, size_t len) {
+    if (_fs.file < 0 || !_fs.writing) return false;
+    _host_fs_entry_t &entry = _entries()[_fs.file];
+    if (entry.offset + entry.size + len > _fs.size ||
+        flash_dev().write(_fs.address + entry.offset + entry.size, data, len) != ESP_OK) {
+        return false;
+    }
+    entry.size += len;
+    return true;
+}
+
+// a written file only counts once the directory has it
+void fs_files_close() {
+    if (_fs.file >= 0 && _fs.writing) {
+        _count() = _fs.file + 1;
+        if (flash_dev().erase_range(_fs.address, SPI_FLASH_SEC_SIZE) == ESP_OK) {
+            flash_dev().write(_fs.address, _fs.block0, SPI_FLASH_SEC_SIZE);
+        }
+    }
+    _fs.file = -1;
+}
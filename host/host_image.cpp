@@ -0,0 +1,428 @@
+/**
+ * @file host_image.cpp
+ * @brief Partition CSV parsing, test image generation and verification.
+ */
+
+#include "host_image.h"
+#include "esp_image_format.h"
+#include <MD5Builder.h>
+#include <algorithm>
+#include "utils.h"
+#include "gz_stream.h"
+#include "fs_files.h"
+#include "part_install.h"
+
+bool read_file(const char *path, std::string &data) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+    data.clear();
+    char buf[1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+    fclose(f);
+    return true;
+}
+
+bool csv_parse_file(const char *path, std::vector<csv_entry_t> &entries, std::string &error) {
+    std::string text;
+    if (!read_file(path, text)) { error = "can't open file"; return false; }
+    part_table_t table;
+    char c_error[80];
+    if (!part_table_parse_csv(text.c_str(), text.size(), HOST_TABLE_ADDR, table, c_error, sizeof(c_error))) {
+        error = c_error;
+        return false;
+    }
+    entries = table_entries(table);
+    return true;
+}
+
+std::vector<csv_entry_t> table_entries(const part_table_t &table) {
+    std::vector<csv_entry_t> entries;
+    for (int i = 0; i < table.count; i++) {
+        const part_entry_t &p = table.entries[i];
+        entries.push_back({p.label, p.type, p.subtype, p.address, p.size, p.flags});
+    }
+    return entries;
+}
+
+// deterministic contents for a partition, so we can tell where bytes came from
+static uint8_t pattern_byte(const std::string &label, uint32_t pos) {
+    uint32_t h = 2166136261u;
+    for (char c : label) h = (h ^ (uint8_t)c) * 16777619u;
+    uint32_t x = h ^ (pos / 4) * 0x9E3779B1u;
+    x ^= x >> 15; x *= 0x2c1b3c6d; x ^= x >> 12;
+    return (uint8_t)(x >> ((pos % 4) * 8));
+}
+
+// how much of a partition holds data; the rest is left erased, like in the field
+static uint32_t used_bytes(const csv_entry_t &e) {
+    uint32_t used;
+    if (e.type == ESP_PARTITION_TYPE_APP) {
+        used = e.size / 10 * 7;
+    } else if (e.subtype >= 0x81 && e.subtype <= 0x83) { // fat, spiffs, littlefs
+        used = e.size / 4;
+    } else {
+        used = e.size / 2;
+    }
+    return used & ~(SPI_FLASH_SEC_SIZE - 1);
+}
+
+// expected contents of one sector of a partition; apps get a valid image
+// header so app_image_length() finds exactly the used part
+static void fill_sector(const csv_entry_t &e, uint32_t pos, uint8_t *sector) {
+    uint32_t used = used_bytes(e);
+    for (uint32_t i = 0; i < SPI_FLASH_SEC_SIZE; i++) {
+        sector[i] = (pos + i < used) ? pattern_byte(e.label, pos + i) : 0xFF;
+    }
+    if (e.type != ESP_PARTITION_TYPE_APP || pos != 0 || used < SPI_FLASH_SEC_SIZE) return;
+    // header, a 0x100 byte segment, then one segment with the rest;
+    // image = align16(headers + segments + checksum) + 32 byte SHA256 = used
+    esp_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ESP_IMAGE_HEADER_MAGIC;
+    header.segment_count = 2;
+    header.hash_appended = 1;
+    esp_image_segment_header_t seg1 = {0x3f400020, 0x100};
+    esp_image_segment_header_t seg2 = {0x400d0020,
+        (uint32_t)(used - 32 - 1 - sizeof(header) - 2 * sizeof(seg1) - seg1.data_len)};
+    memcpy(sector, &header, sizeof(header));
+    memcpy(sector + sizeof(header), &seg1, sizeof(seg1));
+    memcpy(sector + sizeof(header) + sizeof(seg1) + seg1.data_len, &seg2, sizeof(seg2));
+}
+
+std::string image_firmware(uint32_t size, const std::string &name) {
+    esp_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ESP_IMAGE_HEADER_MAGIC;
+    header.segment_count = 3;
+    esp_image_segment_header_t segments[3] = {{0x3f400020, 0x100}, {0x3ffb0000, 0x10000}, {0x400d0020, 0}};
+    uint32_t fixed = sizeof(header) + sizeof(segments) + segments[0].data_len + segments[1].data_len + 16;
+    segments[2].data_len = (size > fixed) ? (size - fixed) & ~3 : 0;
+    std::string image((const char *)&header, sizeof(header));
+    uint8_t checksum = 0xEF;
+    for (const esp_image_segment_header_t &segment : segments) {
+        image.append((const char *)&segment, sizeof(segment));
+        for (uint32_t i = 0; i < segment.data_len; i++) {
+            uint8_t c = (segment.load_addr == 0x3ffb0000) ? 0 : pattern_byte(name, image.size());
+            image.push_back(c);
+            checksum ^= c;
+        }
+    }
+    while (image.size() % 16 != 15) image.push_back(0);
+    image.push_back(checksum);
+    return image;
+}
+
+esp_err_t image_install(OutputSink &out, const part_mgr_env_t &env, const std::string &firmware) {
+    esp_err_t err = part_install_begin(out, env);
+    if (err != ESP_OK) return err;
+    for (size_t pos = 0; pos < firmware.size(); pos += HOST_UPLOAD_CHUNK_SIZE) {
+        size_t n = std::min(firmware.size() - pos, (size_t)HOST_UPLOAD_CHUNK_SIZE);
+        if (part_install_write((const uint8_t *)firmware.data() + pos, n) != ESP_OK) break;
+    }
+    return part_install_finish(out);
+}
+
+static bool has_fs(const csv_entry_t &e) {
+    return e.type == ESP_PARTITION_TYPE_DATA && (e.subtype == 0x82 || e.subtype == 0x83); // spiffs, littlefs
+}
+
+// what image_create() puts on filesystem partitions with `files`: a WLED-ish set,
+// the presets growing with the partition
+static std::vector<std::pair<std::string, std::string>> fs_contents(const csv_entry_t &e) {
+    static const struct { const char *path; uint32_t size; } files[] = {
+        {"/cfg.json", 1800}, {"/wsec.json", 220}, {"/presets.json", 0}, {"/ledmap.json", 3100},
+        {"/skin.css", 9000}, {"/fonts/console_font_5x12.wbf", 2900},
+    };
+    std::vector<std::pair<std::string, std::string>> contents;
+    for (const auto &f : files) {
+        uint32_t size = f.size ? f.size : e.size / 24;
+        std::string data(size, '\0');
+        for (uint32_t i = 0; i < size; i++) data[i] = pattern_byte(e.label + f.path, i);
+        contents.push_back({f.path, data});
+    }
+    return contents;
+}
+
+static bool fs_fill(const csv_entry_t &e) {
+    if (!fs_files_format(FS_KIND_LITTLEFS, e.label.c_str())) return false;
+    bool ok = true;
+    for (const auto &f : fs_contents(e)) {
+        ok = ok && fs_files_open(f.first.c_str(), true) &&
+             fs_files_write((const uint8_t *)f.second.data(), f.second.size());
+        fs_files_close();
+    }
+    fs_files_unmount();
+    return ok;
+}
+
+static bool list_file(void *ctx, const char *path, uint32_t size) {
+    ((std::vector<std::pair<std::string, uint32_t>> *)ctx)->push_back({path, size});
+    return true;
+}
+
+// the filesystem on partition `label` has just the files image_create() put on `e`
+static bool fs_check(const csv_entry_t &e, const char *label, std::string &report) {
+    std::vector<std::pair<std::string, uint32_t>> listed;
+    if (!fs_files_mount(FS_KIND_LITTLEFS, label) || !fs_files_list(list_file, &listed)) {
+        fs_files_unmount();
+        report += std::string(label) + ": filesystem doesn't mount\n";
+        return false;
+    }
+    std::vector<std::pair<std::string, std::string>> expect = fs_contents(e);
+    bool ok = true;
+    if (listed.size() != expect.size()) {
+        char c_buffer[96];
+        snprintf(c_buffer, sizeof(c_buffer), "%s: %u files instead of %u\n", label, (unsigned)listed.size(),
+                 (unsigned)expect.size());
+        report += c_buffer;
+        ok = false;
+    }
+    for (const auto &f : expect) {
+        std::string data(f.second.size() + 1, '\0');
+        int n = fs_files_open(f.first.c_str(), false) ? fs_files_read((uint8_t *)&data[0], data.size()) : -1;
+        fs_files_close();
+        if (n != (int)f.second.size() || data.compare(0, n, f.second) != 0) {
+            report += std::string(label) + ": " + f.first + " is missing or differs\n";
+            ok = false;
+        }
+    }
+    fs_files_unmount();
+    return ok;
+}
+
+static void table_encode(const std::vector<csv_entry_t> &entries, uint8_t *out) {
+    part_table_t table;
+    table.count = 0;
+    for (const csv_entry_t &e : entries) {
+        part_entry_t &p = table.entries[table.count++];
+        p.type = e.type; p.subtype = e.subtype;
+        p.address = e.offset; p.size = e.size;
+        memset(p.label, 0, sizeof(p.label));
+        strncpy(p.label, e.label.c_str(), sizeof(p.label) - 1);
+        p.flags = e.flags;
+    }
+    part_table_encode(table, out);
+}
+
+bool image_create(FlashDev &dev, const std::vector<csv_entry_t> &entries, bool files) {
+    if (entries.size() > MAX_NUMBER_OF_PARTITIONS) return false;
+    for (const csv_entry_t &e : entries) {
+        if ((uint64_t)e.offset + e.size > dev.size()) return false;
+    }
+    uint8_t sector[SPI_FLASH_SEC_SIZE];
+    if (dev.erase_range(0, dev.size()) != ESP_OK) return false;
+
+    // fake bootloader: image magic, then noise
+    for (uint32_t addr = 0x1000; addr < HOST_TABLE_ADDR; addr += SPI_FLASH_SEC_SIZE) {
+        for (uint32_t i = 0; i < SPI_FLASH_SEC_SIZE; i++) sector[i] = pattern_byte("bootloader", addr + i);
+        if (addr == 0x1000) sector[0] = 0xE9;
+        if (dev.write(addr, sector, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+    }
+    table_encode(entries, sector);
+    if (dev.write(HOST_TABLE_ADDR, sector, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+
+    for (const csv_entry_t &e : entries) {
+        if (files && has_fs(e)) {
+            if (!fs_fill(e)) return false;
+            continue;
+        }
+        uint32_t used = used_bytes(e);
+        for (uint32_t pos = 0; pos < used; pos += SPI_FLASH_SEC_SIZE) {
+            fill_sector(e, pos, sector);
+            if (dev.write(e.offset + pos, sector, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+        }
+    }
+    return true;
+}
+
+part_mgr_env_t image_env(const std::vector<csv_entry_t> &entries, int running_slot) {
+    part_mgr_env_t env = {0, 0, false};
+    // OTA slots in subtype order, like esp_ota_get_next_update_partition walks them
+    std::vector<const csv_entry_t *> slots;
+    for (int sub = ESP_PARTITION_SUBTYPE_APP_OTA_0; sub < ESP_PARTITION_SUBTYPE_APP_OTA_0 + 16; sub++) {
+        for (const csv_entry_t &e : entries) {
+            if (e.type == ESP_PARTITION_TYPE_APP && e.subtype == sub) slots.push_back(&e);
+        }
+    }
+    const csv_entry_t *factory = NULL;
+    for (const csv_entry_t &e : entries) {
+        if (e.type == ESP_PARTITION_TYPE_APP && e.subtype == ESP_PARTITION_SUBTYPE_APP_FACTORY) factory = &e;
+    }
+    if (slots.empty()) {
+        if (factory != NULL) env.running_address = factory->offset;
+        return env;
+    }
+    int running = (running_slot < (int)slots.size()) ? running_slot : 0;
+    env.running_address = slots[running]->offset;
+    if (slots.size() > 1) env.next_address = slots[(running + 1) % slots.size()]->offset;
+    return env;
+}
+
+bool image_read_entries(FlashDev &dev, std::vector<csv_entry_t> &entries) {
+    entries.clear();
+    uint32_t addr = getPartitionTableAddr();
+    uint8_t data[PART_TABLE_MAX_SIZE];
+    part_table_t table;
+    char error[64];
+    if (addr == 0 || dev.read(addr, data, sizeof(data)) != ESP_OK ||
+        !part_table_parse_bin(data, sizeof(data), table, error, sizeof(error))) {
+        return false;
+    }
+    entries = table_entries(table);
+    return true;
+}
+
+// esp_ota_select_entry_t: sequence, label, state, then the CRC of the sequence
+int image_boot_slot(FlashDev &dev, const std::vector<csv_entry_t> &entries) {
+    const csv_entry_t *otadata = NULL;
+    int slots = 0;
+    for (const csv_entry_t &e : entries) {
+        if (e.type == ESP_PARTITION_TYPE_DATA && e.subtype == ESP_PARTITION_SUBTYPE_DATA_OTA) otadata = &e;
+        if (e.type == ESP_PARTITION_TYPE_APP && e.subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 &&
+            e.subtype < ESP_PARTITION_SUBTYPE_APP_OTA_0 + 16) slots++;
+    }
+    if (otadata == NULL || slots == 0 || otadata->size < 2 * SPI_FLASH_SEC_SIZE) return -1;
+    uint32_t best_seq = 0;
+    for (int n = 0; n < 2; n++) {
+        uint8_t entry[32];
+        if (dev.read(otadata->offset + n * SPI_FLASH_SEC_SIZE, entry, sizeof(entry)) != ESP_OK) continue;
+        uint32_t seq, crc;
+        memcpy(&seq, entry, 4);
+        memcpy(&crc, entry + 28, 4);
+        if (seq == 0 || seq == 0xFFFFFFFF || gz_crc32(0xFFFFFFFF, entry, 4) != crc) continue;
+        if (seq > best_seq) best_seq = seq;
+    }
+    return best_seq ? (best_seq - 1) % slots : -1;
+}
+
+// [from, to) of a partition is all 0xFF; else note where it isn't
+static bool range_blank(FlashDev &dev, const char *label, uint32_t address, uint32_t from, uint32_t to,
+                        std::string &report) {
+    uint8_t sector[SPI_FLASH_SEC_SIZE];
+    for (uint32_t p = from; p < to; p += SPI_FLASH_SEC_SIZE) {
+        if (dev.read(address + p, sector, SPI_FLASH_SEC_SIZE) != ESP_OK || !is_blank(sector, SPI_FLASH_SEC_SIZE)) {
+            char c_buffer[128];
+            snprintf(c_buffer, sizeof(c_buffer), "%s: not blank at 0x%x (+0x%x)\n", label, address + p, p);
+            report += c_buffer;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool image_verify(FlashDev &dev, const std::vector<csv_entry_t> &original, uint32_t running_address,
+                  std::string &report, bool files) {
+    uint8_t table[SPI_FLASH_SEC_SIZE];
+    if (dev.read(HOST_TABLE_ADDR, table, sizeof(table)) != ESP_OK) {
+        report = "can't read table";
+        return false;
+    }
+    // table MD5 has to match, or the bootloader won't boot
+    size_t offset = 0;
+    while (offset < PART_TABLE_MAX_SIZE && table[offset] == 0xAA && table[offset + 1] == 0x50) offset += PART_TABLE_ENTRY_SIZE;
+    if (table[offset] != 0xEB || table[offset + 1] != 0xEB) {
+        report = "table has no MD5 entry";
+        return false;
+    }
+    uint8_t digest[16];
+    MD5Builder md5;
+    md5.begin();
+    md5.add(table, offset);
+    md5.calculate();
+    md5.getBytes(digest);
+    if (memcmp(digest, table + offset + 16, 16) != 0) {
+        report = "table MD5 mismatch";
+        return false;
+    }
+
+    // the firmware we ran has to be what boots next: where otadata points,
+    // else (no otadata, or never switched) in its own slot
+    const csv_entry_t *running = NULL;
+    for (const csv_entry_t &e : original) {
+        if (e.type == ESP_PARTITION_TYPE_APP && e.offset == running_address) running = &e;
+    }
+    std::string boot_label = running ? running->label : "";
+    part_table_t now;
+    char error[64];
+    if (part_table_parse_bin(table, sizeof(table), now, error, sizeof(error))) {
+        int slot = image_boot_slot(dev, table_entries(now));
+        for (int i = 0; i < now.count && slot >= 0; i++) {
+            if (now.entries[i].type == ESP_PARTITION_TYPE_APP &&
+                now.entries[i].subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0 + slot) {
+                boot_label = now.entries[i].label;
+            }
+        }
+    }
+
+    bool ok = true;
+    uint8_t sector[SPI_FLASH_SEC_SIZE];
+    for (size_t pos = 0; pos < offset; pos += PART_TABLE_ENTRY_SIZE) {
+        char label[17] = {0};
+        memcpy(label, table + pos + 12, 16);
+        uint32_t address, size;
+        memcpy(&address, table + pos + 4, 4);
+        memcpy(&size, table + pos + 8, 4);
+        const csv_entry_t *old = NULL;
+        for (const csv_entry_t &e : original) {
+            if (e.label == label) old = &e;
+        }
+        uint8_t type = table[pos + 2];
+        if (old == NULL || (old->type != type || old->subtype != table[pos + 3])) {
+            // new data partitions have to start out blank
+            if (type == ESP_PARTITION_TYPE_DATA && !range_blank(dev, label, address, 0, size, report)) ok = false;
+            continue;
+        }
+        if (files && has_fs(*old)) {
+            if (!fs_check(*old, label, report)) ok = false;
+            continue;
+        }
+        // otadata counts for what it boots, checked above, not for its bytes
+        if (type == ESP_PARTITION_TYPE_DATA && old->subtype == ESP_PARTITION_SUBTYPE_DATA_OTA &&
+            image_boot_slot(dev, original) >= 0) {
+            continue;
+        }
+        // resized apps other than the one that boots get erased; OTA rewrites them
+        // anyway, so their contents don't matter. Everything else keeps its data.
+        bool boots = (old->type == ESP_PARTITION_TYPE_APP && boot_label == label);
+        if (old->type == ESP_PARTITION_TYPE_APP && old->size != size && !boots) continue;
+        uint32_t check = (old->size < size) ? old->size : size;
+        if (boots && running != NULL && running != old) {
+            // a copy of the firmware from another slot, so just as far as that goes
+            old = running;
+            check = used_bytes(*running);
+        }
+        uint8_t expect[SPI_FLASH_SEC_SIZE];
+        for (uint32_t p = 0; p < check; p += SPI_FLASH_SEC_SIZE) {
+            if (dev.read(address + p, sector, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+            fill_sector(*old, p, expect);
+            for (uint32_t i = 0; i < SPI_FLASH_SEC_SIZE; i++) {
+                if (sector[i] != expect[i]) {
+                    char c_buffer[128];
+                    snprintf(c_buffer, sizeof(c_buffer), "%s: mismatch at 0x%x (+0x%x)\n", label, address + p + i, p + i);
+                    report += c_buffer;
+                    ok = false;
+                    break;
+                }
+            }
+            if (!ok) break;
+        }
+        // and data partitions that grew have nothing but their old data
+        if (ok && type == ESP_PARTITION_TYPE_DATA && !range_blank(dev, label, address, check, size, report)) ok = false;
+    }
+    return ok;
+}
+
+// --- gzip downloads ---
+
+bool gz_inflate(const std::string &in, std::string &out, std::string &error) {
+    out.clear();
+    StringSink sink(out);
+    GunzipSink gunzip(sink);
+    gunzip.write(in.data(), in.size());
+    if (!gunzip.finish()) {
+        error = gunzip.error();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef HOST_IMAGE_H
+#define HOST_IMAGE_H
+
+// Building & checking flash images from partition CSVs, for the host tools.
+#include <string>
+#include <vector>
+#include "flash_dev.h"
+#include "part_mgr.h"
+#include "part_table.h"
+
+#define HOST_TABLE_ADDR 0x8000
+#define HOST_UPLOAD_CHUNK_SIZE 1436     // HTTP_UPLOAD_BUFLEN: what the web server hands an upload handler at a time
+
+// log output for the host tools
+class StdoutSink : public OutputSink {
+public:
+    void write(const char *str, size_t len) override { fwrite(str, 1, len, stdout); }
+};
+
+// collects what it's given, e.g. a gzip made in memory
+class StringSink : public OutputSink {
+public:
+    StringSink(std::string &out) : _out(out) {}
+    void write(const char *str, size_t len) override { _out.append(str, len); }
+private:
+    std::string &_out;
+};
+
+typedef struct {
+    std::string label;
+    uint8_t type;
+    uint8_t subtype;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+} csv_entry_t;
+
+// whole file into data; false if it can't be read
+bool read_file(const char *path, std::string &data);
+// parse a partition CSV like gen_esp32part.py does (enough of it, anyway)
+bool csv_parse_file(const char *path, std::vector<csv_entry_t> &entries, std::string &error);
+std::vector<csv_entry_t> table_entries(const part_table_t &table);
+// write a fake bootloader, the binary table, and patterned contents for each partition;
+// with `files`, spiffs & littlefs partitions get a filesystem with a few files instead
+// (through fs_files.h, so `dev` has to be flash_dev())
+bool image_create(FlashDev &dev, const std::vector<csv_entry_t> &entries, bool files = false);
+// a firmware image of about `size` bytes that app_image_verify() passes, patterned
+// after `name`: a short segment, 64K of zeros (like initialised RAM), then the rest.
+// No SHA256 appended.
+std::string image_firmware(uint32_t size, const std::string &name);
+// what /partition-install does with the upload once the run is over, in the
+// pieces the web server would hand it
+esp_err_t image_install(OutputSink &out, const part_mgr_env_t &env, const std::string &firmware);
+// running app = first OTA slot (or `running_slot`), next = what esp_ota would pick
+part_mgr_env_t image_env(const std::vector<csv_entry_t> &entries, int running_slot);
+// the table on an image (wherever getPartitionTableAddr() finds it); false if there's none
+bool image_read_entries(FlashDev &dev, std::vector<csv_entry_t> &entries);
+// the OTA slot otadata boots, like the bootloader picks it: the valid entry with the
+// highest sequence number; -1 if there's no otadata or nothing valid in it
+int image_boot_slot(FlashDev &dev, const std::vector<csv_entry_t> &entries);
+// check the table on flash against the original contents; false + report on mismatch.
+// The app otadata boots (else the one at running_address) has to hold the firmware
+// that ran from running_address. With `files`, filesystem partitions are checked
+// file by file instead of byte by byte.
+bool image_verify(FlashDev &dev, const std::vector<csv_entry_t> &original, uint32_t running_address,
+                  std::string &report, bool files = false);
+// unpack a gzip download through GunzipSink; false + error if it's something
+// else, or the CRC / length don't match
+bool gz_inflate(const std::string &in, std::string &out, std::string &error);
+
+#endif // HOST_IMAGE_H
@@ -0,0 +1,70 @@
+/**
+ * @file host_port.cpp
+ * @brief Clock & serial stand-ins for the Linux build.
+ */
+
+#include "host_port.h"
+#include <stdarg.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+
+static std::atomic<uint64_t> sim_offset_us(0);
+static bool sleep_for_latency = false;
+static std::atomic<bool> power_on(true);
+
+static uint64_t real_micros() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long micros() {
+    return real_micros() + sim_offset_us;
+}
+
+unsigned long millis() {
+    return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+    host_clock_advance((uint64_t)ms * 1000);
+}
+
+void host_clock_advance(uint64_t us) {
+    if (sleep_for_latency) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    } else {
+        sim_offset_us += us;
+    }
+}
+
+void host_clock_set_sleep(bool sleep) {
+    sleep_for_latency = sleep;
+}
+
+bool host_power_on() {
+    return power_on;
+}
+
+void host_power_set(bool on) {
+    power_on = on;
+}
+
+void HostSerial::print(const char *str) {
+    if (enabled) fputs(str, stderr);
+}
+
+void HostSerial::println(const char *str) {
+    if (enabled) fprintf(stderr, "%s\n", str);
+}
+
+void HostSerial::printf(const char *fmt, ...) {
+    if (!enabled) return;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,67 @@
+#ifndef HOST_PORT_H
+#define HOST_PORT_H
+
+// Stand-ins for the bits of Arduino / ESP-IDF that the portable sources in
+// src/ use, so they build and run on Linux (see host/CMakeLists.txt).
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_NOT_SUPPORTED   0x106
+#define ESP_ERR_INVALID_CRC     0x109
+#define ESP_ERR_IMAGE_INVALID   0x2002
+
+#define SPI_FLASH_SEC_SIZE      4096
+#define ESP_ROM_MD5_DIGEST_LEN  16
+
+#define ESP_PARTITION_TYPE_APP              0x00
+#define ESP_PARTITION_TYPE_DATA             0x01
+#define ESP_PARTITION_SUBTYPE_APP_FACTORY   0x00
+#define ESP_PARTITION_SUBTYPE_APP_OTA_0     0x10
+#define ESP_PARTITION_SUBTYPE_APP_OTA_1     0x11
+#define ESP_PARTITION_SUBTYPE_DATA_OTA      0x00
+#define ESP_PARTITION_SUBTYPE_DATA_NVS      0x02
+#define ESP_PARTITION_SUBTYPE_DATA_COREDUMP 0x03
+#define ESP_PARTITION_SUBTYPE_DATA_UNDEFINED 0x06
+#define ESP_PARTITION_SUBTYPE_DATA_FAT      0x81
+#define ESP_PARTITION_SUBTYPE_DATA_SPIFFS   0x82
+#define ESP_PARTITION_SUBTYPE_ANY           0xff
+
+#define F(x) (x)
+
+// Time. Flash latency is simulated by advancing the clock rather than
+// sleeping (unless host_clock_set_sleep(true)), so micros() reports what
+// the run would have taken on a real chip.
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void host_clock_advance(uint64_t us);
+void host_clock_set_sleep(bool sleep);
+
+// Power, for power cut tests: once it's off, flash & journal writes fail
+// until the simulated reboot turns it on again.
+bool host_power_on();
+void host_power_set(bool on);
+
+// Serial goes to stderr, and can be muted for benchmarks.
+class HostSerial {
+public:
+    void print(const char *str);
+    void println(const char *str);
+    void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    bool enabled = true;
+};
+extern HostSerial Serial;
+
+#endif // HOST_PORT_H
@@ -0,0 +1,211 @@
+/**
+ * @file host_uart.cpp
+ * @brief The client's side of the serial bench protocol, over a tty or pty.
+ *
+ * The board keeps resending what we haven't ACKed, so all the client does
+ * about a lost or broken frame is NAK it once, to get it sooner. Duplicates
+ * are ACKed again, in case it was the ACK that got lost.
+ */
+
+#include "host_uart.h"
+#include "gz_stream.h"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+
+FdUartPort::~FdUartPort() {
+    if (_fd >= 0) ::close(_fd);
+}
+
+static speed_t _speed(int baud) {
+    switch (baud) {
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    default: return B0;
+    }
+}
+
+bool FdUartPort::open(const char *path, int baud) {
+    _fd = ::open(path, O_RDWR | O_NOCTTY);
+    if (_fd < 0) return false;
+    struct termios tio;
+    if (tcgetattr(_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~CRTSCTS;
+        if (_speed(baud) != B0) {
+            cfsetispeed(&tio, _speed(baud));
+            cfsetospeed(&tio, _speed(baud));
+        }
+        tcsetattr(_fd, TCSANOW, &tio);
+    }
+    tcflush(_fd, TCIFLUSH);
+    return true;
+}
+
+int FdUartPort::read(uint8_t *data, size_t len, uint32_t timeout_ms) {
+    struct pollfd p = {_fd, POLLIN, 0};
+    int r = poll(&p, 1, timeout_ms);
+    if (r < 0) return (errno == EINTR) ? 0 : -1;
+    if (r == 0) return 0;
+    ssize_t n = ::read(_fd, data, len);
+    if (n > 0) return n;
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    // a pty master reads EIO while nobody has the other side open, e.g. a board rebooting
+    if (n < 0 && errno == EIO) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms < 50 ? timeout_ms : 50));
+        return 0;
+    }
+    return -1;
+}
+
+bool FdUartPort::write(const uint8_t *data, size_t len) {
+    int stuck = 0;
+    while (len > 0) {
+        ssize_t n = ::write(_fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        // a pty nobody reads fills up; after a second of that, nobody's there
+        if (n < 0 && errno == EAGAIN && ++stuck <= 10) {
+            struct pollfd p = {_fd, POLLOUT, 0};
+            poll(&p, 1, 100);
+            continue;
+        }
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+        stuck = 0;
+    }
+    return true;
+}
+
+void UartClient::_send(uint8_t type, uint8_t seq, const uint8_t *payload, size_t len) {
+    uint8_t frame[UART_PROTO_FRAME_MAX];
+    _port.write(frame, uart_frame_encode(type, seq, payload, len, frame));
+}
+
+bool UartClient::request(uint8_t cmd, const uint8_t *payload, size_t len, OutputSink & data, OutputSink & log,
+                         uart_end_t & end, std::string & error) {
+    typedef std::chrono::steady_clock clock;
+    memset(&end, 0, sizeof(end));
+    uint8_t cmd_seq = _seq;
+    _send(cmd, cmd_seq, payload, len);
+    uint32_t taken = 0;                 // frames of the answer so far
+    int nak_for = -1;                   // NAKed this seq already; the board resends the window from there
+    int resends = 0;
+    uint32_t bytes = 0, crc = 0;
+    clock::time_point last_heard = clock::now();
+    uint8_t buf[4096];
+    while (true) {
+        int n = _port.read(buf, sizeof(buf), 100);
+        if (n < 0) {
+            error = "the port is gone";
+            return false;
+        }
+        clock::time_point now = clock::now();
+        if (n == 0) {
+            uint32_t quiet_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_heard).count();
+            if (taken == 0 && quiet_ms >= 2 * UART_PROTO_ACK_TIMEOUT_MS && resends < UART_PROTO_RETRIES) {
+                // the command got lost on the way
+                _send(cmd, cmd_seq, payload, len);
+                _stats.commands_resent++;
+                resends++;
+                last_heard = now;
+            } else if (quiet_ms >= _timeout_ms) {
+                error = taken ? "the answer stopped" : "no answer";
+                return false;
+            }
+            // a frame that stopped halfway: NAK it like a bad one, and look for frames behind it
+            if (!_reader.idle()) continue;
+        }
+        size_t pos = 0;
+        UartFrameReader::result_t r;
+        bool stalled = (n == 0);
+        while ((r = stalled ? UartFrameReader::BAD : _reader.feed(buf, n, pos)) != UartFrameReader::NONE) {
+            uint8_t expected = cmd_seq + taken;
+            if (r == UartFrameReader::BAD) {
+                _stats.bad++;
+                // after a stall the board's waiting too, so NAK even if we did already
+                if (nak_for != expected || stalled) {
+                    _send(UART_CMD_NAK, expected);
+                    _stats.naks++;
+                    nak_for = expected;
+                }
+                stalled = false;
+                continue;
+            }
+            const uart_frame_t & f = _reader.frame();
+            last_heard = now;
+            if (f.type == UART_RSP_NAK) {
+                if (taken == 0) {
+                    _send(cmd, cmd_seq, payload, len);
+                    _stats.commands_resent++;
+                }
+                continue;
+            }
+            if (f.type < UART_RSP_DATA) continue;
+            if (f.seq != expected) {
+                if ((uint8_t)(expected - 1 - f.seq) < UART_PROTO_WINDOW) {
+                    // one we have, maybe of the last answer: the board missed our ACK
+                    _send(UART_CMD_ACK, expected - 1);
+                    _stats.duplicates++;
+                    // ... of its END, and so this command, while it waited for that
+                    if (taken == 0 && f.type == UART_RSP_END) {
+                        _send(cmd, cmd_seq, payload, len);
+                        _stats.commands_resent++;
+                    }
+                } else if (nak_for != expected) {
+                    _send(UART_CMD_NAK, expected);
+                    _stats.naks++;
+                    nak_for = expected;
+                }
+                continue;
+            }
+            _send(UART_CMD_ACK, f.seq);
+            taken++;
+            nak_for = -1;
+            _stats.frames++;
+            switch (f.type) {
+            case UART_RSP_DATA:
+                data.write((const char *)f.payload, f.len);
+                bytes += f.len;
+                crc = gz_crc32(crc, f.payload, f.len);
+                break;
+            case UART_RSP_LOG:
+                log.write((const char *)f.payload, f.len);
+                break;
+            case UART_RSP_PROGRESS:
+                if (f.len >= 12) {
+                    std::string phase((const char *)f.payload + 12, f.len - 12);
+                    log.progress(phase.c_str(), uart_get32(f.payload), uart_get32(f.payload + 4));
+                }
+                break;
+            case UART_RSP_END:
+                _seq = f.seq + 1;
+                if (f.len < UART_END_SIZE) {
+                    error = "short END frame";
+                    return false;
+                }
+                end.status = uart_get32(f.payload);
+                end.bytes = uart_get32(f.payload + 4);
+                end.crc = uart_get32(f.payload + 8);
+                end.result = uart_get32(f.payload + 12);
+                if (end.bytes != bytes || end.crc != crc) {
+                    char c_buffer[96];
+                    snprintf(c_buffer, sizeof(c_buffer), "got %u bytes, CRC %08x; the board sent %u, CRC %08x",
+                             bytes, crc, end.bytes, end.crc);
+                    error = c_buffer;
+                    return false;
+                }
+                return true;
+            }
+        }
+    }
+}
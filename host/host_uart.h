@@ -0,0 +1,54 @@
+#ifndef HOST_UART_H
+#define HOST_UART_H
+
+// The client's side of the serial bench protocol (src/uart_proto.h), for
+// uart_client: a tty or pty as a UartPort, and one command at a time over it.
+#include <string>
+#include <time.h>
+#include "uart_proto.h"
+
+// a serial port, or the pty of a uart_standin board
+class FdUartPort : public UartPort {
+public:
+    FdUartPort() : _fd(-1) {}
+    ~FdUartPort();
+    // raw mode at `baud` (ignored by ptys), anything waiting in the input dropped
+    bool open(const char *path, int baud);
+    // take over an fd that's set up already
+    void attach(int fd) { _fd = fd; }
+    int read(uint8_t *data, size_t len, uint32_t timeout_ms) override;
+    bool write(const uint8_t *data, size_t len) override;
+private:
+    int _fd;
+};
+
+typedef struct {
+    uint32_t frames;                    /*!< answer frames taken */
+    uint32_t bad;                       /*!< arrived with a wrong CRC or length */
+    uint32_t naks;                      /*!< NAKs sent for a missing frame */
+    uint32_t duplicates;                /*!< frames that came again */
+    uint32_t commands_resent;           /*!< the board NAKed a command, or didn't answer */
+} uart_client_stats_t;
+
+class UartClient {
+public:
+    UartClient(UartPort & port, uint32_t timeout_ms = 10000)
+        : _port(port), _timeout_ms(timeout_ms), _seq(time(NULL)) { memset(&_stats, 0, sizeof(_stats)); }
+    // send a command and take its answer: DATA to `data`, LOG to `log`, PROGRESS as
+    // log.progress(phase, done, total). False + error if the answer broke off or
+    // doesn't add up to what the END says; `end` is the board's verdict otherwise.
+    bool request(uint8_t cmd, const uint8_t *payload, size_t len, OutputSink & data, OutputSink & log,
+                 uart_end_t & end, std::string & error);
+    const uart_client_stats_t & stats() { return _stats; }
+    uint32_t skipped() { return _reader.skipped(); }
+private:
+    void _send(uint8_t type, uint8_t seq, const uint8_t *payload = NULL, size_t len = 0);
+    UartPort & _port;
+    UartFrameReader _reader;
+    uint32_t _timeout_ms;
+    uint8_t _seq;                       // of the next command: after the last END; from the clock at first,
+                                        // so a new client's first command isn't taken for the last client's
+    uart_client_stats_t _stats;
+};
+
+#endif // HOST_UART_H
@@ -0,0 +1,513 @@
+/**
+ * @file partition_bench.cpp
+ * @brief Replays partition_mgr_fix over partition CSVs on file-backed images
+ * and reports time & flash traffic per layout.
+ */
+
+#include "part_mgr.h"
+#include "file_flash_dev.h"
+#include "host_image.h"
+#include "journal.h"
+#include "part_plan.h"
+#include "app_image.h"
+#include "utils.h"
+#include "digest_cache.h"
+#include "fs_carry.h"
+#include "gz_stream.h"
+#include "part_install.h"
+#include "part_layouts.h"
+#include <MD5Builder.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+
+// drops the log, but takes `delay_us` per write like sendContent over WiFi would
+class SlowNullSink : public OutputSink {
+public:
+    SlowNullSink(uint32_t delay_us) : writes(0), _delay_us(delay_us) {}
+    void write(const char *str, size_t len) override {
+        writes++;
+        if (_delay_us) std::this_thread::sleep_for(std::chrono::microseconds(_delay_us));
+    }
+    uint32_t writes;
+private:
+    uint32_t _delay_us;
+};
+
+// run the planner on the freshly made image and check every candidate: partitions
+// in order & apart, inside the flash, grown apps at full size, the first one in place,
+// the running app either in place or erased (it's copied to the first one), and
+// bytes moved & erased adding up to what its layout does
+static std::string plan_check(FlashDev &dev, const std::vector<csv_entry_t> &entries, const char *strategy,
+                              uint32_t running_address, const plan_cost_model_t &model, plan_result_t &plan) {
+    // same used sizes as partition_mgr_run(): app images, else up to the last non-blank sector
+    plan_part_t parts[MAX_NUMBER_OF_PARTITIONS];
+    int count = (entries.size() < MAX_NUMBER_OF_PARTITIONS) ? entries.size() : MAX_NUMBER_OF_PARTITIONS;
+    for (int i = 0; i < count; i++) {
+        const csv_entry_t &e = entries[i];
+        uint32_t used = e.size;
+        if (e.type == ESP_PARTITION_TYPE_APP) {
+            uint32_t image_len = app_image_length(e.offset, e.size);
+            if (image_len) used = (image_len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+        } else {
+            uint8_t sector[SPI_FLASH_SEC_SIZE];
+            while (used > 0 && dev.read(e.offset + used - SPI_FLASH_SEC_SIZE, sector, sizeof(sector)) == ESP_OK &&
+                   is_blank(sector, sizeof(sector))) {
+                used -= SPI_FLASH_SEC_SIZE;
+            }
+        }
+        parts[i] = {e.type, e.subtype, e.offset, e.size, used, e.label.c_str()};
+    }
+    plan_layouts(parts, count, dev.size(), running_address, model, strategy, plan);
+
+    char line[160];
+    std::string report;
+    _my_partition_planner_t planner[MAX_NUMBER_OF_PARTITIONS];
+    for (int n = 0; n < plan.count; n++) {
+        const plan_candidate_t &c = plan.candidates[n];
+        plan_candidate_layout(parts, count, plan, n, planner);
+        uint32_t end = 0, moved = 0, erased = 0;
+        for (int i = 0; i < count; i++) {
+            const _my_partition_planner_t &p = planner[i];
+            uint32_t address = p.address_new ? p.address_new : p.address_old;
+            uint32_t size = p.size_new ? p.size_new : p.size_old;
+            const char *problem = NULL;
+            if (address < end) problem = "overlaps the one before";
+            else if ((uint64_t)address + size > dev.size()) problem = "is past the end of flash";
+            else if (i == plan.first_app_index && address != p.address_old) problem = "is the first OTA slot, but moves";
+            else if (parts[i].address == running_address && p.action_move) problem = "is the running app, but moves";
+            else if (i == c.shrink_index && size == 0) problem = "shrinks to nothing";
+            else if (parts[i].type == ESP_PARTITION_TYPE_APP && parts[i].size < RESIZE_APP_PARTITION_SIZE &&
+                     parts[i].subtype != ESP_PARTITION_SUBTYPE_APP_FACTORY && size != RESIZE_APP_PARTITION_SIZE) {
+                problem = "doesn't grow";
+            }
+            if (problem) {
+                snprintf(line, sizeof(line), "    plan %s: %s %s\n", c.strategy, entries[i].label.c_str(), problem);
+                report += line;
+            }
+            end = address + size;
+            if (p.action_erase) {
+                erased += parts[i].used;
+            } else if (p.action_move) {
+                uint32_t m = (parts[i].used < size) ? parts[i].used : size;
+                moved += m;
+                erased += m;
+            }
+        }
+        if (moved != c.bytes_moved || erased != c.bytes_erased) {
+            snprintf(line, sizeof(line), "    plan %s: moves %uK & erases %uK, but says %uK & %uK\n", c.strategy,
+                     moved / 1024, erased / 1024, c.bytes_moved / 1024, c.bytes_erased / 1024);
+            report += line;
+        }
+        if (strategy == NULL && plan.best >= 0 && c.cost_ms < plan.candidates[plan.best].cost_ms) {
+            snprintf(line, sizeof(line), "    plan %s is cheaper than the chosen one\n", c.strategy);
+            report += line;
+        }
+    }
+    return report;
+}
+
+// after a run, the digest cache must have noticed every write: each region's
+// MD5 is what's in flash now, and the regions are those of the new table
+static std::string digest_check(FileFlashDev &dev) {
+    std::string report;
+    if (!digest_cache_update()) report += "    digests: update failed\n";
+    std::vector<digest_region_t> regions;
+    digest_region_t r;
+    while (digest_cache_region(regions.size(), r)) regions.push_back(r);
+    int count = regions.size();
+    std::vector<csv_entry_t> table;
+    uint8_t *t = dev.data() + HOST_TABLE_ADDR;
+    for (size_t pos = 0; pos < PART_TABLE_MAX_SIZE && t[pos] == 0xAA && t[pos + 1] == 0x50; pos += 32) {
+        csv_entry_t e;
+        memcpy(&e.offset, t + pos + 4, 4);
+        memcpy(&e.size, t + pos + 8, 4);
+        table.push_back(e);
+    }
+    if (count != (int)table.size() + 2) report += "    digests: regions don't match the table\n";
+    for (int i = 0; i < count; i++) {
+        if (i >= 2 && i - 2 < (int)table.size() &&
+            (regions[i].address != table[i - 2].offset || regions[i].size != table[i - 2].size)) {
+            report += std::string("    digests: ") + regions[i].name + " isn't where the table has it\n";
+        }
+        MD5Builder md5;
+        md5.begin();
+        md5.add(dev.data() + regions[i].address, regions[i].size);
+        md5.calculate();
+        uint8_t expect[16];
+        md5.getBytes(expect);
+        if (!regions[i].valid || memcmp(expect, regions[i].md5, 16) != 0) {
+            report += std::string("    digests: ") + regions[i].name + " is stale\n";
+        }
+    }
+    return report;
+}
+
+// a layout part_layouts.cpp knows has to be what the build checked: the same
+// table, byte for byte, and the same candidates as the planner finds at run
+// time. Run as it ships (first slot, cheapest candidate), it has to come out
+// as expected; and a run that's done leaves the layout the build worked out.
+static std::string layout_check(FileFlashDev &dev, const layout_known_t &known, const uint8_t *table,
+                                const plan_result_t *plan, int result, bool as_shipped) {
+    std::string report;
+    char line[160];
+    const layout_t &l = *known.layout;
+    layout_bin_t bin = layout_encode(l.parts, l.count);
+    if (memcmp(bin.data, table, sizeof(bin.data)) != 0) {
+        report += "    layout: the CSV isn't the table part_layouts.cpp has\n";
+    }
+    if (!report.empty() || dev.size() != l.flash_size) return report;
+
+    const layout_plan_t &kp = known.plan;
+    if (plan != NULL && (plan->size_delta != kp.size_delta || plan->first_app_index != kp.first_app_index ||
+                         (kp.size_delta != 0 && plan->count != kp.count))) {
+        snprintf(line, sizeof(line), "    layout: planner finds %d candidates for 0x%x, the build %d for 0x%x\n",
+                 plan->count, plan->size_delta, kp.count, kp.size_delta);
+        report += line;
+    }
+    for (int n = 0; plan != NULL && report.empty() && kp.size_delta != 0 && n < kp.count; n++) {
+        const plan_candidate_t &c = plan->candidates[n];
+        if (strcmp(c.strategy, plan_strategy_name(kp.candidates[n].strategy)) != 0 ||
+            c.shrink_index != kp.candidates[n].shrink_index) {
+            snprintf(line, sizeof(line), "    layout: candidate %d is %s of %d, the build has %s of %d\n", n,
+                     c.strategy, c.shrink_index, plan_strategy_name(kp.candidates[n].strategy),
+                     kp.candidates[n].shrink_index);
+            report += line;
+        }
+    }
+    bool as_expected = (kp.outcome == LAYOUT_RESIZE) ? (result == PART_MGR_DONE) :
+                       (kp.outcome == LAYOUT_UNNECESSARY) ? (result == PART_MGR_UNNECESSARY) :
+                       (result == PART_MGR_FAILED);
+    if (as_shipped && !as_expected) {
+        report += std::string("    layout: expected to end up ") + layout_outcome_name(kp.outcome) + "\n";
+    }
+    if (result == PART_MGR_DONE && plan != NULL && plan->best >= 0 && report.empty()) {
+        std::vector<csv_entry_t> now;
+        image_read_entries(dev, now);
+        int shrink = plan->candidates[plan->best].shrink_index;
+        for (int i = 0; i < l.count; i++) {
+            layout_part_t p = layout_place(l.parts, l.count, kp.size_delta, shrink, i);
+            if (i >= (int)now.size() || now[i].offset != p.address || now[i].size != p.size) {
+                snprintf(line, sizeof(line), "    layout: %s isn't where the build put it (0x%x, %uK)\n",
+                         p.label, p.address, p.size / 1024);
+                report += line;
+            }
+        }
+    }
+    return report;
+}
+
+static const char *result_names[] = {"failed", "unneeded", "tested", "done"};
+
+static void usage() {
+    fprintf(stderr,
+        "usage: partition_bench [options] <layout.csv>...\n"
+        "  --flash-mb <n>       image size: 4, 8 or 16 (default: the smallest each layout fits)\n"
+        "  --log                show the partition_mgr_fix log\n"
+        "  --net-us <us>        time each log write takes (really waits; combine with --sleep)\n"
+        "  --unbuffered         pass every log write on, instead of through a BufferedSink like the device\n"
+        "  --summary            log a line every 10%% of a move instead of every sector\n"
+        "  --sleep              really wait for the flash latency instead of simulating it\n"
+        "  --move-mode <m>      block (default), sector or pipeline\n"
+        "  --strategy <s>       layout strategy: shrink-biggest, shrink-other or free-space (default: cheapest)\n"
+        "  --target <file>      switch each layout to this table (CSV or binary) instead of resizing\n"
+        "  --power-cuts <n>     also cut the power at n points of each run, resume & verify\n"
+        "  --bad-writes <n>     also drop one write (reported as ok) in n runs; the run must fail, resume & verify\n"
+        "  --keep-fs            put files on spiffs/littlefs partitions, keep them (like ?keep_fs=1), check them\n"
+        "  --running-slot <n>   run from this OTA slot, with otadata booting it (default: 0)\n"
+        "  --install            also run each layout like /partition-install, with a gzipped firmware,\n"
+        "                       and check the new slot has it & boots\n"
+        "  --erase-4k <us> --erase-64k <us> --program <us per page> --read-4k <us>\n");
+}
+
+int main(int argc, char **argv) {
+    flash_latency_t latency = FLASH_LATENCY_DEFAULT;
+    part_mgr_opts_t opts = {};
+    std::vector<const char *> layouts;
+    size_t flash_mb = 0;
+    bool show_log = false, buffered = true, install = false;
+    uint32_t net_us = 0;
+    uint32_t power_cuts = 0, bad_writes = 0;
+    int running_slot = 0;
+    const char *target = NULL;
+    std::string target_data;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--flash-mb") == 0 && value) { flash_mb = atoi(value); i++; }
+        else if (strcmp(argv[i], "--log") == 0) show_log = true;
+        else if (strcmp(argv[i], "--net-us") == 0 && value) { net_us = strtoul(value, NULL, 0); i++; }
+        else if (strcmp(argv[i], "--sleep") == 0) host_clock_set_sleep(true);
+        else if (strcmp(argv[i], "--unbuffered") == 0) buffered = false;
+        else if (strcmp(argv[i], "--summary") == 0) opts.verbosity = OUT_VERBOSITY_SUMMARY;
+        else if (strcmp(argv[i], "--target") == 0 && value) { target = value; i++; }
+        else if (strcmp(argv[i], "--strategy") == 0 && value) { part_mgr_opts_strategy(opts, value); i++; }
+        else if (strcmp(argv[i], "--power-cuts") == 0 && value) { power_cuts = strtoul(value, NULL, 0); i++; }
+        else if (strcmp(argv[i], "--bad-writes") == 0 && value) { bad_writes = strtoul(value, NULL, 0); i++; }
+        else if (strcmp(argv[i], "--keep-fs") == 0) opts.keep_fs = true;
+        else if (strcmp(argv[i], "--install") == 0) install = true;
+        else if (strcmp(argv[i], "--running-slot") == 0 && value) { running_slot = atoi(value); i++; }
+        else if (strcmp(argv[i], "--move-mode") == 0 && value) {
+            opts.move_mode = (strcmp(value, "sector") == 0) ? MOVE_MODE_SECTOR :
+                             (strcmp(value, "pipeline") == 0) ? MOVE_MODE_PIPELINE : MOVE_MODE_BLOCK;
+            i++;
+        }
+        else if (flash_latency_parse_arg(argv[i], value, latency)) i++;
+        else if (argv[i][0] != '-') layouts.push_back(argv[i]);
+        else { usage(); return 2; }
+    }
+    if (layouts.empty() || (flash_mb != 0 && flash_mb != 4 && flash_mb != 8 && flash_mb != 16)) {
+        usage();
+        return 2;
+    }
+    Serial.enabled = show_log;
+    if (target != NULL && !read_file(target, target_data)) { fprintf(stderr, "Can't read %s\n", target); return 2; }
+
+    char image[] = "/tmp/partition_bench_XXXXXX";
+    int fd = mkstemp(image);
+    if (fd < 0) { perror("mkstemp"); return 1; }
+    ::close(fd);
+    std::string journal = std::string(image) + ".journal";
+    journal_set_path(journal.c_str());
+    std::string carry = std::string(image) + ".fs";
+    fs_carry_set_path(carry.c_str());
+
+    char flash_name[32] = "4-16 MB, as each layout needs";
+    if (flash_mb) snprintf(flash_name, sizeof(flash_name), "%u MB", (unsigned)flash_mb);
+    printf("Flash: %s, erase 4K %u us, erase 64K %u us, program %u us/page, read %u us/4K\n",
+           flash_name, latency.erase_4k_us, latency.erase_64k_us, latency.program_page_us, latency.read_4k_us);
+    printf("Move mode: %s, log: %s, %s%s, running from OTA slot %d\n\n", move_mode_name(opts.move_mode),
+           (opts.verbosity == OUT_VERBOSITY_SUMMARY) ? "summary" : "sectors", buffered ? "buffered" : "unbuffered",
+           opts.keep_fs ? ", keeping files" : "", running_slot);
+    printf("%-20s %-9s %-15s %7s %10s %9s %9s %9s %9s %7s %7s  %s\n",
+           "layout", "result", "plan", "est ms", "flash ms", "cpu ms", "read KB", "write KB", "erase KB", "erases",
+           "log wr", "verify");
+
+    // what the device plans with once /flash-bench has timed its chip
+    plan_cost_model_t model = {latency.erase_4k_us, latency.erase_64k_us, latency.program_page_us, latency.read_4k_us};
+    int bad = 0, known_count = 0;
+    digest_cache_init(false);
+    for (const char *layout : layouts) {
+        const char *name = strrchr(layout, '/') ? strrchr(layout, '/') + 1 : layout;
+        std::vector<csv_entry_t> entries;
+        std::string error;
+        FileFlashDev dev(latency);
+        bool parsed = csv_parse_file(layout, entries, error);
+        uint64_t end = 0;
+        for (const csv_entry_t &e : entries) end = std::max(end, (uint64_t)e.offset + e.size);
+        size_t mb = flash_mb ? flash_mb : (end <= (4 << 20)) ? 4 : (end <= (8 << 20)) ? 8 : 16;
+        if (!parsed || !dev.open(image, mb * 1024 * 1024)) {
+            printf("%-20s can't load: %s\n", name, error.c_str());
+            bad++;
+            continue;
+        }
+        flash_dev_set(&dev);
+        part_mgr_env_t env = image_env(entries, running_slot);
+        // otadata has to agree with the slot we say we run from, where there is one;
+        // slot 0 boots without it
+        auto make_image = [&]() {
+            resetPartitionTableAddr();
+            if (!image_create(dev, entries, opts.keep_fs)) return false;
+            if (running_slot != 0) app_image_set_boot(env.running_address);
+            return true;
+        };
+        if (!make_image()) {
+            printf("%-20s doesn't fit in %u MB\n", name, (unsigned)mb);
+            bad++;
+            continue;
+        }
+        plan_result_t plan;
+        plan.best = -1;
+        std::string plan_report = target ? "" : plan_check(dev, entries, opts.strategy[0] ? opts.strategy : NULL,
+                                                                 env.running_address, model, plan);
+        const char *plan_name = (plan.best >= 0) ? plan.candidates[plan.best].strategy : target ? "target" : "-";
+        uint32_t plan_ms = (plan.best >= 0) ? plan.candidates[plan.best].cost_ms : 0;
+        // a run from an OTA slot it erases leaves those steps to the next boot, from the
+        // copy; they're part of the run here
+        auto run = [&](OutputSink &out, const part_mgr_env_t &from) {
+            part_mgr_result_t r = target ? partition_mgr_target(out, from, opts, (const uint8_t *)target_data.data(),
+                                                                target_data.size(), false)
+                                         : partition_mgr_run(out, from, opts, false);
+            resetPartitionTableAddr();
+            if (r == PART_MGR_DONE && partition_mgr_resume(out, opts) == PART_MGR_FAILED) r = PART_MGR_FAILED;
+            return r;
+        };
+        // the next boot, as setup() does it: finish the job, then put kept files back. A run
+        // that stopped before the table was written (packing files, copying the firmware)
+        // is just run again, from whichever slot otadata boots now.
+        auto reboot = [&](OutputSink &out) {
+            resetPartitionTableAddr();
+            part_mgr_result_t r = partition_mgr_resume(out, opts);
+            if (r == PART_MGR_UNNECESSARY && (opts.keep_fs || running_slot != 0)) {
+                int slot = image_boot_slot(dev, entries);
+                r = run(out, image_env(entries, (slot < 0) ? running_slot : slot));
+                resetPartitionTableAddr();
+            }
+            if (r != PART_MGR_FAILED) fs_carry_resume(out);
+            return r;
+        };
+        if (!plan_report.empty()) bad++;
+        const layout_known_t *known = target ? NULL : layout_find_name(name);
+        uint8_t table[PART_TABLE_MAX_SIZE];
+        if (known != NULL) {
+            known_count++;
+            dev.read(HOST_TABLE_ADDR, table, sizeof(table));
+        }
+
+        dev.reset_stats();
+        dev.set_power_cut(0, HOST_TABLE_ADDR);
+        dev.set_bad_write(0, HOST_TABLE_ADDR);
+        StdoutSink log_out;
+        SlowNullSink null_out(net_us);
+        auto cpu_start = std::chrono::steady_clock::now();
+        unsigned long time_start = micros();
+        part_mgr_result_t result;
+        {
+            OutputSink &sink = show_log ? (OutputSink &)log_out : null_out;
+            BufferedSink buffered_out(sink, opts.verbosity);
+            result = run(buffered ? (OutputSink &)buffered_out : sink, env);
+        }
+        unsigned long time_end = micros();
+        auto cpu_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - cpu_start).count();
+
+        flash_stats_t st = dev.stats(); // the run's, not the checks'
+        uint32_t ops = dev.power_ops(), writes = dev.writes(); // nor putting files back
+        std::string report;
+        const char *verify = "-";
+        if (result == PART_MGR_DONE) {
+            NullSink boot_out;
+            fs_carry_resume(show_log ? (OutputSink &)log_out : boot_out);
+            verify = image_verify(dev, entries, env.running_address, report, opts.keep_fs) ? "ok" : "FAILED";
+            report += digest_check(dev);
+            if (!report.empty()) bad++;
+        }
+        if (known != NULL) {
+            std::string layout_report = layout_check(dev, *known, table, plan_report.empty() ? &plan : NULL,
+                                                     result, running_slot == 0 && !opts.keep_fs && opts.strategy[0] == '\0');
+            if (!layout_report.empty()) bad++;
+            plan_report += layout_report;
+        }
+        printf("%-20s %-9s %-15s %7u %10lu %9ld %9llu %9llu %9llu %7u %7u  %s\n",
+               name, result_names[result], plan_name, plan_ms, (time_end - time_start)/1000, (long)cpu_ms,
+               (unsigned long long)st.bytes_read/1024, (unsigned long long)st.bytes_written/1024,
+               (unsigned long long)st.bytes_erased/1024, st.erase_ops, null_out.writes, verify);
+        // the estimate leaves out the log, so only runs that don't wait on the network
+        unsigned long flash_ms = (time_end - time_start)/1000;
+        if (result == PART_MGR_DONE && plan_ms > 0 && net_us == 0 &&
+            (flash_ms > 2 * (unsigned long)plan_ms || 2 * flash_ms < plan_ms)) {
+            char line[96];
+            snprintf(line, sizeof(line), "    est %u ms, but took %lu ms: more than 2x off\n", plan_ms, flash_ms);
+            plan_report += line;
+            bad++;
+        }
+        if (!report.empty()) printf("%s", report.c_str());
+        if (!plan_report.empty()) printf("%s", plan_report.c_str());
+
+        // same run again, cut off at evenly spread writes/erases, then finished from the journal
+        uint32_t resumed = 0;
+        for (uint32_t k = 1; k <= power_cuts && result == PART_MGR_DONE && ops > 0; k++) {
+            uint32_t cut = 1 + (uint64_t)k * (ops - 1) / (power_cuts + 1);
+            make_image();
+            dev.set_power_cut(cut, HOST_TABLE_ADDR);
+            NullSink cut_out;
+            run(show_log ? (OutputSink &)log_out : cut_out, env);
+            // reboot
+            host_power_set(true);
+            dev.set_power_cut(0, HOST_TABLE_ADDR);
+            part_mgr_result_t r = reboot(show_log ? (OutputSink &)log_out : cut_out);
+            report.clear();
+            if (r == PART_MGR_DONE && image_verify(dev, entries, env.running_address, report, opts.keep_fs)) {
+                resumed++;
+            } else {
+                printf("    power cut at op %u of %u: resume %s\n%s", cut, ops, result_names[r], report.c_str());
+            }
+            journal_clear();
+            fs_carry_clear();
+        }
+        if (power_cuts > 0 && result == PART_MGR_DONE && ops > 0) {
+            printf("    power cuts: %u of %u resumed ok\n", resumed, power_cuts);
+            if (resumed != power_cuts) bad++;
+        }
+
+        // and with a write that silently doesn't take: the run has to notice and not
+        // finish; the next boot (with a chip that works again) repairs it from the journal
+        uint32_t caught = 0;
+        resumed = 0;
+        for (uint32_t k = 1; k <= bad_writes && result == PART_MGR_DONE && writes > 0; k++) {
+            uint32_t n = 1 + (uint64_t)k * (writes - 1) / (bad_writes + 1);
+            make_image();
+            dev.set_bad_write(n, HOST_TABLE_ADDR);
+            NullSink bad_out;
+            part_mgr_result_t r = run(show_log ? (OutputSink &)log_out : bad_out, env);
+            dev.set_bad_write(0, HOST_TABLE_ADDR);
+            report.clear();
+            if (r == PART_MGR_DONE) {
+                printf("    bad write %u of %u: not noticed\n", n, writes);
+            } else {
+                caught++;
+                r = reboot(show_log ? (OutputSink &)log_out : bad_out);
+                if (r == PART_MGR_DONE && image_verify(dev, entries, env.running_address, report, opts.keep_fs)) {
+                    resumed++;
+                } else {
+                    printf("    bad write %u of %u: resume %s\n%s", n, writes, result_names[r], report.c_str());
+                }
+            }
+            journal_clear();
+            fs_carry_clear();
+        }
+        if (bad_writes > 0 && result == PART_MGR_DONE && writes > 0) {
+            printf("    bad writes: %u of %u caught, %u repaired by resuming\n", caught, bad_writes, resumed);
+            if (caught != bad_writes || resumed != bad_writes) bad++;
+        }
+        // and once more with a firmware uploaded along: it has to end up in the slot
+        // after the running one, in one piece, with otadata booting it. The run
+        // refuses where it'd have to move the running app or keep files first.
+        if (install && (result == PART_MGR_DONE || result == PART_MGR_UNNECESSARY)) {
+            make_image();
+            NullSink install_out;
+            OutputSink &out = show_log ? (OutputSink &)log_out : install_out;
+            std::string firmware = image_firmware(RESIZE_APP_PARTITION_SIZE - 0x30000, name), packed;
+            {
+                StringSink packed_out(packed);
+                GzipSink gz(packed_out);
+                gz.write(firmware.data(), firmware.size());
+                gz.finish();
+            }
+            if (!part_install_check(out, env, opts)) {
+                printf("    install: refused\n");
+            } else {
+                part_mgr_result_t r = run(out, env);
+                esp_err_t err = (r == PART_MGR_FAILED) ? ESP_FAIL : image_install(out, env, packed);
+                std::vector<csv_entry_t> now, slots;
+                image_read_entries(dev, now);
+                int boot = image_boot_slot(dev, now);
+                for (int sub = ESP_PARTITION_SUBTYPE_APP_OTA_0; sub < ESP_PARTITION_SUBTYPE_APP_OTA_0 + 16; sub++) {
+                    for (const csv_entry_t &e : now) {
+                        if (e.type == ESP_PARTITION_TYPE_APP && e.subtype == sub) slots.push_back(e);
+                    }
+                }
+                std::string in_slot(firmware.size(), '\0');
+                const char *problem = NULL;
+                if (err != ESP_OK) problem = "failed";
+                else if (boot < 0 || boot >= (int)slots.size() || slots[boot].offset == env.running_address) {
+                    problem = "doesn't boot the new slot";
+                } else if (dev.read(slots[boot].offset, &in_slot[0], in_slot.size()) != ESP_OK || in_slot != firmware) {
+                    problem = "isn't in the slot that boots";
+                }
+                if (problem) bad++;
+                printf("    install: %s, %uK gzipped to %uK, %s\n", problem ? "FAILED" : "ok",
+                       (unsigned)firmware.size() / 1024, (unsigned)packed.size() / 1024,
+                       problem ? problem : ("boots from " + slots[boot].label).c_str());
+            }
+            journal_clear();
+            fs_carry_clear();
+        }
+        flash_dev_set(NULL);
+    }
+    if (known_count > 0) printf("\n%d of the layouts checked against what the build worked out for them\n", known_count);
+    unlink(image);
+    fs_carry_clear();
+    return bad ? 1 : 0;
+}
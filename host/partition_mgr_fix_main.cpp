@@ -0,0 +1,322 @@
+/**
+ * @file partition_mgr_fix_main.cpp
+ * @brief Runs partition_mgr_fix against a flash image file on Linux.
+ */
+
+#include "part_mgr.h"
+#include "file_flash_dev.h"
+#include "host_image.h"
+#include "journal.h"
+#include "part_job.h"
+#include "utils.h"
+#include "gz_stream.h"
+#include "digest_cache.h"
+#include "api_json.h"
+#include "flash_bench.h"
+#include "metrics.h"
+#include "fs_carry.h"
+#include "app_image.h"
+#include "part_install.h"
+#include <string>
+#include <thread>
+
+static void usage() {
+    fprintf(stderr,
+        "usage: partition_mgr_fix [options] <image.bin>\n"
+        "  --csv <file>         create the image from a partition CSV first\n"
+        "  --flash-mb <n>       image size when creating: 4, 8 or 16 (default 4)\n"
+        "  --dry-run            only plan, like /partition-read\n"
+        "  --target <file>      switch to this partition table (CSV or binary) instead of resizing\n"
+        "  --install <file>     then write this firmware (raw or gzipped) to the new slot and boot it,\n"
+        "                       like /partition-install\n"
+        "  --resume             finish an interrupted run from <image.bin>.journal, and put kept files\n"
+        "                       back from the archive <image.bin>.fs points to, like setup() does\n"
+        "  --keep-fs            keep the files of a filesystem that shrinks (like ?keep_fs=1); with --csv,\n"
+        "                       spiffs/littlefs partitions get a few files (on a stand-in filesystem)\n"
+        "  --dump <file>        only save the image's flash to <file>, like /flash-download\n"
+        "  --range <spec>       with --dump: just this Range header value, e.g. bytes=65536- or bytes=-4096\n"
+        "  --gzip               with --dump: gzipped, like a download with Accept-Encoding: gzip\n"
+        "  --check-dump <file>  compare a download (raw or gzipped) with the image, or its --range\n"
+        "  --digests            only print the flash region MD5s, like /digests\n"
+        "  --detect-fs          only say which filesystem each data partition has, going by its signature\n"
+        "                       (as keep_fs does); e.g. on a dump of a board with an ESP-IDF or mkspiffs SPIFFS\n"
+        "  --flash-bench        only time the (simulated) flash on a blank scratch area, like /flash-bench;\n"
+        "                       with --json, like /api/flash-bench\n"
+        "  --json               print what /api/device, /api/table & the run's report (/api/plan, /api/job) say\n"
+        "                       instead of the log\n"
+        "  --metrics            print what /metrics says after the run\n"
+        "  --background         run it as a background job, like /partition-fix, and poll its progress\n"
+        "  --running-slot <n>   OTA slot we pretend to run from, otadata set to boot it (default 0)\n"
+        "  --sleep              really wait for the flash latency instead of simulating it\n"
+        "  --move-mode <m>      block (default), sector or pipeline\n"
+        "  --summary            log a line every 10%% of a move instead of every sector\n"
+        "  --strategy <s>       layout strategy: shrink-biggest, shrink-other or free-space (default: cheapest)\n"
+        "  --erase-4k <us> --erase-64k <us> --program <us per page> --read-4k <us>\n");
+}
+
+// writes to a file, for --dump
+class FileSink : public OutputSink {
+public:
+    FileSink(FILE *f) : _f(f) {}
+    void write(const char *str, size_t len) override { fwrite(str, 1, len, _f); }
+private:
+    FILE *_f;
+};
+
+// what handleDownloadFlash() sends for the whole flash & this Range header
+static int dump_flash(FlashDev &dev, const char *path, const char *range, bool gzip) {
+    uint32_t total = dev.size(), first = 0, last = total - 1;
+    http_range_t r = http_range_parse(range, total, first, last);
+    if (r == HTTP_RANGE_UNSATISFIABLE) {
+        fprintf(stderr, "416, Content-Range: bytes */%u\n", total);
+        return 1;
+    }
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return 1;
+    }
+    FileSink file_out(f);
+    unsigned long time_start = micros();
+    esp_err_t err;
+    uint32_t sent = last - first + 1;
+    if (gzip && r == HTTP_RANGE_NONE) {
+        GzipSink out(file_out);
+        err = flash_dev_stream(first, total, out);
+        out.finish();
+        sent = out.bytes_out();
+    } else {
+        err = flash_dev_stream(first, last - first + 1, file_out);
+    }
+    unsigned long time_end = micros();
+    fclose(f);
+    if (r == HTTP_RANGE_OK) printf("206, Content-Range: bytes %u-%u/%u\n", first, last, total);
+    else printf("200, %s%u bytes\n", gzip ? "Content-Encoding: gzip, " : "Content-Length: ", sent);
+    const flash_stats_t &st = dev.stats();
+    printf("result: 0x%x, %u KB in %u reads, %lu ms\n", err, (unsigned)(st.bytes_read / 1024), st.read_ops,
+           (time_end - time_start) / 1000);
+    return (err == ESP_OK) ? 0 : 1;
+}
+
+// a download should be the image, or the --range of it
+static int check_flash_dump(FlashDev &dev, const char *path, const char *range) {
+    std::string data, error;
+    if (!read_file(path, data)) {
+        fprintf(stderr, "Can't read %s\n", path);
+        return 1;
+    }
+    if (data.size() >= 2 && (uint8_t)data[0] == 0x1F && (uint8_t)data[1] == 0x8B) {
+        std::string packed;
+        packed.swap(data);
+        if (!gz_inflate(packed, data, error)) {
+            printf("%s: %s\n", path, error.c_str());
+            return 1;
+        }
+        printf("%s: gzip, %u -> %u bytes\n", path, (unsigned)packed.size(), (unsigned)data.size());
+    }
+    uint32_t total = dev.size(), first = 0, last = total - 1;
+    if (http_range_parse(range, total, first, last) == HTTP_RANGE_UNSATISFIABLE) {
+        fprintf(stderr, "Range not satisfiable\n");
+        return 1;
+    }
+    std::string expect(last - first + 1, '\0');
+    dev.read(first, &expect[0], expect.size());
+    bool same = (data == expect);
+    printf("%s: %s\n", path, same ? "matches the image" : "DIFFERENT from the image");
+    return same ? 0 : 1;
+}
+
+// what a web client of /partition-progress sees: the log as it comes, and the
+// progress every 10%
+static part_mgr_result_t run_background(const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                                        const std::string *target, bool dry_run, bool quiet) {
+    if (!part_job_start(env, opts, target ? (const uint8_t *)target->data() : NULL,
+                        target ? target->size() : 0, dry_run)) {
+        fprintf(stderr, "Can't start the job\n");
+        return PART_MGR_FAILED;
+    }
+    part_job_status_t status;
+    uint32_t from = 0, last_tenth = 0;
+    const char *last_phase = NULL;
+    char buf[512];
+    do {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        part_job_status(status); // before the log, so a finished job's log is complete
+        size_t len;
+        while ((len = part_job_log(from, buf, sizeof(buf))) > 0) if (!quiet) fwrite(buf, 1, len, stdout);
+        if (quiet) continue;
+        uint32_t tenth = status.sectors_total ? status.sectors_done * 10 / status.sectors_total : 0;
+        if (status.phase != last_phase || tenth != last_tenth) {
+            printf("\n[%s %s: %u / %u sectors, %u KB/s, ETA %u s, %u ms]\n ", part_job_state_name(status.state),
+                   status.phase, status.sectors_done, status.sectors_total, status.bytes_per_s / 1024,
+                   status.eta_s, status.elapsed_ms);
+            last_phase = status.phase;
+            last_tenth = tenth;
+        }
+    } while (status.state == PART_JOB_RUNNING);
+    if (!quiet) printf("\njob %s\n", part_job_result_name(status.result));
+    return status.result;
+}
+
+int main(int argc, char **argv) {
+    flash_latency_t latency = FLASH_LATENCY_DEFAULT;
+    part_mgr_opts_t opts = {};
+    const char *csv = NULL, *image = NULL, *target = NULL, *install = NULL, *dump = NULL, *range = NULL, *check_dump = NULL;
+    size_t flash_mb = 4;
+    bool dry_run = false, resume = false, background = false, gzip = false, digests = false, json = false;
+    bool bench = false, metrics = false, keep_fs = false, detect_fs = false;
+    int running_slot = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--csv") == 0 && value) { csv = value; i++; }
+        else if (strcmp(argv[i], "--flash-mb") == 0 && value) { flash_mb = atoi(value); i++; }
+        else if (strcmp(argv[i], "--running-slot") == 0 && value) { running_slot = atoi(value); i++; }
+        else if (strcmp(argv[i], "--dry-run") == 0) dry_run = true;
+        else if (strcmp(argv[i], "--resume") == 0) resume = true;
+        else if (strcmp(argv[i], "--keep-fs") == 0) keep_fs = true;
+        else if (strcmp(argv[i], "--background") == 0) background = true;
+        else if (strcmp(argv[i], "--dump") == 0 && value) { dump = value; i++; }
+        else if (strcmp(argv[i], "--range") == 0 && value) { range = value; i++; }
+        else if (strcmp(argv[i], "--gzip") == 0) gzip = true;
+        else if (strcmp(argv[i], "--digests") == 0) digests = true;
+        else if (strcmp(argv[i], "--detect-fs") == 0) detect_fs = true;
+        else if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--flash-bench") == 0) bench = true;
+        else if (strcmp(argv[i], "--metrics") == 0) metrics = true;
+        else if (strcmp(argv[i], "--check-dump") == 0 && value) { check_dump = value; i++; }
+        else if (strcmp(argv[i], "--target") == 0 && value) { target = value; i++; }
+        else if (strcmp(argv[i], "--install") == 0 && value) { install = value; i++; }
+        else if (strcmp(argv[i], "--sleep") == 0) host_clock_set_sleep(true);
+        else if (strcmp(argv[i], "--move-mode") == 0 && value) {
+            opts.move_mode = (strcmp(value, "sector") == 0) ? MOVE_MODE_SECTOR :
+                             (strcmp(value, "pipeline") == 0) ? MOVE_MODE_PIPELINE : MOVE_MODE_BLOCK;
+            i++;
+        }
+        else if (strcmp(argv[i], "--strategy") == 0 && value) { part_mgr_opts_strategy(opts, value); i++; }
+        else if (strcmp(argv[i], "--summary") == 0) opts.verbosity = OUT_VERBOSITY_SUMMARY;
+        else if (flash_latency_parse_arg(argv[i], value, latency)) i++;
+        else if (argv[i][0] != '-' && image == NULL) image = argv[i];
+        else { usage(); return 2; }
+    }
+    if (image == NULL || (flash_mb != 4 && flash_mb != 8 && flash_mb != 16) || (background && resume) ||
+        (install && (background || resume || dry_run || target))) {
+        usage();
+        return 2;
+    }
+
+    FileFlashDev dev(latency);
+    if (!dev.open(image, csv ? flash_mb * 1024 * 1024 : 0)) {
+        fprintf(stderr, "Can't open image %s\n", image);
+        return 1;
+    }
+    flash_dev_set(&dev);
+    std::string journal = std::string(image) + ".journal";
+    journal_set_path(journal.c_str());
+    std::string carry = std::string(image) + ".fs";
+    fs_carry_set_path(carry.c_str());
+    opts.keep_fs = keep_fs;
+
+    std::vector<csv_entry_t> entries;
+    if (csv != NULL) {
+        std::string error;
+        if (!csv_parse_file(csv, entries, error) || !image_create(dev, entries, keep_fs)) {
+            fprintf(stderr, "Can't create image from %s: %s\n", csv, error.c_str());
+            return 1;
+        }
+    }
+
+    // without a CSV, take the running app from the table on the image
+    part_mgr_env_t env = {0, 0, false};
+    if (csv != NULL) {
+        env = image_env(entries, running_slot);
+        if (running_slot != 0) app_image_set_boot(env.running_address); // otadata boots it, as on the device
+    } else {
+        image_read_entries(dev, entries);
+        env = image_env(entries, running_slot);
+    }
+
+    dev.reset_stats();
+    if (dump != NULL) return dump_flash(dev, dump, range, gzip);
+    if (check_dump != NULL) return check_flash_dump(dev, check_dump, range);
+    if (digests) {
+        digest_cache_init(false);
+        bool ok = digest_cache_update();
+        StdoutSink out;
+        digest_cache_report(out);
+        digest_cache_json(out);
+        return ok ? 0 : 1;
+    }
+    if (detect_fs) {
+        for (const csv_entry_t &e : entries) {
+            if (e.type != ESP_PARTITION_TYPE_DATA) continue;
+            printf("%-16s 0x%06x %8u  %s\n", e.label.c_str(), e.offset, e.size,
+                   fs_kind_name(fs_carry_detect(e.offset, e.size)));
+        }
+        return 0;
+    }
+    StdoutSink stdout_sink;
+    NullSink no_log;
+    if (bench) {
+        flash_bench_result_t result;
+        if (json) Serial.enabled = false;
+        bool ok = flash_bench_run(json ? (OutputSink &)no_log : stdout_sink, env, result);
+        if (json) flash_bench_json(stdout_sink, result);
+        return ok ? 0 : 1;
+    }
+    BufferedSink out(json ? (OutputSink &)no_log : stdout_sink, opts.verbosity);
+    part_mgr_report_t report;
+    if (json) {
+        Serial.enabled = false; // only the JSON on the terminal
+        opts.report = &report;
+        printf("{\"device\":");
+        api_json_device(stdout_sink, env);
+        printf(",\"table\":");
+        api_json_table(stdout_sink);
+    }
+    unsigned long time_start = micros();
+    std::string target_data;
+    if (target != NULL && !read_file(target, target_data)) {
+        fprintf(stderr, "Can't read %s\n", target);
+        return 1;
+    }
+    std::string firmware;
+    if (install != NULL && !read_file(install, firmware)) {
+        fprintf(stderr, "Can't read %s\n", install);
+        return 1;
+    }
+    part_mgr_result_t result;
+    if (install != NULL) {
+        result = part_install_check(out, env, opts) ? partition_mgr_run(out, env, opts, false) : PART_MGR_FAILED;
+        if (result != PART_MGR_FAILED && image_install(out, env, firmware) != ESP_OK) result = PART_MGR_FAILED;
+    } else if (background) {
+        result = run_background(env, opts, target ? &target_data : NULL, dry_run, json);
+    } else {
+        result = resume ? partition_mgr_resume(out, opts) :
+            (target != NULL) ? partition_mgr_target(out, env, opts, (const uint8_t *)target_data.data(), target_data.size(), dry_run) :
+                               partition_mgr_run(out, env, opts, dry_run);
+        if (resume && result != PART_MGR_FAILED && fs_carry_resume(out) == ESP_OK) result = PART_MGR_DONE;
+    }
+    unsigned long time_end = micros();
+    if (json) {
+        if (background) {
+            printf(",\"job\":");
+            api_json_job(stdout_sink);
+        } else {
+            printf(",\"run\":");
+            api_json_report(stdout_sink, report);
+        }
+        printf("}\n");
+        return (result == PART_MGR_FAILED) ? 1 : 0;
+    }
+    if (metrics) {
+        out.flush();
+        printf("\n");
+        metrics_write(stdout_sink);
+    }
+    const flash_stats_t &st = dev.stats();
+    printf("\nresult: %d, read %llu KB, written %llu KB, erased %llu KB in %u erases, %lu ms\n",
+           result, (unsigned long long)st.bytes_read/1024, (unsigned long long)st.bytes_written/1024,
+           (unsigned long long)st.bytes_erased/1024, st.erase_ops, (time_end-time_start)/1000);
+    return (result == PART_MGR_FAILED) ? 1 : 0;
+}
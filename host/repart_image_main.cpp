@@ -0,0 +1,214 @@
+/**
+ * @file repart_image_main.cpp
+ * @brief Repartitions full-flash dumps offline, with the same planner & mover
+ * as the device, into patched images ready to flash.
+ *
+ * Each dump is mapped, copied into its (mapped) output file, and the output is
+ * repartitioned in place through FileFlashDev. The flash latency is only
+ * simulated, so a 4MB dump takes a few milliseconds of real time.
+ */
+
+#include "part_mgr.h"
+#include "file_flash_dev.h"
+#include "host_image.h"
+#include "journal.h"
+#include "api_json.h"
+#include <chrono>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void usage() {
+    fprintf(stderr,
+        "usage: repart_image [options] <dump.bin>...\n"
+        "  -o, --out <path>     patched image; with several dumps, a directory for them\n"
+        "                       (default: <dump>.repart.bin next to each dump)\n"
+        "  --target <file>      switch to this partition table (CSV or binary) instead of resizing\n"
+        "  --dry-run            only plan, write nothing\n"
+        "  --running-slot <n>   OTA slot the device runs from (default: what otadata boots, else 0)\n"
+        "  --move-mode <m>      block (default), sector or pipeline\n"
+        "  --strategy <s>       layout strategy: shrink-biggest, shrink-other or free-space (default: cheapest)\n"
+        "  --verbose            print each run's log, as /partition-read shows it\n"
+        "  --json               one line of JSON per dump: {\"dump\":..,\"out\":..,\"run\":<like /api/plan>}\n");
+}
+
+// a read-only mapping of a whole file
+class MappedFile {
+public:
+    ~MappedFile() {
+        if (data != NULL) munmap((void *)data, size);
+    }
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const uint8_t *)p;
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+        return data != NULL;
+    }
+    const uint8_t *data = NULL;
+    size_t size = 0;
+};
+
+static std::string out_path(const char *dump, const char *out, bool several) {
+    if (out == NULL) return std::string(dump) + ".repart.bin";
+    if (!several) return out;
+    const char *base = strrchr(dump, '/');
+    return std::string(out) + "/" + (base ? base + 1 : dump);
+}
+
+static const char *result_name(part_mgr_result_t result) {
+    switch (result) {
+        case PART_MGR_DONE: return "done";
+        case PART_MGR_TESTED: return "tested";
+        case PART_MGR_UNNECESSARY: return "unneeded";
+        default: return "failed";
+    }
+}
+
+// one dump; false if it failed
+static bool repart_one(const char *dump, const std::string &out, const part_mgr_opts_t &base_opts,
+                       const std::string *target, bool dry_run, int running_slot, bool verbose, bool json) {
+    MappedFile in;
+    if (!in.open(dump) || in.size % SPI_FLASH_SEC_SIZE != 0) {
+        fprintf(stderr, "%s: can't read it, or it isn't whole sectors\n", dump);
+        return false;
+    }
+    flash_latency_t latency = FLASH_LATENCY_DEFAULT;
+    FileFlashDev dev(latency);
+    std::string journal = out + ".journal";
+    if (!dev.open(out.c_str(), in.size)) {
+        fprintf(stderr, "%s: can't write %s\n", dump, out.c_str());
+        return false;
+    }
+    memcpy(dev.data(), in.data, in.size);
+    flash_dev_set(&dev);
+    resetPartitionTableAddr();
+    journal_set_path(journal.c_str());
+
+    std::vector<csv_entry_t> entries;
+    if (!image_read_entries(dev, entries)) {
+        fprintf(stderr, "%s: no valid partition table\n", dump);
+        dev.close();
+        flash_dev_set(NULL);
+        unlink(out.c_str());
+        return false;
+    }
+    if (running_slot < 0) running_slot = image_boot_slot(dev, entries);
+    part_mgr_env_t env = image_env(entries, running_slot < 0 ? 0 : running_slot);
+
+    StdoutSink stdout_sink;
+    NullSink no_log;
+    part_mgr_report_t report;
+    part_mgr_opts_t opts = base_opts;
+    opts.report = &report;
+    part_mgr_result_t result;
+    {
+        BufferedSink log(verbose ? (OutputSink &)stdout_sink : no_log, opts.verbosity);
+        result = (target != NULL) ?
+            partition_mgr_target(log, env, opts, (const uint8_t *)target->data(), target->size(), dry_run) :
+            partition_mgr_run(log, env, opts, dry_run);
+        // steps a device would leave for the boot from the firmware's copy; offline, nothing runs from there
+        part_mgr_opts_t rest = opts;
+        rest.report = NULL;
+        if (result == PART_MGR_DONE && partition_mgr_resume(log, rest) == PART_MGR_FAILED) result = PART_MGR_FAILED;
+    }
+    // what the bootloader will check: the new table & its MD5 entry
+    std::vector<csv_entry_t> after;
+    bool ok = (result != PART_MGR_FAILED);
+    if (result == PART_MGR_DONE && !image_read_entries(dev, after)) {
+        snprintf(report.error, sizeof(report.error), "the new partition table doesn't check out");
+        ok = false;
+    }
+    dev.close();
+    flash_dev_set(NULL);
+    // half a repartition is no image to flash; the dump is still there to try again
+    if (dry_run || !ok) unlink(out.c_str());
+    unlink(journal.c_str());
+
+    if (json) {
+        printf("{\"dump\":\"%s\",\"out\":", dump);
+        if (dry_run || !ok) printf("null"); else printf("\"%s\"", out.c_str());
+        printf(",\"ok\":%s,\"run\":", ok ? "true" : "false");
+        fflush(stdout);
+        api_json_report(stdout_sink, report);
+        printf("}\n");
+        return ok;
+    }
+    char plan[64] = "-";
+    if (report.best >= 0 && report.best < report.candidate_count) {
+        const part_mgr_report_candidate_t &c = report.candidates[report.best];
+        snprintf(plan, sizeof(plan), "%s%s%s, moves %uK, erases %uK, est %u ms", c.strategy,
+                 c.shrink[0] ? " " : "", c.shrink, c.bytes_moved / 1024, c.bytes_erased / 1024, c.cost_ms);
+    }
+    bool wrote = ok && !dry_run;
+    printf("%s: %s, %s%s%s%s%s\n", dump, ok ? result_name(result) : "failed", plan,
+           wrote ? " -> " : "", wrote ? out.c_str() : "", report.error[0] ? "; " : "", report.error);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    part_mgr_opts_t opts = {};
+    opts.verbosity = OUT_VERBOSITY_SUMMARY;
+    const char *out = NULL, *target = NULL;
+    bool dry_run = false, verbose = false, json = false;
+    int running_slot = -1;
+    std::vector<const char *> dumps;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--out") == 0) && value) { out = value; i++; }
+        else if (strcmp(argv[i], "--target") == 0 && value) { target = value; i++; }
+        else if (strcmp(argv[i], "--running-slot") == 0 && value) { running_slot = atoi(value); i++; }
+        else if (strcmp(argv[i], "--dry-run") == 0) dry_run = true;
+        else if (strcmp(argv[i], "--verbose") == 0) verbose = true;
+        else if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--move-mode") == 0 && value) {
+            opts.move_mode = (strcmp(value, "sector") == 0) ? MOVE_MODE_SECTOR :
+                             (strcmp(value, "pipeline") == 0) ? MOVE_MODE_PIPELINE : MOVE_MODE_BLOCK;
+            i++;
+        }
+        else if (strcmp(argv[i], "--strategy") == 0 && value) { part_mgr_opts_strategy(opts, value); i++; }
+        else if (argv[i][0] != '-') dumps.push_back(argv[i]);
+        else { usage(); return 2; }
+    }
+    if (dumps.empty() || (verbose && json)) {
+        usage();
+        return 2;
+    }
+    bool several = dumps.size() > 1;
+    struct stat st;
+    if (several && out != NULL && (stat(out, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, "%s isn't a directory; with several dumps, -o takes one\n", out);
+        return 2;
+    }
+    std::string target_data;
+    if (target != NULL && !read_file(target, target_data)) {
+        fprintf(stderr, "Can't read %s\n", target);
+        return 1;
+    }
+    Serial.enabled = verbose; // the log has it all, and it'd be noise otherwise
+
+    unsigned failed = 0;
+    auto time_start = std::chrono::steady_clock::now();
+    for (const char *dump : dumps) {
+        if (!repart_one(dump, out_path(dump, out, several), opts, target ? &target_data : NULL, dry_run,
+                        running_slot, verbose, json)) {
+            failed++;
+        }
+    }
+    fflush(stdout);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_start);
+    if (!json && several) {
+        fprintf(stderr, "%u dumps, %u failed, %lld ms\n", (unsigned)dumps.size(), failed, (long long)ms.count());
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,419 @@
+/**
+ * @file uart_client_main.cpp
+ * @brief Talks to boards over the serial bench protocol (src/uart_proto.h):
+ * one command, or the whole check, on any number of ports at once.
+ */
+
+#include "host_uart.h"
+#include "host_image.h"
+#include "part_job.h"
+#include "MD5Builder.h"
+#include <chrono>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+static void usage() {
+    fprintf(stderr,
+        "usage: uart_client [options] <command> <port>...\n"
+        "  commands, each sent to every port at once:\n"
+        "    hello              protocol version & what /api/device says\n"
+        "    list               the partition table, like /api/table\n"
+        "    digest             the flash region MD5s, like /digests\n"
+        "    job                the background job, like /api/job\n"
+        "    plan               a dry run, like /partition-read: the log, then the report like /api/plan\n"
+        "    fix                the real thing, like /partition-fix; the board reboots once it's done\n"
+        "    dump <addr> <len>  flash bytes; addr/len in hex or decimal, or one of bootloader, table, flash\n"
+        "                       instead of both\n"
+        "    check              hello, list, digests that match the bootloader & table dumped, plan, then\n"
+        "                       fix until a plan says it's unneeded, and the digests again. Fails on\n"
+        "                       whatever doesn't add up, not on a layout that can't be fixed.\n"
+        "  --baud <n>           (default 921600; ptys don't care)\n"
+        "  --keep-fs            plan/fix: keep the files of a filesystem that shrinks\n"
+        "  --move-mode <m>      plan/fix: block (default), sector or pipeline\n"
+        "  --strategy <s>       plan/fix: shrink-biggest, shrink-other or free-space (default: cheapest)\n"
+        "  --summary            plan/fix: log a line every 10%% of a move instead of every sector\n"
+        "  --gzip               dump: have the board gzip it (unpacked here)\n"
+        "  -o <dir>             each board's answer to <dir>/<port name>.bin or .json instead of stdout\n"
+        "  --timeout <ms>       give up on a board that says nothing for this long (default 10000)\n"
+        "  -v                   check: the log of the runs too\n");
+}
+
+typedef struct {
+    uint8_t run_flags;
+    uint8_t move_mode;
+    std::string strategy;
+    bool gzip;
+    bool verbose;
+    const char *out_dir;
+    int baud;
+    uint32_t timeout_ms;
+} client_opts_t;
+
+// writes to a FILE, for the log of a single board
+class FileSink : public OutputSink {
+public:
+    FileSink(FILE *f) : _f(f) {}
+    void write(const char *str, size_t len) override { fwrite(str, 1, len, _f); fflush(_f); }
+private:
+    FILE *_f;
+};
+
+// the log of a run, with a progress line every 10%, like partition_mgr_fix --background
+class ProgressLog : public OutputSink {
+public:
+    ProgressLog(OutputSink &out, bool show) : _out(out), _show(show), _tenth(0) {}
+    void write(const char *str, size_t len) override { if (_show) _out.write(str, len); }
+    void progress(const char *phase, uint32_t done, uint32_t total) override {
+        uint32_t tenth = total ? (uint64_t)done * 10 / total : 0;
+        if (!_show || (_phase == phase && tenth == _tenth)) return;
+        char c_buffer[96];
+        snprintf(c_buffer, sizeof(c_buffer), "\n[%s: %u / %u KB]\n", phase, done / 1024, total / 1024);
+        _out.write(c_buffer, strlen(c_buffer));
+        _phase = phase;
+        _tenth = tenth;
+    }
+private:
+    OutputSink &_out;
+    bool _show;
+    std::string _phase;
+    uint32_t _tenth;
+};
+
+// one port, and how it went
+typedef struct {
+    std::string port;
+    std::string data;                   // the answer (unpacked, for gzip dumps)
+    std::string log;                    // for more than one board
+    std::string verdict;
+    bool ok;
+    uint32_t wire_bytes;                // DATA as it came over the line
+    uint32_t ms;
+    uart_client_stats_t stats;
+    uint32_t skipped;
+} board_t;
+
+// unsigned number after "key": in JSON; 0 if it isn't there
+static uint32_t json_uint(const std::string &json, const char *key) {
+    std::string k = std::string("\"") + key + "\":";
+    size_t p = json.find(k);
+    return (p == std::string::npos) ? 0 : strtoul(json.c_str() + p + k.size(), NULL, 10);
+}
+
+// the md5 of a region in what DIGEST says; empty if it's stale or not there
+static std::string json_region_md5(const std::string &json, const char *name) {
+    size_t p = json.find(std::string("{\"name\":\"") + name + "\"");
+    if (p == std::string::npos) return "";
+    p = json.find("\"md5\":", p);
+    if (p == std::string::npos || json.compare(p + 6, 1, "\"") != 0) return "";
+    return json.substr(p + 7, 32);
+}
+
+static std::string md5_hex(const std::string &data) {
+    MD5Builder md5;
+    char hex[33];
+    md5.begin();
+    md5.add((const uint8_t *)data.data(), data.size());
+    md5.calculate();
+    md5.getChars(hex);
+    return hex;
+}
+
+class Session {
+public:
+    Session(board_t &board, const client_opts_t &opts, OutputSink &log)
+        : _board(board), _opts(opts), _log(log), _client(_port, opts.timeout_ms) {}
+    bool open() {
+        if (_port.open(_board.port.c_str(), _opts.baud)) return true;
+        _board.verdict = "can't open";
+        return false;
+    }
+    // one command; false + verdict if it didn't come through, or the board said no
+    bool request(uint8_t cmd, const std::string &payload, std::string &data, uart_end_t &end, const char *what,
+                 bool show_log = false) {
+        std::string wire, error;
+        StringSink wire_out(wire);
+        ProgressLog log(_log, show_log);
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start = clock::now();
+        bool ok = _client.request(cmd, (const uint8_t *)payload.data(), payload.size(), wire_out, log, end, error);
+        _board.ms += std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count();
+        _board.wire_bytes += wire.size();
+        _board.stats = _client.stats();
+        _board.skipped = _client.skipped();
+        if (show_log) _log.write("\n", 1);
+        char c_buffer[160];
+        if (!ok) {
+            snprintf(c_buffer, sizeof(c_buffer), "%s: %s", what, error.c_str());
+            _board.verdict = c_buffer;
+            return false;
+        }
+        if (end.status != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "%s: error 0x%x", what, end.status);
+            _board.verdict = c_buffer;
+            return false;
+        }
+        if (cmd == UART_CMD_DUMP && _opts.gzip) {
+            if (!gz_inflate(wire, data, error)) {
+                snprintf(c_buffer, sizeof(c_buffer), "%s: %s", what, error.c_str());
+                _board.verdict = c_buffer;
+                return false;
+            }
+        } else {
+            data.swap(wire);
+        }
+        return true;
+    }
+    bool dump(uint32_t addr, uint32_t len, std::string &data, const char *what) {
+        uint8_t payload[9];
+        uart_put32(payload, addr);
+        uart_put32(payload + 4, len);
+        payload[8] = _opts.gzip ? UART_DUMP_GZIP : 0;
+        uart_end_t end;
+        return request(UART_CMD_DUMP, std::string((const char *)payload, sizeof(payload)), data, end, what);
+    }
+    // PLAN or FIX; the run's result, or -1 if it didn't come through
+    int run(uint8_t cmd, std::string &report) {
+        std::string payload;
+        payload += (char)_opts.run_flags;
+        payload += (char)_opts.move_mode;
+        payload += _opts.strategy;
+        uart_end_t end;
+        const char *what = (cmd == UART_CMD_FIX) ? "fix" : "plan";
+        if (!request(cmd, payload, report, end, what, _opts.verbose)) return -1;
+        return end.result;
+    }
+    // the device JSON; false + verdict if the board speaks something else
+    bool hello(std::string &device, int tries = 1) {
+        std::string data;
+        uart_end_t end;
+        bool ok = false;
+        for (int i = 0; i < tries && !ok; i++) ok = request(UART_CMD_HELLO, "", data, end, "hello");
+        if (!ok) return false;
+        if (data.size() < 4 || (uint8_t)data[0] != UART_PROTO_VERSION) {
+            _board.verdict = "hello: not protocol version " + std::to_string(UART_PROTO_VERSION);
+            return false;
+        }
+        device = data.substr(4);
+        return true;
+    }
+    // digests once the cache has them all, checked against the bootloader & table as dumped
+    bool digests_match(uint32_t table_addr) {
+        std::string json, bootloader, table;
+        uart_end_t end;
+        // the cache finds the regions on its first update, so "ready" alone isn't enough
+        bool ready = false;
+        for (int i = 0; i < 50 && !ready; i++) {
+            if (i > 0) std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            if (!request(UART_CMD_DIGEST, "", json, end, "digest")) return false;
+            ready = !json_region_md5(json, "bootloader").empty() && !json_region_md5(json, "table").empty();
+        }
+        if (!ready) {
+            _board.verdict = "digest: never ready";
+            return false;
+        }
+        if (!dump(0x1000, table_addr - 0x1000, bootloader, "bootloader dump") ||
+            !dump(table_addr, SPI_FLASH_SEC_SIZE, table, "table dump")) {
+            return false;
+        }
+        if (md5_hex(bootloader) != json_region_md5(json, "bootloader") || md5_hex(table) != json_region_md5(json, "table")) {
+            _board.verdict = "digest: doesn't match the dump";
+            return false;
+        }
+        return true;
+    }
+private:
+    board_t &_board;
+    const client_opts_t &_opts;
+    OutputSink &_log;
+    FdUartPort _port;
+    UartClient _client;
+};
+
+// everything a bench wants to know about a board, in one go
+static void check_board(Session &s, board_t &b) {
+    std::string device, json, report;
+    uart_end_t end;
+    if (!s.hello(device)) return;
+    uint32_t table_addr = json_uint(device, "table_address");
+    if (table_addr <= 0x1000) {
+        b.verdict = "hello: no table address";
+        return;
+    }
+    if (!s.request(UART_CMD_LIST, "", json, end, "list")) return;
+    if (json.empty() || json[0] != '{') {
+        b.verdict = "list: not JSON";
+        return;
+    }
+    if (!s.digests_match(table_addr)) return;
+    int result = s.run(UART_CMD_PLAN, report);
+    if (result < 0) return;
+    int fixes = 0;
+    // a run from the second OTA slot copies the firmware to the first and needs another
+    while (result == PART_MGR_TESTED && fixes < 2) {
+        result = s.run(UART_CMD_FIX, report);
+        if (result < 0) return;
+        if (result != PART_MGR_DONE) {
+            b.verdict = std::string("fix: ") + part_job_result_name((part_mgr_result_t)result) + " after a plan that passed";
+            return;
+        }
+        fixes++;
+        // the board reboots into the new table
+        if (!s.hello(device, 3)) return;
+        table_addr = json_uint(device, "table_address");
+        result = s.run(UART_CMD_PLAN, report);
+        if (result < 0) return;
+    }
+    if (fixes > 0 && result != PART_MGR_UNNECESSARY) {
+        b.verdict = std::string("plan after the fix: ") + part_job_result_name((part_mgr_result_t)result);
+        return;
+    }
+    if (fixes > 0 && !s.digests_match(table_addr)) return;
+    b.ok = true;
+    b.verdict = (fixes == 0) ? std::string("ok, plan: ") + part_job_result_name((part_mgr_result_t)result)
+                             : "ok, fixed in " + std::to_string(fixes) + " run" + (fixes > 1 ? "s" : "");
+}
+
+// "0x10000", "65536", or a region the board's hello tells us about
+static bool dump_range(Session &s, board_t &b, const char *addr_arg, const char *len_arg, uint32_t &addr, uint32_t &len) {
+    if (len_arg == NULL) {
+        std::string device;
+        if (!s.hello(device)) return false;
+        uint32_t table_addr = json_uint(device, "table_address");
+        if (strcmp(addr_arg, "bootloader") == 0) { addr = 0x1000; len = table_addr - 0x1000; }
+        else if (strcmp(addr_arg, "table") == 0) { addr = table_addr; len = SPI_FLASH_SEC_SIZE; }
+        else { addr = 0; len = json_uint(device, "flash_size"); }
+        return true;
+    }
+    addr = strtoul(addr_arg, NULL, 0);
+    len = strtoul(len_arg, NULL, 0);
+    return true;
+}
+
+static void serve_board(board_t &b, const client_opts_t &opts, const char *command, const char *addr_arg,
+                        const char *len_arg, OutputSink &log) {
+    Session s(b, opts, log);
+    if (!s.open()) return;
+    uart_end_t end;
+    if (strcmp(command, "check") == 0) {
+        check_board(s, b);
+        return;
+    }
+    if (strcmp(command, "hello") == 0) {
+        if (!s.hello(b.data)) return;
+        b.ok = true;
+        b.verdict = "ok";
+        return;
+    }
+    if (strcmp(command, "plan") == 0 || strcmp(command, "fix") == 0) {
+        int result = s.run(strcmp(command, "fix") == 0 ? UART_CMD_FIX : UART_CMD_PLAN, b.data);
+        if (result < 0) return;
+        b.ok = (result != PART_MGR_FAILED);
+        b.verdict = part_job_result_name((part_mgr_result_t)result);
+        return;
+    }
+    if (strcmp(command, "dump") == 0) {
+        uint32_t addr, len;
+        if (!dump_range(s, b, addr_arg, len_arg, addr, len) || !s.dump(addr, len, b.data, "dump")) return;
+    } else {
+        uint8_t cmd = (strcmp(command, "list") == 0) ? UART_CMD_LIST :
+                      (strcmp(command, "digest") == 0) ? UART_CMD_DIGEST : UART_CMD_JOB;
+        if (!s.request(cmd, "", b.data, end, command)) return;
+    }
+    b.ok = true;
+    b.verdict = "ok";
+}
+
+static bool save_answer(const board_t &b, const char *dir, bool binary) {
+    std::string name = b.port.substr(b.port.rfind('/') + 1);
+    std::string path = std::string(dir) + "/" + name + (binary ? ".bin" : ".json");
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Can't write %s\n", path.c_str());
+        return false;
+    }
+    fwrite(b.data.data(), 1, b.data.size(), f);
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    client_opts_t opts = {0, MOVE_MODE_BLOCK, "", false, false, NULL, UART_PROTO_BAUD, 10000};
+    const char *command = NULL, *addr_arg = NULL, *len_arg = NULL;
+    std::vector<board_t> boards;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--baud") == 0 && value) { opts.baud = atoi(value); i++; }
+        else if (strcmp(argv[i], "--keep-fs") == 0) opts.run_flags |= UART_RUN_KEEP_FS;
+        else if (strcmp(argv[i], "--summary") == 0) opts.run_flags |= UART_RUN_SUMMARY;
+        else if (strcmp(argv[i], "--move-mode") == 0 && value) {
+            opts.move_mode = (strcmp(value, "sector") == 0) ? MOVE_MODE_SECTOR :
+                             (strcmp(value, "pipeline") == 0) ? MOVE_MODE_PIPELINE : MOVE_MODE_BLOCK;
+            i++;
+        }
+        else if (strcmp(argv[i], "--strategy") == 0 && value) { opts.strategy = value; i++; }
+        else if (strcmp(argv[i], "--gzip") == 0) opts.gzip = true;
+        else if (strcmp(argv[i], "-o") == 0 && value) { opts.out_dir = value; i++; }
+        else if (strcmp(argv[i], "--timeout") == 0 && value) { opts.timeout_ms = atoi(value); i++; }
+        else if (strcmp(argv[i], "-v") == 0) opts.verbose = true;
+        else if (argv[i][0] == '-') { usage(); return 2; }
+        else if (command == NULL) command = argv[i];
+        else if (strcmp(command, "dump") == 0 && addr_arg == NULL) {
+            addr_arg = argv[i];
+            bool named = strcmp(addr_arg, "bootloader") == 0 || strcmp(addr_arg, "table") == 0 ||
+                         strcmp(addr_arg, "flash") == 0;
+            if (!named && value) { len_arg = value; i++; }
+        }
+        else {
+            board_t b = {};
+            b.port = argv[i];
+            boards.push_back(b);
+        }
+    }
+    static const char *commands[] = {"hello", "list", "digest", "job", "plan", "fix", "dump", "check"};
+    bool known = false;
+    for (const char *c : commands) known |= (command != NULL && strcmp(command, c) == 0);
+    bool dump = known && strcmp(command, "dump") == 0;
+    if (!known || boards.empty() || (dump && boards.size() > 1 && opts.out_dir == NULL)) {
+        usage();
+        return 2;
+    }
+    if (opts.out_dir != NULL) mkdir(opts.out_dir, 0755);
+    if (strcmp(command, "plan") == 0 || strcmp(command, "fix") == 0) opts.verbose = true;
+
+    // one thread per board; a single board logs as it goes
+    bool single = (boards.size() == 1);
+    FileSink stderr_sink(stderr);
+    std::vector<StringSink> logs;
+    for (board_t &b : boards) logs.emplace_back(b.log);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < boards.size(); i++) {
+        OutputSink &log = single ? (OutputSink &)stderr_sink : (OutputSink &)logs[i];
+        threads.emplace_back(serve_board, std::ref(boards[i]), std::cref(opts), command, addr_arg, len_arg, std::ref(log));
+    }
+    for (std::thread &t : threads) t.join();
+
+    int failed = 0;
+    bool check = strcmp(command, "check") == 0;
+    for (board_t &b : boards) {
+        if (!b.ok) failed++;
+        if (!single && !b.log.empty()) printf("== %s log\n%s\n", b.port.c_str(), b.log.c_str());
+        if (check || !b.ok) continue;
+        if (opts.out_dir != NULL) {
+            if (!save_answer(b, opts.out_dir, dump)) failed++;
+        } else {
+            if (!single) printf("== %s\n", b.port.c_str());
+            fwrite(b.data.data(), 1, b.data.size(), stdout);
+        }
+    }
+    if (single && !check && boards[0].ok) return 0;
+    printf("%-16s %-28s %9s %7s %7s %6s %4s %4s %4s %6s %7s\n", "port", "result", "bytes", "ms", "KB/s",
+           "frames", "bad", "nak", "dup", "resent", "skipped");
+    for (const board_t &b : boards) {
+        printf("%-16s %-28s %9u %7u %7u %6u %4u %4u %4u %6u %7u\n", b.port.c_str(), b.verdict.c_str(), b.wire_bytes,
+               b.ms, b.ms ? (unsigned)((uint64_t)b.wire_bytes * 1000 / 1024 / b.ms) : 0, b.stats.frames, b.stats.bad,
+               b.stats.naks, b.stats.duplicates, b.stats.commands_resent, b.skipped);
+    }
+    return failed ? 1 : 0;
+}
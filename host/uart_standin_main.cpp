@@ -0,0 +1,222 @@
+/**
+ * @file uart_standin_main.cpp
+ * @brief Boards on ptys for uart_client: each one a process of its own with
+ * a flash image made from a partition CSV, serving the bench protocol like
+ * the firmware does on Serial, and "rebooting" after a fix like setup() does.
+ */
+
+#include "host_uart.h"
+#include "host_image.h"
+#include "file_flash_dev.h"
+#include "app_image.h"
+#include "digest_cache.h"
+#include "fs_carry.h"
+#include "journal.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+static void usage() {
+    fprintf(stderr,
+        "usage: uart_standin [options] <layout.csv> [-- <command> [args...]]\n"
+        "  Starts boards on ptys and prints their paths; with a command, runs it with the\n"
+        "  paths added to its arguments, stops the boards after it and exits with its status.\n"
+        "  --count <n>          boards (default 1)\n"
+        "  --flash-mb <n>       4, 8 or 16 (default: the smallest the layout fits)\n"
+        "  --running-slot <n>   OTA slot the boards run from (default 0)\n"
+        "  --keep-fs            spiffs/littlefs partitions get a few files\n"
+        "  --noise <n>          garble about one frame in n, both ways, and put debug log text between frames\n"
+        "  --sleep              really wait for the flash latency instead of simulating it\n"
+        "  --log                the boards' debug log to stderr\n");
+}
+
+// a line that drops & garbles bytes now and then, and has the debug log on it too
+class NoisyPort : public UartPort {
+public:
+    NoisyPort(UartPort &port, int noise, unsigned seed) : _port(port), _noise(noise), _seed(seed) {}
+    int read(uint8_t *data, size_t len, uint32_t timeout_ms) override {
+        int n = _port.read(data, len, timeout_ms);
+        if (n > 0 && _noise > 0 && rand_r(&_seed) % _noise == 0) data[rand_r(&_seed) % n] ^= 0x10;
+        return n;
+    }
+    bool write(const uint8_t *data, size_t len) override {
+        if (_noise <= 0) return _port.write(data, len);
+        if (rand_r(&_seed) % _noise == 0) {
+            static const char line[] = "[D][WiFiManager.cpp:1234] handleRequest(): [WM] <- HTTP Root\r\n";
+            _port.write((const uint8_t *)line, sizeof(line) - 1);
+        }
+        if (rand_r(&_seed) % _noise != 0) return _port.write(data, len);
+        std::string garbled((const char *)data, len);
+        int what = rand_r(&_seed) % 3;
+        if (what == 0) garbled[rand_r(&_seed) % len] ^= 0x01;      // a flipped bit
+        else if (what == 1) garbled.erase(rand_r(&_seed) % len, 1); // a dropped byte
+        else garbled.resize(rand_r(&_seed) % len);                  // cut short
+        return _port.write((const uint8_t *)garbled.data(), garbled.size());
+    }
+private:
+    UartPort &_port;
+    int _noise;
+    unsigned _seed;
+};
+
+// one board's state, for the hooks
+static struct {
+    FileFlashDev *dev;
+    UartPort *port;
+    std::vector<csv_entry_t> entries;
+    part_mgr_env_t env;
+    int running_slot;
+    bool keep_fs;
+} _board;
+
+static part_mgr_env_t board_env() {
+    return _board.env;
+}
+
+// what ESP.restart() and setup() would do: finish the job, put kept files back,
+// and run from whatever otadata boots now
+static void board_reboot() {
+    static const char boot[] = "ets Jul 29 2019 12:21:46\r\n\r\nrst:0xc (SW_CPU_RESET),boot:0x13 (SPI_FAST_FLASH_BOOT)\r\n";
+    _board.port->write((const uint8_t *)boot, sizeof(boot) - 1);
+    NullSink out;
+    part_mgr_opts_t opts = {};
+    opts.keep_fs = _board.keep_fs;
+    resetPartitionTableAddr();
+    part_mgr_result_t resumed = partition_mgr_resume(out, opts);
+    if (resumed != PART_MGR_FAILED) fs_carry_resume(out);
+    std::vector<csv_entry_t> entries;
+    if (image_read_entries(*_board.dev, entries)) _board.entries = entries;
+    int slot = image_boot_slot(*_board.dev, _board.entries);
+    _board.env = image_env(_board.entries, (slot < 0) ? _board.running_slot : slot);
+    Serial.println("Starting ESP32Repartition");
+}
+
+static int board_main(int master, const std::string &image, const std::vector<csv_entry_t> &entries,
+                      size_t flash_mb, int running_slot, bool keep_fs, int noise, unsigned seed) {
+    FileFlashDev dev(FLASH_LATENCY_DEFAULT);
+    if (!dev.open(image.c_str(), flash_mb * 1024 * 1024)) {
+        fprintf(stderr, "Can't open image %s\n", image.c_str());
+        return 1;
+    }
+    flash_dev_set(&dev);
+    std::string journal = image + ".journal", carry = image + ".fs";
+    journal_set_path(journal.c_str());
+    fs_carry_set_path(carry.c_str());
+    if (!image_create(dev, entries, keep_fs)) {
+        fprintf(stderr, "Can't create image %s\n", image.c_str());
+        return 1;
+    }
+    _board.dev = &dev;
+    _board.entries = entries;
+    _board.env = image_env(entries, running_slot);
+    _board.running_slot = running_slot;
+    _board.keep_fs = keep_fs;
+    if (running_slot != 0) app_image_set_boot(_board.env.running_address);
+    digest_cache_init(true);
+
+    FdUartPort fd_port;
+    fd_port.attach(master);
+    NoisyPort noisy(fd_port, noise, seed);
+    _board.port = &noisy;
+    uart_proto_hooks_t hooks = {board_env, board_reboot};
+    uart_proto_serve(noisy, hooks);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *csv = NULL;
+    int count = 1, running_slot = 0, noise = 0, command = 0;
+    size_t flash_mb = 0;
+    bool keep_fs = false, log = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--count") == 0 && value) { count = atoi(value); i++; }
+        else if (strcmp(argv[i], "--flash-mb") == 0 && value) { flash_mb = atoi(value); i++; }
+        else if (strcmp(argv[i], "--running-slot") == 0 && value) { running_slot = atoi(value); i++; }
+        else if (strcmp(argv[i], "--noise") == 0 && value) { noise = atoi(value); i++; }
+        else if (strcmp(argv[i], "--keep-fs") == 0) keep_fs = true;
+        else if (strcmp(argv[i], "--sleep") == 0) host_clock_set_sleep(true);
+        else if (strcmp(argv[i], "--log") == 0) log = true;
+        else if (strcmp(argv[i], "--") == 0 && i + 1 < argc) { command = i + 1; break; }
+        else if (argv[i][0] != '-' && csv == NULL) csv = argv[i];
+        else { usage(); return 2; }
+    }
+    if (csv == NULL || count < 1 || (flash_mb != 0 && flash_mb != 4 && flash_mb != 8 && flash_mb != 16)) {
+        usage();
+        return 2;
+    }
+    std::vector<csv_entry_t> entries;
+    std::string error;
+    if (!csv_parse_file(csv, entries, error)) {
+        fprintf(stderr, "Can't read %s: %s\n", csv, error.c_str());
+        return 1;
+    }
+    uint64_t end = 0;
+    for (const csv_entry_t &e : entries) end = std::max(end, (uint64_t)e.offset + e.size);
+    if (flash_mb == 0) flash_mb = (end <= (4 << 20)) ? 4 : (end <= (8 << 20)) ? 8 : 16;
+    Serial.enabled = log;
+
+    // a pty per board; the board has the master side, clients open the slave like a serial port
+    std::vector<pid_t> pids;
+    std::vector<std::string> paths, images;
+    for (int i = 0; i < count; i++) {
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            fprintf(stderr, "Can't make a pty\n");
+            return 1;
+        }
+        std::string path = ptsname(master);
+        // raw, no echo; and held open, so writes with no client just pile up until one flushes them
+        int slave = open(path.c_str(), O_RDWR | O_NOCTTY);
+        struct termios tio;
+        if (slave < 0 || tcgetattr(slave, &tio) != 0) {
+            fprintf(stderr, "Can't open %s\n", path.c_str());
+            return 1;
+        }
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+        std::string image = "/tmp/uart_standin_" + std::to_string(getpid()) + "_" + std::to_string(i) + ".bin";
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) _exit(board_main(master, image, entries, flash_mb, running_slot, keep_fs, noise, i + 1));
+        close(master);
+        pids.push_back(pid);
+        paths.push_back(path);
+        images.push_back(image);
+    }
+
+    int rc = 0;
+    if (command == 0) {
+        for (const std::string &p : paths) printf("%s\n", p.c_str());
+        fflush(stdout);
+        // until Ctrl-C, which the boards get too
+        signal(SIGINT, SIG_IGN);
+        while (wait(NULL) > 0) {}
+    } else {
+        std::vector<char *> args(argv + command, argv + argc);
+        for (std::string &p : paths) args.push_back(&p[0]);
+        args.push_back(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            execvp(args[0], args.data());
+            fprintf(stderr, "Can't run %s\n", args[0]);
+            _exit(127);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        rc = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        for (pid_t p : pids) kill(p, SIGTERM);
+        for (pid_t p : pids) waitpid(p, NULL, 0);
+    }
+    for (const std::string &image : images) {
+        unlink(image.c_str());
+        unlink((image + ".journal").c_str());
+        unlink((image + ".fs").c_str());
+    }
+    return rc;
+}
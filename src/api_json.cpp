@@ -0,0 +1,180 @@
+/**
+ * @file api_json.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief JSON versions of the device info, the table, a run's report & the job.
+ *
+ * Written piece by piece to the sink (put a BufferedSink in front of the web
+ * server), so nothing here needs more than a line's worth of RAM. Addresses &
+ * sizes are plain numbers in bytes.
+ */
+
+#include "api_json.h"
+#include "device_info.h"
+#include "digest_cache.h"
+#include "flash_dev.h"
+#include "part_job.h"
+#include "sector_pool.h"
+#include <stdarg.h>
+
+static void _json(OutputSink & out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void _json(OutputSink & out, const char *fmt, ...) {
+    char c_buffer[192];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(c_buffer, sizeof(c_buffer), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(c_buffer) - 1) len = sizeof(c_buffer) - 1;
+    if (len > 0) out.write(c_buffer, len);
+}
+
+// a quoted string, or null
+static void _json_str(OutputSink & out, const char *str) {
+    if (str == NULL) {
+        out.write("null", 4);
+        return;
+    }
+    out.write("\"", 1);
+    for (const char *p = str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            char esc[2] = {'\\', *p};
+            out.write(esc, 2);
+        } else if ((uint8_t)*p < 0x20) {
+            _json(out, "\\u%04x", (uint8_t)*p);
+        } else {
+            out.write(p, 1);
+        }
+    }
+    out.write("\"", 1);
+}
+
+static const char *_step_kind_name(uint8_t kind) {
+    switch (kind) {
+        case JOURNAL_STEP_MOVE: return "move";
+        case JOURNAL_STEP_ERASE: return "erase";
+        case JOURNAL_STEP_CLEAN: return "clean";
+    }
+    return "?";
+}
+
+static void _json_table(OutputSink & out, const part_table_t & table) {
+    out.write("[", 1);
+    for (int i = 0; i < table.count; i++) {
+        const part_entry_t & e = table.entries[i];
+        _json(out, "%s{\"label\":", i ? "," : "");
+        _json_str(out, e.label);
+        _json(out, ",\"type\":%u,\"subtype\":%u,\"address\":%u,\"size\":%u,\"flags\":%u}",
+              e.type, e.subtype, e.address, e.size, e.flags);
+    }
+    out.write("]", 1);
+}
+
+void api_json_device(OutputSink & out, const part_mgr_env_t & env) {
+    device_info_t d;
+    getDeviceInfoData(d);
+    out.write("{\"build\":", 9);
+    _json_str(out, d.build);
+    out.write(",\"build_date\":", 14);
+    _json_str(out, d.build_date);
+    out.write(",\"sdk\":", 7);
+    _json_str(out, d.sdk);
+    out.write(",\"chip\":", 8);
+    _json_str(out, d.chip_model);
+    _json(out, ",\"chip_id\":%u,\"flash_chip_id\":%u,\"flash_size\":%u,\"heap_size\":%u,\"sketch_size\":%u",
+          d.chip_id, d.flash_chip_id, d.flash_size, d.heap_size, d.sketch_size);
+    _json(out, ",\"table_address\":%u,\"running_address\":%u,\"next_address\":%u,\"flash_encrypted\":%s",
+          (unsigned)getPartitionTableAddr(), env.running_address, env.next_address,
+          env.flash_encrypted ? "true" : "false");
+
+    // only what the cache has; hashing the bootloader here would make this request slow
+    digest_region_t r;
+    out.write(",\"bootloader_md5\":", 18);
+    if (digest_cache_region(0, r) && r.valid && strcmp(r.name, "bootloader") == 0) {
+        char hex[33];
+        for (int b = 0; b < 16; b++) sprintf(hex + b * 2, "%02x", r.md5[b]);
+        _json_str(out, hex);
+    } else {
+        out.write("null", 4);
+    }
+
+    part_job_status_t status;
+    part_job_status(status);
+    _json(out, ",\"job\":{\"state\":\"%s\",\"phase\":\"%s\"}}\n", part_job_state_name(status.state), status.phase);
+}
+
+void api_json_table(OutputSink & out) {
+    char error[64];
+    uint32_t addr = getPartitionTableAddr();
+    SectorBuffer sector;
+    uint8_t *data = sector.data();
+    part_table_t *table = (part_table_t *)malloc(sizeof(part_table_t));
+    if (addr == 0) {
+        snprintf(error, sizeof(error), "partition table not found");
+    } else if (data == NULL || table == NULL) {
+        snprintf(error, sizeof(error), "out of memory");
+    } else if (flash_dev().read(addr, data, PART_TABLE_MAX_SIZE) != ESP_OK) {
+        snprintf(error, sizeof(error), "can't read the partition table");
+    } else if (part_table_parse_bin(data, PART_TABLE_MAX_SIZE, *table, error, sizeof(error))) {
+        _json(out, "{\"address\":%u,\"partitions\":", addr);
+        _json_table(out, *table);
+        out.write("}\n", 2);
+        free(table);
+        return;
+    }
+    free(table);
+    out.write("{\"error\":", 9);
+    _json_str(out, error);
+    out.write("}\n", 2);
+}
+
+void api_json_report(OutputSink & out, const part_mgr_report_t & r) {
+    _json(out, "{\"result\":\"%s\",\"error\":", part_job_result_name(r.result));
+    _json_str(out, r.error[0] ? r.error : NULL);
+    _json(out, ",\"time_ms\":{\"plan\":%u,\"table\":%u,\"steps\":%u,\"total\":%u}",
+          r.plan_ms, r.table_ms, r.steps_ms, r.total_ms);
+    out.write(",\"table\":", 9);
+    _json_table(out, r.table);
+
+    _json(out, ",\"plan\":{\"size_delta\":%u,\"relocate_ms\":%u,\"candidates\":[", r.size_delta,
+          r.relocate_ms);
+    for (int n = 0; n < r.candidate_count; n++) {
+        const part_mgr_report_candidate_t & c = r.candidates[n];
+        _json(out, "%s{\"strategy\":", n ? "," : "");
+        _json_str(out, c.strategy);
+        out.write(",\"shrink\":", 10);
+        _json_str(out, c.shrink[0] ? c.shrink : NULL);
+        _json(out, ",\"bytes_moved\":%u,\"bytes_erased\":%u,\"cost_ms\":%u,\"chosen\":%s}",
+              c.bytes_moved, c.bytes_erased, c.cost_ms, (n == r.best) ? "true" : "false");
+    }
+    out.write("]}", 2);
+
+    out.write(",\"new_table\":", 13);
+    if (r.table_new.count > 0) _json_table(out, r.table_new); else out.write("null", 4);
+
+    out.write(",\"steps\":[", 10);
+    for (int n = 0; n < r.step_count; n++) {
+        const part_mgr_report_step_t & s = r.steps[n];
+        _json(out, "%s{\"kind\":\"%s\",\"partition\":%u,\"from\":%u,\"to\":%u,\"size\":%u,\"done\":%s,\"time_ms\":%u",
+              n ? "," : "", _step_kind_name(s.step.kind), s.step.partition, s.step.addr_from, s.step.addr_to,
+              s.step.size, s.done ? "true" : "false", s.time_ms);
+        if (s.step.kind == JOURNAL_STEP_MOVE) {
+            _json(out, ",\"mode\":\"%s\",\"copied\":%u,\"blanked\":%u,\"skipped\":%u,\"verified\":%u,"
+                  "\"verify_errors\":%u,\"verify_ms\":%lu", move_mode_name(s.stats.mode), s.stats.copied,
+                  s.stats.blanked, s.stats.skipped, s.stats.verified, s.stats.verify_errors, s.stats.verify_us / 1000);
+        }
+        out.write("}", 1);
+    }
+    out.write("]}\n", 3);
+}
+
+void api_json_job(OutputSink & out) {
+    part_job_status_t status;
+    part_job_status(status);
+    _json(out, "{\"state\":\"%s\",\"phase\":\"%s\",\"test_only\":%s,\"sectors_done\":%u,\"sectors_total\":%u,"
+          "\"bytes_per_s\":%u,\"eta_s\":%u,\"elapsed_ms\":%u,\"report\":",
+          part_job_state_name(status.state), status.phase, status.test_only ? "true" : "false",
+          status.sectors_done, status.sectors_total, status.bytes_per_s, status.eta_s, status.elapsed_ms);
+    part_mgr_report_t *report = part_job_report();
+    if (report != NULL) api_json_report(out, *report); else out.write("null\n", 5);
+    free(report);
+    out.write("}\n", 2);
+}
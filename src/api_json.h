@@ -0,0 +1,18 @@
+#ifndef API_JSON_H
+#define API_JSON_H
+
+// Compact JSON for scripts: the facts behind the pages, without the HTML.
+// Everything comes from the same structs the log is printed from.
+#include "part_mgr.h"
+
+// build, chip, flash, where we run from, the cached bootloader MD5 & the job's state
+void api_json_device(OutputSink & out, const part_mgr_env_t & env);
+// the table on flash now: {"address":..,"partitions":[...]}, or {"error":..}
+void api_json_table(OutputSink & out);
+// a run: result, first error, per-phase timings, table before & after, the plan
+// with its byte cost, and each step
+void api_json_report(OutputSink & out, const part_mgr_report_t & report);
+// the background job's status, and its report once it's over
+void api_json_job(OutputSink & out);
+
+#endif // API_JSON_H
@@ -0,0 +1,149 @@
+/**
+ * @file app_image.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Walks the app image header & segments, like the bootloader does.
+ */
+
+#include "esp_image_format.h"
+#include "app_image.h"
+#include "flash_dev.h"
+#include "gz_stream.h"
+#include "part_mgr.h"
+#include "part_table.h"
+#include "sector_pool.h"
+
+#define APP_IMAGE_SHA256_LEN 32
+
+uint32_t app_image_length(uint32_t addr, uint32_t max_len) {
+    esp_image_header_t header;
+    if (max_len < sizeof(header)) return 0;
+    if (flash_dev().read(addr, &header, sizeof(header)) != ESP_OK) return 0;
+    if (header.magic != ESP_IMAGE_HEADER_MAGIC || header.segment_count == 0 ||
+        header.segment_count > ESP_IMAGE_MAX_SEGMENTS) {
+        return 0;
+    }
+
+    uint32_t len = sizeof(header);
+    for (int i = 0; i < header.segment_count; i++) {
+        esp_image_segment_header_t segment;
+        if (len + sizeof(segment) > max_len) return 0;
+        if (flash_dev().read(addr + len, &segment, sizeof(segment)) != ESP_OK) return 0;
+        if (segment.data_len > max_len - len - sizeof(segment)) return 0;
+        len += sizeof(segment) + segment.data_len;
+    }
+    // checksum byte goes at the end of the padding to 16 bytes
+    len = (len + 1 + 15) & ~15;
+    if (header.hash_appended) len += APP_IMAGE_SHA256_LEN;
+    return (len <= max_len) ? len : 0;
+}
+
+#ifndef REPART_HOST
+esp_err_t app_image_verify(uint32_t addr, uint32_t max_len) {
+    const esp_partition_pos_t pos = {addr, max_len};
+    esp_image_metadata_t data;
+    return esp_image_verify(ESP_IMAGE_VERIFY, &pos, &data);
+}
+
+#else // REPART_HOST
+// the checksum is the XOR of all segment data, from 0xEF; there's no SHA256 here
+esp_err_t app_image_verify(uint32_t addr, uint32_t max_len) {
+    esp_image_header_t header;
+    uint32_t len = app_image_length(addr, max_len);
+    if (len == 0) return ESP_ERR_IMAGE_INVALID;
+    SectorBuffer buffer;
+    if (!buffer.ok()) return ESP_ERR_NO_MEM;
+    esp_err_t err = flash_dev().read(addr, &header, sizeof(header));
+    uint8_t checksum = 0xEF;
+    uint32_t pos = sizeof(header);
+    for (int i = 0; i < header.segment_count && err == ESP_OK; i++) {
+        esp_image_segment_header_t segment;
+        err = flash_dev().read(addr + pos, &segment, sizeof(segment));
+        pos += sizeof(segment);
+        for (uint32_t o = 0; o < segment.data_len && err == ESP_OK; o += SPI_FLASH_SEC_SIZE) {
+            uint32_t n = (segment.data_len - o < SPI_FLASH_SEC_SIZE) ? segment.data_len - o : SPI_FLASH_SEC_SIZE;
+            err = flash_dev().read(addr + pos + o, buffer.data(), n);
+            for (uint32_t k = 0; k < n; k++) checksum ^= buffer.data()[k];
+        }
+        pos += segment.data_len;
+    }
+    uint8_t stored;
+    if (err == ESP_OK) err = flash_dev().read(addr + ((pos + 1 + 15) & ~15) - 1, &stored, 1);
+    if (err == ESP_OK && stored != checksum) err = ESP_ERR_IMAGE_INVALID;
+    return err;
+}
+#endif
+
+// esp_ota_select_entry_t: one at the start of each otadata sector; the bootloader
+// takes the valid one with the highest sequence number, and boots slot (seq - 1) % slots
+typedef struct {
+    uint32_t ota_seq;
+    uint8_t seq_label[20];
+    uint32_t ota_state;
+    uint32_t crc;                       // CRC-32 of ota_seq
+} _ota_select_entry_t;
+
+// what esp_ota_set_boot_partition() does, minus the image check, but going by
+// the table on flash: right after a repartition that isn't the one IDF read at boot
+static esp_err_t _set_boot(uint32_t addr, const part_table_t & table);
+
+esp_err_t app_image_set_boot(uint32_t addr) {
+    // the table & its entries are ~6K; off the stack of the upload handler & the job
+    struct _table_read_t {
+        uint8_t data[PART_TABLE_MAX_SIZE];
+        part_table_t table;
+    } *read = (_table_read_t *)malloc(sizeof(_table_read_t));
+    if (read == NULL) return ESP_ERR_NO_MEM;
+    char error[64];
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (getPartitionTableAddr() != 0 &&
+        flash_dev().read(getPartitionTableAddr(), read->data, sizeof(read->data)) == ESP_OK &&
+        part_table_parse_bin(read->data, sizeof(read->data), read->table, error, sizeof(error))) {
+        err = _set_boot(addr, read->table);
+    }
+    free(read);
+    return err;
+}
+
+static esp_err_t _set_boot(uint32_t addr, const part_table_t & table) {
+    const part_entry_t *otadata = NULL;
+    int slots = 0, slot = -1;
+    for (int i = 0; i < table.count; i++) {
+        const part_entry_t &e = table.entries[i];
+        if (e.type == ESP_PARTITION_TYPE_DATA && e.subtype == ESP_PARTITION_SUBTYPE_DATA_OTA) otadata = &e;
+        if (e.type == ESP_PARTITION_TYPE_APP && e.subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 &&
+            e.subtype < ESP_PARTITION_SUBTYPE_APP_OTA_0 + 16) {
+            slots++;
+            if (e.address == addr) slot = e.subtype - ESP_PARTITION_SUBTYPE_APP_OTA_0;
+        }
+    }
+    if (otadata == NULL || slot < 0 || otadata->size < 2 * SPI_FLASH_SEC_SIZE) return ESP_ERR_NOT_FOUND;
+
+    // the next sequence number that picks the slot, into the sector that isn't the live one
+    uint32_t seq = 0;
+    int live = -1;
+    for (int n = 0; n < 2; n++) {
+        _ota_select_entry_t entry;
+        if (flash_dev().read(otadata->address + n * SPI_FLASH_SEC_SIZE, &entry, sizeof(entry)) != ESP_OK) return ESP_FAIL;
+        if (entry.ota_seq == 0 || entry.ota_seq == 0xFFFFFFFF ||
+            gz_crc32(0xFFFFFFFF, (const uint8_t *)&entry.ota_seq, sizeof(entry.ota_seq)) != entry.crc) {
+            continue;
+        }
+        if (entry.ota_seq > seq) {
+            seq = entry.ota_seq;
+            live = n;
+        }
+    }
+    _ota_select_entry_t entry;
+    memset(&entry, 0xFF, sizeof(entry));
+    entry.ota_seq = seq + 1;
+    while ((entry.ota_seq - 1) % slots != (uint32_t)slot) entry.ota_seq++;
+    entry.crc = gz_crc32(0xFFFFFFFF, (const uint8_t *)&entry.ota_seq, sizeof(entry.ota_seq));
+    uint32_t sector = otadata->address + ((live == 0) ? SPI_FLASH_SEC_SIZE : 0);
+    esp_err_t err = flash_dev().erase_range(sector, SPI_FLASH_SEC_SIZE);
+    if (err == ESP_OK) err = flash_dev().write(sector, &entry, sizeof(entry));
+    // if the write didn't take, the old slot still boots
+    _ota_select_entry_t check;
+    if (err == ESP_OK) err = flash_dev().read(sector, &check, sizeof(check));
+    if (err == ESP_OK && memcmp(&check, &entry, sizeof(entry)) != 0) err = ESP_ERR_INVALID_CRC;
+    return err;
+}
@@ -0,0 +1,18 @@
+#ifndef APP_IMAGE_H
+#define APP_IMAGE_H
+
+// Finding out how much of an app partition the firmware image really uses,
+// and which one the bootloader starts.
+#include "main.h"
+
+// length of the app image at addr (header, segments, checksum, appended SHA256),
+// or 0 if there's no valid image header within max_len bytes
+uint32_t app_image_length(uint32_t addr, uint32_t max_len);
+// check the image at addr the way the bootloader will: segments, checksum and
+// (on the chip) the appended SHA256. ESP_OK if it would boot.
+esp_err_t app_image_verify(uint32_t addr, uint32_t max_len);
+// boot the OTA slot at addr from now on, like esp_ota_set_boot_partition();
+// it has to be in the table on flash. ESP_ERR_NOT_FOUND if it isn't.
+esp_err_t app_image_set_boot(uint32_t addr);
+
+#endif // APP_IMAGE_H
@@ -1,5 +1,8 @@
 #include "device_info.h"
 #include "part_mgr.h"
+#include "flash_dev.h"
+#include "digest_cache.h"
+#include "sector_pool.h"
 #include "main.h"
 
 #include <Arduino.h>
@@ -22,45 +25,65 @@ uint32_t _ESP_getFlashChipSize(void) {
   return 0;
 }
 
-void getDeviceInfo(char* info, size_t infoSize) {
+void getDeviceInfoData(device_info_t &info) {
     uint32_t chipId = 0;
     for(int i=0; i<17; i=i+8) {
         chipId |= ((ESP.getEfuseMac() >> (40 - i)) & 0xff) << i;
     }
+    info.build = FIRMWARE_VERSION;
+    info.build_date = __DATE__ " " __TIME__;
+    info.sdk = ESP.getSdkVersion();
+    info.chip_model = ESP.getChipModel();
+    info.chip_id = chipId;
+    info.flash_chip_id = ESP_getFlashChipId();
+    info.flash_size = _ESP_getFlashChipSize();
+    info.heap_size = ESP.getHeapSize();
+    info.sketch_size = ESP.getSketchSize();
+}
 
+void getDeviceInfo(char* info, size_t infoSize) {
+    device_info_t d;
+    getDeviceInfoData(d);
     snprintf(info, infoSize,
-             "Build %s - %s %s\n"
+             "Build %s - %s\n"
              "ESP SDK %s / %u (%s)\n"
              "Flash chip ID / Size: 0x%x / %u KB\n"
              "Program heap / size: %u KB / %u KB",
-             FIRMWARE_VERSION, __DATE__, __TIME__,
-             ESP.getSdkVersion(), chipId, ESP.getChipModel(),
-             ESP_getFlashChipId(), _ESP_getFlashChipSize()/1024,
-             ESP.getHeapSize()/1024, ESP.getSketchSize()/1024);
+             d.build, d.build_date,
+             d.sdk, d.chip_id, d.chip_model,
+             d.flash_chip_id, d.flash_size/1024,
+             d.heap_size/1024, d.sketch_size/1024);
 }
 
-// get MD5 of bootloader
+// get MD5 of bootloader; from the digest cache if it has it
 void getBootloaderMd5(char *output_buffer, size_t output_buffer_size) {
   if (output_buffer_size < (ESP_ROM_MD5_DIGEST_LEN * 2 + 4)) {
     snprintf(output_buffer, output_buffer_size, "Buffer too small\n");
     return;
   }
   char md5_buf[ESP_ROM_MD5_DIGEST_LEN];
-  MD5Builder _md5 = MD5Builder();
-  _md5.begin();
+  if (!digest_cache_get("bootloader", (uint8_t*)md5_buf)) {
+    MD5Builder _md5 = MD5Builder();
+    _md5.begin();
 
-  uint8_t partition_buffer[SPI_FLASH_SEC_SIZE];
-  for (uint32_t addr = 0x1000; addr < getPartitionTableAddr(); addr += SPI_FLASH_SEC_SIZE) {
-    if (spi_flash_read(addr, partition_buffer, SPI_FLASH_SEC_SIZE) != ESP_OK) {
-      snprintf(output_buffer, output_buffer_size, "Failed to read flash at offset 0x%x\n", addr);
-      DEBUG_PRINT(output_buffer);
+    SectorBuffer sector; // not 4K of the caller's stack
+    uint8_t *partition_buffer = sector.data();
+    if (partition_buffer == NULL) {
+      snprintf(output_buffer, output_buffer_size, "Out of memory\n");
       return;
     }
-    _md5.add(partition_buffer, SPI_FLASH_SEC_SIZE);
+    for (uint32_t addr = 0x1000; addr < getPartitionTableAddr(); addr += SPI_FLASH_SEC_SIZE) {
+      if (flash_dev().read(addr, partition_buffer, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+        snprintf(output_buffer, output_buffer_size, "Failed to read flash at offset 0x%x\n", addr);
+        DEBUG_PRINT(output_buffer);
+        return;
+      }
+      _md5.add(partition_buffer, SPI_FLASH_SEC_SIZE);
+    }
+
+    _md5.calculate();
+    _md5.getBytes((uint8_t*)(md5_buf));
   }
-  
-  _md5.calculate();
-  _md5.getBytes((uint8_t*)(md5_buf));
 
   // Get hex version of MD5, format kinda
   for (int i = 0; i < 16; i++) {
@@ -2,7 +2,22 @@
 #define DEVICE_INFO_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+// what getDeviceInfo() prints, as data
+typedef struct {
+    const char *build;                  /*!< FIRMWARE_VERSION */
+    const char *build_date;             /*!< __DATE__ __TIME__ */
+    const char *sdk;
+    const char *chip_model;
+    uint32_t chip_id;
+    uint32_t flash_chip_id;
+    uint32_t flash_size;                /*!< bytes */
+    uint32_t heap_size;                 /*!< bytes */
+    uint32_t sketch_size;               /*!< bytes */
+} device_info_t;
+
+void getDeviceInfoData(device_info_t &info);
 void getDeviceInfo(char* info, size_t infoSize);
 void getBootloaderMd5(char *output_buffer, size_t output_buffer_size);
 
@@ -0,0 +1,248 @@
+/**
+ * @file digest_cache.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Background MD5s of the flash regions, invalidated by writes.
+ *
+ * The flash write hook only marks regions stale (it runs with the flash
+ * device locked). Hashing happens without our mutex held, and a result is
+ * only kept if nothing wrote to the region in the meantime.
+ */
+
+#include "digest_cache.h"
+#include "flash_dev.h"
+#include "part_mgr.h"
+#include "part_table.h"
+#include "port_task.h"
+#include "sector_pool.h"
+#include <MD5Builder.h>
+
+#define DIGEST_BOOTLOADER_ADDR  0x1000
+#define DIGEST_MD5_CHUNK        0x8000      // MD5Builder::add() takes 16 bit lengths on some cores
+
+static struct {
+    bool initialized;
+    bool rebuild;                       // the table changed; find the regions again
+    int count;
+    digest_region_t regions[DIGEST_MAX_REGIONS];
+    unsigned long last_write_ms;
+} _cache;
+
+static PortQueue *_kick = NULL;         // wakes the task after writes
+
+static PortMutex & _cache_mutex() {
+    static PortMutex mutex;
+    return mutex;
+}
+
+// flash_dev_stream() into an MD5
+class _Md5Sink : public OutputSink {
+public:
+    _Md5Sink() { _md5.begin(); }
+    void write(const char *str, size_t len) override {
+        for (size_t o = 0; o < len; o += DIGEST_MD5_CHUNK) {
+            size_t n = (len - o < DIGEST_MD5_CHUNK) ? len - o : DIGEST_MD5_CHUNK;
+            _md5.add((const uint8_t *)str + o, n);
+        }
+    }
+    void get(uint8_t md5[16]) {
+        _md5.calculate();
+        _md5.getBytes(md5);
+    }
+private:
+    MD5Builder _md5;
+};
+
+static bool _hash_region(uint32_t addr, uint32_t size, uint8_t md5[16]) {
+    _Md5Sink sink;
+    if (flash_dev_stream(addr, size, sink) != ESP_OK) return false;
+    sink.get(md5);
+    return true;
+}
+
+static void _add_region(digest_region_t *regions, int &count, const char *name, uint32_t addr, uint32_t size) {
+    if (count >= DIGEST_MAX_REGIONS) return;
+    digest_region_t &r = regions[count++];
+    memset(&r, 0, sizeof(r));
+    strncpy(r.name, name, sizeof(r.name) - 1);
+    r.address = addr;
+    r.size = size;
+}
+
+// bootloader, table, and what the table on flash lists; hashes of unchanged regions are kept
+static void _build_regions() {
+    // a full table's worth is too much for the task's stack
+    digest_region_t *regions = (digest_region_t *)malloc(sizeof(digest_region_t) * DIGEST_MAX_REGIONS);
+    if (regions == NULL) return; // still stale; next time
+    int count = 0;
+    uint32_t table_addr = getPartitionTableAddr();
+    if (table_addr > DIGEST_BOOTLOADER_ADDR) {
+        _add_region(regions, count, "bootloader", DIGEST_BOOTLOADER_ADDR, table_addr - DIGEST_BOOTLOADER_ADDR);
+        _add_region(regions, count, "table", table_addr, SPI_FLASH_SEC_SIZE);
+        SectorBuffer sector;
+        uint8_t *data = sector.data();
+        part_table_t *table = (part_table_t *)malloc(sizeof(part_table_t));
+        char error[64];
+        if (data != NULL && table != NULL && flash_dev().read(table_addr, data, PART_TABLE_MAX_SIZE) == ESP_OK &&
+            part_table_parse_bin(data, PART_TABLE_MAX_SIZE, *table, error, sizeof(error))) {
+            for (int i = 0; i < table->count; i++) {
+                _add_region(regions, count, table->entries[i].label, table->entries[i].address, table->entries[i].size);
+            }
+        }
+        free(table);
+    }
+
+    PortLock lock(_cache_mutex());
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < _cache.count; j++) {
+            const digest_region_t &old = _cache.regions[j];
+            if (old.valid && old.address == regions[i].address && old.size == regions[i].size) {
+                memcpy(regions[i].md5, old.md5, sizeof(old.md5));
+                regions[i].valid = true;
+            }
+        }
+    }
+    memcpy(_cache.regions, regions, count * sizeof(digest_region_t));
+    _cache.count = count;
+    _cache.rebuild = false;
+    free(regions);
+}
+
+static void _on_flash_write(size_t addr, size_t len) {
+    {
+        PortLock lock(_cache_mutex());
+        for (int i = 0; i < _cache.count; i++) {
+            digest_region_t &r = _cache.regions[i];
+            if (addr < r.address + r.size && r.address < addr + len) {
+                r.valid = false;
+                r.generation++;
+                if (strcmp(r.name, "table") == 0) _cache.rebuild = true;
+            }
+        }
+        _cache.last_write_ms = millis();
+    }
+    uint8_t kick = 0;
+    if (_kick != NULL) _kick->send(&kick, 0);
+}
+
+static void _digest_task(void *arg) {
+    uint8_t kick;
+    for (;;) {
+        // a repartition writes for a while; don't slow it down by reading along
+        while (millis() - _cache.last_write_ms < DIGEST_SETTLE_MS) delay(DIGEST_SETTLE_MS / 4);
+        digest_cache_update();
+        _kick->receive(&kick, PORT_MAX_WAIT);
+    }
+}
+
+void digest_cache_init(bool background) {
+    if (_cache.initialized) return;
+    _cache.rebuild = true; // the first update finds them
+    _cache.initialized = true;
+    _cache.last_write_ms = millis() - DIGEST_SETTLE_MS;
+    flash_dev_set_write_hook(_on_flash_write);
+    if (!background) return;
+    _kick = new PortQueue(sizeof(uint8_t), 1);
+    if (!_kick->ok() || !port_task_start(_digest_task, NULL, "digests", DIGEST_TASK_STACK, DIGEST_TASK_CORE,
+                                         PORT_PRIORITY_LOW)) {
+        DEBUG_PRINT("Failed to start digest task\n");
+    }
+}
+
+bool digest_cache_update() {
+    if (_cache.rebuild) _build_regions();
+    bool ok = true;
+    for (int i = 0; ; i++) {
+        digest_region_t r;
+        {
+            PortLock lock(_cache_mutex());
+            if (i >= _cache.count) break;
+            r = _cache.regions[i];
+        }
+        if (r.valid) continue;
+        uint8_t md5[16];
+        if (!_hash_region(r.address, r.size, md5)) {
+            ok = false;
+            continue;
+        }
+        PortLock lock(_cache_mutex());
+        digest_region_t &now = _cache.regions[i];
+        if (i < _cache.count && now.address == r.address && now.generation == r.generation) {
+            memcpy(now.md5, md5, sizeof(md5));
+            now.valid = true;
+        } else {
+            ok = false; // written while we were reading; next time
+        }
+    }
+    return ok;
+}
+
+bool digest_cache_get(const char *name, uint8_t md5[16]) {
+    if (!_cache.initialized) return false;
+    if (_cache.rebuild) _build_regions();
+    digest_region_t r;
+    int i;
+    {
+        PortLock lock(_cache_mutex());
+        for (i = 0; i < _cache.count && strcmp(_cache.regions[i].name, name) != 0; i++);
+        if (i == _cache.count) return false;
+        r = _cache.regions[i];
+    }
+    if (r.valid) {
+        memcpy(md5, r.md5, 16);
+        return true;
+    }
+    if (!_hash_region(r.address, r.size, md5)) return false;
+    PortLock lock(_cache_mutex());
+    digest_region_t &now = _cache.regions[i];
+    if (i < _cache.count && now.address == r.address && now.generation == r.generation) {
+        memcpy(now.md5, md5, 16);
+        now.valid = true;
+    }
+    return true;
+}
+
+bool digest_cache_region(int i, digest_region_t & region) {
+    PortLock lock(_cache_mutex());
+    if (i < 0 || i >= _cache.count) return false;
+    region = _cache.regions[i];
+    return true;
+}
+
+static void _md5_hex(const uint8_t md5[16], char *hex) {
+    for (int i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", md5[i]);
+}
+
+void digest_cache_report(OutputSink & out) {
+    if (!_cache.initialized) return;
+    digest_region_t r;
+    char c_buffer[96], hex[33];
+    _add_output(out, "Digests (MD5):\n");
+    for (int i = 0; digest_cache_region(i, r); i++) {
+        if (r.valid) _md5_hex(r.md5, hex);
+        snprintf(c_buffer, sizeof(c_buffer), "  %-16s 0x%06x +0x%06x  %s\n", r.name,
+                 r.address, r.size, r.valid ? hex : "(still working on it)");
+        _add_output(out, c_buffer);
+    }
+}
+
+void digest_cache_json(OutputSink & out) {
+    digest_region_t r;
+    bool ready = _cache.initialized;
+    for (int i = 0; ready && digest_cache_region(i, r); i++) ready = r.valid;
+    char c_buffer[160], hex[35];
+    snprintf(c_buffer, sizeof(c_buffer), "{\"ready\":%s,\"regions\":[", ready ? "true" : "false");
+    out.write(c_buffer, strlen(c_buffer));
+    for (int i = 0; _cache.initialized && digest_cache_region(i, r); i++) {
+        if (r.valid) {
+            hex[0] = '"';
+            _md5_hex(r.md5, hex + 1);
+            strcpy(hex + 33, "\"");
+        } else {
+            strcpy(hex, "null");
+        }
+        snprintf(c_buffer, sizeof(c_buffer), "%s{\"name\":\"%s\",\"address\":%u,\"size\":%u,\"md5\":%s}",
+                 i ? "," : "", r.name, r.address, r.size, hex);
+        out.write(c_buffer, strlen(c_buffer));
+    }
+    out.write("]}\n", 3);
+}
@@ -0,0 +1,38 @@
+#ifndef DIGEST_CACHE_H
+#define DIGEST_CACHE_H
+
+// MD5s of the bootloader, the partition table and every partition, worked out
+// once in the background and kept until something writes to the region. The
+// report & /digests read them from here instead of hashing flash each time.
+#include "out_sink.h"
+#include "part_plan.h"
+
+#define DIGEST_MAX_REGIONS      (MAX_NUMBER_OF_PARTITIONS + 2)
+#define DIGEST_SETTLE_MS        2000        // wait for writes to stop this long before hashing again
+#define DIGEST_TASK_STACK       4096
+#define DIGEST_TASK_CORE        0
+
+typedef struct {
+    char name[17];                      /*!< "bootloader", "table", or the partition label */
+    uint32_t address;
+    uint32_t size;
+    uint8_t md5[16];
+    bool valid;                         /*!< md5 matches what's in flash */
+    uint32_t generation;                /*!< bumped by every write to the region */
+} digest_region_t;
+
+// watch flash writes, find the regions on the first update; with `background`, a low priority
+// task hashes whatever is stale, otherwise call digest_cache_update()
+void digest_cache_init(bool background);
+// hash all stale regions now; false if some failed or got written meanwhile
+bool digest_cache_update();
+// a region's MD5, hashing it now if it's stale; false if there's no such region
+bool digest_cache_get(const char *name, uint8_t md5[16]);
+// copy of region i as it is (bootloader, table, then the partitions); false past the last one
+bool digest_cache_region(int i, digest_region_t & region);
+// human-readable, one line per region, for the report
+void digest_cache_report(OutputSink & out);
+// {"ready":..,"regions":[{"name":..,"address":..,"size":..,"md5":..}, ...]}; md5 is null while stale
+void digest_cache_json(OutputSink & out);
+
+#endif // DIGEST_CACHE_H
@@ -0,0 +1,301 @@
+/**
+ * @file flash_bench.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Flash throughput on this board's chip, on a blank scratch area.
+ *
+ * The scratch area is the last 128K (64K aligned) of a data partition, and
+ * only if all of it reads blank: programming & erasing it again leaves it as
+ * it was. Each program round writes all of it at one chunk size, reads it
+ * back through the cache, and erases it with 4K sectors or 64K blocks.
+ */
+
+#include "flash_bench.h"
+#include "device_info.h"
+#include "flash_dev.h"
+#include "part_job.h"
+#include "port_task.h"
+#include "sector_pool.h"
+#include "utils.h"
+
+// what gets timed, in the order it's shown
+static const struct {
+    flash_bench_op_t op;
+    uint32_t chunk;
+} _bench_rows[] = {
+    {FLASH_BENCH_READ, 0x100}, {FLASH_BENCH_READ, 0x1000}, {FLASH_BENCH_READ, 0x4000},
+    {FLASH_BENCH_PROGRAM, 0x100}, {FLASH_BENCH_PROGRAM, 0x1000}, {FLASH_BENCH_PROGRAM, 0x4000},
+    {FLASH_BENCH_ERASE, 0x1000}, {FLASH_BENCH_ERASE, 0x10000},
+    {FLASH_BENCH_MMAP_READ, FLASH_STREAM_WINDOW},
+};
+
+static struct {
+    bool measured;
+    plan_cost_model_t model;
+} _last;
+
+static PortMutex & _last_mutex() {
+    static PortMutex mutex;
+    return mutex;
+}
+
+const char *flash_bench_op_name(flash_bench_op_t op) {
+    switch (op) {
+        case FLASH_BENCH_READ: return "read";
+        case FLASH_BENCH_PROGRAM: return "program";
+        case FLASH_BENCH_ERASE: return "erase";
+        case FLASH_BENCH_MMAP_READ: return "mmap read";
+    }
+    return "?";
+}
+
+static flash_bench_row_t *_row(flash_bench_result_t & result, flash_bench_op_t op, uint32_t chunk) {
+    for (int i = 0; i < result.count; i++) {
+        if (result.rows[i].op == op && result.rows[i].chunk == chunk) return &result.rows[i];
+    }
+    return NULL;
+}
+
+static uint32_t _us_per_op(const flash_bench_row_t *row) {
+    return (row != NULL && row->ops > 0) ? row->us / row->ops : 0;
+}
+
+// the last 128K of the biggest data partition that's blank there; false if none is
+static bool _find_scratch(flash_bench_result_t & result, uint8_t *buffer) {
+    uint32_t addr = getPartitionTableAddr();
+    SectorBuffer sector;
+    uint8_t *data = sector.data();
+    part_table_t *table = (part_table_t *)malloc(sizeof(part_table_t));
+    bool found = false;
+    if (addr == 0) {
+        snprintf(result.error, sizeof(result.error), "partition table not found");
+    } else if (data == NULL || table == NULL) {
+        snprintf(result.error, sizeof(result.error), "out of memory");
+    } else if (flash_dev().read(addr, data, PART_TABLE_MAX_SIZE) != ESP_OK ||
+               !part_table_parse_bin(data, PART_TABLE_MAX_SIZE, *table, result.error, sizeof(result.error))) {
+        if (result.error[0] == '\0') snprintf(result.error, sizeof(result.error), "can't read the partition table");
+    } else {
+        snprintf(result.error, sizeof(result.error), "no data partition with a blank 128K at its end");
+        bool tried[MAX_NUMBER_OF_PARTITIONS] = {false};
+        while (!found) {
+            int best = -1;
+            for (int i = 0; i < table->count; i++) {
+                const part_entry_t & e = table->entries[i];
+                if (tried[i] || e.type != ESP_PARTITION_TYPE_DATA) continue;
+                if (best < 0 || e.size > table->entries[best].size) best = i;
+            }
+            if (best < 0) break;
+            tried[best] = true;
+            const part_entry_t & e = table->entries[best];
+            uint32_t end = (e.address + e.size) & ~(FLASH_STREAM_WINDOW - 1);
+            if (end < e.address + FLASH_BENCH_SCRATCH_SIZE || end > flash_dev().size()) continue;
+            uint32_t start = end - FLASH_BENCH_SCRATCH_SIZE;
+            bool blank = true;
+            for (uint32_t o = 0; o < FLASH_BENCH_SCRATCH_SIZE && blank; o += FLASH_BENCH_MAX_CHUNK) {
+                blank = flash_dev().read(start + o, buffer, FLASH_BENCH_MAX_CHUNK) == ESP_OK &&
+                        is_blank(buffer, FLASH_BENCH_MAX_CHUNK);
+            }
+            if (!blank) continue;
+            memcpy(result.scratch_label, e.label, sizeof(result.scratch_label));
+            result.scratch_address = start;
+            result.scratch_size = FLASH_BENCH_SCRATCH_SIZE;
+            result.error[0] = '\0';
+            found = true;
+        }
+    }
+    free(table);
+    return found;
+}
+
+static esp_err_t _bench_read(flash_bench_result_t & result, uint8_t *buffer, uint32_t chunk) {
+    flash_bench_row_t *row = _row(result, FLASH_BENCH_READ, chunk);
+    esp_err_t err = ESP_OK;
+    unsigned long time_start = micros();
+    for (uint32_t o = 0; o < result.scratch_size && err == ESP_OK; o += chunk, row->ops++) {
+        err = flash_dev().read(result.scratch_address + o, buffer, chunk);
+    }
+    row->us += micros() - time_start;
+    row->bytes += result.scratch_size;
+    return err;
+}
+
+static esp_err_t _bench_program(flash_bench_result_t & result, const uint8_t *pattern, uint32_t chunk) {
+    flash_bench_row_t *row = _row(result, FLASH_BENCH_PROGRAM, chunk);
+    esp_err_t err = ESP_OK;
+    unsigned long time_start = micros();
+    for (uint32_t o = 0; o < result.scratch_size && err == ESP_OK; o += chunk, row->ops++) {
+        err = flash_dev().write(result.scratch_address + o, pattern + (o % FLASH_BENCH_MAX_CHUNK), chunk);
+    }
+    row->us += micros() - time_start;
+    row->bytes += result.scratch_size;
+    return err;
+}
+
+// through the cache, one MMU page at a time; also checks what the program round wrote
+static esp_err_t _bench_mmap(flash_bench_result_t & result, const uint8_t *pattern) {
+    flash_bench_row_t *row = _row(result, FLASH_BENCH_MMAP_READ, FLASH_STREAM_WINDOW);
+    bool same = true;
+    unsigned long time_start = micros();
+    for (uint32_t o = 0; o < result.scratch_size; o += FLASH_STREAM_WINDOW, row->ops++) {
+        uint32_t handle;
+        const uint8_t *mapped = (const uint8_t *)flash_dev().map(result.scratch_address + o, FLASH_STREAM_WINDOW, handle);
+        if (mapped == NULL) return ESP_ERR_NOT_SUPPORTED;
+        for (uint32_t k = 0; k < FLASH_STREAM_WINDOW; k += FLASH_BENCH_MAX_CHUNK) {
+            same = same && memcmp(mapped + k, pattern, FLASH_BENCH_MAX_CHUNK) == 0;
+        }
+        flash_dev().unmap(handle);
+    }
+    row->us += micros() - time_start;
+    row->bytes += result.scratch_size;
+    return same ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+static esp_err_t _bench_erase(flash_bench_result_t & result, uint32_t chunk) {
+    flash_bench_row_t *row = _row(result, FLASH_BENCH_ERASE, chunk);
+    esp_err_t err = ESP_OK;
+    unsigned long time_start = micros();
+    for (uint32_t o = 0; o < result.scratch_size && err == ESP_OK; o += chunk, row->ops++) {
+        err = flash_dev().erase_range(result.scratch_address + o, chunk);
+    }
+    row->us += micros() - time_start;
+    row->bytes += result.scratch_size;
+    return err;
+}
+
+static void _bench_report(OutputSink & out, const flash_bench_result_t & result) {
+    char c_buffer[128];
+    snprintf(c_buffer, sizeof(c_buffer), "Flash chip 0x%06x, %u MB; scratch area 0x%06x +0x%05x at the end of '%s'\n",
+             result.flash_chip_id, result.flash_size / (1024 * 1024), result.scratch_address, result.scratch_size,
+             result.scratch_label);
+    _add_output(out, c_buffer);
+    _add_output(out, "  op          chunk     ops      KB/s     us/op\n");
+    for (int i = 0; i < result.count; i++) {
+        const flash_bench_row_t & r = result.rows[i];
+        if (r.ops == 0) continue;
+        uint32_t kb_s = r.us ? (uint32_t)((uint64_t)r.bytes * 1000000 / 1024 / r.us) : 0;
+        snprintf(c_buffer, sizeof(c_buffer), "  %-10s %6u %7u %9u %9u\n", flash_bench_op_name(r.op), r.chunk,
+                 r.ops, kb_s, _us_per_op(&r));
+        _add_output(out, c_buffer);
+    }
+    if (!result.ok) return;
+    snprintf(c_buffer, sizeof(c_buffer), "Cost model: erase 4K %u us, erase 64K %u us, program %u us/page, read 4K %u us\n",
+             result.model.erase_4k_us, result.model.erase_64k_us, result.model.program_page_us, result.model.read_4k_us);
+    _add_output(out, c_buffer);
+}
+
+bool flash_bench_run(OutputSink & out, const part_mgr_env_t & env, flash_bench_result_t & result) {
+    memset(&result, 0, sizeof(result));
+    device_info_t d;
+    getDeviceInfoData(d);
+    result.flash_chip_id = d.flash_chip_id;
+    result.flash_size = d.flash_size;
+    for (size_t i = 0; i < sizeof(_bench_rows) / sizeof(_bench_rows[0]); i++) {
+        result.rows[result.count].op = _bench_rows[i].op;
+        result.rows[result.count++].chunk = _bench_rows[i].chunk;
+    }
+    if (part_job_busy()) {
+        snprintf(result.error, sizeof(result.error), "a repartition job is running");
+    } else if (env.flash_encrypted) {
+        snprintf(result.error, sizeof(result.error), "flash encryption is on");
+    }
+    uint8_t *buffer = NULL, *pattern = NULL;
+    if (result.error[0] == '\0') {
+        buffer = (uint8_t *)malloc(FLASH_BENCH_MAX_CHUNK);
+        pattern = (uint8_t *)malloc(FLASH_BENCH_MAX_CHUNK);
+        if (buffer == NULL || pattern == NULL) snprintf(result.error, sizeof(result.error), "out of memory");
+    }
+    if (result.error[0] != '\0' || !_find_scratch(result, buffer)) {
+        free(pattern);
+        free(buffer);
+        _add_output(out, "ERROR: Not benchmarking the flash: ");
+        _add_output(out, result.error);
+        _add_output(out, "\n");
+        return false;
+    }
+    // every bit flips, in no simple order
+    for (uint32_t i = 0; i < FLASH_BENCH_MAX_CHUNK; i++) pattern[i] = (uint8_t)((i * 7) ^ (i >> 8) ^ 0x5A);
+
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < result.count && err == ESP_OK; i++) {
+        if (result.rows[i].op == FLASH_BENCH_READ) err = _bench_read(result, buffer, result.rows[i].chunk);
+    }
+    // sectors after the smallest writes, blocks after the others
+    static const uint32_t rounds[3][2] = {{0x100, 0x1000}, {0x1000, 0x10000}, {0x4000, 0x10000}};
+    bool written = false;
+    for (int n = 0; n < 3 && err == ESP_OK; n++) {
+        written = true;
+        err = _bench_program(result, pattern, rounds[n][0]);
+        if (err == ESP_OK) err = _bench_mmap(result, pattern);
+        if (err == ESP_ERR_NOT_SUPPORTED) err = ESP_OK; // no cache to read through
+        if (err == ESP_OK) err = _bench_erase(result, rounds[n][1]);
+    }
+    // whatever happened, leave it as blank as we found it
+    if (written && err != ESP_OK) flash_dev().erase_range(result.scratch_address, result.scratch_size);
+    for (uint32_t o = 0; o < result.scratch_size && err == ESP_OK; o += FLASH_BENCH_MAX_CHUNK) {
+        err = flash_dev().read(result.scratch_address + o, buffer, FLASH_BENCH_MAX_CHUNK);
+        if (err == ESP_OK && !is_blank(buffer, FLASH_BENCH_MAX_CHUNK)) err = ESP_ERR_INVALID_CRC;
+    }
+    free(pattern);
+    free(buffer);
+
+    if (err != ESP_OK) {
+        snprintf(result.error, sizeof(result.error), (err == ESP_ERR_INVALID_CRC) ?
+                 "flash doesn't read back what was written" : "flash error 0x%x", err);
+    } else {
+        result.ok = true;
+        result.model.erase_4k_us = _us_per_op(_row(result, FLASH_BENCH_ERASE, 0x1000));
+        result.model.erase_64k_us = _us_per_op(_row(result, FLASH_BENCH_ERASE, 0x10000));
+        result.model.program_page_us = _us_per_op(_row(result, FLASH_BENCH_PROGRAM, 0x100));
+        result.model.read_4k_us = _us_per_op(_row(result, FLASH_BENCH_READ, 0x1000));
+        PortLock lock(_last_mutex());
+        _last.model = result.model;
+        _last.measured = true;
+    }
+    _bench_report(out, result);
+    if (!result.ok) {
+        _add_output(out, "ERROR: Flash benchmark failed: ");
+        _add_output(out, result.error);
+        _add_output(out, "\n");
+    }
+    return result.ok;
+}
+
+bool flash_bench_cost_model(plan_cost_model_t & model) {
+    PortLock lock(_last_mutex());
+    if (_last.measured) model = _last.model;
+    return _last.measured;
+}
+
+void flash_bench_json(OutputSink & out, const flash_bench_result_t & result) {
+    char c_buffer[192];
+    snprintf(c_buffer, sizeof(c_buffer), "{\"ok\":%s,\"error\":%s%s%s,\"flash_chip_id\":%u,\"flash_size\":%u",
+             result.ok ? "true" : "false", result.ok ? "" : "\"", result.ok ? "null" : result.error,
+             result.ok ? "" : "\"", result.flash_chip_id, result.flash_size);
+    out.write(c_buffer, strlen(c_buffer));
+    if (result.scratch_size > 0) {
+        snprintf(c_buffer, sizeof(c_buffer), ",\"scratch\":{\"partition\":\"%s\",\"address\":%u,\"size\":%u}",
+                 result.scratch_label, result.scratch_address, result.scratch_size);
+    } else {
+        snprintf(c_buffer, sizeof(c_buffer), ",\"scratch\":null");
+    }
+    out.write(c_buffer, strlen(c_buffer));
+    out.write(",\"results\":[", 12);
+    bool first = true;
+    for (int i = 0; i < result.count; i++) {
+        const flash_bench_row_t & r = result.rows[i];
+        if (r.ops == 0) continue;
+        uint32_t kb_s = r.us ? (uint32_t)((uint64_t)r.bytes * 1000000 / 1024 / r.us) : 0;
+        snprintf(c_buffer, sizeof(c_buffer), "%s{\"op\":\"%s\",\"chunk\":%u,\"ops\":%u,\"bytes\":%u,\"us\":%u,"
+                 "\"kb_per_s\":%u,\"us_per_op\":%u}", first ? "" : ",", flash_bench_op_name(r.op), r.chunk,
+                 r.ops, r.bytes, r.us, kb_s, _us_per_op(&r));
+        out.write(c_buffer, strlen(c_buffer));
+        first = false;
+    }
+    if (result.ok) {
+        snprintf(c_buffer, sizeof(c_buffer), "],\"cost_model\":{\"erase_4k_us\":%u,\"erase_64k_us\":%u,"
+                 "\"program_page_us\":%u,\"read_4k_us\":%u}}\n", result.model.erase_4k_us,
+                 result.model.erase_64k_us, result.model.program_page_us, result.model.read_4k_us);
+    } else {
+        snprintf(c_buffer, sizeof(c_buffer), "],\"cost_model\":null}\n");
+    }
+    out.write(c_buffer, strlen(c_buffer));
+}
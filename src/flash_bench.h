@@ -0,0 +1,52 @@
+#ifndef FLASH_BENCH_H
+#define FLASH_BENCH_H
+
+// How fast this board's flash chip really is: read, program, 4K & 64K erase and
+// mapped reads, timed on a scratch area at the end of a data partition. The
+// numbers become the cost model the planner estimates repartition times with.
+#include "out_sink.h"
+#include "part_mgr.h"
+
+#define FLASH_BENCH_SCRATCH_SIZE    0x20000     // two 64K blocks, blank before & after
+#define FLASH_BENCH_MAX_CHUNK       0x4000
+#define FLASH_BENCH_MAX_ROWS        12
+
+typedef enum {
+    FLASH_BENCH_READ = 0,
+    FLASH_BENCH_PROGRAM,
+    FLASH_BENCH_ERASE,
+    FLASH_BENCH_MMAP_READ,
+} flash_bench_op_t;
+
+typedef struct {
+    flash_bench_op_t op;
+    uint32_t chunk;                     /*!< bytes per call */
+    uint32_t ops;
+    uint32_t bytes;
+    uint32_t us;
+} flash_bench_row_t;
+
+typedef struct {
+    bool ok;
+    char error[64];
+    uint32_t flash_chip_id;
+    uint32_t flash_size;
+    char scratch_label[17];             /*!< the data partition the scratch area is in */
+    uint32_t scratch_address;
+    uint32_t scratch_size;
+    int count;
+    flash_bench_row_t rows[FLASH_BENCH_MAX_ROWS];
+    plan_cost_model_t model;            /*!< what the rows say, per 4K / 64K / page */
+} flash_bench_result_t;
+
+// time the flash on the first data partition (biggest first) whose last 128K
+// is blank, and leave it blank again; refuses while a job runs or with flash
+// encryption on. The table goes to `out`.
+bool flash_bench_run(OutputSink & out, const part_mgr_env_t & env, flash_bench_result_t & result);
+// {"flash_chip_id":..,"scratch":{..},"results":[{"op":..,"chunk":..,"kb_per_s":..,"us_per_op":..}],"cost_model":{..}}
+void flash_bench_json(OutputSink & out, const flash_bench_result_t & result);
+// the last successful run's cost model, if there was one since boot
+bool flash_bench_cost_model(plan_cost_model_t & model);
+const char *flash_bench_op_name(flash_bench_op_t op);
+
+#endif // FLASH_BENCH_H
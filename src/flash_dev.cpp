@@ -0,0 +1,145 @@
+/**
+ * @file flash_dev.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Flash device interface + the ESP32 SPI flash implementation.
+ */
+
+#include "flash_dev.h"
+#include "metrics.h"
+#include "sector_pool.h"
+#ifndef REPART_HOST
+#include "esp_flash_encrypt.h"
+#endif
+
+static flash_write_hook_t write_hook = NULL;
+
+void flash_dev_set_write_hook(flash_write_hook_t hook) {
+    write_hook = hook;
+}
+
+esp_err_t FlashDev::read(size_t addr, void *buf, size_t len) {
+    PortLock lock(_lock);
+    _stats.read_ops++;
+    _stats.bytes_read += len;
+    unsigned long time_start = micros();
+    esp_err_t err = do_read(addr, buf, len);
+    metrics_record(METRIC_FLASH_READ, len, micros() - time_start);
+    return err;
+}
+
+esp_err_t FlashDev::write(size_t addr, const void *buf, size_t len) {
+    PortLock lock(_lock);
+    _stats.write_ops++;
+    _stats.bytes_written += len;
+    unsigned long time_start = micros();
+    esp_err_t err = do_write(addr, buf, len);
+    metrics_record(METRIC_FLASH_WRITE, len, micros() - time_start);
+    if (write_hook) write_hook(addr, len);
+    return err;
+}
+
+esp_err_t FlashDev::erase_range(size_t addr, size_t len) {
+    PortLock lock(_lock);
+    _stats.erase_ops++;
+    _stats.erase_sectors += len / SPI_FLASH_SEC_SIZE;
+    _stats.bytes_erased += len;
+    unsigned long time_start = micros();
+    esp_err_t err = do_erase_range(addr, len);
+    metrics_record(METRIC_FLASH_ERASE, len, micros() - time_start);
+    if (write_hook) write_hook(addr, len);
+    return err;
+}
+
+const void *FlashDev::map(size_t addr, size_t len, uint32_t &handle) {
+    PortLock lock(_lock);
+    unsigned long time_start = micros();
+    const void *ptr = do_map(addr, len, handle);
+    if (ptr != NULL) {
+        _stats.read_ops++;
+        _stats.bytes_read += len;
+        metrics_record(METRIC_FLASH_MAP, len, micros() - time_start);
+    }
+    return ptr;
+}
+
+void FlashDev::unmap(uint32_t handle) {
+    PortLock lock(_lock);
+    do_unmap(handle);
+}
+
+#ifndef REPART_HOST
+// The real thing.
+class EspFlashDev : public FlashDev {
+public:
+    size_t size() override { return spi_flash_get_chip_size(); }
+protected:
+    esp_err_t do_read(size_t addr, void *buf, size_t len) override {
+        return spi_flash_read(addr, buf, len);
+    }
+    esp_err_t do_write(size_t addr, const void *buf, size_t len) override {
+        return spi_flash_write(addr, buf, len);
+    }
+    esp_err_t do_erase_range(size_t addr, size_t len) override {
+        return spi_flash_erase_range(addr, len);
+    }
+    // the MMU maps whole 64K pages. With flash encryption, mapped reads are
+    // decrypted while spi_flash_read() isn't; stay with the raw bytes then.
+    const void *do_map(size_t addr, size_t len, uint32_t &handle) override {
+        if (esp_flash_encryption_enabled()) return NULL;
+        size_t base = addr & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+        const void *ptr;
+        spi_flash_mmap_handle_t h;
+        if (spi_flash_mmap(base, addr + len - base, SPI_FLASH_MMAP_DATA, &ptr, &h) != ESP_OK) return NULL;
+        handle = h;
+        return (const uint8_t *)ptr + (addr - base);
+    }
+    void do_unmap(uint32_t handle) override {
+        spi_flash_munmap(handle);
+    }
+};
+
+static EspFlashDev esp_flash_dev;
+static FlashDev *current_flash_dev = &esp_flash_dev;
+#else
+static FlashDev *current_flash_dev = NULL; // host builds must call flash_dev_set()
+#endif
+
+FlashDev &flash_dev() {
+    return *current_flash_dev;
+}
+
+void flash_dev_set(FlashDev *dev) {
+#ifndef REPART_HOST
+    if (dev == NULL) dev = &esp_flash_dev;
+#endif
+    current_flash_dev = dev;
+}
+
+esp_err_t flash_dev_stream(size_t addr, size_t len, OutputSink & out) {
+    SectorBuffer buffer(false);         // only needed if mapping doesn't work
+    esp_err_t err = ESP_OK;
+    while (len > 0 && err == ESP_OK) {
+        // up to the next window edge, so a map never needs more than one page
+        size_t n = FLASH_STREAM_WINDOW - (addr % FLASH_STREAM_WINDOW);
+        if (n > len) n = len;
+        uint32_t handle;
+        const void *mapped = flash_dev().map(addr, n, handle);
+        if (mapped != NULL) {
+            out.write((const char *)mapped, n);
+            flash_dev().unmap(handle);
+        } else {
+            if (!buffer.take()) {
+                err = ESP_ERR_NO_MEM;
+                break;
+            }
+            for (size_t o = 0; o < n && err == ESP_OK; o += SPI_FLASH_SEC_SIZE) {
+                size_t k = (n - o < SPI_FLASH_SEC_SIZE) ? n - o : SPI_FLASH_SEC_SIZE;
+                err = flash_dev().read(addr + o, buffer.data(), k);
+                if (err == ESP_OK) out.write((const char *)buffer.data(), k);
+            }
+        }
+        addr += n;
+        len -= n;
+    }
+    return err;
+}
@@ -0,0 +1,67 @@
+#ifndef FLASH_DEV_H
+#define FLASH_DEV_H
+
+// Flash device interface. Everything that touches flash goes through here,
+// so the same code can run on the chip or against a file-backed image.
+#include "main.h"
+#include "port_task.h"
+#include "out_sink.h"
+#ifndef REPART_HOST
+#include "esp_spi_flash.h"
+#endif
+
+#define FLASH_STREAM_WINDOW 0x10000     // flash_dev_stream() maps this much at a time, one MMU page
+
+typedef struct {
+    uint32_t read_ops;
+    uint32_t write_ops;
+    uint32_t erase_ops;                 /*!< number of erase_range() calls */
+    uint32_t erase_sectors;             /*!< number of 4K sectors erased */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t bytes_erased;
+} flash_stats_t;
+
+// told about every write & erase, after it's done; called with the device locked, so no flash access
+typedef void (*flash_write_hook_t)(size_t addr, size_t len);
+
+class FlashDev {
+public:
+    virtual ~FlashDev() {}
+
+    // same semantics as spi_flash_read / spi_flash_write / spi_flash_erase_range
+    esp_err_t read(size_t addr, void *buf, size_t len);
+    esp_err_t write(size_t addr, const void *buf, size_t len);
+    esp_err_t erase_range(size_t addr, size_t len);
+    // read-only view of the range, without copying; NULL if it can't be
+    // mapped (use read() then). Give the handle back to unmap() when done.
+    const void *map(size_t addr, size_t len, uint32_t &handle);
+    void unmap(uint32_t handle);
+    virtual size_t size() = 0;
+
+    const flash_stats_t &stats() const { return _stats; }
+    void reset_stats() { memset(&_stats, 0, sizeof(_stats)); }
+
+protected:
+    virtual esp_err_t do_read(size_t addr, void *buf, size_t len) = 0;
+    virtual esp_err_t do_write(size_t addr, const void *buf, size_t len) = 0;
+    virtual esp_err_t do_erase_range(size_t addr, size_t len) = 0;
+    virtual const void *do_map(size_t addr, size_t len, uint32_t &handle) { return NULL; }
+    virtual void do_unmap(uint32_t handle) {}
+
+private:
+    flash_stats_t _stats = {};
+    PortMutex _lock; // one chip, whichever task is asking
+};
+
+// the flash device in use; defaults to the chip's SPI flash on the ESP32
+FlashDev &flash_dev();
+// swap in a different flash device (host builds); NULL restores the default
+void flash_dev_set(FlashDev *dev);
+// one hook for all devices; NULL for none
+void flash_dev_set_write_hook(flash_write_hook_t hook);
+// send the range to `out` as it is in flash: mapped a window at a time where
+// possible, through a sector buffer where not
+esp_err_t flash_dev_stream(size_t addr, size_t len, OutputSink & out);
+
+#endif // FLASH_DEV_H
@@ -0,0 +1,398 @@
+/**
+ * @file fs_carry.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Carries the files of a shrunk filesystem partition over the reboot.
+ *
+ * Archive: a sector with the fs_carry_t, then for each file a 2 byte name
+ * length, a 4 byte size, the name and the contents. The header is written
+ * last, so a half-written archive never looks like one.
+ */
+
+#include "fs_carry.h"
+#include "flash_dev.h"
+#include "part_mgr.h"
+#include "sector_pool.h"
+#include "gz_stream.h"
+#include "utils.h"
+
+#define FS_CARRY_ENTRY_HEAD     6       // name length, size
+#define SPIFFS_PAGE_DATA        251     // 256 byte page, minus its header
+#define SPIFFS_BLOCK_PAGES      15      // 16 pages in a 4K block, one of them the lookup page
+
+fs_kind_t fs_carry_detect(uint32_t address, uint32_t size) {
+    uint8_t head[16];
+    uint16_t magic;
+    for (uint32_t block = 0; block < 2 && (block + 1) * SPI_FLASH_SEC_SIZE <= size; block++) {
+        // LittleFS: the superblock pair, its name at offset 8
+        uint32_t at = address + block * SPI_FLASH_SEC_SIZE;
+        if (flash_dev().read(at, head, sizeof(head)) == ESP_OK && memcmp(head + 8, "littlefs", 8) == 0) {
+            return FS_KIND_LITTLEFS;
+        }
+        // SPIFFS: the block magic, the last object id of the lookup page; ESP-IDF
+        // builds mix in the number of blocks left
+        if (flash_dev().read(address + FS_SPIFFS_MAGIC_PADDR(block), &magic, sizeof(magic)) == ESP_OK &&
+            (magic == FS_SPIFFS_MAGIC(size / SPI_FLASH_SEC_SIZE, block) || magic == FS_SPIFFS_MAGIC_NO_LENGTH)) {
+            return FS_KIND_SPIFFS;
+        }
+    }
+    return FS_KIND_NONE;
+}
+
+const char *fs_kind_name(fs_kind_t kind) {
+    switch (kind) {
+        case FS_KIND_LITTLEFS: return "LittleFS";
+        case FS_KIND_SPIFFS: return "SPIFFS";
+        default: return "none";
+    }
+}
+
+static uint32_t _sectors(uint32_t bytes) {
+    return (bytes + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+}
+
+// the files, and a rough (generous) idea of the flash they take on a fresh filesystem
+typedef struct {
+    fs_kind_t kind;
+    uint32_t files;
+    uint32_t bytes;
+    uint32_t length;                    // in the archive
+    uint32_t need;                      // LittleFS: bytes of whole blocks; SPIFFS: pages
+    bool long_name;
+} _tally_t;
+
+static bool _tally_file(void *ctx, const char *path, uint32_t size) {
+    _tally_t &t = *(_tally_t *)ctx;
+    size_t len = strlen(path);
+    if (len > FS_FILES_PATH_MAX) {
+        t.long_name = true;
+        return false;
+    }
+    t.files++;
+    t.bytes += size;
+    t.length += FS_CARRY_ENTRY_HEAD + len + size;
+    t.need += (t.kind == FS_KIND_SPIFFS) ? 1 + (size + SPIFFS_PAGE_DATA - 1) / SPIFFS_PAGE_DATA : _sectors(size);
+    return true;
+}
+
+bool fs_carry_check(OutputSink & ws, fs_carry_t & carry, uint32_t new_size) {
+    char c_buffer[160];
+    _tally_t t = {(fs_kind_t)carry.kind, 0, 0, 0, 0, false};
+    bool listed = fs_files_mount(t.kind, carry.label) && fs_files_list(_tally_file, &t);
+    fs_files_unmount();
+    if (!listed) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: Can't read the files on %s (%s)%s; not shrinking it without them.\n",
+                 carry.label, fs_kind_name(t.kind), t.long_name ? ", a name is too long" : "");
+        _add_output(ws, c_buffer);
+        return false;
+    }
+    // LittleFS: superblocks, directory blocks & some to spare for copy-on-write;
+    // SPIFFS only fills about 3/4 of a partition reliably
+    uint32_t need = (t.kind == FS_KIND_SPIFFS) ?
+        (t.need + SPIFFS_BLOCK_PAGES - 1) / SPIFFS_BLOCK_PAGES * SPI_FLASH_SEC_SIZE / 3 * 4 :
+        t.need + (4 + t.files / 16) * SPI_FLASH_SEC_SIZE;
+    snprintf(c_buffer, sizeof(c_buffer), "%s (%s) has %u files, %uK; they need ~%uK of the new %uK\n",
+             carry.label, fs_kind_name(t.kind), t.files, t.bytes / 1024, need / 1024, new_size / 1024);
+    _add_output(ws, c_buffer);
+    if (need > new_size) {
+        _add_output(ws, "ERROR: The files won't fit the smaller partition.\n");
+        return false;
+    }
+    uint32_t span = SPI_FLASH_SEC_SIZE + _sectors(t.length);
+    if (span > carry.area_size) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: No room to keep them over the reboot: %uK, the OTA slot has %uK.\n",
+                 span / 1024, carry.area_size / 1024);
+        _add_output(ws, c_buffer);
+        return false;
+    }
+    carry.magic = FS_CARRY_MAGIC;
+    carry.version = FS_CARRY_VERSION;
+    carry.area_size = span;
+    carry.length = t.length;
+    carry.file_count = t.files;
+    carry.file_bytes = t.bytes;
+    carry.crc = 0;
+    return true;
+}
+
+// the archive's files, written a sector at a time after its header sector
+class _ArchiveWriter {
+public:
+    _ArchiveWriter(uint32_t address) : length(0), crc(0), _address(address + SPI_FLASH_SEC_SIZE), _fill(0) {}
+    bool ok() { return _sector.ok(); }
+    esp_err_t add(const uint8_t *data, size_t len) {
+        crc = gz_crc32(crc, data, len);
+        length += len;
+        while (len > 0) {
+            size_t n = SPI_FLASH_SEC_SIZE - _fill;
+            if (n > len) n = len;
+            memcpy(_sector.data() + _fill, data, n);
+            _fill += n;
+            data += n;
+            len -= n;
+            if (_fill == SPI_FLASH_SEC_SIZE) {
+                esp_err_t err = flush();
+                if (err != ESP_OK) return err;
+            }
+        }
+        return ESP_OK;
+    }
+    // what's in the buffer, padded to a sector
+    esp_err_t flush() {
+        if (_fill == 0) return ESP_OK;
+        memset(_sector.data() + _fill, 0xFF, SPI_FLASH_SEC_SIZE - _fill);
+        esp_err_t err = flash_dev().write(_address, _sector.data(), SPI_FLASH_SEC_SIZE);
+        _address += SPI_FLASH_SEC_SIZE;
+        _fill = 0;
+        return err;
+    }
+    uint32_t length;
+    uint32_t crc;
+private:
+    SectorBuffer _sector;
+    uint32_t _address;
+    size_t _fill;
+};
+
+// and read back in order
+class _ArchiveReader {
+public:
+    _ArchiveReader(const fs_carry_t & carry) : crc(0), _address(carry.address + SPI_FLASH_SEC_SIZE), _left(carry.length) {}
+    esp_err_t get(void *data, size_t len) {
+        if (len > _left) return ESP_ERR_INVALID_SIZE;
+        esp_err_t err = flash_dev().read(_address, data, len);
+        if (err != ESP_OK) return err;
+        crc = gz_crc32(crc, (const uint8_t *)data, len);
+        _address += len;
+        _left -= len;
+        return ESP_OK;
+    }
+    uint32_t left() { return _left; }
+    uint32_t crc;
+private:
+    uint32_t _address;
+    uint32_t _left;
+};
+
+typedef struct {
+    _ArchiveWriter *out;
+    uint8_t *chunk;
+    uint32_t files;
+    esp_err_t err;
+} _pack_t;
+
+static bool _pack_file(void *ctx, const char *path, uint32_t size) {
+    _pack_t &p = *(_pack_t *)ctx;
+    uint8_t head[FS_CARRY_ENTRY_HEAD];
+    uint16_t path_len = strlen(path);
+    memcpy(head, &path_len, 2);
+    memcpy(head + 2, &size, 4);
+    if (!fs_files_open(path, false)) {
+        p.err = ESP_ERR_NOT_FOUND;
+        return false;
+    }
+    p.err = p.out->add(head, sizeof(head));
+    if (p.err == ESP_OK) p.err = p.out->add((const uint8_t *)path, path_len);
+    for (uint32_t left = size; p.err == ESP_OK && left > 0; ) {
+        int n = fs_files_read(p.chunk, (left < SPI_FLASH_SEC_SIZE) ? left : SPI_FLASH_SEC_SIZE);
+        if (n <= 0) {
+            p.err = ESP_FAIL;
+            break;
+        }
+        p.err = p.out->add(p.chunk, n);
+        left -= n;
+    }
+    fs_files_close();
+    p.files++;
+    return p.err == ESP_OK;
+}
+
+// the header on flash is this one, and the files add up to its CRC
+static esp_err_t _archive_check(const fs_carry_t & carry, uint8_t *chunk) {
+    esp_err_t err = flash_dev().read(carry.address, chunk, sizeof(fs_carry_t));
+    if (err != ESP_OK) return err;
+    if (memcmp(chunk, &carry, sizeof(fs_carry_t)) != 0) return ESP_ERR_INVALID_CRC;
+    _ArchiveReader in(carry);
+    while (in.left() > 0) {
+        err = in.get(chunk, (in.left() < SPI_FLASH_SEC_SIZE) ? in.left() : SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) return err;
+    }
+    return (in.crc == carry.crc) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+bool fs_carry_pack(OutputSink & ws, fs_carry_t & carry) {
+    char c_buffer[128];
+    unsigned long time_start = micros();
+    snprintf(c_buffer, sizeof(c_buffer), "Packing the files of %s at 0x%x, length 0x%x\n",
+             carry.label, carry.address, carry.area_size);
+    _add_output(ws, c_buffer);
+    _ArchiveWriter out(carry.address);
+    SectorBuffer chunk;
+    if (!out.ok() || !chunk.ok()) {
+        _add_output(ws, "Failed to allocate memory for packing the files\n");
+        return false;
+    }
+    _pack_t p = {&out, chunk.data(), 0, ESP_OK};
+    esp_err_t err = flash_dev().erase_range(carry.address, carry.area_size);
+    if (err == ESP_OK) {
+        if (!fs_files_mount((fs_kind_t)carry.kind, carry.label)) err = ESP_ERR_NOT_FOUND;
+        else if (!fs_files_list(_pack_file, &p)) err = (p.err != ESP_OK) ? p.err : ESP_FAIL;
+        fs_files_unmount();
+    }
+    if (err == ESP_OK) err = out.flush();
+    // the files changed since they were counted
+    if (err == ESP_OK && (out.length != carry.length || p.files != carry.file_count)) err = ESP_ERR_INVALID_SIZE;
+    if (err == ESP_OK) {
+        carry.crc = out.crc;
+        memset(chunk.data(), 0xFF, SPI_FLASH_SEC_SIZE);
+        memcpy(chunk.data(), &carry, sizeof(carry));
+        err = flash_dev().write(carry.address, chunk.data(), SPI_FLASH_SEC_SIZE);
+    }
+    if (err == ESP_OK) err = _archive_check(carry, chunk.data());
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to pack the files: 0x%x\n", err);
+        _add_output(ws, c_buffer);
+        return false;
+    }
+    snprintf(c_buffer, sizeof(c_buffer), " ... %u files packed & read back in %lu ms\n",
+             carry.file_count, (micros() - time_start) / 1000);
+    _add_output(ws, c_buffer);
+    return true;
+}
+
+// write the files from the archive to the mounted filesystem, or (check) compare them
+static esp_err_t _unpack(const fs_carry_t & carry, uint8_t *chunk, uint8_t *other, bool check) {
+    _ArchiveReader in(carry);
+    char path[FS_FILES_PATH_MAX + 1];
+    for (uint32_t n = 0; n < carry.file_count; n++) {
+        uint8_t head[FS_CARRY_ENTRY_HEAD];
+        uint16_t path_len;
+        uint32_t size;
+        esp_err_t err = in.get(head, sizeof(head));
+        if (err != ESP_OK) return err;
+        memcpy(&path_len, head, 2);
+        memcpy(&size, head + 2, 4);
+        if (path_len > FS_FILES_PATH_MAX) return ESP_ERR_INVALID_SIZE;
+        err = in.get(path, path_len);
+        if (err != ESP_OK) return err;
+        path[path_len] = '\0';
+        if (!fs_files_open(path, !check)) return ESP_ERR_NOT_FOUND;
+        for (uint32_t left = size; err == ESP_OK && left > 0; ) {
+            size_t len = (left < SPI_FLASH_SEC_SIZE) ? left : SPI_FLASH_SEC_SIZE;
+            err = in.get(chunk, len);
+            if (err != ESP_OK) break;
+            if (check) {
+                if (fs_files_read(other, len) != (int)len || memcmp(chunk, other, len) != 0) err = ESP_ERR_INVALID_CRC;
+            } else if (!fs_files_write(chunk, len)) {
+                err = ESP_FAIL;
+            }
+            left -= len;
+        }
+        fs_files_close();
+        if (err != ESP_OK) return err;
+    }
+    return ESP_OK;
+}
+
+#ifndef REPART_HOST
+#include <Preferences.h>
+
+// not the journal's: that one's cleared before the reboot
+#define FS_CARRY_NAMESPACE "repart_fs"
+
+bool fs_carry_save(const fs_carry_t & carry) {
+    Preferences prefs;
+    if (!prefs.begin(FS_CARRY_NAMESPACE, false)) return false;
+    bool ok = prefs.putBytes("carry", &carry, sizeof(carry)) == sizeof(carry);
+    prefs.end();
+    return ok;
+}
+
+static bool _load(fs_carry_t & carry) {
+    Preferences prefs;
+    if (!prefs.begin(FS_CARRY_NAMESPACE, true)) return false;
+    bool ok = prefs.getBytes("carry", &carry, sizeof(carry)) == sizeof(carry);
+    prefs.end();
+    return ok && carry.magic == FS_CARRY_MAGIC && carry.version == FS_CARRY_VERSION;
+}
+
+void fs_carry_clear() {
+    Preferences prefs;
+    if (!prefs.begin(FS_CARRY_NAMESPACE, false)) return;
+    prefs.clear();
+    prefs.end();
+}
+
+#else // REPART_HOST
+
+static const char *carry_path = NULL;
+
+void fs_carry_set_path(const char *path) {
+    carry_path = path;
+}
+
+bool fs_carry_save(const fs_carry_t & carry) {
+    if (carry_path == NULL || !host_power_on()) return false;
+    FILE *f = fopen(carry_path, "wb");
+    if (f == NULL) return false;
+    bool ok = fwrite(&carry, sizeof(carry), 1, f) == 1;
+    return (fclose(f) == 0) && ok;
+}
+
+static bool _load(fs_carry_t & carry) {
+    if (carry_path == NULL) return false;
+    FILE *f = fopen(carry_path, "rb");
+    if (f == NULL) return false;
+    bool ok = fread(&carry, sizeof(carry), 1, f) == 1;
+    fclose(f);
+    return ok && carry.magic == FS_CARRY_MAGIC && carry.version == FS_CARRY_VERSION;
+}
+
+void fs_carry_clear() {
+    if (carry_path != NULL && host_power_on()) remove(carry_path);
+}
+#endif
+
+esp_err_t fs_carry_resume(OutputSink & ws) {
+    fs_carry_t carry;
+    if (!_load(carry)) return ESP_ERR_NOT_FOUND;
+    // if the table never got written, the files are still where they were
+    uint8_t table_md5[16];
+    if (!getPartitionTableMd5(table_md5) || memcmp(table_md5, carry.table_md5, sizeof(table_md5)) != 0) {
+        _add_output(ws, "Found files to put back under another partition table; ignoring them.\n");
+        fs_carry_clear();
+        return ESP_ERR_NOT_FOUND;
+    }
+    char c_buffer[128];
+    snprintf(c_buffer, sizeof(c_buffer), "Putting %u files (%uK) back on %s (%s)\n",
+             carry.file_count, carry.file_bytes / 1024, carry.label, fs_kind_name((fs_kind_t)carry.kind));
+    _add_output(ws, c_buffer);
+    unsigned long time_start = micros();
+    SectorBuffer chunk, other;
+    if (!chunk.ok() || !other.ok()) {
+        _add_output(ws, "Failed to allocate memory for the files\n");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = _archive_check(carry, chunk.data());
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: The files' archive doesn't check out (0x%x); they're lost.\n", err);
+        _add_output(ws, c_buffer);
+        fs_carry_clear();
+        return err;
+    }
+    // from scratch every time, so a power cut in here just means doing it again
+    if (!fs_files_format((fs_kind_t)carry.kind, carry.label)) err = ESP_FAIL;
+    if (err == ESP_OK) err = _unpack(carry, chunk.data(), other.data(), false);
+    if (err == ESP_OK) err = _unpack(carry, chunk.data(), other.data(), true);
+    fs_files_unmount();
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to put the files back: 0x%x; trying again next boot.\n", err);
+        _add_output(ws, c_buffer);
+        return err;
+    }
+    fs_carry_clear();
+    // the OTA slot's next image goes there
+    flash_dev().erase_range(carry.address, carry.area_size);
+    snprintf(c_buffer, sizeof(c_buffer), " ... Files back & checked in %lu ms\n", (micros() - time_start) / 1000);
+    _add_output(ws, c_buffer);
+    return ESP_OK;
+}
@@ -0,0 +1,63 @@
+#ifndef FS_CARRY_H
+#define FS_CARRY_H
+
+// Keeps the files of a LittleFS / SPIFFS partition that a resize shrinks.
+// Before the new table is written, the files (just their bytes, not the rest
+// of the old filesystem) are packed into an archive in flash the run leaves
+// alone: the tail of the OTA slot it erases, where that slot is in both
+// tables. On the next boot, with the new table live, the partition is
+// formatted at its new size and the files go back in.
+#include "main.h"
+#include "fs_files.h"
+#include "out_sink.h"
+
+#define FS_CARRY_MAGIC 0x43465045 // "EPFC"
+#define FS_CARRY_VERSION 1
+
+// where SPIFFS keeps the magic of block bix, and what it is: SPIFFS_MAGIC_PADDR
+// & SPIFFS_MAGIC from spiffs_nucleus.h, for ESP-IDF's config (256 byte pages,
+// 4K blocks, 16 bit object ids, so one lookup page; SPIFFS_USE_MAGIC_LENGTH)
+#define FS_SPIFFS_PAGE_SIZE     256
+#define FS_SPIFFS_LOOKUP_PAGES  1       // an object id for each of the 16 pages
+#define FS_SPIFFS_MAGIC_PADDR(bix) \
+    ((bix) * SPI_FLASH_SEC_SIZE + FS_SPIFFS_LOOKUP_PAGES * FS_SPIFFS_PAGE_SIZE - sizeof(uint16_t))
+#define FS_SPIFFS_MAGIC(blocks, bix) ((uint16_t)(0x20140529 ^ FS_SPIFFS_PAGE_SIZE ^ ((blocks) - (bix))))
+// the same without SPIFFS_USE_MAGIC_LENGTH, as some mkspiffs builds have it
+#define FS_SPIFFS_MAGIC_NO_LENGTH ((uint16_t)(0x20140529 ^ FS_SPIFFS_PAGE_SIZE))
+
+// what's carried & where it waits; the archive starts with a copy, and NVS
+// has one until the files are back
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t kind;                       /*!< fs_kind_t */
+    char label[17];                     /*!< partition the files go back to */
+    uint32_t address;                   /*!< archive: this header's sector, then the files */
+    uint32_t area_size;                 /*!< bytes at address the archive may use; erased afterwards */
+    uint32_t length;                    /*!< bytes of files (with their names) after the header sector */
+    uint32_t crc;                       /*!< CRC-32 of those */
+    uint32_t file_count;
+    uint32_t file_bytes;                /*!< just the files' contents */
+    uint8_t table_md5[16];              /*!< MD5 entry of the table the files go back under */
+} fs_carry_t;
+
+// the filesystem in [address, address + size), going by its signature in the first blocks
+fs_kind_t fs_carry_detect(uint32_t address, uint32_t size);
+const char *fs_kind_name(fs_kind_t kind);
+// list the files on carry.label; they have to fit a new_size partition, and
+// the archive carry.area_size. Fills in the counts; false + log if they don't.
+bool fs_carry_check(OutputSink & ws, fs_carry_t & carry, uint32_t new_size);
+// write the archive and read it back; false + log if that fails
+bool fs_carry_pack(OutputSink & ws, fs_carry_t & carry);
+// remember it over the reboot
+bool fs_carry_save(const fs_carry_t & carry);
+void fs_carry_clear();
+// at boot, once the journal is done: put the files back if the table on flash
+// is the one they wait for. ESP_ERR_NOT_FOUND if there's nothing to do.
+esp_err_t fs_carry_resume(OutputSink & ws);
+#ifdef REPART_HOST
+// host builds keep the note in a file, like the journal; NULL = nowhere
+void fs_carry_set_path(const char *path);
+#endif
+
+#endif // FS_CARRY_H
@@ -0,0 +1,90 @@
+/**
+ * @file fs_files.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief fs_files.h through the Arduino core's LittleFS & SPIFFS.
+ */
+
+#include "fs_files.h"
+#include <FS.h>
+#include <LittleFS.h>
+#include <SPIFFS.h>
+
+#define FS_FILES_BASE_PATH      "/carry"
+#define FS_FILES_DEPTH_MAX      8
+
+static fs_kind_t _kind = FS_KIND_NONE;
+static File _file;
+
+static fs::FS & _fs() {
+    return (_kind == FS_KIND_SPIFFS) ? (fs::FS &)SPIFFS : (fs::FS &)LittleFS;
+}
+
+bool fs_files_mount(fs_kind_t kind, const char *label) {
+    fs_files_unmount();
+    bool ok = (kind == FS_KIND_LITTLEFS) ? LittleFS.begin(false, FS_FILES_BASE_PATH, 2, label) :
+              (kind == FS_KIND_SPIFFS) ? SPIFFS.begin(false, FS_FILES_BASE_PATH, 2, label) : false;
+    if (ok) _kind = kind;
+    return ok;
+}
+
+bool fs_files_format(fs_kind_t kind, const char *label) {
+    fs_files_unmount();
+    // begin() formats what doesn't mount; format() wipes what happened to
+    bool ok = (kind == FS_KIND_LITTLEFS) ? LittleFS.begin(true, FS_FILES_BASE_PATH, 2, label) && LittleFS.format() :
+              (kind == FS_KIND_SPIFFS) ? SPIFFS.begin(true, FS_FILES_BASE_PATH, 2, label) && SPIFFS.format() : false;
+    if (ok) _kind = kind;
+    return ok;
+}
+
+void fs_files_unmount() {
+    if (_file) _file.close();
+    if (_kind == FS_KIND_LITTLEFS) LittleFS.end();
+    if (_kind == FS_KIND_SPIFFS) SPIFFS.end();
+    _kind = FS_KIND_NONE;
+}
+
+static bool _list_dir(const char *dir, fs_files_each_t each, void *ctx, int depth) {
+    File root = _fs().open(dir);
+    if (!root || !root.isDirectory()) return false;
+    for (File f = root.openNextFile(); f; f = root.openNextFile()) {
+        bool ok = f.isDirectory() ? (depth < FS_FILES_DEPTH_MAX && _list_dir(f.path(), each, ctx, depth + 1)) :
+                                    each(ctx, f.path(), f.size());
+        if (!ok) return false;
+    }
+    return true;
+}
+
+bool fs_files_list(fs_files_each_t each, void *ctx) {
+    return _kind != FS_KIND_NONE && _list_dir("/", each, ctx, 0);
+}
+
+bool fs_files_open(const char *path, bool write) {
+    if (_kind == FS_KIND_NONE) return false;
+    if (_file) _file.close();
+    if (write && _kind == FS_KIND_LITTLEFS) {
+        // SPIFFS has no directories, just slashes in names
+        char dir[FS_FILES_PATH_MAX];
+        for (const char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+            size_t n = slash - path;
+            if (n >= sizeof(dir)) return false;
+            memcpy(dir, path, n);
+            dir[n] = '\0';
+            _fs().mkdir(dir);
+        }
+    }
+    _file = _fs().open(path, write ? FILE_WRITE : FILE_READ);
+    return (bool)_file;
+}
+
+int fs_files_read(uint8_t *data, size_t len) {
+    if (!_file) return -1;
+    return _file.read(data, len);
+}
+
+bool fs_files_write(const uint8_t *data, size_t len) {
+    return _file && _file.write(data, len) == len;
+}
+
+void fs_files_close() {
+    if (_file) _file.close();
+}
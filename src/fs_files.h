@@ -0,0 +1,34 @@
+#ifndef FS_FILES_H
+#define FS_FILES_H
+
+// The files on a filesystem partition, one at a time, for carrying them over
+// a shrink (fs_carry.h). On the chip that's LittleFS or SPIFFS from the
+// Arduino core; the Linux build has a stand-in (host/host_fs_files.cpp).
+#include "main.h"
+
+#define FS_FILES_PATH_MAX       128     // whole path, with directories
+
+typedef enum {
+    FS_KIND_NONE = 0,
+    FS_KIND_LITTLEFS,
+    FS_KIND_SPIFFS,
+} fs_kind_t;
+
+// one file of a listing; false stops it
+typedef bool (*fs_files_each_t)(void *ctx, const char *path, uint32_t size);
+
+// mount the filesystem on the partition labelled `label`, as the table the chip booted with has it
+bool fs_files_mount(fs_kind_t kind, const char *label);
+// erase it & mount it empty
+bool fs_files_format(fs_kind_t kind, const char *label);
+void fs_files_unmount();
+// every file, in every directory; false if listing failed or `each` stopped it
+bool fs_files_list(fs_files_each_t each, void *ctx);
+// one file open at a time: to read it, or to write it from scratch (directories and all)
+bool fs_files_open(const char *path, bool write);
+// bytes read, 0 at the end, -1 on errors
+int fs_files_read(uint8_t *data, size_t len);
+bool fs_files_write(const uint8_t *data, size_t len);
+void fs_files_close();
+
+#endif // FS_FILES_H
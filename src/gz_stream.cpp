@@ -0,0 +1,530 @@
+/**
+ * @file gz_stream.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief A tiny gzip writer for mostly-empty flash.
+ *
+ * RFC 1951/1952, stripped down. The whole stream is one fixed-Huffman block,
+ * plus an empty final block once we know it's over. Every byte goes out as a
+ * literal, and repeats of it as matches at distance 1 (3..258 bytes each), so
+ * a blank 4K sector is about 26 bytes. Any inflate can read it.
+ *
+ * GunzipSink is the reader, for any deflate stream: canonical Huffman codes
+ * decoded a bit at a time (like zlib's puff.c), one symbol per step. Input is
+ * held back until there's GUNZIP_IN_AHEAD of it, so a step never has to stop
+ * halfway and pick up again with the next upload chunk.
+ */
+
+#include "gz_stream.h"
+#ifndef REPART_HOST
+#include "esp_rom_crc.h"
+#endif
+
+// deflate length codes 257..285: base length & extra bits
+static const uint16_t _len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t _len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+// distance codes 0..29
+static const uint16_t _dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t _dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+uint32_t gz_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+#ifndef REPART_HOST
+    // the ROM has a table-driven one, with the same pre & post inversion
+    return esp_rom_crc32_le(crc, data, len);
+#else
+    // a nibble at a time; a 1K table isn't worth it next to the WiFi
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+#endif
+}
+
+GzipSink::GzipSink(OutputSink & out)
+    : _out(out), _len(0), _bitbuf(0), _bitcount(0), _have_prev(false), _prev(0), _run(0),
+      _crc(0), _size(0), _total_out(0), _finished(false) {
+    // gzip header: deflate, no name, no mtime, Unix
+    static const uint8_t header[10] = {0x1F, 0x8B, 0x08, 0x00, 0, 0, 0, 0, 0x00, 0x03};
+    memcpy(_buffer, header, sizeof(header));
+    _len = sizeof(header);
+    _bits(0, 1);                        // BFINAL: not yet
+    _bits(1, 2);                        // BTYPE: fixed Huffman
+}
+
+GzipSink::~GzipSink() {
+    finish();
+}
+
+// raw bits, LSB first
+void GzipSink::_bits(uint32_t value, int count) {
+    _bitbuf |= value << _bitcount;
+    _bitcount += count;
+    while (_bitcount >= 8) {
+        _buffer[_len++] = _bitbuf & 0xFF;
+        _bitbuf >>= 8;
+        _bitcount -= 8;
+        if (_len == GZ_OUT_BUFFER_SIZE) _flush_out();
+    }
+}
+
+// Huffman codes go MSB first
+void GzipSink::_code(uint32_t code, int len) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < len; i++) reversed |= ((code >> i) & 1) << (len - 1 - i);
+    _bits(reversed, len);
+}
+
+// fixed literal/length code for symbol 0..287
+static void _symbol(uint32_t sym, uint32_t &code, int &len) {
+    if (sym < 144) { code = 0x30 + sym; len = 8; }
+    else if (sym < 256) { code = 0x190 + (sym - 144); len = 9; }
+    else if (sym < 280) { code = sym - 256; len = 7; }
+    else { code = 0xC0 + (sym - 280); len = 8; }
+}
+
+void GzipSink::_literal(uint8_t c) {
+    uint32_t code;
+    int len;
+    _symbol(c, code, len);
+    _code(code, len);
+}
+
+void GzipSink::_match(uint32_t len) {
+    int i = 28;
+    while (_len_base[i] > len) i--;
+    uint32_t code;
+    int bits;
+    _symbol(257 + i, code, bits);
+    _code(code, bits);
+    if (_len_extra[i]) _bits(len - _len_base[i], _len_extra[i]);
+    _code(0, 5);                        // distance code 0: distance 1, no extra bits
+}
+
+// send the repeats of _prev we've been holding back
+void GzipSink::_end_run() {
+    if (_run >= 3) {
+        _match(_run);
+    } else {
+        for (uint32_t i = 0; i < _run; i++) _literal(_prev);
+    }
+    _run = 0;
+}
+
+void GzipSink::write(const char *str, size_t len) {
+    if (_finished) return;
+    const uint8_t *data = (const uint8_t *)str;
+    _crc = gz_crc32(_crc, data, len);
+    _size += len;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (_have_prev && c == _prev) {
+            if (++_run == GZ_MAX_MATCH) _end_run();
+            continue;
+        }
+        _end_run();
+        _literal(c);
+        _prev = c;
+        _have_prev = true;
+    }
+}
+
+void GzipSink::_flush_out() {
+    if (_len == 0) return;
+    _out.write((const char *)_buffer, _len);
+    _total_out += _len;
+    _len = 0;
+}
+
+// passes on the whole bytes so far; the last few bits wait for more
+void GzipSink::flush() {
+    _flush_out();
+    _out.flush();
+}
+
+void GzipSink::finish() {
+    if (_finished) return;
+    _end_run();
+    _code(0, 7);                        // end of block
+    _bits(1, 1);                        // BFINAL
+    _bits(1, 2);                        // fixed Huffman, empty
+    _code(0, 7);                        // end of block
+    if (_bitcount > 0) _bits(0, 8 - _bitcount);
+    uint32_t trailer[2] = {_crc, _size};
+    for (int i = 0; i < 2; i++) {
+        for (int b = 0; b < 4; b++) _bits((trailer[i] >> (8 * b)) & 0xFF, 8);
+    }
+    _finished = true;
+    flush();
+}
+
+// GunzipSink: where the stream is at
+enum {
+    _GUNZIP_HEADER = 0,                 // the fixed 10 bytes
+    _GUNZIP_EXTRA_LEN,                  // FEXTRA: its length
+    _GUNZIP_EXTRA,                      // ... and _left bytes of it
+    _GUNZIP_NAME,                       // FNAME, up to its 0
+    _GUNZIP_COMMENT,                    // FCOMMENT, likewise
+    _GUNZIP_HCRC,                       // FHCRC
+    _GUNZIP_BLOCK,                      // next block header
+    _GUNZIP_STORED,                     // _left bytes of a stored block
+    _GUNZIP_CODES,                      // Huffman coded block
+    _GUNZIP_TRAILER,                    // CRC & length
+    _GUNZIP_DONE,
+};
+
+#define _GUNZIP_FHCRC       0x02
+#define _GUNZIP_FEXTRA      0x04
+#define _GUNZIP_FNAME       0x08
+#define _GUNZIP_FCOMMENT    0x10
+#define _GUNZIP_FLAGS_SEEN  (_GUNZIP_FHCRC | _GUNZIP_FEXTRA | _GUNZIP_FNAME | _GUNZIP_FCOMMENT)
+
+GunzipSink::GunzipSink(OutputSink & out)
+    : _out(out), _window(NULL), _in(NULL), _in_pos(0), _in_len(0), _bitbuf(0), _bitcount(0),
+      _state(_GUNZIP_HEADER), _last(false), _left(0), _wpos(0), _pending(0),
+      _crc(0), _size(0), _total_in(0), _error(NULL) {
+    _window = (uint8_t *)malloc(GUNZIP_WINDOW_SIZE + GUNZIP_IN_SIZE);
+    if (_window == NULL) {
+        _error = "out of memory";
+        return;
+    }
+    _in = _window + GUNZIP_WINDOW_SIZE;
+}
+
+GunzipSink::~GunzipSink() {
+    free(_window);
+}
+
+void GunzipSink::write(const char *str, size_t len) {
+    _total_in += len;
+    while (len > 0 && _error == NULL && _state != _GUNZIP_DONE) {
+        // drop what's been used, fill up the rest
+        memmove(_in, _in + _in_pos, _in_len - _in_pos);
+        _in_len -= _in_pos;
+        _in_pos = 0;
+        size_t n = (len < GUNZIP_IN_SIZE - _in_len) ? len : GUNZIP_IN_SIZE - _in_len;
+        memcpy(_in + _in_len, str, n);
+        _in_len += n;
+        str += n;
+        len -= n;
+        _inflate(false);
+    }
+}
+
+void GunzipSink::flush() {
+    if (_window != NULL) _flush_window();
+    _out.flush();
+}
+
+bool GunzipSink::finish() {
+    if (_error == NULL) _inflate(true);
+    if (_error == NULL && _state != _GUNZIP_DONE) _error = "cut short";
+    flush();
+    return _error == NULL;
+}
+
+void GunzipSink::_inflate(bool end) {
+    while (_error == NULL && _state != _GUNZIP_DONE) {
+        // at the end, a step that runs out of input is an error
+        if (!end && _in_len - _in_pos < GUNZIP_IN_AHEAD) break;
+        _step();
+    }
+}
+
+// make sure there are `count` bits (up to 24) in _bitbuf; false at the end of the input
+bool GunzipSink::_need(int count) {
+    while (_bitcount < count) {
+        if (_in_pos == _in_len) {
+            _error = "cut short";
+            return false;
+        }
+        _bitbuf |= (uint32_t)_in[_in_pos++] << _bitcount;
+        _bitcount += 8;
+    }
+    return true;
+}
+
+uint32_t GunzipSink::_take(int count) {
+    if (count == 0 || !_need(count)) return 0;
+    uint32_t value = _bitbuf & ((1u << count) - 1);
+    _bitbuf >>= count;
+    _bitcount -= count;
+    return value;
+}
+
+// one symbol, -1 if the bits aren't a code
+int GunzipSink::_decode(const _huffman_t & h) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        code |= _take(1);
+        if (_error != NULL) return -1;
+        int count = h.count[len];
+        if (code - count < first) return h.symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+// canonical code from the code lengths; false if they ask for more codes than there are
+bool GunzipSink::_build(_huffman_t & h, const uint8_t *lengths, int n) {
+    uint16_t offs[16];
+    memset(h.count, 0, sizeof(h.count));
+    for (int i = 0; i < n; i++) h.count[lengths[i]]++;
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left = (left << 1) - h.count[len];
+        if (left < 0) return false;
+    }
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h.count[len];
+    for (int i = 0; i < n; i++) {
+        if (lengths[i] != 0) h.symbol[offs[lengths[i]]++] = i;
+    }
+    return true;
+}
+
+void GunzipSink::_step() {
+    switch (_state) {
+        case _GUNZIP_HEADER: {
+            uint8_t header[10];
+            for (int i = 0; i < 10; i++) header[i] = _take(8);
+            if (_error != NULL) return;
+            if (header[0] != 0x1F || header[1] != 0x8B || header[2] != 0x08 ||
+                (header[3] & ~_GUNZIP_FLAGS_SEEN) != 0) {
+                _error = "not a gzip stream";
+                return;
+            }
+            _left = header[3];          // the flags, while the optional fields go by
+            _state = _GUNZIP_EXTRA_LEN;
+            break;
+        }
+        case _GUNZIP_EXTRA_LEN:
+            if (_left & _GUNZIP_FEXTRA) {
+                uint32_t flags = _left;
+                uint32_t len = _take(16);
+                _state = _GUNZIP_EXTRA;
+                _left = (len << 8) | flags;
+            } else {
+                _state = _GUNZIP_NAME;
+            }
+            break;
+        case _GUNZIP_EXTRA:
+            if ((_left >> 8) == 0) {
+                _state = _GUNZIP_NAME;
+            } else {
+                _take(8);
+                _left -= 0x100;
+            }
+            break;
+        case _GUNZIP_NAME:
+        case _GUNZIP_COMMENT: {
+            uint32_t flag = (_state == _GUNZIP_NAME) ? _GUNZIP_FNAME : _GUNZIP_FCOMMENT;
+            if (!(_left & flag) || _take(8) == 0) {
+                _left &= ~flag;
+                _state++;
+            }
+            break;
+        }
+        case _GUNZIP_HCRC:
+            if (_left & _GUNZIP_FHCRC) _take(16);
+            _state = _GUNZIP_BLOCK;
+            break;
+        case _GUNZIP_BLOCK:
+            _block_header();
+            break;
+        case _GUNZIP_STORED: {
+            // whole bytes from here on, straight from the buffer
+            uint32_t n = _in_len - _in_pos;
+            if (n > _left) n = _left;
+            if (n == 0 && _left > 0) {
+                _error = "cut short";
+                return;
+            }
+            for (uint32_t i = 0; i < n; i++) _put(_in[_in_pos + i]);
+            _in_pos += n;
+            _left -= n;
+            if (_left == 0) _state = _last ? _GUNZIP_TRAILER : _GUNZIP_BLOCK;
+            break;
+        }
+        case _GUNZIP_CODES:
+            _codes();
+            break;
+        case _GUNZIP_TRAILER: {
+            _take(_bitcount % 8);       // to the byte boundary
+            uint32_t crc = _take(16);
+            crc |= _take(16) << 16;
+            uint32_t size = _take(16);
+            size |= _take(16) << 16;
+            if (_error != NULL) return;
+            _flush_window();            // the CRC is counted as the bytes are passed on
+            if (crc != _crc) {
+                _error = "CRC mismatch";
+            } else if (size != _size) {
+                _error = "length mismatch";
+            }
+            _state = _GUNZIP_DONE;
+            break;
+        }
+    }
+}
+
+void GunzipSink::_block_header() {
+    _last = _take(1);
+    uint32_t type = _take(2);
+    if (_error != NULL) return;
+    if (type == 0) {
+        _take(_bitcount % 8);
+        uint32_t len = _take(16);
+        uint32_t nlen = _take(16);
+        if (_error != NULL) return;
+        if ((len ^ 0xFFFF) != nlen) {
+            _error = "bad stored block length";
+            return;
+        }
+        _left = len;
+        _state = _GUNZIP_STORED;
+        // _bitcount is 0 now: _take(16) only ever loads whole bytes past the boundary
+    } else if (type == 1) {
+        uint8_t lengths[288 + 30];
+        int i = 0;
+        for (; i < 144; i++) lengths[i] = 8;
+        for (; i < 256; i++) lengths[i] = 9;
+        for (; i < 280; i++) lengths[i] = 7;
+        for (; i < 288; i++) lengths[i] = 8;
+        for (i = 0; i < 30; i++) lengths[288 + i] = 5;
+        _build(_lencode, lengths, 288);
+        _build(_distcode, lengths + 288, 30);
+        _state = _GUNZIP_CODES;
+    } else if (type == 2) {
+        _dynamic_tables();
+        if (_error == NULL) _state = _GUNZIP_CODES;
+    } else {
+        _error = "bad block type";
+    }
+}
+
+// the code lengths of a dynamic block, themselves Huffman coded
+void GunzipSink::_dynamic_tables() {
+    static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint8_t lengths[286 + 30];
+    int nlen = _take(5) + 257;
+    int ndist = _take(5) + 1;
+    int ncode = _take(4) + 4;
+    if (_error != NULL) return;
+    if (nlen > 286 || ndist > 30) {
+        _error = "bad code counts";
+        return;
+    }
+    memset(lengths, 0, sizeof(lengths));
+    for (int i = 0; i < ncode; i++) lengths[order[i]] = _take(3);
+    if (_error != NULL || !_build(_lencode, lengths, 19)) {
+        if (_error == NULL) _error = "bad code length code";
+        return;
+    }
+    for (int i = 0; i < nlen + ndist;) {
+        int sym = _decode(_lencode);
+        if (sym < 0) {
+            if (_error == NULL) _error = "bad code lengths";
+            return;
+        }
+        if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        }
+        uint8_t len = 0;
+        int repeat;
+        if (sym == 16) {
+            if (i == 0) {
+                _error = "repeat with no length";
+                return;
+            }
+            len = lengths[i - 1];
+            repeat = 3 + _take(2);
+        } else if (sym == 17) {
+            repeat = 3 + _take(3);
+        } else {
+            repeat = 11 + _take(7);
+        }
+        if (_error != NULL) return;
+        if (i + repeat > nlen + ndist) {
+            _error = "too many code lengths";
+            return;
+        }
+        while (repeat--) lengths[i++] = len;
+    }
+    if (lengths[256] == 0) {
+        _error = "no end-of-block code";
+        return;
+    }
+    if (!_build(_lencode, lengths, nlen) || !_build(_distcode, lengths + nlen, ndist)) {
+        _error = "bad Huffman code";
+    }
+}
+
+// one literal, match or end of block
+void GunzipSink::_codes() {
+    int sym = _decode(_lencode);
+    if (sym < 0) {
+        if (_error == NULL) _error = "bad literal/length code";
+        return;
+    }
+    if (sym < 256) {
+        _put(sym);
+        return;
+    }
+    if (sym == 256) {
+        _state = _last ? _GUNZIP_TRAILER : _GUNZIP_BLOCK;
+        return;
+    }
+    sym -= 257;
+    if (sym >= 29) {
+        _error = "bad length code";
+        return;
+    }
+    uint32_t len = _len_base[sym] + _take(_len_extra[sym]);
+    int dsym = _decode(_distcode);
+    if (dsym < 0 || dsym >= 30) {
+        if (_error == NULL) _error = "bad distance code";
+        return;
+    }
+    uint32_t dist = _dist_base[dsym] + _take(_dist_extra[dsym]);
+    if (_error != NULL) return;
+    if (dist > _size && _size < GUNZIP_WINDOW_SIZE) {
+        _error = "distance too far back";
+        return;
+    }
+    while (len--) _put(_window[(_wpos - dist) & (GUNZIP_WINDOW_SIZE - 1)]);
+}
+
+void GunzipSink::_put(uint8_t c) {
+    _window[_wpos++] = c;
+    _pending++;
+    _size++;
+    if (_wpos == GUNZIP_WINDOW_SIZE) {
+        _flush_window();
+        _wpos = 0;
+    }
+}
+
+// pass on what's in the window since last time; it never wraps, see _put()
+void GunzipSink::_flush_window() {
+    if (_pending == 0) return;
+    const uint8_t *data = _window + _wpos - _pending;
+    _crc = gz_crc32(_crc, data, _pending);
+    _out.write((const char *)data, _pending);
+    _pending = 0;
+}
@@ -0,0 +1,104 @@
+#ifndef GZ_STREAM_H
+#define GZ_STREAM_H
+
+// gzip on the fly, for downloads: what's written goes out compressed to the
+// sink behind it. Only runs of the same byte are compressed (deflate matches
+// at distance 1, fixed Huffman codes), which is what flash mostly has lots of:
+// 0xFF padding & empty sectors. No window, so it needs next to no RAM.
+// And the other way round for uploads, with GunzipSink.
+#include "out_sink.h"
+
+#define GZ_OUT_BUFFER_SIZE  1024        // compressed bytes collected before they're passed on
+#define GZ_MAX_MATCH        258         // longest deflate match
+
+class GzipSink : public OutputSink {
+public:
+    GzipSink(OutputSink & out);
+    ~GzipSink();
+    void write(const char *str, size_t len) override;
+    void flush() override;
+    // end the stream: last block, CRC & length. Nothing can be written after.
+    void finish();
+    uint32_t bytes_in() { return _size; }
+    uint32_t bytes_out() { return _total_out; }
+private:
+    void _bits(uint32_t value, int count);
+    void _code(uint32_t code, int len);
+    void _literal(uint8_t c);
+    void _match(uint32_t len);
+    void _end_run();
+    void _flush_out();
+    OutputSink & _out;
+    uint8_t _buffer[GZ_OUT_BUFFER_SIZE];
+    size_t _len;
+    uint32_t _bitbuf;                   // bits not yet in _buffer, LSB first
+    int _bitcount;
+    bool _have_prev;
+    uint8_t _prev;                      // last byte sent as a literal or a match
+    uint32_t _run;                      // repeats of _prev not sent yet
+    uint32_t _crc;
+    uint32_t _size;                     // uncompressed bytes, mod 2^32 like gzip's ISIZE
+    uint32_t _total_out;
+    bool _finished;
+};
+
+#define GUNZIP_WINDOW_SIZE  32768       // deflate's longest distance back
+#define GUNZIP_IN_SIZE      2048        // compressed bytes held until they're decoded
+#define GUNZIP_IN_AHEAD     1024        // decoded only with this much more to come (or at the end),
+                                        // so no symbol or block header runs out of input halfway
+
+// gunzip on the fly, for uploads: what's written is a gzip stream, what it
+// unpacks to goes to the sink behind it, up to a window at a time. All of
+// deflate (stored, fixed & dynamic blocks); the window & input buffer come
+// from the heap, ~34K.
+class GunzipSink : public OutputSink {
+public:
+    GunzipSink(OutputSink & out);
+    ~GunzipSink();
+    void write(const char *str, size_t len) override;
+    // passes on what's been unpacked so far
+    void flush() override;
+    // no more input: unpack the rest and check the CRC & length. False if the
+    // stream was bad or cut short; error() says why.
+    bool finish();
+    const char *error() { return _error; }  // NULL while all is well
+    uint32_t bytes_in() { return _total_in; }
+    uint32_t bytes_out() { return _size; }
+private:
+    typedef struct {
+        uint16_t count[16];             // codes of each length
+        uint16_t symbol[288];           // symbols, ordered by code
+    } _huffman_t;
+    void _inflate(bool end);
+    void _step();
+    bool _need(int count);
+    uint32_t _take(int count);
+    int _decode(const _huffman_t & h);
+    bool _build(_huffman_t & h, const uint8_t *lengths, int n);
+    void _block_header();
+    void _dynamic_tables();
+    void _codes();
+    void _put(uint8_t c);
+    void _flush_window();
+    OutputSink & _out;
+    uint8_t *_window;                   // then the input buffer; NULL if there was no RAM
+    uint8_t *_in;
+    size_t _in_pos, _in_len;
+    uint32_t _bitbuf;                   // bits taken from _in but not used yet, LSB first
+    int _bitcount;
+    int _state;
+    bool _last;                         // the block being unpacked is the final one
+    uint32_t _left;                     // stored block bytes, or header bytes to skip
+    uint32_t _wpos;                     // next byte in the window
+    uint32_t _pending;                  // bytes before _wpos not passed on yet
+    _huffman_t _lencode, _distcode;
+    uint32_t _crc;
+    uint32_t _size;                     // unpacked bytes, mod 2^32 like gzip's ISIZE
+    uint32_t _total_in;
+    const char *_error;
+};
+
+// standard CRC-32 (zlib / gzip), continue from `crc` (0 to start)
+uint32_t gz_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif // GZ_STREAM_H
@@ -0,0 +1,97 @@
+/**
+ * @file journal.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Keeps the repartition journal in NVS (or a file, on host).
+ *
+ * The job is stored once, progress updates only write two small values,
+ * so NVS just appends an entry each time and doesn't wear anything out.
+ */
+
+#include "journal.h"
+
+#ifndef REPART_HOST
+#include <Preferences.h>
+
+#define JOURNAL_NAMESPACE "repart"
+
+bool journal_save(const journal_t &job) {
+    Preferences prefs;
+    if (!prefs.begin(JOURNAL_NAMESPACE, false)) return false;
+    bool ok = (prefs.putBytes("job", &job, sizeof(job)) == sizeof(job)) &&
+              (prefs.putUShort("step", job.step) == sizeof(uint16_t)) &&
+              (prefs.putULong("done", job.done) == sizeof(uint32_t));
+    prefs.end();
+    return ok;
+}
+
+bool journal_commit(uint16_t step, uint32_t done) {
+    Preferences prefs;
+    if (!prefs.begin(JOURNAL_NAMESPACE, false)) return false;
+    bool ok = (prefs.putUShort("step", step) == sizeof(uint16_t)) &&
+              (prefs.putULong("done", done) == sizeof(uint32_t));
+    prefs.end();
+    return ok;
+}
+
+bool journal_load(journal_t &job) {
+    Preferences prefs;
+    if (!prefs.begin(JOURNAL_NAMESPACE, true)) return false;
+    bool ok = (prefs.getBytes("job", &job, sizeof(job)) == sizeof(job));
+    if (ok) {
+        job.step = prefs.getUShort("step", 0);
+        job.done = prefs.getULong("done", 0);
+    }
+    prefs.end();
+    return ok && job.magic == JOURNAL_MAGIC && job.version == JOURNAL_VERSION &&
+           job.step_count <= JOURNAL_MAX_STEPS;
+}
+
+void journal_clear() {
+    Preferences prefs;
+    if (!prefs.begin(JOURNAL_NAMESPACE, false)) return;
+    prefs.clear();
+    prefs.end();
+}
+
+#else // REPART_HOST
+
+static const char *journal_path = NULL;
+
+void journal_set_path(const char *path) {
+    journal_path = path;
+}
+
+static bool _journal_write(const journal_t &job) {
+    if (!host_power_on()) return false;
+    FILE *f = fopen(journal_path, "wb");
+    if (f == NULL) return false;
+    bool ok = fwrite(&job, sizeof(job), 1, f) == 1;
+    return (fclose(f) == 0) && ok;
+}
+
+bool journal_save(const journal_t &job) {
+    return (journal_path != NULL) && _journal_write(job);
+}
+
+bool journal_commit(uint16_t step, uint32_t done) {
+    journal_t job;
+    if (!journal_load(job)) return false;
+    job.step = step;
+    job.done = done;
+    return _journal_write(job);
+}
+
+bool journal_load(journal_t &job) {
+    if (journal_path == NULL) return false;
+    FILE *f = fopen(journal_path, "rb");
+    if (f == NULL) return false;
+    bool ok = fread(&job, sizeof(job), 1, f) == 1;
+    fclose(f);
+    return ok && job.magic == JOURNAL_MAGIC && job.version == JOURNAL_VERSION &&
+           job.step_count <= JOURNAL_MAX_STEPS;
+}
+
+void journal_clear() {
+    if (journal_path != NULL && host_power_on()) remove(journal_path);
+}
+#endif
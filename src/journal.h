@@ -0,0 +1,50 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// The repartition job journal: the list of steps to do after the new
+// partition table is written, and how far we got. Survives reboots, so an
+// interrupted job can be finished instead of needing a USB reflash.
+#include "main.h"
+
+#define JOURNAL_MAGIC 0x4A525045 // "EPRJ"
+#define JOURNAL_VERSION 2
+#define JOURNAL_MAX_STEPS 190 // a move and a clean for each of MAX_NUMBER_OF_PARTITIONS
+
+typedef enum {
+    JOURNAL_STEP_MOVE = 1,              /*!< move size bytes from addr_from to addr_to */
+    JOURNAL_STEP_ERASE,                 /*!< erase size bytes at addr_to */
+    JOURNAL_STEP_CLEAN,                 /*!< erase whatever isn't blank in size bytes at addr_to */
+} journal_step_kind_t;
+
+typedef struct {
+    uint8_t kind;                       /*!< journal_step_kind_t */
+    uint8_t partition;                  /*!< index in the table, for the log */
+    uint32_t addr_from;
+    uint32_t addr_to;
+    uint32_t size;
+} journal_step_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t step_count;
+    uint8_t table_md5[16];              /*!< MD5 entry of the new table; the job only applies to it */
+    journal_step_t steps[JOURNAL_MAX_STEPS];
+    uint16_t step;                      /*!< current step */
+    uint32_t done;                      /*!< bytes of the current step that are done */
+} journal_t;
+
+// store the whole job; false if there's nowhere to keep it
+bool journal_save(const journal_t &job);
+// note progress: step `step` has `done` bytes done
+bool journal_commit(uint16_t step, uint32_t done);
+// load a stored job; false if there's none
+bool journal_load(journal_t &job);
+// job's done (or abandoned)
+void journal_clear();
+#ifdef REPART_HOST
+// host builds keep the journal in a file, e.g. next to the flash image; NULL = no journal
+void journal_set_path(const char *path);
+#endif
+
+#endif // JOURNAL_H
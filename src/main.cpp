@@ -23,12 +23,18 @@
  * 7. Upload your desired firmware update
  * 8. Good luck.
  * 
- * Note: This only works if the current partition is app0.
- * If it's app1, you need to upload a firmware update first (it can be this one).
+ * Or steps 4-7 in one go: 'Fix partitions & install', pick the firmware (.bin,
+ * or .bin.gz) once the run is done, and the one reboot goes straight into it.
+ *
+ * Note: This works from app0 or app1. From app1, it copies itself to app0 first,
+ * and boots from there next; app0 keeps its place.
  * 
- * Note 2: It expects a partition table with app0, app1, data in that order, nothing behind it.
+ * Note 2: It needs app0, app1 and at least one data partition to take the space from
+ * (or free flash behind the last partition). Anything may come before the apps, and
+ * any number of partitions after them, up to the 95 a table holds, on 4, 8 or 16MB flash.
  * 
- * Note 3: It empties app1 & data partitions, and resizes app0 & app1.
+ * Note 3: It empties app1 & the data partition that shrinks (unless 'Keep files' is
+ * ticked), moves the partitions in between, and resizes app0 & app1.
  * 
  * This: https://github.com/softplus/Esp32Repartition
  * WLED: https://kno.wled.ge/ & https://github.com/Aircoookie/WLED
@@ -41,42 +47,135 @@
 #include <WiFiManager.h>
 #include "main.h"
 #include "part_mgr.h"
+#include "part_job.h"
+#include "flash_dev.h"
+#include "app_image.h"
 #include "device_info.h"
+#include "utils.h"
+#include "gz_stream.h"
+#include "digest_cache.h"
+#include "api_json.h"
+#include "flash_bench.h"
+#include "metrics.h"
+#include "fs_carry.h"
+#include "part_install.h"
+#include "uart_proto.h"
 
 WiFiManager wm;
 
 void bindServerCallback();
 void handlePartitionRead();
 void handlePartitionFix();
+void handlePartitionTarget();
+void handlePartitionTargetUpload();
+void handlePartitionInstallStart();
+void handlePartitionInstall();
+void handlePartitionInstallUpload();
+void handlePartitionProgress();
 void handleDownloadFlash(size_t start, size_t end, const char *filename);
 void handleDownloadBootloader();
 void handleDownloadPartition();
 void handleDownloadApp1();
+void handleDownloadAll();
+void handleDigests();
+void handleApiDevice();
+void handleApiTable();
+void handleApiPlan();
+void handleApiJob();
+void handleFlashBench();
+void handleApiFlashBench();
+void handleMetrics();
+part_mgr_opts_t getPartitionOpts();
 
 // bind the server callbacks
 void bindServerCallback(){
   wm.server->on("/partition-read", handlePartitionRead);
   wm.server->on("/partition-fix", handlePartitionFix);
+  wm.server->on("/partition-target", HTTP_POST, handlePartitionTarget, handlePartitionTargetUpload);
+  wm.server->on("/partition-install", HTTP_GET, handlePartitionInstallStart);
+  wm.server->on("/partition-install", HTTP_POST, handlePartitionInstall, handlePartitionInstallUpload);
+  wm.server->on("/partition-progress", handlePartitionProgress);
   wm.server->on("/bootloader-download", handleDownloadBootloader);
   wm.server->on("/partition-download", handleDownloadPartition);
   wm.server->on("/app1-download", handleDownloadApp1);
+  wm.server->on("/flash-download", handleDownloadAll);
+  wm.server->on("/digests", handleDigests);
+  wm.server->on("/api/device", handleApiDevice);
+  wm.server->on("/api/table", handleApiTable);
+  wm.server->on("/api/plan", handleApiPlan);
+  wm.server->on("/api/job", handleApiJob);
+  wm.server->on("/flash-bench", handleFlashBench);
+  wm.server->on("/api/flash-bench", handleApiFlashBench);
+  wm.server->on("/metrics", handleMetrics);
+  // EventSource sends Last-Event-ID when it reconnects; Range resumes downloads
+  const char *headers[] = {"Last-Event-ID", "Range", "Accept-Encoding"};
+  wm.server->collectHeaders(headers, 3);
 }
 
-// Downloads a memory section
+// while a job moves things around, flash reads show half-done work
+bool refuseWhileBusy() {
+  if (!part_job_busy()) return false;
+  wm.server->send(503, "text/plain", "A repartition job is running, try again when it's done.\n");
+  return true;
+}
+
+// Downloads a memory section, or the part of it asked for with a Range header,
+// straight from mapped flash. Gzipped if the client takes that and wants it
+// all (unless ?raw=1); mostly-empty flash shrinks to a fraction.
 void handleDownloadFlash(size_t start, size_t end, const char *filename) {
-  DEBUG_PRINT("Downloading...\n");
-  char buf[SPI_FLASH_SEC_SIZE];
-  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  if (refuseWhileBusy()) return;
+  if (end <= start) {
+    // nothing there: no range of it can be satisfied
+    if (wm.server->header("Range").length() > 0) {
+      wm.server->sendHeader("Content-Range", "bytes */0");
+      wm.server->send(416, "text/plain", "Range not satisfiable\n");
+    } else {
+      wm.server->send(404, "text/plain", "Nothing to download there.\n");
+    }
+    return;
+  }
+  char buf[80];
+  uint32_t total = end - start, first = 0, last = total - 1;
+  http_range_t range = http_range_parse(wm.server->header("Range").c_str(), total, first, last);
+  if (range == HTTP_RANGE_NONE && wm.server->arg("raw") != "1" &&
+      wm.server->header("Accept-Encoding").indexOf("gzip") >= 0) {
+    DEBUG_PRINTF("Downloading 0x%x..0x%x, gzipped\n", start, end);
+    snprintf(buf, sizeof(buf), "attachment; filename=%s", filename);
+    wm.server->sendHeader("Content-Disposition", buf);
+    wm.server->sendHeader("Content-Encoding", "gzip");
+    wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+    wm.server->send(200, "application/octet-stream", "");
+    WebOutputSink web(wm.server);
+    GzipSink out(web);
+    unsigned long time_start = micros();
+    esp_err_t err = flash_dev_stream(start, total, out);
+    out.finish();
+    metrics_record(METRIC_DOWNLOAD, out.bytes_out(), micros() - time_start);
+    DEBUG_PRINTF("Done: 0x%x, %u bytes sent\n", err, out.bytes_out());
+    return;
+  }
+  if (range == HTTP_RANGE_UNSATISFIABLE) {
+    snprintf(buf, sizeof(buf), "bytes */%u", total);
+    wm.server->sendHeader("Content-Range", buf);
+    wm.server->send(416, "text/plain", "Range not satisfiable\n");
+    return;
+  }
+  DEBUG_PRINTF("Downloading 0x%x..0x%x\n", start + first, start + last);
+  wm.server->sendHeader("Accept-Ranges", "bytes");
   snprintf(buf, sizeof(buf), "attachment; filename=%s", filename);
   wm.server->sendHeader("Content-Disposition", buf);
-  wm.server->send(200, "application/octet-stream", "");
-  for (uint32_t addr = start; addr<end; addr+=SPI_FLASH_SEC_SIZE) {
-    DEBUG_PRINTF("Reading flash at 0x%x\n", addr);
-    if (spi_flash_read(addr, (void *)buf, SPI_FLASH_SEC_SIZE) != ESP_OK) {
-      DEBUG_PRINTF("Failed to read flash at offset 0x%x\n", addr);
-      break;
-    }
-    wm.server->sendContent(buf, SPI_FLASH_SEC_SIZE);
+  if (range == HTTP_RANGE_OK) {
+    snprintf(buf, sizeof(buf), "bytes %u-%u/%u", first, last, total);
+    wm.server->sendHeader("Content-Range", buf);
+  }
+  wm.server->setContentLength(last - first + 1);
+  wm.server->send((range == HTTP_RANGE_OK) ? 206 : 200, "application/octet-stream", "");
+  WebOutputSink out(wm.server);
+  unsigned long time_start = micros();
+  esp_err_t err = flash_dev_stream(start + first, last - first + 1, out);
+  metrics_record(METRIC_DOWNLOAD, last - first + 1, micros() - time_start);
+  if (err != ESP_OK) {
+    DEBUG_PRINTF("Failed to read flash: 0x%x\n", err);
   }
   DEBUG_PRINT("Done.\n");
 }
@@ -85,47 +184,417 @@ void handleDownloadFlash(size_t start, size_t end, const char *filename) {
 void handleDownloadBootloader() {
   size_t boot_addr = 0x1000;
   size_t boot_end = getPartitionTableAddr();
+  if (boot_end == 0) {
+    wm.server->send(404, "text/plain", "No partition table found, so no idea where the bootloader ends.\n");
+    return;
+  }
   handleDownloadFlash(boot_addr, boot_end, "current-bootloader.bin");
 }
 
 // Downloads the partition table
 void handleDownloadPartition() {
   size_t part_addr = getPartitionTableAddr();
+  if (part_addr == 0) {
+    wm.server->send(404, "text/plain", "No partition table found.\n");
+    return;
+  }
   handleDownloadFlash(part_addr, part_addr+SPI_FLASH_SEC_SIZE, "current-partition.bin");
 }
 
 // Downloads the second app partition (likely where the old firmware was)
 // Downloading app0 makes no sense (it's this code)
+// Only the firmware image itself is sent, if we can tell how long it is.
 void handleDownloadApp1() {
-  esp_partition_t part;
-  getPartitionApp1(&part);
-  handleDownloadFlash(part.address, part.address+part.size, "current-app1.bin");
+  esp_partition_t part = {};
+  if (!getPartitionApp1(&part) || part.size == 0) {
+    wm.server->send(404, "text/plain", "There's no second app partition.\n");
+    return;
+  }
+  uint32_t len = app_image_length(part.address, part.size);
+  if (len == 0) len = part.size;
+  len = (len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+  handleDownloadFlash(part.address, part.address+len, "current-app1.bin");
+}
+
+// Downloads the whole flash chip, for a full backup
+void handleDownloadAll() {
+  handleDownloadFlash(0, flash_dev().size(), "current-flash.bin");
+}
+
+// handle the /digests route: MD5 of each flash region, as JSON, from the cache
+void handleDigests() {
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "application/json", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  digest_cache_json(out);
+}
+
+// the /api/... routes: one small JSON object each, for scripts
+void handleApiDevice() {
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "application/json", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  api_json_device(out, partition_mgr_env());
+}
+
+void handleApiTable() {
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "application/json", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  api_json_table(out);
+}
+
+// a dry run, like /partition-read, takes the same options
+void handleApiPlan() {
+  if (part_job_busy()) {
+    wm.server->send(503, "application/json", "{\"error\":\"busy\"}\n");
+    return;
+  }
+  part_mgr_report_t *report = (part_mgr_report_t *)malloc(sizeof(part_mgr_report_t));
+  if (report == NULL) {
+    wm.server->send(500, "application/json", "{\"error\":\"out of memory\"}\n");
+    return;
+  }
+  part_mgr_opts_t opts = getPartitionOpts();
+  opts.report = report;
+  NullSink log;
+  partition_mgr_run(log, partition_mgr_env(), opts, true);
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "application/json", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  api_json_report(out, *report);
+  free(report);
+}
+
+// the background job's progress, and what it did once it's over
+void handleApiJob() {
+  wm.server->sendHeader("Cache-Control", "no-cache");
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "application/json", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  api_json_job(out);
+}
+
+// time this board's flash chip on a blank scratch area; takes a few seconds,
+// and later plans estimate with what it measured
+void handleFlashBench() {
+  if (refuseWhileBusy()) return;
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "text/html", "");
+  wm.server->sendContent(HTML_INTRO);
+  {
+    WebOutputSink web(wm.server);
+    BufferedSink out(web);
+    flash_bench_result_t result;
+    flash_bench_run(out, partition_mgr_env(), result);
+  }
+  wm.server->sendContent(HTML_OUTRO);
+}
+
+void handleApiFlashBench() {
+  if (part_job_busy()) {
+    wm.server->send(503, "application/json", "{\"error\":\"busy\"}\n");
+    return;
+  }
+  flash_bench_result_t result;
+  NullSink log;
+  flash_bench_run(log, partition_mgr_env(), result);
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "application/json", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  flash_bench_json(out, result);
+}
+
+// counters & latency histograms for Prometheus; answers while a job runs, that's when it's interesting
+void handleMetrics() {
+  wm.server->sendHeader("Cache-Control", "no-cache");
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "text/plain; version=0.0.4", "");
+  WebOutputSink web(wm.server);
+  BufferedSink out(web);
+  metrics_write(out);
+}
+
+// options from the request, e.g. /partition-fix?mode=sector&log=summary
+part_mgr_opts_t getPartitionOpts() {
+  part_mgr_opts_t opts = {};
+  if (wm.server->arg("mode") == "sector") opts.move_mode = MOVE_MODE_SECTOR;
+  if (wm.server->arg("mode") == "pipeline") opts.move_mode = MOVE_MODE_PIPELINE;
+  part_mgr_opts_strategy(opts, wm.server->arg("strategy").c_str());
+  if (wm.server->arg("log") == "summary") opts.verbosity = OUT_VERBOSITY_SUMMARY;
+  opts.keep_fs = (wm.server->arg("keep_fs") == "1");
+  return opts;
 }
 
 // handle the /partition-read route
 void handlePartitionRead() {
+  if (refuseWhileBusy()) return;
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "text/html", "");
+  wm.server->sendContent(HTML_INTRO);
+  partition_mgr_fix(wm.server, getPartitionOpts(), true);
+  wm.server->sendContent(HTML_OUTRO);
+}
+
+// the log & progress of the background job, live from /partition-progress
+#define HTML_PROGRESS F("</pre><p id='progress'>Starting...</p><pre id='log'></pre><pre>" \
+  "<script>var es = new EventSource('/partition-progress');" \
+  "var st = document.getElementById('progress');" \
+  "es.addEventListener('log', function(e) { document.getElementById('log').textContent += e.data; });" \
+  "es.addEventListener('progress', function(e) { var p = JSON.parse(e.data);" \
+  "  st.textContent = p.phase + ': ' + p.sectors_done + ' / ' + p.sectors_total + ' sectors, ' +" \
+  "  Math.round(p.bytes_per_s / 1024) + ' KB/s, ETA ' + p.eta_s + ' s'; });" \
+  "es.addEventListener('end', function(e) { es.close(); st.textContent += ' - ' + JSON.parse(e.data).result; });" \
+  "</script>")
+
+// start a real run in the background and show its progress; if one is
+// running already, this just watches it
+void startPartitionJob(const uint8_t *target, size_t target_len) {
   wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
   wm.server->send(200, "text/html", "");
   wm.server->sendContent(HTML_INTRO);
-  partition_mgr_fix(wm.server, true);
+  if (part_job_busy()) {
+    wm.server->sendContent("A repartition job is running already, showing that one.\n");
+  } else if (!part_job_start(partition_mgr_env(), getPartitionOpts(), target, target_len, false)) {
+    wm.server->sendContent("ERROR: Couldn't start the repartition job.\n");
+    wm.server->sendContent(HTML_OUTRO);
+    return;
+  }
+  wm.server->sendContent(HTML_PROGRESS);
   wm.server->sendContent(HTML_OUTRO);
 }
 
 // handle the /partition-fix route
 void handlePartitionFix() {
+  startPartitionJob(NULL, 0);
+}
+
+// handle the /partition-progress route: Server-Sent Events with the job's log
+// since the client's last event, its progress, and 'end' once it's over. The
+// response ends right there so the server can get on with other clients;
+// EventSource reconnects after `retry` with Last-Event-ID to get the rest.
+void handlePartitionProgress() {
+  part_job_status_t status;
+  part_job_status(status);
+  uint32_t from = status.log_start;
+  if (wm.server->hasHeader("Last-Event-ID") && wm.server->header("Last-Event-ID").length() > 0) {
+    from = strtoul(wm.server->header("Last-Event-ID").c_str(), NULL, 10);
+  }
+  wm.server->sendHeader("Cache-Control", "no-cache");
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "text/event-stream", "");
+  wm.server->sendContent("retry: 1000\n\n");
+
+  // each log line is a data: line; the client joins them with newlines again
+  char buf[512];
+  String event;
+  event.reserve(sizeof(buf) + 64);
+  size_t len;
+  for (int chunks = 0; chunks < PART_JOB_LOG_SIZE / (int)sizeof(buf) &&
+                       (len = part_job_log(from, buf, sizeof(buf))) > 0; chunks++) {
+    event = "event: log\ndata: ";
+    for (size_t i = 0; i < len; i++) {
+      if (buf[i] == '\n') event += "\ndata: ";
+      else if (buf[i] != '\r') event += buf[i];
+    }
+    event += "\nid: " + String(from) + "\n\n";
+    wm.server->sendContent(event);
+  }
+
+  char c_buffer[256];
+  snprintf(c_buffer, sizeof(c_buffer),
+           "event: progress\ndata: {\"state\":\"%s\",\"phase\":\"%s\",\"sectors_done\":%u,"
+           "\"sectors_total\":%u,\"bytes_per_s\":%u,\"eta_s\":%u,\"elapsed_ms\":%u}\n\n",
+           part_job_state_name(status.state), status.phase, status.sectors_done, status.sectors_total,
+           status.bytes_per_s, status.eta_s, status.elapsed_ms);
+  wm.server->sendContent(c_buffer);
+  if (status.state != PART_JOB_RUNNING && from >= status.log_end) {
+    snprintf(c_buffer, sizeof(c_buffer), "event: end\ndata: {\"result\":\"%s\"}\n\n",
+             (status.state == PART_JOB_IDLE) ? "none" : part_job_result_name(status.result));
+    wm.server->sendContent(c_buffer);
+  }
+}
+
+// uploaded target table for /partition-target: CSV text or a binary table
+#define TARGET_UPLOAD_MAX 4096
+static uint8_t *target_upload = NULL;
+static size_t target_upload_len = 0;
+static bool target_upload_ok = false;
+
+// collects the upload, chunk by chunk
+void handlePartitionTargetUpload() {
+  HTTPUpload& upload = wm.server->upload();
+  if (upload.status == UPLOAD_FILE_START) {
+    if (target_upload == NULL) target_upload = (uint8_t *)malloc(TARGET_UPLOAD_MAX);
+    target_upload_len = 0;
+    target_upload_ok = (target_upload != NULL);
+  } else if (upload.status == UPLOAD_FILE_WRITE && target_upload_ok) {
+    if (target_upload_len + upload.currentSize > TARGET_UPLOAD_MAX) {
+      target_upload_ok = false;
+    } else {
+      memcpy(target_upload + target_upload_len, upload.buf, upload.currentSize);
+      target_upload_len += upload.currentSize;
+    }
+  } else if (upload.status == UPLOAD_FILE_ABORTED) {
+    target_upload_ok = false;
+  }
+}
+
+// handle the /partition-target route; only a dry run unless apply=1, which runs in the background
+void handlePartitionTarget() {
+  if (target_upload_ok && target_upload_len > 0 && wm.server->arg("apply") == "1") {
+    startPartitionJob(target_upload, target_upload_len); // the job has its own copy
+  } else if (!refuseWhileBusy()) {
+    wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+    wm.server->send(200, "text/html", "");
+    wm.server->sendContent(HTML_INTRO);
+    if (!target_upload_ok || target_upload_len == 0) {
+      wm.server->sendContent("ERROR: Upload a partition table (CSV or binary, up to 4K).\n");
+    } else {
+      partition_mgr_fix_target(wm.server, getPartitionOpts(), target_upload, target_upload_len, true);
+    }
+    wm.server->sendContent(HTML_OUTRO);
+  }
+  free(target_upload);
+  target_upload = NULL;
+  target_upload_ok = false;
+}
+
+// /partition-install: the repartition, then the firmware for the new slot,
+// and one reboot into it. GET starts the run like /partition-fix; once it's
+// done, the page offers the upload, which POSTs here and goes straight into
+// the new slot. Nothing waits for the job, so the portal keeps answering.
+// The job's log has it all for the page.
+#define HTML_INSTALL_FORM F("<form id='install' action='/partition-install' method='post' " \
+  "enctype='multipart/form-data' style='display:none'>" \
+  "<input type='file' name='firmware' accept='.bin,.gz'><button>Install</button></form>" \
+  "<script>es.addEventListener('end', function(e) { var r = JSON.parse(e.data).result;" \
+  "  if (r == 'done' || r == 'unnecessary') document.getElementById('install').style.display = 'block'; });" \
+  "</script>")
+#define INSTALL_WAIT_MS 600000          // for the upload after a run; then reboot into the new table without it
+
+typedef enum {
+  INSTALL_NONE = 0,                     // no upload came
+  INSTALL_BUSY,                         // a job is running
+  INSTALL_NO_JOB,                       // no finished run that waits for the firmware
+  INSTALL_WRITING,
+  INSTALL_FAILED,
+  INSTALL_DONE,
+} install_state_t;
+static install_state_t install_state = INSTALL_NONE;
+static bool install_reboot = false;     // the firmware is in: reboot into it, new table or not
+
+// handle GET /partition-install: check, then start the run that the firmware follows
+void handlePartitionInstallStart() {
+  if (refuseWhileBusy()) return;
+  part_mgr_env_t env = partition_mgr_env();
+  part_mgr_opts_t opts = getPartitionOpts();
   wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
   wm.server->send(200, "text/html", "");
   wm.server->sendContent(HTML_INTRO);
-  partition_mgr_fix(wm.server, false);
-  wm.server->sendContent(HTML_OUTRO); // unless we already rebooted, lol
+  WebOutputSink out(wm.server);
+  if (part_install_check(out, env, opts)) { // else it said why
+    if (!part_job_start(env, opts, NULL, 0, false, true)) {
+      wm.server->sendContent("ERROR: Couldn't start the repartition job.\n");
+    } else {
+      wm.server->sendContent(HTML_PROGRESS);
+      wm.server->sendContent(HTML_INSTALL_FORM);
+    }
+  }
+  wm.server->sendContent(HTML_OUTRO);
+}
+
+// the firmware, after the run it follows is over
+void handlePartitionInstallUpload() {
+  HTTPUpload& upload = wm.server->upload();
+  OutputSink & log = part_job_out();
+  if (upload.status == UPLOAD_FILE_START) {
+    part_job_status_t status;
+    part_job_status(status);
+    if (status.state == PART_JOB_RUNNING) {
+      install_state = INSTALL_BUSY;
+    } else if (status.state != PART_JOB_FINISHED || !status.firmware_follows || install_reboot ||
+               (status.result != PART_MGR_DONE && status.result != PART_MGR_UNNECESSARY)) {
+      install_state = INSTALL_NO_JOB;
+    } else {
+      install_state = (part_install_begin(log, partition_mgr_env()) == ESP_OK) ? INSTALL_WRITING : INSTALL_FAILED;
+    }
+  } else if (upload.status == UPLOAD_FILE_WRITE && install_state == INSTALL_WRITING) {
+    part_install_write(upload.buf, upload.currentSize);
+  } else if (upload.status == UPLOAD_FILE_END && install_state == INSTALL_WRITING) {
+    install_state = (part_install_finish(log) == ESP_OK) ? INSTALL_DONE : INSTALL_FAILED;
+  } else if (upload.status == UPLOAD_FILE_ABORTED && install_state == INSTALL_WRITING) {
+    part_install_abort();
+    _add_output(log, "ERROR: The upload broke off. The firmware that's running now still boots.\n");
+    install_state = INSTALL_FAILED;
+  }
+}
+
+// handle POST /partition-install, once the upload is in
+void handlePartitionInstall() {
+  install_state_t state = install_state;
+  install_state = INSTALL_NONE;
+  if (state == INSTALL_BUSY) {
+    wm.server->send(503, "text/plain", "A repartition job is running, try again when it's done.\n");
+    return;
+  }
+  if (state == INSTALL_DONE) {
+    _add_output(part_job_out(), "READY! Rebooting into the new firmware in a few seconds...\n");
+    install_reboot = true;
+  }
+  wm.server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  wm.server->send(200, "text/html", "");
+  wm.server->sendContent(HTML_INTRO);
+  if (state == INSTALL_NONE) {
+    wm.server->sendContent("ERROR: Upload a firmware image (.bin, or .bin.gz).\n");
+  } else if (state == INSTALL_NO_JOB) {
+    wm.server->sendContent("ERROR: Fix partitions & install first; the firmware goes in once that's done.\n");
+  } else {
+    // a failed one can be uploaded again
+    wm.server->sendContent(HTML_PROGRESS);
+    if (state == INSTALL_FAILED) wm.server->sendContent(HTML_INSTALL_FORM);
+  }
+  wm.server->sendContent(HTML_OUTRO);
+}
+
+// a fix over serial is over once the client has the END; no need for job_loop()'s wait
+void uartReboot() {
+    Serial.println("Rebooting into the new partition table");
+    Serial.flush();
+    ESP.restart();
 }
 
 // main setup function
 void setup()
 {
-    Serial.begin(115200);
+    Serial.begin(UART_PROTO_BAUD);
     Serial.println("Starting ESP32Repartition");
 
+    // finish a repartition that lost power halfway, before anything else touches flash
+    NullSink resume_out;
+    part_mgr_opts_t resume_opts = {};
+    part_mgr_result_t resumed = partition_mgr_resume(resume_out, resume_opts);
+    if (resumed == PART_MGR_DONE) {
+        Serial.println("Finished interrupted repartition");
+    }
+    // then files kept from a shrunk filesystem go back, now that its new size is in the table
+    if (resumed != PART_MGR_FAILED && fs_carry_resume(resume_out) == ESP_OK) {
+        Serial.println("Put the kept files back");
+    }
+    // hash the flash regions in the background, for the report & /digests
+    digest_cache_init(true);
+    // the bench protocol on Serial; in a task of its own, so it works while autoConnect() blocks
+    uart_proto_hooks_t uart_hooks = {partition_mgr_env, uartReboot};
+    if (!uart_proto_start(uart_hooks)) {
+        Serial.println("Failed to start the serial bench protocol");
+    }
+
     // setup WifiManager for AP, custom menu
     bool res;
     wm.setTitle("Esp32Repartition");
@@ -137,7 +606,9 @@ void setup()
       "  document.getElementById('more').style.display === 'none' ? 'block' : 'none';"
       "}</script>"
       "<form action='/partition-read' method='get'><button>List partitions</button></form><br/>"
-      "<form action='/partition-fix' method='get'><button>Fix partitions</button></form><br/>"
+      "<form action='/partition-fix' method='get'><label><input type='checkbox' name='keep_fs' value='1'>Keep files</label>"
+      "<button>Fix partitions</button></form><br/>"
+      "<form action='/partition-install' method='get'><button>Fix partitions & install</button></form><br/>"
       "<form action='/update' method='get'><button>Install new firmware</button></form><br/>"
       "<a id='toggle' onclick='toggleVisible()'>[ More ]</a><div id='more' style='display:none;'>"      
       "<form action='/0wifi' method='get'><button>Configure wifi settings</button></form><br/>"
@@ -145,6 +616,11 @@ void setup()
       "<form action='/info' method='get'><button>Device-info</button></form><br/>"
       "<form action='/bootloader-download' method='get'><button>Download bootloader</button></form><br/>"
       "<form action='/partition-download' method='get'><button>Download partition table</button></form><br/>"
+      "<form action='/flash-download' method='get'><button>Download whole flash</button></form><br/>"
+      "<form action='/flash-bench' method='get'><button>Benchmark flash</button></form><br/>"
+      "<form action='/partition-target' method='post' enctype='multipart/form-data'>"
+      "<input type='file' name='table' accept='.csv,.bin'><label><input type='checkbox' name='apply' value='1'>Apply</label>"
+      "<button>Switch to partition table</button></form><br/>"
       "</div><br/><br/>"
       "<a href='https://github.com/softplus/Esp32Repartition'>Esp32Repartition on Github</a><br/>"
       "<script>document.head.prepend(Object.assign(document.createElement('meta'),{name:'robots',content:'noindex'}));</script>"
@@ -174,8 +650,34 @@ void watchdog_loop() {
   }
 }
 
+// A finished real run needs a reboot into the new table, an installed firmware
+// one into it; give the clients a few seconds to pick up the end of the log first.
+// A run that a firmware follows waits for that, up to INSTALL_WAIT_MS.
+#define JOB_REBOOT_DELAY_MS 5000
+void job_loop() {
+  static uint32_t nextTime = 0;
+  static uint32_t rebootTime = 0;
+  if (millis() < nextTime) return;
+  nextTime = millis() + 500;
+  part_job_status_t status;
+  part_job_status(status);
+  if (!install_reboot && (status.state != PART_JOB_FINISHED || status.result != PART_MGR_DONE || status.test_only)) {
+    return;
+  }
+  if (rebootTime == 0) {
+    rebootTime = millis() + ((status.firmware_follows && !install_reboot) ? INSTALL_WAIT_MS : JOB_REBOOT_DELAY_MS);
+  } else if (install_reboot && rebootTime > millis() + JOB_REBOOT_DELAY_MS) {
+    rebootTime = millis() + JOB_REBOOT_DELAY_MS;
+  }
+  if (millis() > rebootTime) {
+    Serial.println(install_reboot ? "Rebooting into the new firmware" : "Rebooting into the new partition table");
+    ESP.restart();
+  }
+}
+
 // main loop function
 void loop() {
   watchdog_loop();
+  job_loop();
   wm.process(); // maintain portal
 }
@@ -2,7 +2,11 @@
 #define MAIN_H
 
 // Include necessary libraries
+#ifdef REPART_HOST
+#include "host_port.h" // Linux build, see host/
+#else
 #include <Arduino.h>
+#endif
 
 // This is what the app partitions will be resized to.
 // Adjust this as needed.
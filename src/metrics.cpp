@@ -0,0 +1,135 @@
+/**
+ * @file metrics.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Per-operation counters & latency histograms, and /metrics.
+ *
+ * Recording is a few adds under a mutex, so it can sit in the flash calls.
+ * Buckets hold plain counts; they're summed up into Prometheus' cumulative
+ * ones only when written out.
+ */
+
+#include "metrics.h"
+#include "out_sink.h"
+#include "part_job.h"
+#include "port_task.h"
+#include "sector_pool.h"
+#include <stdarg.h>
+#ifndef REPART_HOST
+#include "esp_heap_caps.h"
+#endif
+
+// upper bounds, in us: a page program is ~0.7 ms, a sector erase ~45 ms, a block erase ~150 ms
+static const uint32_t _bounds_us[METRIC_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 };
+
+static const char *_op_names[METRIC_OP_COUNT] = {
+    "flash_read", "flash_write", "flash_erase", "flash_map", "web_send", "download" };
+
+typedef struct {
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t sum_us;
+    uint32_t max_us;
+    uint32_t buckets[METRIC_BUCKETS + 1];
+} _metric_t;
+
+static _metric_t _metrics[METRIC_OP_COUNT];
+
+static PortMutex & _metrics_mutex() {
+    static PortMutex mutex;
+    return mutex;
+}
+
+void metrics_record(metric_op_t op, uint32_t bytes, uint32_t us) {
+    int b = 0;
+    while (b < METRIC_BUCKETS && us > _bounds_us[b]) b++;
+    PortLock lock(_metrics_mutex());
+    _metric_t & m = _metrics[op];
+    m.count++;
+    m.bytes += bytes;
+    m.sum_us += us;
+    if (us > m.max_us) m.max_us = us;
+    m.buckets[b]++;
+}
+
+static void _line(OutputSink & out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void _line(OutputSink & out, const char *fmt, ...) {
+    char c_buffer[160];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(c_buffer, sizeof(c_buffer), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(c_buffer) - 1) len = sizeof(c_buffer) - 1;
+    if (len > 0) out.write(c_buffer, len);
+}
+
+// us as seconds, without needing printf's 64 bit or float support
+static void _seconds(char *buf, size_t len, uint64_t us) {
+    snprintf(buf, len, "%u.%06u", (unsigned)(us / 1000000), (unsigned)(us % 1000000));
+}
+
+void metrics_write(OutputSink & out) {
+    _metric_t m[METRIC_OP_COUNT];
+    {
+        PortLock lock(_metrics_mutex());
+        memcpy(m, _metrics, sizeof(m));
+    }
+    char le[16], sum[24];
+    _line(out, "# HELP repart_op_duration_seconds How long flash operations, web sends and downloads took.\n");
+    _line(out, "# TYPE repart_op_duration_seconds histogram\n");
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        uint32_t cumulative = 0;
+        for (int b = 0; b <= METRIC_BUCKETS; b++) {
+            cumulative += m[op].buckets[b];
+            if (b < METRIC_BUCKETS) _seconds(le, sizeof(le), _bounds_us[b]); else strcpy(le, "+Inf");
+            _line(out, "repart_op_duration_seconds_bucket{op=\"%s\",le=\"%s\"} %u\n", _op_names[op], le, cumulative);
+        }
+        _seconds(sum, sizeof(sum), m[op].sum_us);
+        _line(out, "repart_op_duration_seconds_sum{op=\"%s\"} %s\n", _op_names[op], sum);
+        _line(out, "repart_op_duration_seconds_count{op=\"%s\"} %u\n", _op_names[op], m[op].count);
+    }
+    _line(out, "# HELP repart_op_duration_max_seconds The slowest of each since boot.\n");
+    _line(out, "# TYPE repart_op_duration_max_seconds gauge\n");
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        _seconds(sum, sizeof(sum), m[op].max_us);
+        _line(out, "repart_op_duration_max_seconds{op=\"%s\"} %s\n", _op_names[op], sum);
+    }
+    _line(out, "# HELP repart_op_bytes_total Bytes read, written, erased, mapped, sent and downloaded.\n");
+    _line(out, "# TYPE repart_op_bytes_total counter\n");
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        _line(out, "repart_op_bytes_total{op=\"%s\"} %lu\n", _op_names[op], (unsigned long)m[op].bytes);
+    }
+
+#ifndef REPART_HOST
+    _line(out, "# HELP repart_heap_free_bytes Free heap now.\n# TYPE repart_heap_free_bytes gauge\n");
+    _line(out, "repart_heap_free_bytes %u\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    _line(out, "# HELP repart_heap_min_free_bytes Lowest free heap since boot.\n# TYPE repart_heap_min_free_bytes gauge\n");
+    _line(out, "repart_heap_min_free_bytes %u\n", (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    _line(out, "# HELP repart_heap_largest_free_block_bytes Biggest malloc() that would work now.\n"
+               "# TYPE repart_heap_largest_free_block_bytes gauge\n");
+    _line(out, "repart_heap_largest_free_block_bytes %u\n", (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+#endif
+    sector_pool_stats_t pool;
+    sector_pool_stats(pool);
+    _line(out, "# HELP repart_sector_pool_buffers Sector buffers reserved at link time.\n"
+               "# TYPE repart_sector_pool_buffers gauge\n");
+    _line(out, "repart_sector_pool_buffers %u\n", pool.count);
+    _line(out, "# HELP repart_sector_pool_in_use Sector buffers in use now.\n# TYPE repart_sector_pool_in_use gauge\n");
+    _line(out, "repart_sector_pool_in_use %u\n", pool.in_use);
+    _line(out, "# HELP repart_sector_pool_high_water Most sector buffers in use at once.\n"
+               "# TYPE repart_sector_pool_high_water gauge\n");
+    _line(out, "repart_sector_pool_high_water %u\n", pool.high_water);
+    _line(out, "# HELP repart_sector_pool_fallbacks_total Sector buffers that came from the heap, the pool being empty.\n"
+               "# TYPE repart_sector_pool_fallbacks_total counter\n");
+    _line(out, "repart_sector_pool_fallbacks_total %u\n", pool.fallbacks);
+    _line(out, "# HELP repart_sector_pool_failures_total Sector buffers that couldn't be had at all.\n"
+               "# TYPE repart_sector_pool_failures_total counter\n");
+    _line(out, "repart_sector_pool_failures_total %u\n", pool.failures);
+
+    part_job_status_t status;
+    part_job_status(status);
+    _line(out, "# HELP repart_job_running 1 while a repartition job runs.\n# TYPE repart_job_running gauge\n");
+    _line(out, "repart_job_running %u\n", status.state == PART_JOB_RUNNING ? 1 : 0);
+    _line(out, "# HELP repart_uptime_seconds Time since boot.\n# TYPE repart_uptime_seconds gauge\n");
+    _line(out, "repart_uptime_seconds %lu\n", millis() / 1000);
+}
@@ -0,0 +1,28 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Counts, bytes & latency histograms of the slow things: flash operations,
+// sending to the web client, and whole downloads. Kept in RAM since boot, and
+// shown in the Prometheus text format by /metrics along with the heap.
+#include "main.h"
+
+class OutputSink;
+
+typedef enum {
+    METRIC_FLASH_READ = 0,
+    METRIC_FLASH_WRITE,
+    METRIC_FLASH_ERASE,
+    METRIC_FLASH_MAP,
+    METRIC_WEB_SEND,                    /*!< one chunk of a response to the client */
+    METRIC_DOWNLOAD,                    /*!< a whole flash download */
+    METRIC_OP_COUNT,
+} metric_op_t;
+
+#define METRIC_BUCKETS          13      // upper bounds in metrics.cpp, plus +Inf
+
+// one operation of `bytes` that took `us`
+void metrics_record(metric_op_t op, uint32_t bytes, uint32_t us);
+// everything, as Prometheus text exposition format 0.0.4
+void metrics_write(OutputSink & out);
+
+#endif // METRICS_H
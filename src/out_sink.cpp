@@ -0,0 +1,51 @@
+/**
+ * @file out_sink.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Log output helpers.
+ */
+
+#include "out_sink.h"
+
+BufferedSink::BufferedSink(OutputSink & out, out_verbosity_t verbosity)
+    : _out(out), _verbosity(verbosity), _len(0), _first_ms(0), _writes(0) {
+    _buffer = (char *)malloc(OUT_SINK_BUFFER_SIZE);
+}
+
+BufferedSink::~BufferedSink() {
+    flush();
+    free(_buffer);
+}
+
+void BufferedSink::write(const char *str, size_t len) {
+    if (_buffer != NULL && _len + len > OUT_SINK_BUFFER_SIZE) flush();
+    // too big to be worth copying
+    if (_buffer == NULL || len >= OUT_SINK_BUFFER_SIZE) {
+        _out.write(str, len);
+        _writes++;
+        return;
+    }
+    if (_len == 0) _first_ms = millis();
+    memcpy(_buffer + _len, str, len);
+    _len += len;
+    if (millis() - _first_ms >= OUT_SINK_FLUSH_MS) flush();
+}
+
+void BufferedSink::flush() {
+    if (_len > 0) {
+        _out.write(_buffer, _len);
+        _writes++;
+        _len = 0;
+    }
+    _out.flush();
+}
+
+// simple debugging & output display
+void _add_output(OutputSink & ws, const char *str) {
+    ws.write(str, strlen(str));
+    DEBUG_PRINT(str);
+};
+#ifndef REPART_HOST
+void _add_output(OutputSink & ws, const String& str) {
+    _add_output(ws, str.c_str());
+};
+#endif
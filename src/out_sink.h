@@ -0,0 +1,78 @@
+#ifndef OUT_SINK_H
+#define OUT_SINK_H
+
+// Where the human-readable log of a run goes: the web page, or stdout on host.
+#include "main.h"
+#include "metrics.h"
+#ifndef REPART_HOST
+#include "WebServer.h"
+#endif
+
+#define OUT_SINK_BUFFER_SIZE    1024        // BufferedSink collects this much before passing it on
+#define OUT_SINK_FLUSH_MS       500         // ... or until the oldest byte in it is this old
+
+typedef enum {
+    OUT_VERBOSITY_SECTORS = 0,          /*!< moves log every sector's address */
+    OUT_VERBOSITY_SUMMARY,              /*!< moves log a line every 10% */
+} out_verbosity_t;
+
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    virtual void write(const char *str, size_t len) = 0;
+    // work done so far, in bytes of `total`; `phase` is a static string
+    virtual void progress(const char *phase, uint32_t done, uint32_t total) {}
+    // pass on anything held back
+    virtual void flush() {}
+    virtual out_verbosity_t verbosity() { return OUT_VERBOSITY_SECTORS; }
+};
+
+// drops everything; the debug serial still gets it via _add_output()
+class NullSink : public OutputSink {
+public:
+    void write(const char *str, size_t len) override {}
+};
+
+// collects small writes into fewer, bigger ones for the sink behind it. Over
+// the web, every write is a chunk of its own, and each one costs a TCP segment.
+class BufferedSink : public OutputSink {
+public:
+    BufferedSink(OutputSink & out, out_verbosity_t verbosity = OUT_VERBOSITY_SECTORS);
+    ~BufferedSink();
+    void write(const char *str, size_t len) override;
+    void progress(const char *phase, uint32_t done, uint32_t total) override { _out.progress(phase, done, total); }
+    void flush() override;
+    out_verbosity_t verbosity() override { return _verbosity; }
+    uint32_t writes() { return _writes; }
+private:
+    OutputSink & _out;
+    out_verbosity_t _verbosity;
+    char *_buffer;                      // NULL if there was no RAM for it: writes go straight through
+    size_t _len;
+    unsigned long _first_ms;            // when the oldest byte in the buffer came
+    uint32_t _writes;                   // passed on to _out
+};
+
+#ifndef REPART_HOST
+// sends everything as chunked content of the current response; a slow client
+// shows up in the web_send histogram of /metrics
+class WebOutputSink : public OutputSink {
+public:
+    WebOutputSink(std::unique_ptr<WebServer> & ws) : _ws(ws) {}
+    void write(const char *str, size_t len) override {
+        unsigned long time_start = micros();
+        _ws->sendContent(str, len);
+        metrics_record(METRIC_WEB_SEND, len, micros() - time_start);
+    }
+private:
+    std::unique_ptr<WebServer> & _ws;
+};
+#endif
+
+// simple debugging & output display: to the sink and the debug serial
+void _add_output(OutputSink & ws, const char *str);
+#ifndef REPART_HOST
+void _add_output(OutputSink & ws, const String& str);
+#endif
+
+#endif // OUT_SINK_H
@@ -0,0 +1,280 @@
+/**
+ * @file part_install.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Writes an uploaded firmware into the slot a repartition made room for.
+ *
+ * One install at a time, like the job. Each chunk of the upload goes through
+ * a GunzipSink if the upload starts like gzip, then into _SlotWriter: that
+ * fills a sector buffer and writes it out once it's full, erasing a whole 64K
+ * block ahead where one starts (one erase instead of 16) unless the run left
+ * it blank. Nothing but the slot is written until the image checks out; then
+ * otadata, last.
+ */
+
+#include "part_install.h"
+#include "app_image.h"
+#include "flash_dev.h"
+#include "gz_stream.h"
+#include "sector_pool.h"
+#include "utils.h"
+#include <new>
+
+// reading a block is much cheaper than erasing it again
+static bool _blank(uint32_t addr, uint32_t len) {
+    uint32_t handle;
+    const void *mapped = flash_dev().map(addr, len, handle);
+    if (mapped != NULL) {
+        bool blank = is_blank((const uint8_t *)mapped, len);
+        flash_dev().unmap(handle);
+        return blank;
+    }
+    uint8_t chunk[256];
+    for (uint32_t o = 0; o < len; o += sizeof(chunk)) {
+        if (flash_dev().read(addr + o, chunk, sizeof(chunk)) != ESP_OK || !is_blank(chunk, sizeof(chunk))) return false;
+    }
+    return true;
+}
+
+// the slot, from its start, a sector at a time
+class _SlotWriter : public OutputSink {
+public:
+    _SlotWriter(uint32_t address, uint32_t size)
+        : _address(address), _size(size), _fill(0), _written(0), _erased(0),
+          _err(ESP_OK) {
+        if (!_buffer.ok()) _err = ESP_ERR_NO_MEM;
+    }
+    void write(const char *str, size_t len) override {
+        while (len > 0 && _err == ESP_OK) {
+            size_t n = (len < SPI_FLASH_SEC_SIZE - _fill) ? len : SPI_FLASH_SEC_SIZE - _fill;
+            memcpy(_buffer.data() + _fill, str, n);
+            _fill += n;
+            str += n;
+            len -= n;
+            if (_fill == SPI_FLASH_SEC_SIZE) _write_sector();
+        }
+    }
+    // the last, partly filled sector
+    esp_err_t finish() {
+        if (_fill > 0 && _err == ESP_OK) {
+            memset(_buffer.data() + _fill, 0xFF, SPI_FLASH_SEC_SIZE - _fill);
+            _write_sector();
+        }
+        return _err;
+    }
+    esp_err_t err() { return _err; }
+    uint32_t written() { return _written; }
+private:
+    void _write_sector() {
+        uint32_t offset = _written & ~(SPI_FLASH_SEC_SIZE - 1);
+        if (offset >= _size) {
+            _err = ESP_ERR_INVALID_SIZE;
+            return;
+        }
+        if (offset >= _erased) {
+            uint32_t n = SPI_FLASH_SEC_SIZE;
+            if ((_address + offset) % PART_INSTALL_BLOCK_SIZE == 0 && offset + PART_INSTALL_BLOCK_SIZE <= _size) {
+                n = PART_INSTALL_BLOCK_SIZE;
+            }
+            if (!_blank(_address + offset, n)) _err = flash_dev().erase_range(_address + offset, n);
+            _erased = offset + n;
+        }
+        if (_err == ESP_OK) _err = flash_dev().write(_address + offset, _buffer.data(), SPI_FLASH_SEC_SIZE);
+        _written += _fill;
+        _fill = 0;
+    }
+    SectorBuffer _buffer;
+    uint32_t _address, _size;
+    uint32_t _fill;                     // bytes in _buffer
+    uint32_t _written;                  // bytes of the image, in flash or _buffer's worth before it
+    uint32_t _erased;                   // offset the slot's erased up to
+    esp_err_t _err;
+};
+
+static struct {
+    part_entry_t slot;
+    uint32_t received;                  // bytes of upload
+    unsigned long time_start;
+    _SlotWriter *writer;                // NULL = no install going on
+    GunzipSink *gunzip;                 // NULL = not gzip, or not known yet
+} _install;
+
+// the table on flash, on the heap (it's 3K, and the upload handler's stack is
+// small); NULL if there's none, or no memory. free() it.
+static part_table_t *_read_table() {
+    uint8_t *data = (uint8_t *)malloc(PART_TABLE_MAX_SIZE);
+    part_table_t *table = (part_table_t *)malloc(sizeof(part_table_t));
+    char error[64];
+    bool ok = data != NULL && table != NULL && getPartitionTableAddr() != 0 &&
+              flash_dev().read(getPartitionTableAddr(), data, PART_TABLE_MAX_SIZE) == ESP_OK &&
+              part_table_parse_bin(data, PART_TABLE_MAX_SIZE, *table, error, sizeof(error));
+    free(data);
+    if (!ok) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static bool _is_ota(const part_entry_t & e) {
+    return e.type == ESP_PARTITION_TYPE_APP && e.subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 &&
+           e.subtype < ESP_PARTITION_SUBTYPE_APP_OTA_0 + 16;
+}
+
+bool part_install_check(OutputSink & ws, const part_mgr_env_t & env, const part_mgr_opts_t & opts) {
+    if (env.flash_encrypted) {
+        _add_output(ws, "ERROR: Flash encryption is enabled. Can't install the firmware.\n");
+        return false;
+    }
+    if (opts.keep_fs) {
+        _add_output(ws, "ERROR: Kept files wait in the app slot the firmware goes to. "
+                        "Fix partitions with 'Keep files' first, then install.\n");
+        return false;
+    }
+    part_table_t *table = _read_table();
+    if (table == NULL) {
+        _add_output(ws, "ERROR: Partition table not found. Can't continue.\n");
+        return false;
+    }
+    // the run copies a firmware that isn't in the first slot there before it
+    // grows the apps (see part_mgr.cpp), and that copy needs its own reboot
+    int first = -1, running = -1;
+    bool grows = false;
+    for (int i = 0; i < table->count; i++) {
+        const part_entry_t & e = table->entries[i];
+        if (!_is_ota(e)) continue;
+        if (first < 0) first = i;
+        if (e.address == env.running_address) running = i;
+        if ((e.subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0 || e.subtype == ESP_PARTITION_SUBTYPE_APP_OTA_1) &&
+            e.size < RESIZE_APP_PARTITION_SIZE) {
+            grows = true;
+        }
+    }
+    bool ok = false;
+    if (running < 0) {
+        _add_output(ws, "ERROR: Not running from an OTA app slot. Can't install the firmware.\n");
+    } else if (running != first && grows) {
+        char c_buffer[160];
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: Running from %s, which the run moves to %s. "
+                 "Fix partitions first, then install.\n", table->entries[running].label, table->entries[first].label);
+        _add_output(ws, c_buffer);
+    } else {
+        ok = true;
+    }
+    free(table);
+    return ok;
+}
+
+void part_install_abort() {
+    delete _install.gunzip;
+    delete _install.writer;
+    _install.gunzip = NULL;
+    _install.writer = NULL;
+}
+
+// the slot esp_ota_get_next_update_partition() would pick: the next OTA subtype after ours, round
+esp_err_t part_install_begin(OutputSink & ws, const part_mgr_env_t & env) {
+    part_install_abort();
+    part_table_t *table = _read_table();
+    if (table == NULL) {
+        _add_output(ws, "ERROR: Partition table not found. Can't continue.\n");
+        return ESP_ERR_NOT_FOUND;
+    }
+    int running = -1;
+    for (int i = 0; i < table->count; i++) {
+        if (_is_ota(table->entries[i]) && table->entries[i].address == env.running_address) running = i;
+    }
+    const part_entry_t *next = NULL, *lowest = NULL;
+    for (int i = 0; i < table->count && running >= 0; i++) {
+        const part_entry_t & e = table->entries[i];
+        if (!_is_ota(e) || i == running) continue;
+        if (e.subtype > table->entries[running].subtype && (next == NULL || e.subtype < next->subtype)) next = &e;
+        if (lowest == NULL || e.subtype < lowest->subtype) lowest = &e;
+    }
+    if (next == NULL) next = lowest;
+    if (next == NULL) {
+        _add_output(ws, "ERROR: There's no other OTA app slot for the firmware.\n");
+        free(table);
+        return ESP_ERR_NOT_FOUND;
+    }
+    _install.slot = *next;
+    free(table);
+    const part_entry_t & slot = _install.slot;
+    _install.received = 0;
+    _install.time_start = millis();
+    _install.writer = new (std::nothrow) _SlotWriter(slot.address, slot.size);
+    if (_install.writer == NULL || _install.writer->err() != ESP_OK) {
+        _add_output(ws, "ERROR: Out of memory for the firmware upload.\n");
+        part_install_abort();
+        return ESP_ERR_NO_MEM;
+    }
+    char c_buffer[96];
+    snprintf(c_buffer, sizeof(c_buffer), "Installing the firmware to %s at 0x%x (%uK)\n",
+             slot.label, slot.address, slot.size / 1024);
+    _add_output(ws, c_buffer);
+    return ESP_OK;
+}
+
+esp_err_t part_install_write(const uint8_t *data, size_t len) {
+    if (_install.writer == NULL) return ESP_ERR_INVALID_ARG;
+    if (_install.writer->err() != ESP_OK) return _install.writer->err();
+    // app images start with 0xE9, gzip with 0x1F 0x8B
+    if (_install.received == 0 && len > 0 && data[0] == 0x1F) {
+        _install.gunzip = new (std::nothrow) GunzipSink(*_install.writer);
+        if (_install.gunzip == NULL) return ESP_ERR_NO_MEM;
+    }
+    _install.received += len;
+    if (_install.gunzip != NULL) {
+        _install.gunzip->write((const char *)data, len);
+        if (_install.gunzip->error() != NULL) return ESP_ERR_INVALID_ARG;
+    } else {
+        _install.writer->write((const char *)data, len);
+    }
+    return _install.writer->err();
+}
+
+esp_err_t part_install_finish(OutputSink & ws) {
+    if (_install.writer == NULL) return ESP_ERR_INVALID_ARG;
+    char c_buffer[160];
+    const part_entry_t & slot = _install.slot;
+    esp_err_t err = ESP_OK;
+    if (_install.gunzip != NULL && !_install.gunzip->finish()) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: The upload isn't a good gzip file: %s.\n", _install.gunzip->error());
+        _add_output(ws, c_buffer);
+        err = ESP_ERR_INVALID_ARG;
+    }
+    if (err == ESP_OK) err = _install.writer->finish();
+    if (err == ESP_ERR_INVALID_SIZE) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: The firmware doesn't fit in %s (%uK).\n", slot.label, slot.size / 1024);
+        _add_output(ws, c_buffer);
+    } else if (err != ESP_OK && err != ESP_ERR_INVALID_ARG) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to write the firmware: 0x%x\n", err);
+        _add_output(ws, c_buffer);
+    }
+    if (err == ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Firmware written: %u bytes from a %u byte%s upload in %lu ms\n",
+                 _install.writer->written(), _install.received, _install.gunzip ? " gzip" : "",
+                 millis() - _install.time_start);
+        _add_output(ws, c_buffer);
+        err = app_image_verify(slot.address, slot.size);
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "ERROR: The firmware isn't a valid app image (0x%x).\n", err);
+            _add_output(ws, c_buffer);
+        }
+    }
+    if (err == ESP_OK) {
+        _add_output(ws, "Firmware checks out: OK\n");
+        err = app_image_set_boot(slot.address);
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to make %s boot: 0x%x\n", slot.label, err);
+            _add_output(ws, c_buffer);
+        }
+    }
+    if (err == ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Boots from %s from now on: OK\n", slot.label);
+        _add_output(ws, c_buffer);
+    } else {
+        _add_output(ws, "The firmware that's running now still boots; upload the new one again.\n");
+    }
+    part_install_abort();
+    return err;
+}
@@ -0,0 +1,24 @@
+#ifndef PART_INSTALL_H
+#define PART_INSTALL_H
+
+// The firmware upload of /partition-install, written into the app slot a
+// repartition just made room for, so one reboot goes straight into it. The
+// upload is gunzipped on the way if it's gzip, written a sector at a time,
+// checked like the bootloader checks it, and only then made the one that boots.
+#include "part_mgr.h"
+
+#define PART_INSTALL_BLOCK_SIZE 0x10000 // erased a block at a time where that's aligned
+
+// before the run: whether the firmware can go in right after it; false + log
+// if not (the run would move the running app, or keep files in the slot)
+bool part_install_check(OutputSink & ws, const part_mgr_env_t & env, const part_mgr_opts_t & opts);
+// after the run: find the slot after the running one in the table on flash, and get ready to write it
+esp_err_t part_install_begin(OutputSink & ws, const part_mgr_env_t & env);
+// the next piece of the upload; once one fails, the rest are dropped
+esp_err_t part_install_write(const uint8_t *data, size_t len);
+// the end of the upload: check the image and boot it from now on. Logs either way.
+esp_err_t part_install_finish(OutputSink & ws);
+// the upload broke off; the slot isn't booted
+void part_install_abort();
+
+#endif // PART_INSTALL_H
@@ -0,0 +1,218 @@
+/**
+ * @file part_job.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Background repartition job, with a shared log & progress.
+ *
+ * There's only ever one job. Its task writes the log & progress through
+ * _JobSink; readers take the same mutex and copy out what they need, so
+ * nobody holds it for longer than a memcpy.
+ */
+
+#include "part_job.h"
+#include "port_task.h"
+
+static struct {
+    part_job_state_t state;
+    part_mgr_result_t result;
+    bool test_only;
+    bool firmware_follows;
+    const char *phase;
+    uint32_t done, total;               // bytes
+    uint32_t work_start_done;           // done at the first progress report
+    unsigned long work_start_us;
+    unsigned long time_start, time_end; // ms
+    uint32_t log_start;                 // where this job's log starts
+    uint32_t log_end;                   // absolute; the ring has the last PART_JOB_LOG_SIZE bytes
+    char log[PART_JOB_LOG_SIZE];
+    // the job's input, owned by us while it runs
+    part_mgr_env_t env;
+    part_mgr_opts_t opts;
+    uint8_t *target;
+    size_t target_len;
+    part_mgr_report_t *report;          // kept from the first job on; NULL if there was no RAM
+} _job;
+
+static PortMutex & _job_mutex() {
+    static PortMutex mutex;
+    return mutex;
+}
+
+// the job task's output: into the ring & the progress fields
+class _JobSink : public OutputSink {
+public:
+    out_verbosity_t verbosity() override { return _job.opts.verbosity; }
+    void write(const char *str, size_t len) override {
+        PortLock lock(_job_mutex());
+        // only the tail fits anyway
+        if (len > PART_JOB_LOG_SIZE) {
+            _job.log_end += len - PART_JOB_LOG_SIZE;
+            str += len - PART_JOB_LOG_SIZE;
+            len = PART_JOB_LOG_SIZE;
+        }
+        while (len > 0) {
+            size_t pos = _job.log_end % PART_JOB_LOG_SIZE;
+            size_t n = (len < PART_JOB_LOG_SIZE - pos) ? len : PART_JOB_LOG_SIZE - pos;
+            memcpy(_job.log + pos, str, n);
+            _job.log_end += n;
+            str += n;
+            len -= n;
+        }
+    }
+    void progress(const char *phase, uint32_t done, uint32_t total) override {
+        PortLock lock(_job_mutex());
+        if (_job.work_start_us == 0) {
+            _job.work_start_us = micros() | 1;
+            _job.work_start_done = done;
+        }
+        _job.phase = phase;
+        _job.done = done;
+        _job.total = total;
+    }
+};
+
+static void _job_task(void *arg) {
+    _JobSink out;
+    part_mgr_result_t result = (_job.target != NULL) ?
+        partition_mgr_target(out, _job.env, _job.opts, _job.target, _job.target_len, _job.test_only) :
+        partition_mgr_run(out, _job.env, _job.opts, _job.test_only);
+    free(_job.target);
+    _job.target = NULL;
+#ifndef REPART_HOST
+    // the loop reboots a little later, so the clients still see this
+    if (result == PART_MGR_DONE && !_job.test_only && !_job.firmware_follows) {
+        _add_output(out, "READY! After reboot, upload the firmware that you need.\n\n");
+        _add_output(out, "Rebooting in a few seconds...\n");
+    }
+#endif
+
+    PortLock lock(_job_mutex());
+    _job.result = result;
+    _job.phase = PART_JOB_PHASE_DONE;
+    _job.time_end = millis();
+    _job.state = PART_JOB_FINISHED;
+}
+
+bool part_job_start(const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                    const uint8_t *target, size_t target_len, bool test_only,
+                    bool firmware_follows) {
+    uint8_t *target_copy = NULL;
+    if (target != NULL) {
+        target_copy = (uint8_t *)malloc(target_len);
+        if (target_copy == NULL) return false;
+        memcpy(target_copy, target, target_len);
+    }
+    {
+        PortLock lock(_job_mutex());
+        if (_job.state == PART_JOB_RUNNING) {
+            free(target_copy);
+            return false;
+        }
+        if (_job.report == NULL) _job.report = (part_mgr_report_t *)malloc(sizeof(part_mgr_report_t));
+        _job.state = PART_JOB_RUNNING;
+        _job.result = PART_MGR_FAILED;
+        _job.test_only = test_only;
+        _job.firmware_follows = firmware_follows;
+        _job.phase = PART_JOB_PHASE_PLANNING;
+        _job.done = _job.total = 0;
+        _job.work_start_done = 0;
+        _job.work_start_us = 0;
+        _job.time_start = millis();
+        _job.time_end = 0;
+        // the log keeps counting up, so a client of the last job doesn't mistake this one's for old
+        _job.log_start = _job.log_end;
+        _job.env = env;
+        _job.opts = opts;
+        _job.opts.report = _job.report;
+        _job.target = target_copy;
+        _job.target_len = target_len;
+    }
+    if (!port_task_start(_job_task, NULL, "repart_job", PART_JOB_STACK_SIZE, PART_JOB_CORE)) {
+        PortLock lock(_job_mutex());
+        free(_job.target);
+        _job.target = NULL;
+        _job.state = PART_JOB_IDLE;
+        return false;
+    }
+    return true;
+}
+
+bool part_job_busy() {
+    PortLock lock(_job_mutex());
+    return _job.state == PART_JOB_RUNNING;
+}
+
+void part_job_status(part_job_status_t & status) {
+    PortLock lock(_job_mutex());
+    status.state = _job.state;
+    status.result = _job.result;
+    status.test_only = _job.test_only;
+    status.firmware_follows = _job.firmware_follows;
+    status.phase = (_job.state == PART_JOB_IDLE) ? "idle" : _job.phase;
+    status.sectors_done = _job.done / SPI_FLASH_SEC_SIZE;
+    status.sectors_total = _job.total / SPI_FLASH_SEC_SIZE;
+    status.bytes_per_s = 0;
+    status.eta_s = 0;
+    if (_job.work_start_us != 0 && _job.done > _job.work_start_done) {
+        uint64_t us = (uint64_t)(micros() - _job.work_start_us);
+        if (us > 0) {
+            uint64_t rate = (uint64_t)(_job.done - _job.work_start_done) * 1000000 / us;
+            status.bytes_per_s = (uint32_t)rate;
+            if (rate > 0 && _job.state == PART_JOB_RUNNING) {
+                status.eta_s = (uint32_t)((uint64_t)(_job.total - _job.done) / rate);
+            }
+        }
+    }
+    status.elapsed_ms = (_job.state == PART_JOB_IDLE) ? 0 :
+        ((_job.state == PART_JOB_FINISHED) ? _job.time_end : millis()) - _job.time_start;
+    status.log_start = _job.log_start;
+    status.log_end = _job.log_end;
+}
+
+part_mgr_report_t *part_job_report() {
+    PortLock lock(_job_mutex());
+    if (_job.state != PART_JOB_FINISHED || _job.report == NULL) return NULL;
+    part_mgr_report_t *report = (part_mgr_report_t *)malloc(sizeof(part_mgr_report_t));
+    if (report != NULL) memcpy(report, _job.report, sizeof(part_mgr_report_t));
+    return report;
+}
+
+size_t part_job_log(uint32_t & from, char *buf, size_t len) {
+    PortLock lock(_job_mutex());
+    if (from > _job.log_end) from = _job.log_end; // from an earlier boot
+    if (_job.log_end - from > PART_JOB_LOG_SIZE) from = _job.log_end - PART_JOB_LOG_SIZE;
+    size_t copied = 0;
+    while (copied < len && from < _job.log_end) {
+        size_t pos = from % PART_JOB_LOG_SIZE;
+        size_t n = _job.log_end - from;
+        if (n > PART_JOB_LOG_SIZE - pos) n = PART_JOB_LOG_SIZE - pos;
+        if (n > len - copied) n = len - copied;
+        memcpy(buf + copied, _job.log + pos, n);
+        copied += n;
+        from += n;
+    }
+    return copied;
+}
+
+OutputSink & part_job_out() {
+    static _JobSink out;
+    return out;
+}
+
+const char *part_job_state_name(part_job_state_t state) {
+    switch (state) {
+        case PART_JOB_IDLE: return "idle";
+        case PART_JOB_RUNNING: return "running";
+        case PART_JOB_FINISHED: return "finished";
+    }
+    return "?";
+}
+
+const char *part_job_result_name(part_mgr_result_t result) {
+    switch (result) {
+        case PART_MGR_FAILED: return "failed";
+        case PART_MGR_UNNECESSARY: return "unnecessary";
+        case PART_MGR_TESTED: return "tested";
+        case PART_MGR_DONE: return "done";
+    }
+    return "?";
+}
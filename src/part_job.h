@@ -0,0 +1,58 @@
+#ifndef PART_JOB_H
+#define PART_JOB_H
+
+// Runs a repartition in its own task, so the web server keeps going. The log
+// goes to a ring buffer and progress is kept here; any number of clients can
+// poll both while the job runs, and read the outcome afterwards.
+#include "part_mgr.h"
+
+#define PART_JOB_LOG_SIZE       8192        // log ring; clients that fall further behind miss lines
+#define PART_JOB_STACK_SIZE     12288
+#define PART_JOB_CORE           1           // same core as the Arduino loop, WiFi keeps core 0
+
+// phases besides the MOVE_PHASE_* ones
+#define PART_JOB_PHASE_PLANNING "planning"
+#define PART_JOB_PHASE_DONE     "done"
+
+typedef enum {
+    PART_JOB_IDLE = 0,                  /*!< nothing started since boot */
+    PART_JOB_RUNNING,                   /*!< the task is working on it */
+    PART_JOB_FINISHED,                  /*!< over; see result */
+} part_job_state_t;
+
+typedef struct {
+    part_job_state_t state;
+    part_mgr_result_t result;           /*!< once finished */
+    bool test_only;                     /*!< a dry run */
+    bool firmware_follows;              /*!< a firmware upload comes once it's done */
+    const char *phase;                  /*!< what it's doing now */
+    uint32_t sectors_done;              /*!< of all moves & erases, resumed ones included */
+    uint32_t sectors_total;
+    uint32_t bytes_per_s;               /*!< since the flash work started; 0 if unknown */
+    uint32_t eta_s;                     /*!< 0 if unknown */
+    uint32_t elapsed_ms;                /*!< since the job started, or how long it took */
+    uint32_t log_start;                 /*!< log offset where this job's log starts */
+    uint32_t log_end;                   /*!< log offset after the last byte so far */
+} part_job_status_t;
+
+// start a job in the background: partition_mgr_target() if target is set,
+// else partition_mgr_run(). Options & target are copied. False if a job is
+// still running or the task can't be started. With firmware_follows, the log
+// doesn't ask for a firmware upload at the end: one is coming (part_install.h).
+bool part_job_start(const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                    const uint8_t *target, size_t target_len, bool test_only,
+                    bool firmware_follows = false);
+bool part_job_busy();
+void part_job_status(part_job_status_t & status);
+// a copy of what the last job did, once it's finished; NULL before that, or
+// without the RAM for one. free() it. The next job can start while it's used.
+part_mgr_report_t *part_job_report();
+// copy log bytes from offset `from` on, up to len; `from` is moved up to what
+// the ring still has, and past what was copied. Returns the byte count.
+size_t part_job_log(uint32_t & from, char *buf, size_t len);
+// the job's log, for what follows the job once it's finished; clients see it as more of the same
+OutputSink & part_job_out();
+const char *part_job_state_name(part_job_state_t state);
+const char *part_job_result_name(part_mgr_result_t result);
+
+#endif // PART_JOB_H
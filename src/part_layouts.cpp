@@ -0,0 +1,226 @@
+/**
+ * @file part_layouts.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief The layouts in partitions/, as CSVs, checked & planned by the compiler.
+ *
+ * Each table here is its CSV, entry for entry (partition_bench checks they
+ * still encode to the same bytes). The static_asserts below are the checks
+ * that used to be "flash it & see" in platformio.ini: sane tables, plans that
+ * come out the way the comments there say, and candidate layouts that are
+ * sane tables too. What ships is the result: a name, a plan & an MD5 each.
+ */
+
+#include "part_layouts.h"
+
+#define _NVS        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS
+#define _OTADATA    ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA
+#define _COREDUMP   ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP
+#define _UNDEFINED  ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED
+#define _FAT        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT
+#define _SPIFFS     ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS
+#define _FACTORY    ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY
+#define _OTA_0      ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0
+#define _OTA_1      ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1
+
+static constexpr layout_part_t _default_4mb[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x140000,  "app0",       0},
+    {_OTA_1,     0x150000,  0x140000,  "app1",       0},
+    {_SPIFFS,    0x290000,  0x160000,  "spiffs",     0},
+    {_COREDUMP,  0x3F0000,  0x10000,   "coredump",   0},
+};
+
+static constexpr layout_part_t _huge_app[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x300000,  "app0",       0},
+    {_SPIFFS,    0x310000,  0xE0000,   "spiffs",     0},
+    {_COREDUMP,  0x3F0000,  0x10000,   "coredump",   0},
+};
+
+static constexpr layout_part_t _many_data_16mb[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x140000,  "app0",       0},
+    {_OTA_1,     0x150000,  0x140000,  "app1",       0},
+    {_FAT,       0x290000,  0x40000,   "log00",      0},
+    {_SPIFFS,    0x2D0000,  0x40000,   "log01",      0},
+    {_NVS,       0x310000,  0x40000,   "log02",      0},
+    {_UNDEFINED, 0x350000,  0x40000,   "log03",      0},
+    {_FAT,       0x390000,  0x40000,   "log04",      0},
+    {_SPIFFS,    0x3D0000,  0x40000,   "log05",      0},
+    {_FAT,       0x410000,  0x100000,  "media0",     0},
+    {_UNDEFINED, 0x510000,  0x40000,   "log07",      0},
+    {_FAT,       0x550000,  0x40000,   "log08",      0},
+    {_SPIFFS,    0x590000,  0x40000,   "log09",      0},
+    {_NVS,       0x5D0000,  0x40000,   "log10",      0},
+    {_UNDEFINED, 0x610000,  0x40000,   "log11",      0},
+    {_FAT,       0x650000,  0x40000,   "log12",      0},
+    {_FAT,       0x690000,  0x100000,  "media1",     0},
+    {_NVS,       0x790000,  0x40000,   "log14",      0},
+    {_UNDEFINED, 0x7D0000,  0x40000,   "log15",      0},
+    {_FAT,       0x810000,  0x40000,   "log16",      0},
+    {_SPIFFS,    0x850000,  0x40000,   "log17",      0},
+    {_NVS,       0x890000,  0x40000,   "log18",      0},
+    {_UNDEFINED, 0x8D0000,  0x40000,   "log19",      0},
+    {_FAT,       0x910000,  0x100000,  "media2",     0},
+    {_SPIFFS,    0xA10000,  0x40000,   "log21",      0},
+    {_NVS,       0xA50000,  0x40000,   "log22",      0},
+    {_UNDEFINED, 0xA90000,  0x40000,   "log23",      0},
+    {_FAT,       0xAD0000,  0x40000,   "log24",      0},
+    {_SPIFFS,    0xB10000,  0x40000,   "log25",      0},
+    {_NVS,       0xB50000,  0x40000,   "log26",      0},
+    {_FAT,       0xB90000,  0x100000,  "media3",     0},
+    {_FAT,       0xC90000,  0x360000,  "storage",    0},
+    {_COREDUMP,  0xFF0000,  0x10000,   "coredump",   0},
+};
+
+static constexpr layout_part_t _max_app_4mb[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_FACTORY,   0x10000,   0x3E0000,  "app0",       0},
+    {_COREDUMP,  0x3F0000,  0x10000,   "coredump",   0},
+};
+
+static constexpr layout_part_t _min_spiffs[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x1E0000,  "app0",       0},
+    {_OTA_1,     0x1F0000,  0x1E0000,  "app1",       0},
+    {_SPIFFS,    0x3D0000,  0x20000,   "spiffs",     0},
+    {_COREDUMP,  0x3F0000,  0x10000,   "coredump",   0},
+};
+
+static constexpr layout_part_t _nofs[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x140000,  "app0",       0},
+    {_OTA_1,     0x200000,  0x140000,  "app1",       0},
+    {_COREDUMP,  0x3F0000,  0x10000,   "coredump",   0},
+};
+
+static constexpr layout_part_t _previous[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x140000,  "app0",       0},
+    {_OTA_1,     0x150000,  0x140000,  "app1",       0},
+    {_SPIFFS,    0x290000,  0x170000,  "spiffs",     0},
+};
+
+static constexpr layout_part_t _tinyuf2[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x160000,  "ota_0",      0},
+    {_OTA_1,     0x170000,  0x160000,  "ota_1",      0},
+    {_FACTORY,   0x2D0000,  0x40000,   "uf2",        0},
+    {_FAT,       0x310000,  0xF0000,   "ffat",       0},
+};
+
+static constexpr layout_part_t _zigbee[] = {
+    {_NVS,       0x9000,    0x5000,    "nvs",        0},
+    {_OTADATA,   0xE000,    0x2000,    "otadata",    0},
+    {_OTA_0,     0x10000,   0x140000,  "app0",       0},
+    {_OTA_1,     0x150000,  0x140000,  "app1",       0},
+    {_SPIFFS,    0x290000,  0x15B000,  "spiffs",     0},
+    {_FAT,       0x3EB000,  0x4000,    "zb_storage", 0},
+    {_FAT,       0x3EF000,  0x1000,    "zb_fct",     0},
+    {_COREDUMP,  0x3F0000,  0x10000,   "coredump",   0},
+};
+
+#define _LAYOUT(name, flash_size, expect) \
+    {#name, flash_size, _##name, sizeof(_##name) / sizeof(_##name[0]), expect}
+
+// expectations as in platformio.ini
+static constexpr layout_t _layouts[] = {
+    _LAYOUT(default_4mb,    0x400000,  LAYOUT_RESIZE),
+    _LAYOUT(huge_app,       0x400000,  LAYOUT_ONE_APP),
+    _LAYOUT(many_data_16mb, 0x1000000, LAYOUT_RESIZE),
+    _LAYOUT(max_app_4mb,    0x400000,  LAYOUT_ONE_APP),
+    _LAYOUT(min_spiffs,     0x400000,  LAYOUT_UNNECESSARY),
+    _LAYOUT(nofs,           0x400000,  LAYOUT_NO_ROOM),
+    _LAYOUT(previous,       0x400000,  LAYOUT_RESIZE),
+    _LAYOUT(tinyuf2,        0x400000,  LAYOUT_RESIZE),
+    _LAYOUT(zigbee,         0x400000,  LAYOUT_RESIZE),
+};
+
+#define _LAYOUT_COUNT ((int)(sizeof(_layouts) / sizeof(_layouts[0])))
+
+static constexpr layout_known_t _known[] = {
+    layout_evaluate(_layouts[0]), layout_evaluate(_layouts[1]), layout_evaluate(_layouts[2]),
+    layout_evaluate(_layouts[3]), layout_evaluate(_layouts[4]), layout_evaluate(_layouts[5]),
+    layout_evaluate(_layouts[6]), layout_evaluate(_layouts[7]), layout_evaluate(_layouts[8]),
+};
+static_assert(sizeof(_known) / sizeof(_known[0]) == _LAYOUT_COUNT, "every layout needs its layout_evaluate()");
+
+// every candidate a layout has is a sane table, with the first grown app in place
+constexpr bool _plans_ok(const layout_known_t &k) {
+    for (int n = 0; n < k.plan.count; n++) {
+        if (!layout_plan_ok(*k.layout, k.plan, n)) return false;
+    }
+    return true;
+}
+
+constexpr bool _aligned(const layout_known_t &k) { return layout_aligned(k.layout->parts, k.layout->count); }
+constexpr bool _in_order(const layout_known_t &k) { return layout_in_order(k.layout->parts, k.layout->count); }
+constexpr bool _fits(const layout_known_t &k) {
+    return layout_fits(k.layout->parts, k.layout->count, k.layout->flash_size);
+}
+constexpr bool _labels_ok(const layout_known_t &k) { return layout_labels_ok(k.layout->parts, k.layout->count); }
+
+#define _CHECK(i, file) \
+    static_assert(layout_label_eq(_known[i].layout->name, #file), #file ": not layout " #i); \
+    static_assert(_aligned(_known[i]), #file ": a partition isn't aligned"); \
+    static_assert(_in_order(_known[i]), #file ": partitions out of order, overlapping or over the table"); \
+    static_assert(_fits(_known[i]), #file ": doesn't fit its flash or the table"); \
+    static_assert(_labels_ok(_known[i]), #file ": a label's too long, empty or used twice"); \
+    static_assert(_known[i].plan.outcome == _known[i].layout->expect, #file ": doesn't plan as expected"); \
+    static_assert(_plans_ok(_known[i]), #file ": a candidate layout isn't a sane table")
+
+_CHECK(0, default_4mb);
+_CHECK(1, huge_app);
+_CHECK(2, many_data_16mb);
+_CHECK(3, max_app_4mb);
+_CHECK(4, min_spiffs);
+_CHECK(5, nofs);
+_CHECK(6, previous);
+_CHECK(7, tinyuf2);
+_CHECK(8, zigbee);
+
+// and what the platformio.ini comments say in words
+static_assert(_known[0].plan.candidates[0].strategy == LAYOUT_SHRINK_BIGGEST &&
+              _known[0].plan.candidates[0].shrink_index == 4, "default_4mb: spiffs gives up the space");
+static_assert(_known[7].plan.count == 1 && _known[7].plan.candidates[0].shrink_index == 5,
+              "tinyuf2: ffat gives up the space, uf2 & ffat move");
+static_assert(_known[5].plan.size_delta == 0x80000 && _known[5].plan.count == 0, "nofs: too small data");
+
+const layout_known_t *layout_known(int i) {
+    return (i >= 0 && i < _LAYOUT_COUNT) ? &_known[i] : NULL;
+}
+
+const layout_known_t *layout_find(const uint8_t *md5) {
+    for (const layout_known_t &k : _known) {
+        if (memcmp(k.md5.bytes, md5, sizeof(k.md5.bytes)) == 0) return &k;
+    }
+    return NULL;
+}
+
+const layout_known_t *layout_find_name(const char *name) {
+    size_t len = strlen(name);
+    if (len > 4 && strcmp(name + len - 4, ".csv") == 0) len -= 4;
+    for (const layout_known_t &k : _known) {
+        if (strlen(k.layout->name) == len && strncmp(k.layout->name, name, len) == 0) return &k;
+    }
+    return NULL;
+}
+
+const char *layout_outcome_name(layout_outcome_t outcome) {
+    switch (outcome) {
+    case LAYOUT_RESIZE: return "apps grow";
+    case LAYOUT_UNNECESSARY: return "apps are big enough";
+    case LAYOUT_ONE_APP: return "fails, only one app";
+    case LAYOUT_TOO_FEW: return "fails, too few partitions";
+    case LAYOUT_NO_ROOM: return "fails, too small data";
+    }
+    return "?";
+}
@@ -0,0 +1,323 @@
+#ifndef PART_LAYOUTS_H
+#define PART_LAYOUTS_H
+
+// Partition layouts as compile-time constants. Everything here is constexpr:
+// a layout encodes to the same bytes part_table_encode() writes (entries, then
+// the MD5 entry), and plans the way plan_layouts() does as far as that goes
+// without the flash: which candidates there are, and where each one puts every
+// partition. Which candidate is cheapest depends on how full the partitions
+// are and how fast this chip erases, so that's still picked at run time.
+// The known layouts (partitions/*.csv) are in part_layouts.cpp, each with
+// static_asserts; one that's broken, or plans differently than expected,
+// doesn't build.
+#include "part_table.h"
+
+#define LAYOUT_TABLE_ADDR 0x8000 // where the known layouts have their table
+
+typedef struct {
+    uint8_t type;
+    uint8_t subtype;
+    uint32_t address;
+    uint32_t size;
+    const char *label;
+    uint32_t flags;
+} layout_part_t;
+
+// what partition_mgr_run() makes of a layout, running from the first OTA slot
+typedef enum {
+    LAYOUT_RESIZE,                      /*!< the apps grow */
+    LAYOUT_UNNECESSARY,                 /*!< they're big enough already */
+    LAYOUT_ONE_APP,                     /*!< fails: no second OTA slot */
+    LAYOUT_TOO_FEW,                     /*!< fails: needs 2+ app, 1+ data partitions */
+    LAYOUT_NO_ROOM,                     /*!< fails: no data partition can give up the space */
+} layout_outcome_t;
+
+// plan_strategy_name() order
+typedef enum {
+    LAYOUT_SHRINK_BIGGEST,
+    LAYOUT_SHRINK_OTHER,
+    LAYOUT_FREE_SPACE,
+} layout_strategy_t;
+
+typedef struct {
+    const char *name;                   /*!< partitions/<name>.csv */
+    uint32_t flash_size;
+    const layout_part_t *parts;
+    int count;
+    layout_outcome_t expect;            /*!< what it's known to do (see platformio.ini) */
+} layout_t;
+
+typedef struct {
+    layout_strategy_t strategy;
+    int shrink_index;                   /*!< as in plan_candidate_t */
+} layout_candidate_t;
+
+typedef struct {
+    layout_outcome_t outcome;
+    uint32_t size_delta;
+    int first_app_index;
+    int count;                          /*!< candidates, in the order plan_layouts() proposes them */
+    layout_candidate_t candidates[PLAN_MAX_CANDIDATES];
+} layout_plan_t;
+
+typedef struct {
+    uint8_t bytes[16];
+} layout_md5_t;
+
+typedef struct {
+    uint8_t data[PART_TABLE_MAX_SIZE];  /*!< 0xFF after the MD5 entry */
+    int len;                            /*!< entries & MD5 entry */
+} layout_bin_t;
+
+// a known layout with what the build worked out for it
+typedef struct {
+    const layout_t *layout;
+    layout_plan_t plan;
+    layout_md5_t md5;                   /*!< of its table, as in the MD5 entry */
+} layout_known_t;
+
+constexpr int layout_label_len(const char *label) {
+    int n = 0;
+    while (label[n] != '\0') n++;
+    return n;
+}
+
+constexpr bool layout_label_eq(const char *a, const char *b) {
+    int n = 0;
+    while (a[n] != '\0' && a[n] == b[n]) n++;
+    return a[n] == b[n];
+}
+
+constexpr bool layout_is_ota(const layout_part_t &p) {
+    return p.type == ESP_PARTITION_TYPE_APP && p.subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 &&
+           p.subtype < ESP_PARTITION_SUBTYPE_APP_OTA_0 + 16;
+}
+
+// same as _is_grown_app() in part_plan.cpp
+constexpr bool layout_is_grown_app(const layout_part_t &p) {
+    return p.type == ESP_PARTITION_TYPE_APP &&
+           (p.subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0 || p.subtype == ESP_PARTITION_SUBTYPE_APP_OTA_1) &&
+           p.size < RESIZE_APP_PARTITION_SIZE;
+}
+
+// apps on 64K, everything else on 4K, sizes in whole sectors
+constexpr bool layout_aligned(const layout_part_t *parts, int count) {
+    for (int i = 0; i < count; i++) {
+        uint32_t align = (parts[i].type == ESP_PARTITION_TYPE_APP) ? 0x10000 : SPI_FLASH_SEC_SIZE;
+        if (parts[i].size == 0 || parts[i].address % align != 0 || parts[i].size % SPI_FLASH_SEC_SIZE != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// in address order, after the table, none overlapping the one before
+constexpr bool layout_in_order(const layout_part_t *parts, int count) {
+    uint64_t end = LAYOUT_TABLE_ADDR + SPI_FLASH_SEC_SIZE;
+    for (int i = 0; i < count; i++) {
+        if (parts[i].address < end) return false;
+        end = (uint64_t)parts[i].address + parts[i].size;
+    }
+    return true;
+}
+
+// inside the flash, and few enough for the table
+constexpr bool layout_fits(const layout_part_t *parts, int count, uint32_t flash_size) {
+    if (count < 1 || (count + 1) * PART_TABLE_ENTRY_SIZE > PART_TABLE_MAX_SIZE) return false;
+    for (int i = 0; i < count; i++) {
+        if ((uint64_t)parts[i].address + parts[i].size > flash_size) return false;
+    }
+    return true;
+}
+
+// 1-16 characters (the table has no room for a terminator), none used twice
+constexpr bool layout_labels_ok(const layout_part_t *parts, int count) {
+    for (int i = 0; i < count; i++) {
+        int len = layout_label_len(parts[i].label);
+        if (len == 0 || len > 16) return false;
+        for (int j = 0; j < i; j++) {
+            if (layout_label_eq(parts[i].label, parts[j].label)) return false;
+        }
+    }
+    return true;
+}
+
+constexpr bool layout_check(const layout_t &l) {
+    return layout_aligned(l.parts, l.count) && layout_in_order(l.parts, l.count) &&
+           layout_fits(l.parts, l.count, l.flash_size) && layout_labels_ok(l.parts, l.count);
+}
+
+// where a plan that takes size_delta from partition `shrink` (-1: from the free
+// space at the end) puts partition i: partitions up to that one shift up by the
+// growth before them, those after it by that less size_delta. See _plan_walk().
+constexpr layout_part_t layout_place(const layout_part_t *parts, int count, uint32_t size_delta, int shrink, int i) {
+    int64_t growth = 0;
+    for (int j = 0; j < i && j < count; j++) {
+        if (layout_is_grown_app(parts[j])) growth += (int64_t)RESIZE_APP_PARTITION_SIZE - parts[j].size;
+    }
+    int64_t offset = (shrink >= 0 && i > shrink) ? growth - size_delta : growth;
+    layout_part_t p = parts[i];
+    p.address = (uint32_t)((int64_t)p.address + offset);
+    if (layout_is_grown_app(parts[i])) p.size = RESIZE_APP_PARTITION_SIZE;
+    if (i == shrink) p.size -= size_delta;
+    // a partition that'd start below 0 lands past any flash, so it doesn't fit either
+    if ((int64_t)parts[i].address + offset < 0) p.address = 0xFFFFFFFF;
+    return p;
+}
+
+constexpr bool layout_place_fits(const layout_part_t *parts, int count, uint32_t flash_size, uint32_t size_delta,
+                                 int shrink) {
+    for (int i = 0; i < count; i++) {
+        layout_part_t p = layout_place(parts, count, size_delta, shrink, i);
+        if ((uint64_t)p.address + p.size > flash_size) return false;
+    }
+    return true;
+}
+
+// plan_layouts(), without the costs: every candidate that fits, in the order it proposes them
+constexpr layout_plan_t layout_plan(const layout_part_t *parts, int count, uint32_t flash_size) {
+    layout_plan_t plan = {};
+    plan.first_app_index = -1;
+    int ota_count = 0, app_count = 0, data_count = 0, biggest = -1;
+    for (int i = 0; i < count; i++) {
+        if (layout_is_ota(parts[i])) ota_count++;
+        if (parts[i].type == ESP_PARTITION_TYPE_APP) app_count++;
+        if (parts[i].type == ESP_PARTITION_TYPE_DATA) {
+            data_count++;
+            if (biggest < 0 || parts[i].size > parts[biggest].size) biggest = i;
+        }
+        if (layout_is_grown_app(parts[i])) {
+            plan.size_delta += RESIZE_APP_PARTITION_SIZE - parts[i].size;
+            if (plan.first_app_index < 0) plan.first_app_index = i;
+        }
+    }
+    if (ota_count < 2) {
+        plan.outcome = LAYOUT_ONE_APP;
+        return plan;
+    }
+    if (app_count < 2 || data_count < 1) {
+        plan.outcome = LAYOUT_TOO_FEW;
+        return plan;
+    }
+    if (plan.size_delta == 0) {
+        plan.outcome = LAYOUT_UNNECESSARY;
+        return plan;
+    }
+    // shrink-biggest, then shrink-other in table order, then free-space; see _can_shrink()
+    for (int pass = 0; pass < 3; pass++) {
+        for (int i = (pass == 2) ? -1 : 0; i < ((pass == 2) ? 0 : count); i++) {
+            if (pass < 2 && ((i == biggest) != (pass == 0) || i <= plan.first_app_index ||
+                             parts[i].type != ESP_PARTITION_TYPE_DATA || parts[i].size <= plan.size_delta)) {
+                continue;
+            }
+            if (plan.count < PLAN_MAX_CANDIDATES && layout_place_fits(parts, count, flash_size, plan.size_delta, i)) {
+                plan.candidates[plan.count++] = {(layout_strategy_t)pass, i};
+            }
+        }
+    }
+    plan.outcome = (plan.count > 0) ? LAYOUT_RESIZE : LAYOUT_NO_ROOM;
+    return plan;
+}
+
+// candidate n of the plan leaves a layout that's as sane as the one before,
+// with the first grown app where it was
+constexpr bool layout_plan_ok(const layout_t &l, const layout_plan_t &plan, int n) {
+    layout_part_t placed[MAX_NUMBER_OF_PARTITIONS] = {};
+    for (int i = 0; i < l.count && i < MAX_NUMBER_OF_PARTITIONS; i++) {
+        placed[i] = layout_place(l.parts, l.count, plan.size_delta, plan.candidates[n].shrink_index, i);
+    }
+    return layout_aligned(placed, l.count) && layout_in_order(placed, l.count) &&
+           layout_fits(placed, l.count, l.flash_size) &&
+           placed[plan.first_app_index].address == l.parts[plan.first_app_index].address;
+}
+
+constexpr uint32_t _layout_md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+constexpr uint8_t _layout_md5_s[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+// RFC 1321, a 64 byte block at a time, with the padding made up on the way
+constexpr layout_md5_t layout_md5(const uint8_t *data, int len) {
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    int blocks = (len + 8) / 64 + 1;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int b = 0; b < blocks; b++) {
+        uint32_t m[16] = {};
+        for (int k = 0; k < 64; k++) {
+            int pos = b * 64 + k;
+            uint32_t byte = (pos < len) ? data[pos] : (pos == len) ? 0x80 :
+                            (pos >= blocks * 64 - 8) ? (uint32_t)(bits >> (8 * (pos - (blocks * 64 - 8)))) & 0xFF : 0;
+            m[k / 4] |= byte << (8 * (k % 4));
+        }
+        uint32_t a = h[0], bb = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f = 0;
+            int g = 0;
+            if (i < 16) { f = (bb & c) | (~bb & d); g = i; }
+            else if (i < 32) { f = (d & bb) | (~d & c); g = (5 * i + 1) % 16; }
+            else if (i < 48) { f = bb ^ c ^ d; g = (3 * i + 5) % 16; }
+            else { f = c ^ (bb | ~d); g = (7 * i) % 16; }
+            uint32_t x = a + f + _layout_md5_k[i] + m[g];
+            int s = _layout_md5_s[(i / 16) * 4 + i % 4];
+            a = d; d = c; c = bb;
+            bb = bb + ((x << s) | (x >> (32 - s)));
+        }
+        h[0] += a; h[1] += bb; h[2] += c; h[3] += d;
+    }
+    layout_md5_t md5 = {};
+    for (int k = 0; k < 16; k++) md5.bytes[k] = (uint8_t)(h[k / 4] >> (8 * (k % 4)));
+    return md5;
+}
+
+constexpr void _layout_put32(uint8_t *p, uint32_t v) {
+    for (int k = 0; k < 4; k++) p[k] = (uint8_t)(v >> (8 * k));
+}
+
+// the table part_table_encode() writes for it: entries, MD5 entry, 0xFF
+constexpr layout_bin_t layout_encode(const layout_part_t *parts, int count) {
+    layout_bin_t bin = {};
+    for (int k = 0; k < PART_TABLE_MAX_SIZE; k++) bin.data[k] = 0xFF;
+    int pos = 0;
+    for (int i = 0; i < count && pos + 2 * PART_TABLE_ENTRY_SIZE <= PART_TABLE_MAX_SIZE; i++) {
+        uint8_t *p = bin.data + pos;
+        p[0] = 0xAA; p[1] = 0x50; p[2] = parts[i].type; p[3] = parts[i].subtype;
+        _layout_put32(p + 4, parts[i].address);
+        _layout_put32(p + 8, parts[i].size);
+        for (int k = 0; k < 16; k++) p[12 + k] = 0;
+        for (int k = 0; k < 16 && parts[i].label[k] != '\0'; k++) p[12 + k] = (uint8_t)parts[i].label[k];
+        _layout_put32(p + 28, parts[i].flags);
+        pos += PART_TABLE_ENTRY_SIZE;
+    }
+    bin.data[pos] = 0xEB; bin.data[pos + 1] = 0xEB;
+    layout_md5_t md5 = layout_md5(bin.data, pos);
+    for (int k = 0; k < 16; k++) bin.data[pos + 16 + k] = md5.bytes[k];
+    bin.len = pos + PART_TABLE_ENTRY_SIZE;
+    return bin;
+}
+
+constexpr layout_known_t layout_evaluate(const layout_t &l) {
+    layout_known_t known = {};
+    known.layout = &l;
+    known.plan = layout_plan(l.parts, l.count, l.flash_size);
+    layout_bin_t bin = layout_encode(l.parts, l.count);
+    for (int k = 0; k < 16; k++) known.md5.bytes[k] = bin.data[bin.len - 16 + k];
+    return known;
+}
+
+// the known layouts; NULL past the last one
+const layout_known_t *layout_known(int i);
+// the known layout with this table (its MD5 entry's MD5); NULL if it's none of them
+const layout_known_t *layout_find(const uint8_t *md5);
+// the known layout that's partitions/<name>.csv (or <name> with .csv); NULL if there's none
+const layout_known_t *layout_find_name(const char *name);
+const char *layout_outcome_name(layout_outcome_t outcome);
+
+#endif // PART_LAYOUTS_H
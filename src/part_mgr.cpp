@@ -4,12 +4,24 @@
  * @brief This does the bulk of the partion management aka resizing. Very hacky.
  */
 
-#include "esp_spi_flash.h"
+#ifndef REPART_HOST
 #include "esp_ota_ops.h"
 #include "esp_flash_encrypt.h"
 #include "esp_image_format.h"
+#endif
 #include "main.h"
 #include "part_mgr.h"
+#include "flash_dev.h"
+#include "part_move.h"
+#include "part_plan.h"
+#include "part_table.h"
+#include "part_layouts.h"
+#include "app_image.h"
+#include "journal.h"
+#include "digest_cache.h"
+#include "flash_bench.h"
+#include "fs_carry.h"
+#include "sector_pool.h"
 #include "utils.h"
 #include "device_info.h"
 #include <MD5Builder.h>
@@ -18,7 +30,6 @@
 
 // Definitions from the ESP SDK & from poking around.
 #define PARTITION_TABLE_SIZE 0x0C00
-#define MAX_NUMBER_OF_PARTITIONS 10 // arbitrary, we just want to be sure we have things ok
 
 typedef struct {
     uint16_t magic_id;                  /*!< It's magic */
@@ -31,27 +42,33 @@ typedef struct {
     bool readonly;                      /*!< flag is set to true if partition is read-only */
 } _my_esp_partition_t; // <- structure in partition table, from ESP SDK
 
+static size_t cached_partition_table_addr = 0;
 
-typedef struct {
-    uint32_t address_old;
-    uint32_t address_new;
-    uint32_t size_old;
-    uint32_t size_new;
-    bool action_erase;
-    bool action_move;
-} _my_partition_planner_t;
+void part_mgr_opts_strategy(part_mgr_opts_t & opts, const char *strategy) {
+    memset(opts.strategy, 0, sizeof(opts.strategy));
+    if (strategy != NULL) strncpy(opts.strategy, strategy, sizeof(opts.strategy) - 1);
+}
 
 // get the address of the partition table; either 0x8000 or 0x9000; 0=failed
 size_t getPartitionTableAddr() {
     // we're looking for "AA 50"
-    static size_t cached_addr = 0;
+    size_t &cached_addr = cached_partition_table_addr;
     if (cached_addr != 0) {
         return cached_addr;
     }
     uint8_t b_buffer[4];
-    for (size_t addr = 0x8000; addr < 0xA000; addr += 0x1000) {
-        DEBUG_PRINTF("Checking for partition table at 0x%08x\n", addr);
-        esp_err_t err = spi_flash_read(addr, b_buffer, sizeof(b_buffer));
+    // where our build put it first; bigger bootloaders (secure boot, some 8/16MB
+    // boards) push it up, as far as 0x10000
+#ifdef CONFIG_PARTITION_TABLE_OFFSET
+    if (flash_dev().read(CONFIG_PARTITION_TABLE_OFFSET, b_buffer, sizeof(b_buffer)) == ESP_OK &&
+        b_buffer[0] == 0xAA && b_buffer[1] == 0x50) {
+        cached_addr = CONFIG_PARTITION_TABLE_OFFSET;
+        return cached_addr;
+    }
+#endif
+    for (size_t addr = 0x8000; addr <= 0x10000; addr += 0x1000) {
+        DEBUG_PRINTF("Checking for partition table at 0x%08x\n", (unsigned)addr);
+        esp_err_t err = flash_dev().read(addr, b_buffer, sizeof(b_buffer));
         if (err != ESP_OK) {
             continue;
         }
@@ -64,119 +81,657 @@ size_t getPartitionTableAddr() {
     return 0; // we got nothing, not even an error
 }
 
-// simple debugging & output display
-void _add_output(std::unique_ptr<WebServer> & ws, const char *str) {
-    ws->sendContent(str, strlen(str));
-    DEBUG_PRINT(str);
-};
-void _add_output(std::unique_ptr<WebServer> & ws, const String& str) {
-    _add_output(ws, str.c_str());
-};
+// the MD5 the table on flash ends with; false if there's no MD5 entry
+bool getPartitionTableMd5(uint8_t *md5) {
+    if (getPartitionTableAddr() == 0) return false;
+    uint8_t row[32];
+    for (size_t offset = 0; offset < PARTITION_TABLE_SIZE; offset += 32) {
+        if (flash_dev().read(getPartitionTableAddr() + offset, row, sizeof(row)) != ESP_OK) return false;
+        if (row[0] == 0xEB && row[1] == 0xEB) {
+            memcpy(md5, row + 16, 16);
+            return true;
+        }
+    }
+    return false;
+}
+
+// forget the cached table address (host builds switch between images)
+void resetPartitionTableAddr() {
+    cached_partition_table_addr = 0;
+}
 
+#ifndef REPART_HOST
 // gets the second app partition table entry
-void getPartitionApp1(esp_partition_t *part) {
+bool getPartitionApp1(esp_partition_t *part) {
     const esp_partition_t* p_next = esp_ota_get_next_update_partition(NULL);
     if (p_next == NULL) {
-        return;
+        return false;
     }
     memcpy(part, p_next, sizeof(esp_partition_t));
+    return true;
 }
+#endif
 
-// Expand app partitions to our ideal size, output to response 
-void partition_mgr_fix(std::unique_ptr<WebServer> & ws, bool test_only) {
-    char c_buffer[256];
+// bytes of a partition that hold data: the image size (sector aligned) for apps,
+// up to the last sector that isn't blank for everything else
+static uint32_t _used_size(OutputSink & ws, const _my_esp_partition_t *part, uint32_t address, uint32_t size) {
+    char c_buffer[80];
+    if (part->type == ESP_PARTITION_TYPE_APP) {
+        uint32_t image_len = app_image_length(address, size);
+        if (image_len == 0) return size;
+        snprintf(c_buffer, sizeof(c_buffer), "App image is %u bytes (%uK of %uK)\n",
+                 image_len, image_len/1024, size/1024);
+        _add_output(ws, c_buffer);
+        return (image_len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    }
+    SectorBuffer sector;
+    uint8_t *buffer = sector.data();
+    if (buffer == NULL) return size;
+    uint32_t used = size;
+    while (used > 0) {
+        if (flash_dev().read(address + used - SPI_FLASH_SEC_SIZE, buffer, SPI_FLASH_SEC_SIZE) != ESP_OK) break;
+        if (!is_blank(buffer, SPI_FLASH_SEC_SIZE)) break;
+        used -= SPI_FLASH_SEC_SIZE;
+    }
+    if (used < size) {
+        snprintf(c_buffer, sizeof(c_buffer), "%s has data in %uK of %uK\n", part->label, used/1024, size/1024);
+        _add_output(ws, c_buffer);
+    }
+    return used;
+}
 
-    // 1. confirm first app partition is active
-    // 2. Check if partition table findable
-    // 3. copy partition table to local buffer
-    // 4. confirm that order is app, app, data; else fail
-    // 5. calculate new data partition size
-    // 6. erase data partition, app1 partition
-    // 7. write partition table
-    // 8. reboot.
+static void _add_step(journal_t & job, journal_step_kind_t kind, int partition,
+                      uint32_t addr_from, uint32_t addr_to, uint32_t size) {
+    if (job.step_count < JOURNAL_MAX_STEPS) {
+        journal_step_t & step = job.steps[job.step_count];
+        step.kind = kind;
+        step.partition = partition;
+        step.addr_from = addr_from;
+        step.addr_to = addr_to;
+        step.size = size;
+    }
+    job.step_count++; // caller checks for overflow
+}
+
+// leave [addr, addr + size) out of the erase & clean steps, splitting them where needed
+static void _keep_out_of_steps(journal_t & job, uint32_t addr, uint32_t size) {
+    for (int n = 0; n < job.step_count && job.step_count <= JOURNAL_MAX_STEPS; n++) {
+        journal_step_t & step = job.steps[n];
+        uint32_t end = step.addr_to + step.size;
+        if (step.kind == JOURNAL_STEP_MOVE || end <= addr || addr + size <= step.addr_to) continue;
+        journal_step_t after = step;
+        after.addr_to = addr + size;
+        after.size = (end > after.addr_to) ? end - after.addr_to : 0;
+        step.size = (addr > step.addr_to) ? addr - step.addr_to : 0;
+        if (after.size > 0) {
+            if (job.step_count == JOURNAL_MAX_STEPS) {
+                job.step_count++; // caller checks for overflow
+                return;
+            }
+            memmove(&job.steps[n + 2], &job.steps[n + 1], (job.step_count - n - 1) * sizeof(journal_step_t));
+            job.steps[n + 1] = after;
+            job.step_count++;
+        }
+        if (step.size == 0) {
+            memmove(&job.steps[n], &job.steps[n + 1], (job.step_count - n - 1) * sizeof(journal_step_t));
+            job.step_count--;
+            n--;
+        }
+    }
+}
+
+typedef struct {
+    uint16_t step;
+} _step_commit_t;
+
+static void _commit_progress(void *ctx, uint32_t done) {
+    journal_commit(((_step_commit_t *)ctx)->step, done);
+}
 
-    // show device info
+// passes a step's progress on as progress of the whole job
+class _JobProgressSink : public OutputSink {
+public:
+    _JobProgressSink(OutputSink & out, uint32_t total) : base(0), _out(out), _total(total) {}
+    void write(const char *str, size_t len) override { _out.write(str, len); }
+    void progress(const char *phase, uint32_t done, uint32_t total) override {
+        _out.progress(phase, base + done, _total);
+    }
+    void flush() override { _out.flush(); }
+    out_verbosity_t verbosity() override { return _out.verbosity(); }
+    uint32_t base;                      // bytes in the steps before this one
+private:
+    OutputSink & _out;
+    uint32_t _total;
+};
+
+// starts the run's report, if it has one, and keeps the first error line of the log for it
+class _ReportSink : public OutputSink {
+public:
+    _ReportSink(OutputSink & out, part_mgr_report_t *report) : _out(out), _report(report) {
+        if (_report == NULL) return;
+        memset(_report, 0, sizeof(part_mgr_report_t));
+        _report->best = -1;
+        _report->start_ms = millis();
+    }
+    void write(const char *str, size_t len) override {
+        if (_report != NULL && _report->error[0] == '\0' &&
+            (strncmp(str, "ERROR", 5) == 0 || strncmp(str, "Failed", 6) == 0)) {
+            size_t n = strcspn(str, "\n");
+            if (n > len) n = len;
+            if (n > sizeof(_report->error) - 1) n = sizeof(_report->error) - 1;
+            memcpy(_report->error, str, n);
+            _report->error[n] = '\0';
+        }
+        _out.write(str, len);
+    }
+    void progress(const char *phase, uint32_t done, uint32_t total) override { _out.progress(phase, done, total); }
+    void flush() override { _out.flush(); }
+    out_verbosity_t verbosity() override { return _out.verbosity(); }
+    part_mgr_result_t finish(part_mgr_result_t result) {
+        if (_report == NULL) return result;
+        _report->result = result;
+        _report->total_ms = millis() - _report->start_ms;
+        if (!_report->applied) _report->plan_ms = _report->total_ms;
+        return result;
+    }
+private:
+    OutputSink & _out;
+    part_mgr_report_t *_report;
+};
+
+// the table as the report has it; the entries may have been changed in place
+static void _report_table(part_mgr_report_t *report, part_table_t & table,
+                          _my_esp_partition_t **partitions, int partition_count) {
+    if (report == NULL) return;
+    table.count = partition_count;
+    for (int i=0; i<partition_count; i++) {
+        part_entry_t & e = table.entries[i];
+        e.type = partitions[i]->type;
+        e.subtype = partitions[i]->subtype;
+        e.address = partitions[i]->address;
+        e.size = partitions[i]->size;
+        memcpy(e.label, partitions[i]->label, 16);
+        e.label[16] = '\0';
+        memcpy(&e.flags, (const uint8_t *)partitions[i] + 28, sizeof(e.flags));
+    }
+}
+
+// do the job's steps from job.step (with job.done bytes of it done) up to `end`
+static bool _run_steps(OutputSink & out, const journal_t & job, const part_mgr_opts_t & opts, bool journaled,
+                       uint16_t end) {
+    char c_buffer[160];
+    uint32_t total = 0;
+    for (uint16_t n = 0; n < job.step_count; n++) total += job.steps[n].size;
+    _JobProgressSink ws(out, total);
+    for (uint16_t n = 0; n < job.step; n++) ws.base += job.steps[n].size;
+    part_mgr_report_t *report = opts.report;
+    if (report != NULL) {
+        report->step_count = job.step_count;
+        for (uint16_t n = 0; n < job.step_count; n++) {
+            memset(&report->steps[n], 0, sizeof(report->steps[n]));
+            report->steps[n].step = job.steps[n];
+            report->steps[n].done = (n < job.step);
+        }
+    }
+    unsigned long steps_start = millis();
+    for (uint16_t n = job.step; n < end; n++) {
+        const journal_step_t & step = job.steps[n];
+        uint32_t done = (n == job.step) ? job.done : 0;
+        const char *phase = (step.kind == JOURNAL_STEP_MOVE) ? MOVE_PHASE_MOVING : MOVE_PHASE_ERASING;
+        ws.progress(phase, done, step.size);
+        unsigned long time_start = micros();
+        move_stats_t ms;
+        memset(&ms, 0, sizeof(ms));
+        esp_err_t err = ESP_OK;
+        switch (step.kind) {
+        case JOURNAL_STEP_ERASE:
+        case JOURNAL_STEP_CLEAN:
+            snprintf(c_buffer, sizeof(c_buffer), "Erasing partition %i at 0x%x, length 0x%x\n",
+                     step.partition, step.addr_to, step.size);
+            _add_output(ws, c_buffer);
+            if (step.kind == JOURNAL_STEP_ERASE) {
+                err = flash_dev().erase_range(step.addr_to, step.size);
+            } else {
+                err = partition_erase(ws, step.addr_to, step.size, ms);
+            }
+            if (err != ESP_OK) {
+                snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
+                _add_output(ws, c_buffer);
+                break;
+            }
+            snprintf(c_buffer, sizeof(c_buffer), " ... Partition erased in %lu ms\n", (micros()-time_start)/1000);
+            _add_output(ws, c_buffer);
+            break;
+        case JOURNAL_STEP_MOVE: {
+            snprintf(c_buffer, sizeof(c_buffer), "Moving partition %i from 0x%x to 0x%x length 0x%x ...\n ",
+                     step.partition, step.addr_from, step.addr_to, step.size);
+            _add_output(ws, c_buffer);
+            if (done > 0) {
+                snprintf(c_buffer, sizeof(c_buffer), "Resuming, %uK already moved\n", done/1024);
+                _add_output(ws, c_buffer);
+            }
+            _step_commit_t ctx = {n};
+            move_resume_t resume = {done, _commit_progress, &ctx};
+            err = partition_move(ws, step.addr_from, step.addr_to, step.size, opts.move_mode, ms,
+                                 journaled ? &resume : NULL);
+            if (err != ESP_OK) {
+                snprintf(c_buffer, sizeof(c_buffer), "Failed to move partition: 0x%x\n", err);
+                _add_output(ws, c_buffer);
+                if (err == ESP_ERR_INVALID_CRC) {
+                    _add_output(ws, "Not rebooting; the next boot moves it again from the journal.\n");
+                }
+                break;
+            }
+            snprintf(c_buffer, sizeof(c_buffer), "... Partition moved %i sectors (%i copied, %i erased, %i skipped) in %lu ms (%lu ms/sector)\n", 
+                ms.sectors, ms.copied, ms.blanked, ms.skipped, ms.time_us/1000, ms.time_us/(1000*(ms.sectors ? ms.sectors : 1)));
+            _add_output(ws, c_buffer);
+            snprintf(c_buffer, sizeof(c_buffer), "    %s mode, %uK window, %u block + %u sector erases\n",
+                move_mode_name(ms.mode), ms.window/1024, ms.block_erases, ms.sector_erases);
+            _add_output(ws, c_buffer);
+            snprintf(c_buffer, sizeof(c_buffer), "    %u sectors verified, %lu KB/s read back\n",
+                ms.verified, (unsigned long)((uint64_t)ms.verified * (SPI_FLASH_SEC_SIZE / 1024) * 1000000 / (ms.verify_us ? ms.verify_us : 1)));
+            _add_output(ws, c_buffer);
+            break;
+        }
+        default:
+            _add_output(ws, "ERROR: Unknown journal step.\n");
+            err = ESP_FAIL;
+            break;
+        }
+        if (report != NULL) {
+            report->steps[n].time_ms = (micros() - time_start) / 1000;
+            report->steps[n].stats = ms;
+            report->steps[n].done = (err == ESP_OK);
+            report->steps_ms = millis() - steps_start;
+        }
+        if (err != ESP_OK) return false;
+        if (journaled) journal_commit(n + 1, 0);
+        ws.progress(phase, step.size, step.size);
+        ws.base += step.size;
+    }
+    return true;
+}
+
+// device info & the usual warning at the top of every run
+static void _show_header(OutputSink & ws, bool test_only) {
+    char c_buffer[256];
     getDeviceInfo(c_buffer, sizeof(c_buffer)); // get hardware info
     _add_output(ws, c_buffer);
     _add_output(ws, "\n");
-    snprintf(c_buffer, sizeof(c_buffer), "Partition table address: 0x%x\n", getPartitionTableAddr());
+    snprintf(c_buffer, sizeof(c_buffer), "Partition table address: 0x%x\n", (unsigned)getPartitionTableAddr());
     _add_output(ws, c_buffer);
     getBootloaderMd5(c_buffer, sizeof(c_buffer));
     _add_output(ws, F("Bootloader MD5: "));
     _add_output(ws, c_buffer);
-    _add_output(ws, "\n\n");
+    _add_output(ws, "\n");
+    digest_cache_report(ws);
+    _add_output(ws, "\n");
 
     // info text
     if (!test_only) {
         _add_output(ws, "NOTE: If you do not see a line with 'Ready' at the end,\nthis process didn't work.\n\n");
     }
+}
 
-    // Check for flash encryption - we can't do anything if it's encrypted
-    // Rewriting the partition table will brick your device.
-    if (esp_flash_encryption_enabled()) {
-        _add_output(ws, "ERROR: Flash encryption is enabled. Can't continue.\n");
-        return;
-    }
-
-    // 1. confirm first app partition is active
-    const esp_partition_t* p_running = esp_ota_get_running_partition();
-    const esp_partition_t* p_next = esp_ota_get_next_update_partition(NULL);
-    if (p_next == NULL) {
-        _add_output(ws, "ERROR: There is only one app partition.\n");
-        return;
-    }
-    if (p_running->address > p_next->address) {
-        _add_output(ws, "ERROR: YOU MUST UPLOAD THE FIRMWARE AGAIN.\n");
-        _add_output(ws, "The current partition is not the first one.\n");
-        _add_output(ws, "<a href='/update'>Upload firmware again</a>\n");
-        return;
+static void _show_partitions(OutputSink & ws, _my_esp_partition_t **partitions, int partition_count) {
+    char c_buffer[128];
+    for (int i=0; i<partition_count; i++) {
+        snprintf(c_buffer, sizeof(c_buffer), "Type: %02x / %02x, Addr: 0x%06x, Size: 0x%06x (%dK): %s\n",
+                partitions[i]->type, partitions[i]->subtype, partitions[i]->address, partitions[i]->size, (int)(partitions[i]->size/1024), partitions[i]->label);
+        _add_output(ws, c_buffer);
     }
-    _add_output(ws, "Current app parition is first: OK\n");
+}
 
+// read the table into `buffer` & split out the entries; NULL if that fails
+static char *_read_table(OutputSink & ws, SectorBuffer & buffer, _my_esp_partition_t **partitions,
+                         unsigned short & partition_count, size_t & md5_offset) {
+    char c_buffer[96];
     // 2. Check if partition table findable
     if (getPartitionTableAddr() == 0) {
         _add_output(ws, "ERROR: Partition table not found. Can't continue.\n");
-        return;
+        return NULL;
     }
 
     // 3. Copy partition table to local buffer
     _add_output(ws, "Reading partition table...\n");
-    char *partition_buffer = (char *)malloc(SPI_FLASH_SEC_SIZE+1);
+    char *partition_buffer = (char *)buffer.data();
     if (partition_buffer == NULL) {
         _add_output(ws, "Failed to allocate memory for partition buffer\n");
-        return;
+        return NULL;
     }
-    _my_esp_partition_t *partitions[MAX_NUMBER_OF_PARTITIONS] = {NULL};
     esp_err_t err =
-        spi_flash_read(getPartitionTableAddr(), partition_buffer, SPI_FLASH_SEC_SIZE);
+        flash_dev().read(getPartitionTableAddr(), partition_buffer, SPI_FLASH_SEC_SIZE);
     if (err != ESP_OK) {
         snprintf(c_buffer, sizeof(c_buffer), "Failed to read partition table: 0x%x\n", err);
         _add_output(ws, c_buffer);
-        free(partition_buffer);
-        return;
+        return NULL;
     }
 
     // separate out partitions
     _add_output(ws, "Splitting partitions out...\n");
-    unsigned short partition_count = 0;
-    size_t md5_offset = 0;
+    partition_count = 0;
+    md5_offset = 0;
 
-    for (size_t offset = 0; offset < SPI_FLASH_SEC_SIZE; offset += 32) {
+    // the bootloader reads PARTITION_TABLE_SIZE: entries, then the MD5 entry
+    for (size_t offset = 0; offset < PARTITION_TABLE_SIZE; offset += 32) {
         if ((*(partition_buffer+offset)==0xAA) && (*(partition_buffer+offset+1)==0x50)) {
-            partitions[partition_count] = (_my_esp_partition_t*)(partition_buffer + offset);
-            partition_count++;
-            if (partition_count>MAX_NUMBER_OF_PARTITIONS) break;
+            if (partition_count == MAX_NUMBER_OF_PARTITIONS) {
+                _add_output(ws, "ERROR: Too many partitions. Can't continue.\n");
+                return NULL;
+            }
+            partitions[partition_count++] = (_my_esp_partition_t*)(partition_buffer + offset);
         } else if ((*(partition_buffer+offset)==0xEB) && (*(partition_buffer+offset+1)==0xEB)) {
             md5_offset = offset;
+            break;
+        } else {
+            break;
         }
     }
+    if (md5_offset == 0) {
+        _add_output(ws, "ERROR: Partition table has no MD5 entry. Can't continue.\n");
+        return NULL;
+    }
     _add_output(ws, "Created local copy of partiton table: OK\n");
-    for (int i=0; i<partition_count; i++) {
-        snprintf(c_buffer, sizeof(c_buffer), "Type: %02x / %02x, Addr: 0x%06x, Size: 0x%06x (%dK): %s\n",
-                partitions[i]->type, partitions[i]->subtype, partitions[i]->address, partitions[i]->size, (int)(partitions[i]->size/1024), partitions[i]->label);
+    _show_partitions(ws, partitions, partition_count);
+    // one of partitions/*.csv? then the build already knows what it does
+    const layout_known_t *known = layout_find((const uint8_t *)partition_buffer + md5_offset + 16);
+    if (known != NULL) {
+        snprintf(c_buffer, sizeof(c_buffer), "Known layout %s, checked at build time: %s, %d layout option%s\n",
+                 known->layout->name, layout_outcome_name(known->plan.outcome), known->plan.count,
+                 (known->plan.count == 1) ? "" : "s");
         _add_output(ws, c_buffer);
     }
     _add_output(ws, "\n");
+    return partition_buffer;
+}
+
+// what the planners need to know; apps only count as far as their image goes
+static void _plan_parts(OutputSink & ws, _my_esp_partition_t **partitions, int partition_count, plan_part_t *parts) {
+    for (int i=0; i<partition_count; i++) {
+        parts[i].type = partitions[i]->type;
+        parts[i].subtype = partitions[i]->subtype;
+        parts[i].address = partitions[i]->address;
+        parts[i].size = partitions[i]->size;
+        parts[i].used = _used_size(ws, partitions[i], partitions[i]->address, partitions[i]->size);
+        parts[i].label = partitions[i]->label;
+    }
+}
+
+// Preferences keeps the journal in the "nvs" partition; only safe if that stays put
+static bool _journal_safe(const plan_part_t *parts, int partition_count, const uint8_t *new_table,
+                          const journal_t & job) {
+    part_table_t *table = (part_table_t *)malloc(sizeof(part_table_t));
+    char error[64];
+    const plan_part_t *nvs_old = NULL;
+    int nvs_new = -1;
+    for (int i=0; i<partition_count; i++) {
+        if (strcmp(parts[i].label, "nvs") == 0) nvs_old = &parts[i];
+    }
+    if (table != NULL && part_table_parse_bin(new_table, SPI_FLASH_SEC_SIZE, *table, error, sizeof(error))) {
+        nvs_new = part_table_find_label(*table, "nvs");
+    }
+    bool kept = nvs_old != NULL && nvs_new >= 0 && nvs_old->address == table->entries[nvs_new].address &&
+                nvs_old->size == table->entries[nvs_new].size;
+    free(table);
+    if (!kept) return false;
+    for (int n=0; n<job.step_count; n++) {
+        const journal_step_t & step = job.steps[n];
+        if (step.addr_to < nvs_old->address + nvs_old->size && nvs_old->address < step.addr_to + step.size) return false;
+    }
+    return true;
+}
+
+// running from an OTA slot the run erases: the firmware goes to the first one,
+// which keeps its place, and that's what boots next
+typedef struct {
+    uint32_t from;                      /*!< the slot we run from */
+    uint32_t to;                        /*!< the first OTA slot */
+    uint32_t size;                      /*!< the image, sector aligned */
+} _relocate_t;
+
+// copy the firmware & switch otadata to it. The old table has the slot where it is
+// now, so whether or not the new one gets written, the chip boots the same firmware.
+static bool _relocate_app(OutputSink & ws, const _relocate_t & relocate, const part_mgr_opts_t & opts) {
+    char c_buffer[96];
+    snprintf(c_buffer, sizeof(c_buffer), "Copying the running firmware from 0x%x to 0x%x length 0x%x ...\n ",
+             relocate.from, relocate.to, relocate.size);
+    _add_output(ws, c_buffer);
+    move_stats_t ms;
+    memset(&ms, 0, sizeof(ms));
+    esp_err_t err = partition_move(ws, relocate.from, relocate.to, relocate.size, opts.move_mode, ms, NULL);
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to copy the running firmware: 0x%x\n", err);
+        _add_output(ws, c_buffer);
+        return false;
+    }
+    err = app_image_set_boot(relocate.to);
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to set the boot partition: 0x%x\n", err);
+        _add_output(ws, c_buffer);
+        return false;
+    }
+    snprintf(c_buffer, sizeof(c_buffer), "Boots from 0x%x from now on: OK\n", relocate.to);
+    _add_output(ws, c_buffer);
+    return true;
+}
+
+// write the new table in partition_buffer (MD5 entry at md5_offset), then do the job's steps
+static part_mgr_result_t _apply(OutputSink & ws, char *partition_buffer, size_t md5_offset,
+                                const plan_part_t *parts, int partition_count,
+                                journal_t & job, const part_mgr_opts_t & opts, fs_carry_t *carry = NULL,
+                                const _relocate_t *relocate = NULL) {
+    char c_buffer[96];
+    if (job.step_count > JOURNAL_MAX_STEPS) {
+        _add_output(ws, "ERROR: Too many partitions to move.\n");
+        return PART_MGR_FAILED;
+    }
+
+    // calculate md5 of new partition table
+    MD5Builder _md5 = MD5Builder();
+    _md5.begin();
+    _md5.add((uint8_t*)partition_buffer, md5_offset);
+    _md5.calculate();
+    _md5.getBytes((uint8_t*)(partition_buffer + md5_offset + 16));
+
+    // the work after the table is written, as a journal; with it, a power cut
+    // in the middle can be finished on the next boot
+    job.magic = JOURNAL_MAGIC;
+    job.version = JOURNAL_VERSION;
+    job.step = 0;
+    job.done = 0;
+    memcpy(job.table_md5, partition_buffer + md5_offset + 16, sizeof(job.table_md5));
+    bool journaled = _journal_safe(parts, partition_count, (const uint8_t *)partition_buffer, job);
+    // a move that doesn't verify is redone from the journal at the next boot;
+    // without one, nothing would, and the new table would boot it broken
+    bool moves = false;
+    for (uint16_t n = 0; n < job.step_count; n++) moves = moves || job.steps[n].kind == JOURNAL_STEP_MOVE;
+    if (moves && !journaled) {
+        _add_output(ws, "ERROR: NVS partition changes; partitions can't be moved without the journal.\n");
+        return PART_MGR_FAILED;
+    }
+    // steps that erase the firmware we run from wait for the boot from its copy
+    uint16_t end = job.step_count;
+    if (relocate != NULL) {
+        for (uint16_t n = 0; n < job.step_count && end == job.step_count; n++) {
+            const journal_step_t & step = job.steps[n];
+            if ((step.addr_to < relocate->from + relocate->size && relocate->from < step.addr_to + step.size) ||
+                (step.kind == JOURNAL_STEP_MOVE &&
+                 step.addr_from < relocate->from + relocate->size && relocate->from < step.addr_from + step.size)) {
+                end = n;
+            }
+        }
+        if (end < job.step_count && !journaled) {
+            _add_output(ws, "ERROR: NVS partition changes; the work can't wait for the reboot.\n");
+            return PART_MGR_FAILED;
+        }
+        if (!_relocate_app(ws, *relocate, opts)) return PART_MGR_FAILED;
+    }
+    if (carry != NULL) {
+        // the note that the files wait is in NVS, next to the journal
+        if (!journaled) {
+            _add_output(ws, "ERROR: NVS partition changes; the files can't be kept over the reboot.\n");
+            return PART_MGR_FAILED;
+        }
+        memcpy(carry->table_md5, job.table_md5, sizeof(carry->table_md5));
+        if (!fs_carry_pack(ws, *carry)) return PART_MGR_FAILED;
+        if (!fs_carry_save(*carry)) {
+            _add_output(ws, "ERROR: Couldn't note where the files wait; not going on without them.\n");
+            return PART_MGR_FAILED;
+        }
+    }
+    if (!journaled) {
+        _add_output(ws, "WARNING: NVS partition changes; this run can't be resumed if interrupted.\n");
+    } else if (!journal_save(job)) {
+        if (moves) {
+            _add_output(ws, "ERROR: Couldn't store the journal; not moving partitions without it.\n");
+            if (carry != NULL) fs_carry_clear();
+            return PART_MGR_FAILED;
+        }
+        _add_output(ws, "WARNING: Couldn't store the journal; this run can't be resumed if interrupted.\n");
+        journaled = false;
+    }
+
+    if (opts.report != NULL) {
+        opts.report->applied = true;
+        opts.report->plan_ms = millis() - opts.report->start_ms;
+    }
+
+    // write partition table buffer back to flash
+    unsigned long time_start = micros();
+    _add_output(ws, "Erasing partition table...\n");
+    esp_err_t err = flash_dev().erase_range(getPartitionTableAddr(), SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition table: 0x%x\n", err);
+        _add_output(ws, c_buffer);
+        if (journaled) journal_clear();
+        if (carry != NULL) fs_carry_clear();
+        return PART_MGR_FAILED;
+    }
+    _add_output(ws, "Writing partition table...\n");
+    err = flash_dev().write(getPartitionTableAddr(), partition_buffer, SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) {
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to write partition table: 0x%x\n", err);
+        _add_output(ws, c_buffer);
+        if (journaled) journal_clear();
+        if (carry != NULL) fs_carry_clear();
+        return PART_MGR_FAILED;
+    }
+    unsigned long time_end = micros();
+    snprintf(c_buffer, sizeof(c_buffer), " ... Partition table written in %lu ms\n", (time_end-time_start)/1000);
+    _add_output(ws, c_buffer);
+    if (opts.report != NULL) opts.report->table_ms = (time_end - time_start) / 1000;
+
+    // time to clean up partitions
+    if (!_run_steps(ws, job, opts, journaled, end)) {
+        // the journal stays; the next boot tries again
+        return PART_MGR_FAILED;
+    }
+    if (end < job.step_count) {
+        // the journal stays for those too; partition_mgr_resume() does them at boot
+        snprintf(c_buffer, sizeof(c_buffer), "Steps %u to %u erase the running firmware; they're done at the next boot.\n",
+                 end + 1, job.step_count);
+        _add_output(ws, c_buffer);
+    } else {
+        if (journaled) journal_clear();
+        _add_output(ws, "Partitions erased / moved: OK\n");
+    }
+    if (carry != NULL) {
+        snprintf(c_buffer, sizeof(c_buffer), "The files of %s go back in after the reboot.\n", carry->label);
+        _add_output(ws, c_buffer);
+    }
+
+    _add_output(ws, "Partition table updated.\n\n");
+    return PART_MGR_DONE;
+}
+
+// with opts.keep_fs: if the partition that shrinks has a filesystem, check its files
+// can be kept, and find them a place over the reboot: past the image of an OTA
+// slot that's erased, where that slot is in both tables. carry.kind stays NONE
+// if there's nothing to keep; false if they can't be.
+static bool _carry_plan(OutputSink & ws, const plan_part_t *parts, const _my_partition_planner_t *planner,
+                        int partition_count, int shrink, fs_carry_t & carry) {
+    char c_buffer[96];
+    memset(&carry, 0, sizeof(carry));
+    fs_kind_t kind = fs_carry_detect(parts[shrink].address, parts[shrink].size);
+    if (kind == FS_KIND_NONE) {
+        snprintf(c_buffer, sizeof(c_buffer), "No filesystem found on %s; nothing to keep.\n", parts[shrink].label);
+        _add_output(ws, c_buffer);
+        return true;
+    }
+    for (int i=0; i<partition_count; i++) {
+        if (!planner[i].action_erase) continue;
+        uint32_t address_new = planner[i].address_new ? planner[i].address_new : planner[i].address_old;
+        uint32_t size_new = planner[i].size_new ? planner[i].size_new : planner[i].size_old;
+        uint32_t from = planner[i].address_old + parts[i].used;
+        uint32_t to = planner[i].address_old + planner[i].size_old;
+        if (from < address_new) from = address_new;
+        if (to > address_new + size_new) to = address_new + size_new;
+        if (to > from && to - from > carry.area_size) {
+            carry.address = from;
+            carry.area_size = to - from;
+        }
+    }
+    carry.kind = kind;
+    memcpy(carry.label, parts[shrink].label, 16);
+    return fs_carry_check(ws, carry, planner[shrink].size_new);
+}
+
+// what a run plans with; for a full table that's ~11K, too much for the stack of
+// the task it runs on, so it's one allocation per run instead
+typedef struct {
+    _my_esp_partition_t *partitions[MAX_NUMBER_OF_PARTITIONS];
+    plan_part_t parts[MAX_NUMBER_OF_PARTITIONS];
+    plan_part_t to[MAX_NUMBER_OF_PARTITIONS];                   // _target(): the new layout
+    char labels[MAX_NUMBER_OF_PARTITIONS][17];                  // _target(): parts[] labels, once the buffer changes
+    _my_partition_planner_t planner[MAX_NUMBER_OF_PARTITIONS];
+    plan_result_t plan;
+    journal_t job;
+} _run_work_t;
+
+static _run_work_t *_run_work_new(OutputSink & ws) {
+    _run_work_t *work = (_run_work_t *)calloc(1, sizeof(_run_work_t));
+    if (work == NULL) _add_output(ws, "ERROR: Not enough memory to plan the run.\n");
+    return work;
+}
+
+// Expand app partitions to our ideal size, output to sink
+static part_mgr_result_t _run(OutputSink & ws, const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                              bool test_only, _run_work_t & work) {
+    char c_buffer[256];
+
+    // 1. confirm there's an OTA slot to grow into
+    // 2. Check if partition table findable
+    // 3. copy partition table to local buffer
+    // 4. confirm that order is app, app, data; else fail
+    // 5. calculate new data partition size
+    // 6. erase data partition, app1 partition
+    // 7. write partition table
+    // 8. reboot.
+
+    _show_header(ws, test_only);
+
+    // Check for flash encryption - we can't do anything if it's encrypted
+    // Rewriting the partition table will brick your device.
+    if (env.flash_encrypted) {
+        _add_output(ws, "ERROR: Flash encryption is enabled. Can't continue.\n");
+        return PART_MGR_FAILED;
+    }
+
+    // 1. confirm there's an OTA slot to grow into
+    if (env.next_address == 0) {
+        _add_output(ws, "ERROR: There is only one app partition.\n");
+        return PART_MGR_FAILED;
+    }
+
+    // 2. + 3. read the table
+    _my_esp_partition_t **partitions = work.partitions;
+    unsigned short partition_count = 0;
+    size_t md5_offset = 0;
+    SectorBuffer table_buffer;
+    char *partition_buffer = _read_table(ws, table_buffer, partitions, partition_count, md5_offset);
+    if (partition_buffer == NULL) return PART_MGR_FAILED;
+    part_mgr_report_t *report = opts.report;
+    if (report != NULL) _report_table(report, report->table, partitions, partition_count);
 
     // 4. Confirm we have min 2x app, and min 1 data
     int app_count = 0, data_count = 0;
@@ -189,78 +744,97 @@ void partition_mgr_fix(std::unique_ptr<WebServer> & ws, bool test_only) {
     }
     if ((app_count < 2) || (data_count < 1)) {
         _add_output(ws, "ERROR: Need 2+ app, 1+ data partitions; can't continue.\n");
-        free(partition_buffer);
-        return;
+        return PART_MGR_FAILED;
     }
 
-    // make planning copy
-    _my_partition_planner_t planner[MAX_NUMBER_OF_PARTITIONS];
-    for (int i=0; i<partition_count; i++) {
-        planner[i].address_old = partitions[i]->address;
-        planner[i].size_old = partitions[i]->size;
-        // defaults
-        planner[i].address_new = 0; planner[i].size_new = 0;
-        planner[i].action_erase = false; planner[i].action_move = false;
-    }
-
-    // plan to resize app partitions
-    uint32_t size_delta = 0;
-    int first_app_index = -1;
-    for (int i=0; i<partition_count; i++) {
-        if (partitions[i]->type == ESP_PARTITION_TYPE_APP && 
-            (partitions[i]->subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0 ||
-             partitions[i]->subtype == ESP_PARTITION_SUBTYPE_APP_OTA_1)) {
-            if (partitions[i]->size < RESIZE_APP_PARTITION_SIZE) {
-                size_delta += RESIZE_APP_PARTITION_SIZE - partitions[i]->size;
-                planner[i].size_new = RESIZE_APP_PARTITION_SIZE;
-                if (first_app_index == -1) {
-                    first_app_index = i;
-                } else {
-                    planner[i].action_erase = true;
-                }
+    plan_part_t *parts = work.parts;
+    _plan_parts(ws, partitions, partition_count, parts);
+    plan_result_t & plan = work.plan;
+    plan_cost_model_t cost_model = PLAN_COST_MODEL_DEFAULT;
+    flash_bench_cost_model(cost_model); // this chip's timing, once /flash-bench measured it
+    plan_layouts(parts, partition_count, flash_dev().size(), env.running_address, cost_model,
+                 opts.strategy[0] ? opts.strategy : NULL, plan);
+    if (report != NULL) {
+        report->size_delta = plan.size_delta;
+        report->relocate_ms = plan.relocate_ms;
+        report->candidate_count = plan.count;
+        report->best = plan.best;
+        for (int n=0; n<plan.count; n++) {
+            const plan_candidate_t &c = plan.candidates[n];
+            part_mgr_report_candidate_t &rc = report->candidates[n];
+            rc.strategy = c.strategy;
+            rc.shrink[0] = '\0';
+            if (c.shrink_index >= 0) {
+                memcpy(rc.shrink, partitions[c.shrink_index]->label, 16);
+                rc.shrink[16] = '\0';
             }
+            rc.bytes_moved = c.bytes_moved;
+            rc.bytes_erased = c.bytes_erased;
+            rc.cost_ms = c.cost_ms;
         }
     }
-    if (size_delta == 0) {
+
+    if (plan.size_delta == 0) {
         _add_output(ws, "UNNECESSARY: App partitions are already ideal size.\n");
         _add_output(ws, "READY TO GO - upload the firmware you want.\n");
         _add_output(ws, "<a href='/update'>Upload new firmware</a>\n");
-        free(partition_buffer);
-        return;
+        return PART_MGR_UNNECESSARY;
     }
 
-    // find biggest data partition to shrink
-    int biggest_data_index = 0; uint32_t biggest_data_size = 0;
-    for (int i=0; i<partition_count; i++) {
-        if (partitions[i]->type == ESP_PARTITION_TYPE_DATA) {
-            if (partitions[i]->size > biggest_data_size) {
-                biggest_data_size = partitions[i]->size;
-                biggest_data_index = i;
-            }
-        }
+    // show the options & what they'd cost
+    snprintf(c_buffer, sizeof(c_buffer), "\nApps need 0x%x (%uK) more. Layout options:\n",
+             plan.size_delta, plan.size_delta/1024);
+    _add_output(ws, c_buffer);
+    for (int n=0; n<plan.count; n++) {
+        const plan_candidate_t &c = plan.candidates[n];
+        snprintf(c_buffer, sizeof(c_buffer), "%s %s: %s%s, moves %uK, erases %uK, ~%u ms%s\n",
+                 (n == plan.best) ? "*" : " ", c.strategy,
+                 (c.shrink_index < 0) ? "use free space" : "shrink ",
+                 (c.shrink_index < 0) ? "" : partitions[c.shrink_index]->label,
+                 c.bytes_moved/1024, c.bytes_erased/1024, c.cost_ms, (n == plan.best) ? " <- chosen" : "");
+        _add_output(ws, c_buffer);
+    }
+    if (plan.relocate_ms) {
+        snprintf(c_buffer, sizeof(c_buffer), "  each includes copying the running firmware first: ~%u ms\n",
+                 plan.relocate_ms);
+        _add_output(ws, c_buffer);
     }
-    if (biggest_data_size < size_delta) {
+    _add_output(ws, "\n");
+    if (plan.best < 0) {
         _add_output(ws, "ERROR: Data partition is not large enough.\n");
-        free(partition_buffer);
-        return;
+        return PART_MGR_FAILED;
     }
-    planner[biggest_data_index].size_new = biggest_data_size - size_delta;
+    _my_partition_planner_t *planner = work.planner;
+    plan_candidate_layout(parts, partition_count, plan, plan.best, planner);
+    _add_output(ws, "Partition table has 2+x app, 1+x data: OK\n");
 
-    // iterate through all partitions
-    uint32_t address_offset = 0;
+    // the first OTA slot keeps its place; running from one that's erased, the
+    // firmware moves there first
+    _relocate_t relocate = {0, 0, 0};
+    int running = -1;
     for (int i=0; i<partition_count; i++) {
-        if (address_offset>0) {
-            planner[i].address_new = planner[i].address_old + address_offset;
-            if (!planner[i].action_erase) {
-                planner[i].action_move = true;
-                if (!planner[i].size_new) planner[i].size_new = planner[i].size_old;
-            }
-        }
-        if (planner[i].size_new != 0) {
-            address_offset += planner[i].size_new - planner[i].size_old;
+        if (parts[i].type == ESP_PARTITION_TYPE_APP && parts[i].address == env.running_address) running = i;
+    }
+    if (running >= 0 && planner[running].action_move) {
+        _add_output(ws, "ERROR: The running app would have to move. Can't continue.\n");
+        return PART_MGR_FAILED;
+    }
+    if (running >= 0 && planner[running].action_erase) {
+        const plan_part_t & first = parts[plan.first_app_index];
+        if (parts[running].used > first.size) {
+            snprintf(c_buffer, sizeof(c_buffer), "ERROR: The running firmware (%uK) doesn't fit %s (%uK).\n",
+                     parts[running].used/1024, first.label, first.size/1024);
+            _add_output(ws, c_buffer);
+            _add_output(ws, "<a href='/update'>Upload firmware again</a>\n");
+            return PART_MGR_FAILED;
         }
+        relocate = {parts[running].address, first.address, parts[running].used};
+        snprintf(c_buffer, sizeof(c_buffer), "Running from %s; the firmware moves to %s first: OK\n",
+                 parts[running].label, first.label);
+        _add_output(ws, c_buffer);
+    } else {
+        _add_output(ws, "Running app keeps its place: OK\n");
     }
-    _add_output(ws, "Partition table has 2+x app, 1+x data: OK\n");
 
     // 5. update partition table based on new addresses + sizes
     for (int i=0; i<partition_count; i++) {
@@ -274,129 +848,274 @@ void partition_mgr_fix(std::unique_ptr<WebServer> & ws, bool test_only) {
 
     // show new partition table
     _add_output(ws, "New partition table:\n");
-    for (int i=0; i<partition_count; i++) {
-        snprintf(c_buffer, sizeof(c_buffer), "Type: %02x / %02x, Addr: 0x%06x, Size: 0x%06x (%dK): %s\n",
-                partitions[i]->type, partitions[i]->subtype, partitions[i]->address, partitions[i]->size, (int)(partitions[i]->size/1024), partitions[i]->label);
-        _add_output(ws, c_buffer);
+    _show_partitions(ws, partitions, partition_count);
+    if (report != NULL) _report_table(report, report->table_new, partitions, partition_count);
+
+    fs_carry_t carry;
+    carry.kind = FS_KIND_NONE;
+    int shrink = plan.candidates[plan.best].shrink_index;
+    if (opts.keep_fs && shrink >= 0) {
+        _add_output(ws, "\n");
+        if (!_carry_plan(ws, parts, planner, partition_count, shrink, carry)) return PART_MGR_FAILED;
     }
+    bool carrying = (carry.kind != FS_KIND_NONE);
 
     if (test_only) {
         _add_output(ws, "\nEverything looks good! Try it for real now!\n");
-        free(partition_buffer);
-        return;
+        return PART_MGR_TESTED;
     }
     _add_output(ws, "\nDoing the work now...\n");
 
-    // calculate md5 of new partition table
-    MD5Builder _md5 = MD5Builder();
-    _md5.begin();
-    _md5.add((uint8_t*)partition_buffer, md5_offset);
-    _md5.calculate();
-    _md5.getBytes((uint8_t*)(partition_buffer + md5_offset + 16));
-   
-    // write partition table buffer back to flash
-    unsigned long time_start = micros();
-    _add_output(ws, "Erasing partition table...\n");
-    err = spi_flash_erase_range(getPartitionTableAddr(), SPI_FLASH_SEC_SIZE);
-    if (err != ESP_OK) {
-        snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition table: 0x%x\n", err);
+    // what to do after the table is written, last partition first
+    journal_t & job = work.job;
+    memset(&job, 0, sizeof(job));
+    for (int i = partition_count - 1; i >= 0; i--) {
+        if (planner[i].action_erase) {
+            // the image is surely there, erase it blind; only check the rest
+            uint32_t used = parts[i].used;
+            if (used > 0) _add_step(job, JOURNAL_STEP_ERASE, i, 0, planner[i].address_old, used);
+            if (used < planner[i].size_old) {
+                _add_step(job, JOURNAL_STEP_CLEAN, i, 0, planner[i].address_old + used, planner[i].size_old - used);
+            }
+        }
+        // a filesystem that's carried is formatted anew; its old blocks stay behind
+        if (carrying && i == shrink) continue;
+        if (planner[i].action_move && (planner[i].address_new!=planner[i].address_old)) {
+            // just what holds data; the rest only needs to end up blank
+            uint32_t used = (parts[i].used < planner[i].size_new) ? parts[i].used : planner[i].size_new;
+            if (used > 0) _add_step(job, JOURNAL_STEP_MOVE, i, planner[i].address_old, planner[i].address_new, used);
+            if (used < planner[i].size_new) {
+                _add_step(job, JOURNAL_STEP_CLEAN, i, 0, planner[i].address_new + used, planner[i].size_new - used);
+            }
+        }
+    }
+    if (carrying) _keep_out_of_steps(job, carry.address, carry.area_size);
+    part_mgr_result_t result = _apply(ws, partition_buffer, md5_offset, parts, partition_count, job, opts,
+                                      carrying ? &carry : NULL, relocate.size ? &relocate : NULL);
+    return result;
+}
+
+// Go from the live table to the one given (binary or CSV), keeping what can be kept
+static part_mgr_result_t _target(OutputSink & ws, const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                                 const uint8_t *target, size_t target_len, bool test_only, _run_work_t & work) {
+    char c_buffer[160];
+    _show_header(ws, test_only);
+    if (env.flash_encrypted) {
+        _add_output(ws, "ERROR: Flash encryption is enabled. Can't continue.\n");
+        return PART_MGR_FAILED;
+    }
+
+    _my_esp_partition_t **partitions = work.partitions;
+    unsigned short partition_count = 0;
+    size_t md5_offset = 0;
+    SectorBuffer table_buffer;
+    char *partition_buffer = _read_table(ws, table_buffer, partitions, partition_count, md5_offset);
+    if (partition_buffer == NULL) return PART_MGR_FAILED;
+    part_mgr_report_t *report = opts.report;
+    if (report != NULL) _report_table(report, report->table, partitions, partition_count);
+
+    // then the new one; it has to fit this chip
+    part_table_t *table = (part_table_t *)malloc(sizeof(part_table_t));
+    if (table == NULL) {
+        _add_output(ws, "Failed to allocate memory for the target table\n");
+        return PART_MGR_FAILED;
+    }
+    char error[96];
+    bool ok = (target_len >= 2 && target[0] == 0xAA && target[1] == 0x50)
+        ? part_table_parse_bin(target, target_len, *table, error, sizeof(error))
+        : part_table_parse_csv((const char *)target, target_len, getPartitionTableAddr(), *table, error, sizeof(error));
+    if (ok) ok = part_table_check(*table, getPartitionTableAddr(), flash_dev().size(), error, sizeof(error));
+    if (!ok) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: Target table: %s\n", error);
         _add_output(ws, c_buffer);
-        free(partition_buffer);
-        return;
+        free(table);
+        return PART_MGR_FAILED;
     }
-    _add_output(ws, "Writing partition table...\n");
-    err = spi_flash_write(getPartitionTableAddr(), partition_buffer, SPI_FLASH_SEC_SIZE);
-    if (err != ESP_OK) {
-        snprintf(c_buffer, sizeof(c_buffer), "Failed to write partition table: 0x%x\n", err);
+    plan_part_t *parts = work.parts;
+    _plan_parts(ws, partitions, partition_count, parts);
+
+
+    _add_output(ws, "\nTarget partition table:\n");
+    plan_part_t *to = work.to;
+    for (int i=0; i<table->count; i++) {
+        const part_entry_t & e = table->entries[i];
+        to[i] = {e.type, e.subtype, e.address, e.size, e.size, e.label};
+        snprintf(c_buffer, sizeof(c_buffer), "Type: %02x / %02x, Addr: 0x%06x, Size: 0x%06x (%dK): %s\n",
+                e.type, e.subtype, e.address, e.size, (int)(e.size/1024), e.label);
         _add_output(ws, c_buffer);
-        free(partition_buffer);
-        return;
     }
-    unsigned long time_end = micros();
-    snprintf(c_buffer, sizeof(c_buffer), " ... Partition table written in %lu ms\n", (time_end-time_start)/1000);
-    _add_output(ws, c_buffer);
 
-    uint8_t* move_buffer = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
-    if (move_buffer == NULL) {
-        snprintf(c_buffer, sizeof(c_buffer), "Failed to allocate memory for buffer\n");
+    journal_t & job = work.job;
+    memset(&job, 0, sizeof(job));
+    plan_candidate_t *summary = (plan_candidate_t *)malloc(sizeof(plan_candidate_t));
+    plan_cost_model_t cost_model = PLAN_COST_MODEL_DEFAULT;
+    flash_bench_cost_model(cost_model); // this chip's timing, once /flash-bench measured it
+    ok = (summary != NULL) &&
+         plan_transition(parts, partition_count, to, table->count, env.running_address, cost_model,
+                         job, *summary, error, sizeof(error));
+    if (!ok) {
+        snprintf(c_buffer, sizeof(c_buffer), "ERROR: Can't get there: %s\n", (summary != NULL) ? error : "out of memory");
         _add_output(ws, c_buffer);
-        free(partition_buffer);
-        return;
+        free(summary);
+        free(table);
+        return PART_MGR_FAILED;
     }
 
-    // time to clean up partitions
-    for (int i = partition_count - 1; i >= 0; i--) {
-        if (planner[i].action_erase) {
-            snprintf(c_buffer, sizeof(c_buffer), "Erasing partition %i at 0x%x, length 0x%x\n", 
-                    i, planner[i].address_new, planner[i].size_new);
-            _add_output(ws, c_buffer);
-            time_start = micros();
-            err = spi_flash_erase_range(planner[i].address_old, planner[i].size_old);
-            if (err != ESP_OK) {
-                snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
-                _add_output(ws, c_buffer);
-            } else {
-                time_end = micros();
-                snprintf(c_buffer, sizeof(c_buffer), " ... Partition erased in %lu ms\n", (time_end-time_start)/1000);
-                _add_output(ws, c_buffer);
-            }
+    // show the plan
+    snprintf(c_buffer, sizeof(c_buffer), "\nPlan: %u steps, moves %uK, erases %uK, ~%u ms\n",
+             job.step_count, summary->bytes_moved/1024, summary->bytes_erased/1024, summary->cost_ms);
+    _add_output(ws, c_buffer);
+    if (report != NULL) {
+        report->table_new = *table;
+        report->candidate_count = 1;
+        report->best = 0;
+        report->candidates[0].strategy = "target";
+        report->candidates[0].shrink[0] = '\0';
+        report->candidates[0].bytes_moved = summary->bytes_moved;
+        report->candidates[0].bytes_erased = summary->bytes_erased;
+        report->candidates[0].cost_ms = summary->cost_ms;
+    }
+    free(summary);
+    for (int n=0; n<job.step_count; n++) {
+        const journal_step_t & step = job.steps[n];
+        if (step.kind == JOURNAL_STEP_MOVE) {
+            snprintf(c_buffer, sizeof(c_buffer), "%2d. move %s: 0x%x -> 0x%x, 0x%x bytes\n",
+                     n + 1, to[step.partition].label, step.addr_from, step.addr_to, step.size);
+        } else {
+            snprintf(c_buffer, sizeof(c_buffer), "%2d. blank %s: 0x%x, 0x%x bytes\n",
+                     n + 1, to[step.partition].label, step.addr_to, step.size);
         }
+        _add_output(ws, c_buffer);
+    }
 
-        if (planner[i].action_move && (planner[i].address_new!=planner[i].address_old)) {
-            snprintf(c_buffer, sizeof(c_buffer), "Moving partition %i from 0x%x to 0x%x length 0x%x ...\n ",
-                     i, planner[i].address_old, planner[i].address_new, planner[i].size_new);
-            _add_output(ws, c_buffer);
-            int counter = 0;
-            time_start = micros();
-            for (int32_t j = planner[i].size_new - SPI_FLASH_SEC_SIZE; j >= 0; j -= SPI_FLASH_SEC_SIZE) {
-                snprintf(c_buffer, sizeof(c_buffer), "0x%x  ", planner[i].address_old + j);
-                _add_output(ws, c_buffer);
-                counter++; if (counter % 8 == 0) _add_output(ws, "\n ");
-                err = spi_flash_read(planner[i].address_old + j, move_buffer, SPI_FLASH_SEC_SIZE);
-                if (err != ESP_OK) {
-                    snprintf(c_buffer, sizeof(c_buffer), "Failed to read partition chunk: 0x%x\n", err);
-                    _add_output(ws, c_buffer);
-                    free(move_buffer);
-                    free(partition_buffer);
-                    break;
-                }
-                err = spi_flash_erase_range(planner[i].address_new+j, SPI_FLASH_SEC_SIZE);
-                if (err != ESP_OK) {
-                    snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
-                    _add_output(ws, c_buffer);
-                    // whatever, we will continue
-                }
-                err = spi_flash_write(planner[i].address_new + j, move_buffer, SPI_FLASH_SEC_SIZE);
-                if (err != ESP_OK) {
-                    snprintf(c_buffer, sizeof(c_buffer), "Failed to write partition chunk: 0x%x\n", err);
-                    _add_output(ws, c_buffer);
-                    // we will also continue
-                }
-            }
-            if (counter % 8 != 0) _add_output(ws, "\n ");
-            time_end = micros();
-            snprintf(c_buffer, sizeof(c_buffer), "... Partition moved %i sectors in %lu ms (%lu ms/sector)\n", 
-                counter, (time_end-time_start)/1000, (time_end-time_start)/(1000*counter));
-            _add_output(ws, c_buffer);
-        }
+    if (test_only) {
+        _add_output(ws, "\nEverything looks good! Try it for real now!\n");
+        free(table);
+        return PART_MGR_TESTED;
     }
-    free(move_buffer);
+    _add_output(ws, "\nDoing the work now...\n");
+
+    // parts[] labels point into the old table; keep a copy, the buffer gets the new one
+    char (*labels)[17] = work.labels;
+    for (int i=0; i<partition_count; i++) {
+        memcpy(labels[i], parts[i].label, sizeof(labels[i]));
+        labels[i][16] = '\0';
+        parts[i].label = labels[i];
+    }
+    part_table_encode(*table, (uint8_t *)partition_buffer);
+    md5_offset = table->count * PART_TABLE_ENTRY_SIZE;
+    free(table);
+    part_mgr_result_t result = _apply(ws, partition_buffer, md5_offset, parts, partition_count, job, opts);
+    return result;
+}
 
+part_mgr_result_t partition_mgr_run(OutputSink & out, const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                                    bool test_only) {
+    _ReportSink ws(out, opts.report);
+    _run_work_t *work = _run_work_new(ws);
+    if (work == NULL) return ws.finish(PART_MGR_FAILED);
+    part_mgr_result_t result = _run(ws, env, opts, test_only, *work);
+    free(work);
+    return ws.finish(result);
+}
+
+part_mgr_result_t partition_mgr_target(OutputSink & out, const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                                       const uint8_t *target, size_t target_len, bool test_only) {
+    _ReportSink ws(out, opts.report);
+    _run_work_t *work = _run_work_new(ws);
+    if (work == NULL) return ws.finish(PART_MGR_FAILED);
+    part_mgr_result_t result = _target(ws, env, opts, target, target_len, test_only, *work);
+    free(work);
+    return ws.finish(result);
+}
+
+// Finish a run that was interrupted after the table was written, if there is one
+static part_mgr_result_t _resume(OutputSink & ws, const part_mgr_opts_t & opts, journal_t & job) {
+    if (!journal_load(job)) return PART_MGR_UNNECESSARY;
+
+    // only if the table on flash is the one the job was made for; if it never
+    // got written, the old layout is still intact and there's nothing to do
+    uint8_t table_md5[16];
+    if (!getPartitionTableMd5(table_md5) || memcmp(table_md5, job.table_md5, sizeof(table_md5)) != 0) {
+        _add_output(ws, "Found a repartition journal for another partition table; ignoring it.\n");
+        journal_clear();
+        return PART_MGR_UNNECESSARY;
+    }
+
+    char c_buffer[80];
+    snprintf(c_buffer, sizeof(c_buffer), "Resuming repartition at step %u of %u\n",
+             job.step + 1, job.step_count);
+    _add_output(ws, c_buffer);
+    if (opts.report != NULL) opts.report->applied = true; // by the run before
+    bool ok = _run_steps(ws, job, opts, true, job.step_count);
+    if (!ok) return PART_MGR_FAILED; // keep the journal, maybe it works next time
+    journal_clear();
     _add_output(ws, "Partitions erased / moved: OK\n");
+    return PART_MGR_DONE;
+}
 
-    _add_output(ws, "Partition table updated.\n\n");
-    _add_output(ws, "READY! After reboot, upload the firmware that you need.\n\n");
+part_mgr_result_t partition_mgr_resume(OutputSink & out, const part_mgr_opts_t & opts) {
+    _ReportSink ws(out, opts.report);
+    // the journal alone is 3K; off the stack of setup() too
+    journal_t *job = (journal_t *)malloc(sizeof(journal_t));
+    if (job == NULL) {
+        _add_output(ws, "ERROR: Not enough memory to resume the repartition.\n");
+        return ws.finish(PART_MGR_FAILED);
+    }
+    part_mgr_result_t result = _resume(ws, opts, *job);
+    free(job);
+    return ws.finish(result);
+}
 
-    _add_output(ws, "Rebooting...\n");
-    _add_output(ws, "\n");
-    _add_output(ws, HTML_OUTRO); // unless we already rebooted, lol
+#ifndef REPART_HOST
+// what the running firmware knows about itself
+part_mgr_env_t partition_mgr_env() {
+    part_mgr_env_t env;
+    const esp_partition_t* p_running = esp_ota_get_running_partition();
+    const esp_partition_t* p_next = esp_ota_get_next_update_partition(NULL);
+    env.running_address = p_running->address;
+    env.next_address = (p_next == NULL) ? 0 : p_next->address;
+    env.flash_encrypted = esp_flash_encryption_enabled();
+    return env;
+}
+
+// the new table is written; say so & reboot into it
+static void _finish_and_reboot(OutputSink & out) {
+    _add_output(out, "READY! After reboot, upload the firmware that you need.\n\n");
 
-    time_start = millis();
+    _add_output(out, "Rebooting...\n");
+    _add_output(out, "\n");
+    _add_output(out, HTML_OUTRO); // unless we already rebooted, lol
+    out.flush();
+
+    unsigned long time_start = millis();
     while (millis() - time_start < 2000) delay(100); // non-blocking delay
 
-    _add_output(ws, "\n"); // sometimes it just doesn't send the rest. this is a hack.
-    free(partition_buffer);
+    _add_output(out, "\n"); // sometimes it just doesn't send the rest. this is a hack.
+    out.flush();
 
     // send results
     ESP.restart();
 }
+
+// Expand app partitions to our ideal size, output to response 
+void partition_mgr_fix(std::unique_ptr<WebServer> & ws, const part_mgr_opts_t & opts, bool test_only) {
+    WebOutputSink web(ws);
+    BufferedSink out(web, opts.verbosity);
+    if (partition_mgr_run(out, partition_mgr_env(), opts, test_only) != PART_MGR_DONE) {
+        return;
+    }
+    _finish_and_reboot(out);
+}
+
+// Switch to an uploaded partition table, output to response
+void partition_mgr_fix_target(std::unique_ptr<WebServer> & ws, const part_mgr_opts_t & opts,
+                              const uint8_t *target, size_t target_len, bool test_only) {
+    WebOutputSink web(ws);
+    BufferedSink out(web, opts.verbosity);
+    if (partition_mgr_target(out, partition_mgr_env(), opts, target, target_len, test_only) != PART_MGR_DONE) {
+        return;
+    }
+    _finish_and_reboot(out);
+}
+#endif
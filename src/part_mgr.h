@@ -1,10 +1,90 @@
 #ifndef PART_MGR_H
 #define PART_MGR_H
 
-#include "WebServer.h"
+#include "out_sink.h"
+#include "part_move.h"
+#include "part_table.h"
 
+// what we know about the running firmware, which can't be read from the table
+typedef struct {
+    uint32_t running_address;           /*!< address of the app partition we're running from */
+    uint32_t next_address;              /*!< address of the next OTA app partition, 0 if none */
+    bool flash_encrypted;               /*!< flash encryption is enabled */
+} part_mgr_env_t;
+
+typedef enum {
+    PART_MGR_FAILED = 0,                /*!< didn't work (or refused to) */
+    PART_MGR_UNNECESSARY,               /*!< app partitions already large enough */
+    PART_MGR_TESTED,                    /*!< dry run passed */
+    PART_MGR_DONE,                      /*!< partitions moved, table written; reboot needed */
+} part_mgr_result_t;
+
+typedef struct {
+    const char *strategy;
+    char shrink[17];                    /*!< label of the data partition that gives up space; "" = free space */
+    uint32_t bytes_moved;
+    uint32_t bytes_erased;
+    uint32_t cost_ms;
+} part_mgr_report_candidate_t;
+
+typedef struct {
+    journal_step_t step;
+    bool done;                          /*!< finished, in this run or an earlier one */
+    uint32_t time_ms;                   /*!< this run's time on it */
+    move_stats_t stats;                 /*!< moves & cleans */
+} part_mgr_report_step_t;
+
+// the facts of a run, as the log tells them, for the JSON API
+typedef struct {
+    part_mgr_result_t result;
+    char error[96];                     /*!< first error line of the log, "" if none */
+    part_table_t table;                 /*!< table on flash when the run started; count 0 = not read */
+    part_table_t table_new;             /*!< what it becomes; count 0 = didn't get that far */
+    uint32_t size_delta;                /*!< resize runs: how much the apps grow */
+    uint32_t relocate_ms;               /*!< copying the running firmware first; in each candidate's cost_ms */
+    int candidate_count;
+    int best;                           /*!< index into candidates; -1 = none */
+    part_mgr_report_candidate_t candidates[PLAN_MAX_CANDIDATES];
+    int step_count;
+    part_mgr_report_step_t steps[JOURNAL_MAX_STEPS];
+    bool applied;                       /*!< got as far as writing the table */
+    unsigned long start_ms;
+    uint32_t plan_ms;                   /*!< reading the table & images, planning */
+    uint32_t table_ms;                  /*!< writing the new table */
+    uint32_t steps_ms;                  /*!< moving & erasing */
+    uint32_t total_ms;
+} part_mgr_report_t;
+
+#define PART_MGR_STRATEGY_LEN   24  // longest strategy name, and then some
+
+// how to do the work; all zeros = defaults
+typedef struct {
+    move_mode_t move_mode;              /*!< how partitions are moved */
+    char strategy[PART_MGR_STRATEGY_LEN]; /*!< layout strategy to use; "" = cheapest */
+    out_verbosity_t verbosity;          /*!< for the sinks the web handlers & the job make */
+    bool keep_fs;                       /*!< carry the files of a shrunk LittleFS / SPIFFS partition over */
+    part_mgr_report_t *report;          /*!< filled in by the run if set */
+} part_mgr_opts_t;
+
+// copy a strategy name into opts, cut to fit; NULL or "" = cheapest
+void part_mgr_opts_strategy(part_mgr_opts_t & opts, const char *strategy);
 size_t getPartitionTableAddr();
-void partition_mgr_fix(std::unique_ptr<WebServer> & ws, bool test_only);
-void getPartitionApp1(esp_partition_t *part);
+bool getPartitionTableMd5(uint8_t *md5);
+void resetPartitionTableAddr();
+part_mgr_result_t partition_mgr_run(OutputSink & ws, const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                                    bool test_only);
+// switch to the given table (binary or CSV) instead, keeping partitions with the same label
+part_mgr_result_t partition_mgr_target(OutputSink & ws, const part_mgr_env_t & env, const part_mgr_opts_t & opts,
+                                       const uint8_t *target, size_t target_len, bool test_only);
+// finish an interrupted run from its journal; UNNECESSARY if there's none
+part_mgr_result_t partition_mgr_resume(OutputSink & ws, const part_mgr_opts_t & opts);
+#ifndef REPART_HOST
+part_mgr_env_t partition_mgr_env();
+void partition_mgr_fix(std::unique_ptr<WebServer> & ws, const part_mgr_opts_t & opts, bool test_only);
+void partition_mgr_fix_target(std::unique_ptr<WebServer> & ws, const part_mgr_opts_t & opts,
+                              const uint8_t *target, size_t target_len, bool test_only);
+// the OTA slot we don't run from; false if there is none
+bool getPartitionApp1(esp_partition_t *part);
+#endif
 
 #endif
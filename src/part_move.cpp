@@ -0,0 +1,646 @@
+/**
+ * @file part_move.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Moves partition contents around in flash, chunk by chunk.
+ *
+ * Each chunk (the RAM window) is read completely before anything in its
+ * destination is erased. Chunks are done starting at the end when moving up,
+ * and at the start when moving down, so a chunk's destination only ever covers
+ * source bytes that are already copied or sitting in RAM.
+ *
+ * The pipeline mode keeps the same order, one sector at a time: a reader task
+ * stages source sectors a few ahead, a writer task erases & programs them, and
+ * the caller just sends the log. Reading ahead is safe because the sectors
+ * read early lie further from the destination than the ones being written.
+ *
+ * For resumable moves, no chunk is longer than the move distance. That way a
+ * chunk's destination never covers its own source, and redoing the chunk that
+ * was cut short finds its source intact.
+ *
+ * Every sector written is checked: the mover takes the CRC of the source while
+ * it's in RAM, and a checker task on the other core reads the destination back
+ * while the next sectors are erased & programmed. A chunk is only committed to
+ * the journal once its sectors check out, so after a mismatch the redo still
+ * finds its source.
+ */
+
+#ifndef REPART_HOST
+#include "esp_heap_caps.h"
+#endif
+#include "part_move.h"
+#include "sector_pool.h"
+#include "flash_dev.h"
+#include "gz_stream.h"
+#include "port_task.h"
+#include "utils.h"
+
+// largest block we could malloc right now
+static size_t _largest_free_block() {
+#ifdef REPART_HOST
+    return 0x1C000; // about what an ESP32 running WiFi + the portal has
+#else
+    return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#endif
+}
+
+const char *move_mode_name(move_mode_t mode) {
+    switch (mode) {
+        case MOVE_MODE_BLOCK: return "block";
+        case MOVE_MODE_SECTOR: return "sector";
+        case MOVE_MODE_PIPELINE: return "pipeline";
+    }
+    return "?";
+}
+
+// sinks that don't want every sector's address get a line every 10% instead;
+// false if `after` is still in the same 10% as `before`
+static bool _summary_line(char *buf, size_t len, uint32_t before, uint32_t after, uint32_t size) {
+    if (size == 0 || after * 10 / size == before * 10 / size) return false;
+    snprintf(buf, len, "%u%% moved (%uK of %uK)\n ", after * 100 / size, after / 1024, size / 1024);
+    return true;
+}
+
+// --- verification ---
+
+typedef enum {
+    _VERIFY_SECTOR = 0,                 // check the sector at addr
+    _VERIFY_SYNC,                       // ack once everything before is checked
+    _VERIFY_END,                        // ack & end the task
+} _verify_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    uint32_t addr;
+    uint32_t crc;                       // of the source
+} _verify_item_t;
+
+class _Verifier {
+public:
+    _Verifier(move_stats_t & stats)
+        : _stats(stats), _todo(sizeof(_verify_item_t), MOVE_VERIFY_DEPTH),
+          _ack(sizeof(uint8_t), 1), _task(false), _failed(false) {}
+    ~_Verifier() {
+        stop();
+    }
+    // false if there's no RAM for it; without a task, add() checks right away
+    bool start() {
+        if (!_buffer.ok()) return false;
+        _task = _todo.ok() && _ack.ok() &&
+                port_task_start(_verify_task, this, "move_verify", 3072, MOVE_VERIFY_CORE);
+        return true;
+    }
+    // `src` is what the sector at `dest` should have now
+    void add(uint32_t dest, const uint8_t *src) {
+        _verify_item_t item = {_VERIFY_SECTOR, dest, gz_crc32(0, src, SPI_FLASH_SEC_SIZE)};
+        if (_task) _todo.send(&item, PORT_MAX_WAIT); else _check(item);
+    }
+    // wait until all added so far are checked; false if one didn't match
+    bool sync() {
+        _wait(_VERIFY_SYNC);
+        return !_failed;
+    }
+    bool failed() { return _failed; }
+    void stop() {
+        _wait(_VERIFY_END);
+        _task = false;
+    }
+private:
+    static void _verify_task(void *arg) {
+        _Verifier *v = (_Verifier *)arg;
+        _verify_item_t item;
+        uint8_t ack = 0;
+        while (v->_todo.receive(&item, PORT_MAX_WAIT)) {
+            if (item.kind == _VERIFY_SECTOR) {
+                v->_check(item);
+                continue;
+            }
+            // after the ack, the owner may be gone
+            bool end = (item.kind == _VERIFY_END);
+            v->_ack.send(&ack, PORT_MAX_WAIT);
+            if (end) break;
+        }
+    }
+    void _check(const _verify_item_t & item) {
+        unsigned long time_start = micros();
+        bool ok = flash_dev().read(item.addr, _buffer.data(), SPI_FLASH_SEC_SIZE) == ESP_OK &&
+                  gz_crc32(0, _buffer.data(), SPI_FLASH_SEC_SIZE) == item.crc;
+        _stats.verify_us += micros() - time_start;
+        if (ok) {
+            _stats.verified++;
+            return;
+        }
+        if (_stats.verify_errors++ == 0) _stats.verify_first_bad = item.addr;
+        _failed = true;
+    }
+    void _wait(uint8_t kind) {
+        if (!_task) return;
+        _verify_item_t item = {kind, 0, 0};
+        uint8_t ack;
+        _todo.send(&item, PORT_MAX_WAIT);
+        _ack.receive(&ack, PORT_MAX_WAIT);
+    }
+    move_stats_t & _stats;
+    SectorBuffer _buffer;
+    PortQueue _todo;
+    PortQueue _ack;
+    bool _task;                         // checker task running
+    volatile bool _failed;
+};
+
+// erase + program one erase unit (64K block or 4K sector) of the chunk;
+// dst is a one-sector scratch buffer for comparing with what's there now
+static esp_err_t _move_unit(OutputSink & ws, uint32_t addr_to, uint32_t len,
+                            const uint8_t *src, uint8_t *dst, move_stats_t & stats, _Verifier & verify) {
+    char c_buffer[64];
+    esp_err_t err;
+    int sectors = len / SPI_FLASH_SEC_SIZE;
+    bool same[MOVE_BLOCK_SIZE / SPI_FLASH_SEC_SIZE], dst_blank[MOVE_BLOCK_SIZE / SPI_FLASH_SEC_SIZE];
+    int need_erase = 0;
+    for (int s = 0; s < sectors; s++) {
+        size_t o = s * SPI_FLASH_SEC_SIZE;
+        err = flash_dev().read(addr_to + o, dst, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to read partition chunk: 0x%x\n", err);
+            _add_output(ws, c_buffer);
+            return err;
+        }
+        same[s] = (memcmp(src + o, dst, SPI_FLASH_SEC_SIZE) == 0);
+        dst_blank[s] = is_blank(dst, SPI_FLASH_SEC_SIZE);
+        if (!same[s] && !dst_blank[s]) need_erase++;
+    }
+
+    bool block_erase = (len == MOVE_BLOCK_SIZE) && (need_erase >= MOVE_BLOCK_MIN_ERASES);
+    if (block_erase) {
+        err = flash_dev().erase_range(addr_to, len);
+        stats.block_erases++;
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
+            _add_output(ws, c_buffer);
+            return err;
+        }
+    }
+    for (int s = 0; s < sectors; s++) {
+        size_t o = s * SPI_FLASH_SEC_SIZE;
+        bool src_blank = is_blank(src + o, SPI_FLASH_SEC_SIZE);
+        if (!block_erase) {
+            // nothing to do if the destination already has it
+            if (same[s]) {
+                stats.skipped++;
+                continue;
+            }
+            // no need to erase what's already blank
+            if (!dst_blank[s]) {
+                err = flash_dev().erase_range(addr_to + o, SPI_FLASH_SEC_SIZE);
+                stats.sector_erases++;
+                if (err != ESP_OK) {
+                    snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
+                    _add_output(ws, c_buffer);
+                    return err;
+                }
+            }
+        }
+        // blank source sector: the erase was all we needed
+        if (src_blank) {
+            if (same[s]) stats.skipped++; else stats.blanked++;
+            verify.add(addr_to + o, src + o);
+            continue;
+        }
+        stats.copied++;
+        err = flash_dev().write(addr_to + o, src + o, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to write partition chunk: 0x%x\n", err);
+            _add_output(ws, c_buffer);
+            return err;
+        }
+        verify.add(addr_to + o, src + o);
+    }
+    return ESP_OK;
+}
+
+// --- pipeline mode ---
+
+#define PIPE_LOG_LEN 60
+#define PIPE_LOG_DEPTH 24
+
+typedef struct {
+    int16_t slot;                       // -1: no more sectors
+    uint32_t offset;                    // within the partition
+} _pipe_item_t;
+
+typedef struct {
+    uint8_t done;                       // 1: writer finished
+    char text[PIPE_LOG_LEN];
+} _pipe_log_t;
+
+typedef struct {
+    uint32_t addr_from, addr_to, size;
+    bool moving_up;
+    bool block_erase_ok;                // far enough apart to erase whole blocks early
+    uint8_t *slots;                     // MOVE_PIPELINE_SLOTS sectors
+    uint8_t *scratch;                   // one sector, writer only
+    PortQueue *free_q;                  // slot numbers the reader can fill
+    PortQueue *full_q;                  // _pipe_item_t for the writer
+    PortQueue *log_q;                   // _pipe_log_t for the caller
+    move_stats_t *stats;
+    _Verifier *verify;
+    const move_resume_t *resume;
+    uint32_t commit_sectors;            // with resume: commit every this many sectors
+    bool verbose;                       // log every sector, not just every 10%
+    volatile uint32_t done;             // bytes written so far, for the caller's progress
+    volatile esp_err_t err;
+} _pipe_ctx_t;
+
+// progress lines may be dropped if the caller is behind; errors never are
+static void _pipe_log(_pipe_ctx_t *ctx, const char *text, bool must_send) {
+    _pipe_log_t msg;
+    msg.done = 0;
+    strncpy(msg.text, text, sizeof(msg.text) - 1);
+    msg.text[sizeof(msg.text) - 1] = '\0';
+    if (!ctx->log_q->send(&msg, must_send ? PORT_MAX_WAIT : 0)) ctx->stats->log_dropped++;
+}
+
+static void _pipe_reader(void *arg) {
+    _pipe_ctx_t *ctx = (_pipe_ctx_t *)arg;
+    char c_buffer[PIPE_LOG_LEN];
+    uint32_t sectors = ctx->size / SPI_FLASH_SEC_SIZE;
+    uint32_t first = ctx->resume ? ctx->resume->done / SPI_FLASH_SEC_SIZE : 0;
+    for (uint32_t n = first; n < sectors && ctx->err == ESP_OK; n++) {
+        _pipe_item_t item;
+        item.offset = (ctx->moving_up ? sectors - 1 - n : n) * SPI_FLASH_SEC_SIZE;
+        ctx->free_q->receive(&item.slot, PORT_MAX_WAIT);
+        esp_err_t err = flash_dev().read(ctx->addr_from + item.offset,
+                                         ctx->slots + item.slot * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to read partition chunk: 0x%x\n", err);
+            _pipe_log(ctx, c_buffer, true);
+            ctx->err = err;
+            break;
+        }
+        ctx->full_q->send(&item, PORT_MAX_WAIT);
+    }
+    _pipe_item_t end = {-1, 0};
+    ctx->full_q->send(&end, PORT_MAX_WAIT);
+}
+
+// if the sector starts a new destination block with enough to erase, erase it whole
+static bool _pipe_block_erase(_pipe_ctx_t *ctx, uint32_t dest, uint32_t &block) {
+    uint32_t b = dest & ~(MOVE_BLOCK_SIZE - 1);
+    if (b == block) return false;
+    block = b;
+    if (!ctx->block_erase_ok || b < ctx->addr_to || b + MOVE_BLOCK_SIZE > ctx->addr_to + ctx->size) return false;
+    // only if the whole block is still to do; a resumed move can start halfway in
+    uint32_t first = ctx->moving_up ? b + MOVE_BLOCK_SIZE - SPI_FLASH_SEC_SIZE : b;
+    if (dest != first) return false;
+    // we don't have the source yet, so count what's not blank
+    int dirty = 0;
+    for (uint32_t o = 0; o < MOVE_BLOCK_SIZE; o += SPI_FLASH_SEC_SIZE) {
+        if (flash_dev().read(b + o, ctx->scratch, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+        if (!is_blank(ctx->scratch, SPI_FLASH_SEC_SIZE)) dirty++;
+    }
+    if (dirty < MOVE_BLOCK_MIN_ERASES) return false;
+    esp_err_t err = flash_dev().erase_range(b, MOVE_BLOCK_SIZE);
+    ctx->stats->block_erases++;
+    if (err != ESP_OK) {
+        char c_buffer[PIPE_LOG_LEN];
+        snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
+        _pipe_log(ctx, c_buffer, true);
+        ctx->err = err;
+        return false;
+    }
+    return true;
+}
+
+// one more sector done, in order; tell the journal every so often, once what's
+// written so far checks out
+static void _pipe_commit(_pipe_ctx_t *ctx, uint32_t &done) {
+    char c_buffer[PIPE_LOG_LEN];
+    if (!ctx->verbose && _summary_line(c_buffer, sizeof(c_buffer), done, done + SPI_FLASH_SEC_SIZE, ctx->size)) {
+        _pipe_log(ctx, c_buffer, false);
+    }
+    done += SPI_FLASH_SEC_SIZE;
+    ctx->done = done;
+    if (ctx->resume == NULL) return;
+    if (done == ctx->size || (done / SPI_FLASH_SEC_SIZE) % ctx->commit_sectors == 0) {
+        if (!ctx->verify->sync()) {
+            ctx->err = ESP_ERR_INVALID_CRC;
+            return;
+        }
+        ctx->resume->commit(ctx->resume->ctx, done);
+    }
+}
+
+static void _pipe_writer(void *arg) {
+    _pipe_ctx_t *ctx = (_pipe_ctx_t *)arg;
+    move_stats_t &stats = *ctx->stats;
+    char c_buffer[PIPE_LOG_LEN];
+    uint32_t block = 0xFFFFFFFF;
+    bool block_erased = false;
+    int counter = 0;
+    uint32_t done = ctx->resume ? ctx->resume->done : 0;
+    _pipe_item_t item;
+    while (ctx->full_q->receive(&item, PORT_MAX_WAIT) && item.slot >= 0) {
+        // after an error, only hand the slots back until the reader notices
+        if (ctx->err != ESP_OK || ctx->verify->failed()) {
+            ctx->free_q->send(&item.slot, PORT_MAX_WAIT);
+            continue;
+        }
+        const uint8_t *src = ctx->slots + item.slot * SPI_FLASH_SEC_SIZE;
+        uint32_t dest = ctx->addr_to + item.offset;
+        esp_err_t err;
+
+        if (ctx->verbose) {
+            snprintf(c_buffer, sizeof(c_buffer), "0x%x  ", ctx->addr_from + item.offset);
+            counter++; if (counter % 8 == 0) strcat(c_buffer, "\n ");
+            _pipe_log(ctx, c_buffer, false);
+        }
+
+        if ((dest & ~(MOVE_BLOCK_SIZE - 1)) != block) block_erased = _pipe_block_erase(ctx, dest, block);
+        if (ctx->err != ESP_OK) {
+            ctx->free_q->send(&item.slot, PORT_MAX_WAIT);
+            continue;
+        }
+        bool src_blank = is_blank(src, SPI_FLASH_SEC_SIZE);
+        if (!block_erased) {
+            err = flash_dev().read(dest, ctx->scratch, SPI_FLASH_SEC_SIZE);
+            // nothing to do if the destination already has it
+            if (err == ESP_OK && memcmp(src, ctx->scratch, SPI_FLASH_SEC_SIZE) == 0) {
+                stats.skipped++;
+                ctx->free_q->send(&item.slot, PORT_MAX_WAIT);
+                _pipe_commit(ctx, done);
+                continue;
+            }
+            // no need to erase what's already blank
+            if (err != ESP_OK || !is_blank(ctx->scratch, SPI_FLASH_SEC_SIZE)) {
+                err = flash_dev().erase_range(dest, SPI_FLASH_SEC_SIZE);
+                stats.sector_erases++;
+                if (err != ESP_OK) {
+                    snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
+                    _pipe_log(ctx, c_buffer, true);
+                    ctx->err = err;
+                    ctx->free_q->send(&item.slot, PORT_MAX_WAIT);
+                    continue;
+                }
+            }
+        }
+        if (src_blank) {
+            stats.blanked++;
+        } else {
+            stats.copied++;
+            err = flash_dev().write(dest, src, SPI_FLASH_SEC_SIZE);
+            if (err != ESP_OK) {
+                snprintf(c_buffer, sizeof(c_buffer), "Failed to write partition chunk: 0x%x\n", err);
+                _pipe_log(ctx, c_buffer, true);
+                ctx->err = err;
+                ctx->free_q->send(&item.slot, PORT_MAX_WAIT);
+                continue;
+            }
+        }
+        ctx->verify->add(dest, src);
+        ctx->free_q->send(&item.slot, PORT_MAX_WAIT);
+        _pipe_commit(ctx, done);
+    }
+    if (counter % 8 != 0) _pipe_log(ctx, "\n ", true);
+    _pipe_log_t msg;
+    msg.done = 1;
+    ctx->log_q->send(&msg, PORT_MAX_WAIT);
+}
+
+static esp_err_t _partition_move_pipelined(OutputSink & ws, uint32_t addr_from, uint32_t addr_to, uint32_t size,
+                                           move_stats_t & stats, _Verifier & verify, const move_resume_t *resume) {
+    uint32_t distance = (addr_to > addr_from) ? addr_to - addr_from : addr_from - addr_to;
+    _pipe_ctx_t ctx;
+    ctx.addr_from = addr_from; ctx.addr_to = addr_to; ctx.size = size;
+    ctx.moving_up = (addr_to > addr_from);
+    ctx.stats = &stats;
+    ctx.verify = &verify;
+    ctx.resume = resume;
+    // erasing a block early wipes the source a block further on; with a
+    // journal, that source must also be committed already
+    uint32_t commit_len = (distance < MOVE_COMMIT_INTERVAL) ? distance : MOVE_COMMIT_INTERVAL;
+    ctx.commit_sectors = commit_len / SPI_FLASH_SEC_SIZE;
+    ctx.block_erase_ok = (distance >= MOVE_BLOCK_SIZE + (resume ? commit_len : 0));
+    ctx.done = resume ? resume->done : 0;
+    ctx.verbose = (ws.verbosity() == OUT_VERBOSITY_SECTORS);
+    ctx.err = ESP_OK;
+    stats.window = (MOVE_PIPELINE_SLOTS + 1) * SPI_FLASH_SEC_SIZE;
+
+    ctx.slots = (uint8_t *)malloc(stats.window);
+    if (ctx.slots == NULL) {
+        _add_output(ws, "Failed to allocate memory for buffer\n");
+        return ESP_ERR_NO_MEM;
+    }
+    ctx.scratch = ctx.slots + MOVE_PIPELINE_SLOTS * SPI_FLASH_SEC_SIZE;
+    PortQueue free_q(sizeof(int16_t), MOVE_PIPELINE_SLOTS);
+    PortQueue full_q(sizeof(_pipe_item_t), MOVE_PIPELINE_SLOTS + 1);
+    PortQueue log_q(sizeof(_pipe_log_t), PIPE_LOG_DEPTH);
+    ctx.free_q = &free_q; ctx.full_q = &full_q; ctx.log_q = &log_q;
+    if (!free_q.ok() || !full_q.ok() || !log_q.ok()) {
+        _add_output(ws, "Failed to allocate memory for queues\n");
+        free(ctx.slots);
+        return ESP_ERR_NO_MEM;
+    }
+    for (int16_t slot = 0; slot < MOVE_PIPELINE_SLOTS; slot++) free_q.send(&slot, 0);
+
+    if (!port_task_start(_pipe_writer, &ctx, "move_writer", 4096, MOVE_WRITER_CORE)) {
+        _add_output(ws, "Failed to start writer task\n");
+        free(ctx.slots);
+        return ESP_ERR_NO_MEM;
+    }
+    if (!port_task_start(_pipe_reader, &ctx, "move_reader", 3072, MOVE_READER_CORE)) {
+        // writer is waiting for sectors; tell it there are none
+        _add_output(ws, "Failed to start reader task\n");
+        _pipe_item_t end = {-1, 0};
+        full_q.send(&end, PORT_MAX_WAIT);
+        ctx.err = ESP_ERR_NO_MEM;
+    }
+
+    // we're the output task now, until the writer is done
+    _pipe_log_t msg;
+    while (log_q.receive(&msg, PORT_MAX_WAIT) && !msg.done) {
+        _add_output(ws, msg.text);
+        ws.progress(MOVE_PHASE_MOVING, ctx.done, size);
+    }
+    ws.progress(MOVE_PHASE_MOVING, ctx.done, size);
+    free(ctx.slots);
+    return ctx.err;
+}
+
+// block & sector mode: a RAM window at a time
+static esp_err_t _partition_move_chunked(OutputSink & ws, uint32_t addr_from, uint32_t addr_to, uint32_t size,
+                                         move_mode_t mode, move_stats_t & stats, _Verifier & verify,
+                                         const move_resume_t *resume) {
+    char c_buffer[64];
+
+    // block mode needs a window of at least one block; the sector to compare with comes from the pool
+    uint32_t window = SPI_FLASH_SEC_SIZE;
+    if (mode == MOVE_MODE_BLOCK) {
+        size_t avail = _largest_free_block();
+        avail = (avail > MOVE_HEAP_RESERVE) ? avail - MOVE_HEAP_RESERVE : 0;
+        window = (avail > MOVE_WINDOW_MAX) ? MOVE_WINDOW_MAX : (avail & ~(MOVE_BLOCK_SIZE - 1));
+        if (window < MOVE_BLOCK_SIZE) {
+            _add_output(ws, "Not enough RAM for block mode, using sector mode.\n ");
+            mode = MOVE_MODE_SECTOR;
+            window = SPI_FLASH_SEC_SIZE;
+        }
+    }
+    // resumable: a chunk must not overwrite its own source
+    uint32_t distance = (addr_to > addr_from) ? addr_to - addr_from : addr_from - addr_to;
+    if (resume != NULL && window > distance) window = distance & ~(SPI_FLASH_SEC_SIZE - 1);
+    bool align_blocks = (mode == MOVE_MODE_BLOCK) && (window >= MOVE_BLOCK_SIZE);
+    stats.mode = mode;
+    stats.window = window;
+
+    // a sector-sized window is a pool buffer too
+    SectorBuffer dst, src_sector(window == SPI_FLASH_SEC_SIZE);
+    uint8_t *src_buffer = (window == SPI_FLASH_SEC_SIZE) ? src_sector.data() : (uint8_t *)malloc(window);
+    if (src_buffer == NULL || !dst.ok()) {
+        if (src_buffer != src_sector.data()) free(src_buffer);
+        _add_output(ws, "Failed to allocate memory for buffer\n");
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t *dst_buffer = dst.data();
+
+    bool moving_up = (addr_to > addr_from);
+    uint32_t done = resume ? resume->done : 0;
+    uint32_t start = moving_up ? size - done : done, end = start;
+    int counter = 0;
+    bool verbose = (ws.verbosity() == OUT_VERBOSITY_SECTORS);
+    esp_err_t err = ESP_OK;
+    while (moving_up ? (start > 0) : (end < size)) {
+        // next chunk; in block mode, the inner chunk edge is block aligned at the destination
+        if (moving_up) {
+            end = start;
+            start = (end > window) ? end - window : 0;
+            if (align_blocks && start > 0) {
+                start = ((addr_to + start + MOVE_BLOCK_SIZE - 1) & ~(MOVE_BLOCK_SIZE - 1)) - addr_to;
+            }
+        } else {
+            start = end;
+            end = (size - start > window) ? start + window : size;
+            if (align_blocks && end < size) {
+                end = ((addr_to + end) & ~(MOVE_BLOCK_SIZE - 1)) - addr_to;
+            }
+        }
+        uint32_t len = end - start;
+
+        for (int32_t j = len - SPI_FLASH_SEC_SIZE; verbose && j >= 0; j -= SPI_FLASH_SEC_SIZE) {
+            snprintf(c_buffer, sizeof(c_buffer), "0x%x  ", addr_from + start + j);
+            _add_output(ws, c_buffer);
+            counter++; if (counter % 8 == 0) _add_output(ws, "\n ");
+        }
+        err = flash_dev().read(addr_from + start, src_buffer, len);
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to read partition chunk: 0x%x\n", err);
+            _add_output(ws, c_buffer);
+            break;
+        }
+
+        // whole aligned blocks where we can, sectors at the edges
+        for (uint32_t pos = 0; pos < len; ) {
+            uint32_t unit = SPI_FLASH_SEC_SIZE;
+            if (align_blocks && ((addr_to + start + pos) % MOVE_BLOCK_SIZE) == 0 &&
+                pos + MOVE_BLOCK_SIZE <= len) {
+                unit = MOVE_BLOCK_SIZE;
+            }
+            err = _move_unit(ws, addr_to + start + pos, unit, src_buffer + pos, dst_buffer, stats, verify);
+            if (err != ESP_OK) break;
+            pos += unit;
+        }
+        if (err != ESP_OK) break;
+        // the journal may only move on past sectors that check out
+        if (resume != NULL ? !verify.sync() : verify.failed()) {
+            err = ESP_ERR_INVALID_CRC;
+            break;
+        }
+        uint32_t chunk_done = moving_up ? size - start : end;
+        if (resume != NULL) resume->commit(resume->ctx, chunk_done);
+        ws.progress(MOVE_PHASE_MOVING, chunk_done, size);
+        if (!verbose && _summary_line(c_buffer, sizeof(c_buffer), chunk_done - len, chunk_done, size)) {
+            _add_output(ws, c_buffer);
+        }
+    }
+    if (counter % 8 != 0) _add_output(ws, "\n ");
+    if (src_buffer != src_sector.data()) free(src_buffer);
+    return err;
+}
+
+esp_err_t partition_move(OutputSink & ws, uint32_t addr_from, uint32_t addr_to, uint32_t size,
+                         move_mode_t mode, move_stats_t & stats, const move_resume_t *resume) {
+    char c_buffer[96];
+    memset(&stats, 0, sizeof(stats));
+    unsigned long time_start = micros();
+    stats.sectors = size / SPI_FLASH_SEC_SIZE;
+    stats.mode = mode;
+
+    _Verifier verify(stats);
+    if (!verify.start()) {
+        _add_output(ws, "Failed to allocate memory for buffer\n");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = (mode == MOVE_MODE_PIPELINE) ?
+        _partition_move_pipelined(ws, addr_from, addr_to, size, stats, verify, resume) :
+        _partition_move_chunked(ws, addr_from, addr_to, size, mode, stats, verify, resume);
+    verify.stop();
+    stats.time_us = micros() - time_start;
+    if (verify.failed()) {
+        snprintf(c_buffer, sizeof(c_buffer), "Moved data doesn't match its source: %u sectors, first at 0x%x\n",
+                 stats.verify_errors, stats.verify_first_bad);
+        _add_output(ws, c_buffer);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return err;
+}
+
+esp_err_t partition_erase(OutputSink & ws, uint32_t addr, uint32_t size, move_stats_t & stats) {
+    char c_buffer[64];
+    memset(&stats, 0, sizeof(stats));
+    unsigned long time_start = micros();
+    stats.mode = MOVE_MODE_BLOCK;
+    stats.window = SPI_FLASH_SEC_SIZE;
+    stats.sectors = size / SPI_FLASH_SEC_SIZE;
+
+    SectorBuffer sector;
+    uint8_t *buffer = sector.data();
+    if (buffer == NULL) {
+        _add_output(ws, "Failed to allocate memory for buffer\n");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    for (uint32_t pos = 0; pos < size && err == ESP_OK; ) {
+        uint32_t unit = SPI_FLASH_SEC_SIZE;
+        if (((addr + pos) % MOVE_BLOCK_SIZE) == 0 && pos + MOVE_BLOCK_SIZE <= size) unit = MOVE_BLOCK_SIZE;
+        bool dirty[MOVE_BLOCK_SIZE / SPI_FLASH_SEC_SIZE];
+        int dirty_count = 0;
+        for (uint32_t o = 0; o < unit; o += SPI_FLASH_SEC_SIZE) {
+            err = flash_dev().read(addr + pos + o, buffer, SPI_FLASH_SEC_SIZE);
+            if (err != ESP_OK) break;
+            dirty[o / SPI_FLASH_SEC_SIZE] = !is_blank(buffer, SPI_FLASH_SEC_SIZE);
+            if (dirty[o / SPI_FLASH_SEC_SIZE]) dirty_count++;
+        }
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to read partition chunk: 0x%x\n", err);
+            _add_output(ws, c_buffer);
+            break;
+        }
+        stats.skipped += unit / SPI_FLASH_SEC_SIZE - dirty_count;
+        stats.blanked += dirty_count;
+        if (unit == MOVE_BLOCK_SIZE && dirty_count >= MOVE_BLOCK_MIN_ERASES) {
+            err = flash_dev().erase_range(addr + pos, unit);
+            stats.block_erases++;
+        } else {
+            for (uint32_t o = 0; o < unit && err == ESP_OK; o += SPI_FLASH_SEC_SIZE) {
+                if (!dirty[o / SPI_FLASH_SEC_SIZE]) continue;
+                err = flash_dev().erase_range(addr + pos + o, SPI_FLASH_SEC_SIZE);
+                stats.sector_erases++;
+            }
+        }
+        if (err != ESP_OK) {
+            snprintf(c_buffer, sizeof(c_buffer), "Failed to erase partition: 0x%x\n", err);
+            _add_output(ws, c_buffer);
+        }
+        pos += unit;
+        ws.progress(MOVE_PHASE_ERASING, pos, size);
+    }
+    stats.time_us = micros() - time_start;
+    return err;
+}
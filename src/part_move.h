@@ -0,0 +1,65 @@
+#ifndef PART_MOVE_H
+#define PART_MOVE_H
+
+// Moving a partition's contents to a new address, overlap-safe.
+#include "out_sink.h"
+
+#define MOVE_BLOCK_SIZE         0x10000     // flash 64K block erase
+#define MOVE_WINDOW_MAX         0x20000     // biggest RAM window we bother with
+#define MOVE_HEAP_RESERVE       0x4000      // leave this much for WiFi & the web server
+#define MOVE_BLOCK_MIN_ERASES   4           // a 64K erase beats this many 4K erases
+#define MOVE_PIPELINE_SLOTS     4           // sectors the reader may stage ahead of the writer
+#define MOVE_READER_CORE        0           // pipeline reader task; WiFi lives here too
+#define MOVE_WRITER_CORE        1           // pipeline writer task; same core as the Arduino loop
+#define MOVE_COMMIT_INTERVAL    0x10000     // pipeline: report progress for the journal this often
+#define MOVE_VERIFY_CORE        0           // reads back & checks what was written, while the writer goes on
+#define MOVE_VERIFY_DEPTH       16          // written sectors the checker may fall behind by
+
+// phases passed to OutputSink::progress()
+#define MOVE_PHASE_MOVING       "moving"
+#define MOVE_PHASE_ERASING      "erasing"
+
+typedef enum {
+    MOVE_MODE_BLOCK = 0,                /*!< RAM window sized from heap, 64K erases where aligned */
+    MOVE_MODE_SECTOR,                   /*!< one 4K sector at a time, 4K erases */
+    MOVE_MODE_PIPELINE,                 /*!< reader & writer tasks, log output from the caller */
+} move_mode_t;
+
+typedef struct {
+    move_mode_t mode;                   /*!< mode actually used (block falls back to sector if low on RAM) */
+    uint32_t window;                    /*!< RAM window used, bytes */
+    uint32_t sectors;                   /*!< sectors in the partition */
+    uint32_t copied;                    /*!< sectors programmed */
+    uint32_t blanked;                   /*!< sectors that only needed an erase */
+    uint32_t skipped;                   /*!< sectors that were already right */
+    uint32_t block_erases;
+    uint32_t sector_erases;
+    uint32_t log_dropped;               /*!< pipeline: progress lines dropped to keep the writer going */
+    uint32_t verified;                  /*!< sectors read back after writing & found to match */
+    uint32_t verify_errors;             /*!< sectors that didn't match their source */
+    uint32_t verify_first_bad;          /*!< address of the first one */
+    unsigned long verify_us;            /*!< time the checker spent reading back & hashing */
+    unsigned long time_us;
+} move_stats_t;
+
+// lets a move be picked up again after a power cut. Progress is counted in
+// bytes from where the move starts (the end, when moving up). commit() is
+// called once the bytes so far are moved for good; nothing after that point
+// overwrites source data that a redo would still need.
+typedef struct {
+    uint32_t done;                      /*!< bytes already moved by an earlier run */
+    void (*commit)(void *ctx, uint32_t done);
+    void *ctx;
+} move_resume_t;
+
+const char *move_mode_name(move_mode_t mode);
+// copy `size` bytes from addr_from to addr_to, either direction, ranges may overlap;
+// resume may be NULL if the move doesn't need to survive a power cut. Each
+// sector written is checked against the CRC of its source; ESP_ERR_INVALID_CRC
+// if one doesn't match. Stops at the first failed erase or write.
+esp_err_t partition_move(OutputSink & ws, uint32_t addr_from, uint32_t addr_to, uint32_t size,
+                         move_mode_t mode, move_stats_t & stats, const move_resume_t *resume);
+// erase whatever in the range isn't blank yet; 64K erases where that's cheaper
+esp_err_t partition_erase(OutputSink & ws, uint32_t addr, uint32_t size, move_stats_t & stats);
+
+#endif // PART_MOVE_H
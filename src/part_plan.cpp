@@ -0,0 +1,498 @@
+/**
+ * @file part_plan.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Works out candidate layouts & what each one costs.
+ *
+ * The grown apps need `size_delta` more bytes. Everything between the first
+ * grown app and wherever that space comes from shifts up by the growth so far,
+ * so the cost depends mostly on how far away the space is found. The first
+ * grown app stays where it is (we're running from it), the other grown apps
+ * are erased rather than moved; OTA rewrites them anyway. Running from one of
+ * those, the firmware is copied to the first one before anything else.
+ */
+
+#include "part_plan.h"
+
+typedef struct {
+    const plan_part_t *parts;
+    int count;
+    uint32_t flash_size;
+    const plan_cost_model_t *model;
+    plan_result_t *result;
+    int biggest;                        /*!< biggest data partition, -1 if none */
+} _plan_ctx_t;
+
+typedef struct {
+    const char *name;
+    void (*propose)(_plan_ctx_t &ctx, const char *name);
+} _plan_strategy_t;
+
+// what a set of partitions costs to move & erase
+typedef struct {
+    uint64_t cost_us;
+    uint32_t bytes_moved;
+    uint32_t bytes_erased;
+    bool fits;                          /*!< all of them end up inside the flash */
+} _plan_work_t;
+
+static uint64_t _erase_cost_us(const plan_cost_model_t &model, uint32_t len) {
+    return (uint64_t)(len / 0x10000) * model.erase_64k_us +
+           (uint64_t)((len % 0x10000) / SPI_FLASH_SEC_SIZE) * model.erase_4k_us;
+}
+
+static uint64_t _read_cost_us(const plan_cost_model_t &model, uint32_t len) {
+    return (uint64_t)len * model.read_4k_us / SPI_FLASH_SEC_SIZE;
+}
+
+static bool _is_grown_app(const plan_part_t &p) {
+    return p.type == ESP_PARTITION_TYPE_APP &&
+           (p.subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0 || p.subtype == ESP_PARTITION_SUBTYPE_APP_OTA_1) &&
+           p.size < RESIZE_APP_PARTITION_SIZE;
+}
+
+static void _work_add(_plan_work_t &sum, const _plan_work_t &w) {
+    sum.cost_us += w.cost_us; sum.bytes_moved += w.bytes_moved; sum.bytes_erased += w.bytes_erased;
+}
+
+static void _work_sub(_plan_work_t &sum, const _plan_work_t &w) {
+    sum.cost_us -= w.cost_us; sum.bytes_moved -= w.bytes_moved; sum.bytes_erased -= w.bytes_erased;
+}
+
+// partition i, `offset` from where it is now and `size_new` big (0 = same, or
+// the grown size for apps): where it goes, and what that costs
+static void _plan_part(const plan_part_t *parts, int i, int first_app_index, int64_t offset, uint32_t size_new,
+                       _my_partition_planner_t &p) {
+    p.address_old = parts[i].address;
+    p.size_old = parts[i].size;
+    p.address_new = 0; p.size_new = size_new;
+    p.action_erase = false; p.action_move = false;
+    if (_is_grown_app(parts[i])) {
+        p.size_new = RESIZE_APP_PARTITION_SIZE;
+        if (i != first_app_index) p.action_erase = true;
+    }
+    if (offset != 0) {
+        p.address_new = p.address_old + offset;
+        if (!p.action_erase) {
+            p.action_move = true;
+            if (!p.size_new) p.size_new = p.size_old;
+        }
+    }
+}
+
+static _plan_work_t _part_work(const _plan_ctx_t &ctx, int i, int64_t offset, uint32_t size_new) {
+    _my_partition_planner_t p;
+    _plan_part(ctx.parts, i, ctx.result->first_app_index, offset, size_new, p);
+    _plan_work_t w = {0, 0, 0, true};
+    int64_t address = (int64_t)p.address_old + offset;
+    uint32_t size = p.size_new ? p.size_new : p.size_old;
+    w.fits = address >= 0 && address + size <= ctx.flash_size;
+
+    // what the work would cost: see partition_mgr_run()
+    uint32_t used = ctx.parts[i].used;
+    if (p.action_erase) {
+        w.bytes_erased = used;
+        w.cost_us = _erase_cost_us(*ctx.model, used) + _read_cost_us(*ctx.model, p.size_old - used);
+    } else if (p.action_move) {
+        uint32_t moved = (used < p.size_new) ? used : p.size_new;
+        w.bytes_moved = moved;
+        w.bytes_erased = moved;
+        // read the source & compare the destination, erase, program; then check the tail
+        w.cost_us = 2 * _read_cost_us(*ctx.model, moved) + _erase_cost_us(*ctx.model, moved) +
+                    (uint64_t)(moved / 0x100) * ctx.model->program_page_us +
+                    _read_cost_us(*ctx.model, p.size_new - moved);
+    }
+    return w;
+}
+
+// the running firmware to the first app, the way partition_mgr_run() relocates
+// it: read, compare, erase & program the image, then point otadata at it
+static uint64_t _relocate_cost_us(const plan_cost_model_t &model, uint32_t used) {
+    return 2 * _read_cost_us(model, used) + _erase_cost_us(model, used) +
+           (uint64_t)(used / 0x100) * model.program_page_us +
+           _read_cost_us(model, 2 * SPI_FLASH_SEC_SIZE) + model.erase_4k_us + model.program_page_us;
+}
+
+static int64_t _growth(const plan_part_t &p) {
+    return _is_grown_app(p) ? (int64_t)RESIZE_APP_PARTITION_SIZE - p.size : 0;
+}
+
+// add the layout (or, when full, swap it for the dearest of a strategy that has others)
+static void _plan_add(_plan_ctx_t &ctx, const char *name, int shrink, const _plan_work_t &work) {
+    if (!work.fits) return;
+    plan_result_t &result = *ctx.result;
+    uint32_t cost_ms = work.cost_us / 1000;
+    int slot = result.count;
+    if (slot >= PLAN_MAX_CANDIDATES) {
+        bool first_of_strategy = true;
+        slot = -1;
+        for (int n=0; n<result.count; n++) {
+            if (strcmp(result.candidates[n].strategy, name) == 0) first_of_strategy = false;
+            int same = 0;
+            for (int k=0; k<result.count; k++) {
+                same += (strcmp(result.candidates[k].strategy, result.candidates[n].strategy) == 0);
+            }
+            if (same > 1 && (slot < 0 || result.candidates[n].cost_ms > result.candidates[slot].cost_ms)) slot = n;
+        }
+        if (slot < 0 || (!first_of_strategy && cost_ms >= result.candidates[slot].cost_ms)) return;
+    } else {
+        result.count++;
+    }
+    plan_candidate_t &c = result.candidates[slot];
+    c.strategy = name;
+    c.shrink_index = shrink;
+    c.bytes_moved = work.bytes_moved;
+    c.bytes_erased = work.bytes_erased;
+    c.cost_ms = cost_ms;
+}
+
+// Every layout where a data partition that `want`s to pays for the growth, in
+// two passes: before the one that shrinks, partitions shift by the growth so
+// far; after it, by that less size_delta. The sums of both kinds make each
+// candidate's cost without going over the table again for it.
+static void _plan_walk(_plan_ctx_t &ctx, const char *name, bool (*want)(_plan_ctx_t &ctx, int i)) {
+    const plan_result_t &result = *ctx.result;
+    _plan_work_t after = {0, 0, 0, true};
+    int last_misfit_after = -1;
+    int64_t growth = 0;
+    for (int i=0; i<ctx.count; i++) {
+        _plan_work_t w = _part_work(ctx, i, growth - result.size_delta, 0);
+        _work_add(after, w);
+        if (!w.fits) last_misfit_after = i;
+        growth += _growth(ctx.parts[i]);
+    }
+    _plan_work_t before = {0, 0, 0, true};
+    growth = 0;
+    for (int i=0; i<ctx.count && before.fits; i++) {
+        // `after` is what's behind i from here on
+        _work_sub(after, _part_work(ctx, i, growth - result.size_delta, 0));
+        if (want(ctx, i)) {
+            _plan_work_t w = _part_work(ctx, i, growth, ctx.parts[i].size - result.size_delta);
+            _work_add(w, before);
+            _work_add(w, after);
+            w.fits = w.fits && last_misfit_after <= i;
+            _plan_add(ctx, name, i, w);
+        }
+        _plan_work_t w = _part_work(ctx, i, growth, 0);
+        _work_add(before, w);
+        before.fits = before.fits && w.fits;
+        growth += _growth(ctx.parts[i]);
+    }
+}
+
+static bool _can_shrink(_plan_ctx_t &ctx, int i) {
+    // only after the first grown app; before it, the running app would have to move
+    return i > ctx.result->first_app_index && ctx.parts[i].type == ESP_PARTITION_TYPE_DATA &&
+           ctx.parts[i].size > ctx.result->size_delta;
+}
+
+static int _biggest_data(const plan_part_t *parts, int count) {
+    int biggest_data_index = -1; uint32_t biggest_data_size = 0;
+    for (int i=0; i<count; i++) {
+        if (parts[i].type == ESP_PARTITION_TYPE_DATA && parts[i].size > biggest_data_size) {
+            biggest_data_size = parts[i].size;
+            biggest_data_index = i;
+        }
+    }
+    return biggest_data_index;
+}
+
+static bool _want_biggest(_plan_ctx_t &ctx, int i) {
+    return i == ctx.biggest && _can_shrink(ctx, i);
+}
+
+static bool _want_other(_plan_ctx_t &ctx, int i) {
+    return i != ctx.biggest && _can_shrink(ctx, i);
+}
+
+// the classic: take it from the biggest data partition
+static void _propose_biggest(_plan_ctx_t &ctx, const char *name) {
+    _plan_walk(ctx, name, _want_biggest);
+}
+
+// any other data partition that's big enough; closer to the apps moves less
+static void _propose_other(_plan_ctx_t &ctx, const char *name) {
+    _plan_walk(ctx, name, _want_other);
+}
+
+// unpartitioned flash after the last partition, e.g. a 4MB layout on 8MB
+static void _propose_free_space(_plan_ctx_t &ctx, const char *name) {
+    _plan_work_t all = {0, 0, 0, true};
+    int64_t growth = 0;
+    for (int i=0; i<ctx.count; i++) {
+        _plan_work_t w = _part_work(ctx, i, growth, 0);
+        _work_add(all, w);
+        all.fits = all.fits && w.fits;
+        growth += _growth(ctx.parts[i]);
+    }
+    _plan_add(ctx, name, -1, all);
+}
+
+static const _plan_strategy_t plan_strategies[] = {
+    {"shrink-biggest", _propose_biggest},
+    {"shrink-other", _propose_other},
+    {"free-space", _propose_free_space},
+};
+
+const char *plan_strategy_name(int i) {
+    if (i < 0 || i >= (int)(sizeof(plan_strategies)/sizeof(plan_strategies[0]))) return NULL;
+    return plan_strategies[i].name;
+}
+
+void plan_layouts(const plan_part_t *parts, int count, uint32_t flash_size, uint32_t running_address,
+                  const plan_cost_model_t &model, const char *strategy, plan_result_t &result) {
+    result.size_delta = 0;
+    result.first_app_index = -1;
+    result.relocate_ms = 0;
+    result.count = 0;
+    result.best = -1;
+    for (int i=0; i<count; i++) {
+        if (_is_grown_app(parts[i])) {
+            result.size_delta += RESIZE_APP_PARTITION_SIZE - parts[i].size;
+            if (result.first_app_index == -1) result.first_app_index = i;
+        }
+    }
+    if (result.size_delta == 0) return;
+
+    _plan_ctx_t ctx = {parts, count, flash_size, &model, &result, _biggest_data(parts, count)};
+    for (const _plan_strategy_t &s : plan_strategies) {
+        s.propose(ctx, s.name);
+    }
+    // every layout erases a grown app other than the first; running from one, it's copied first
+    for (int i=0; i<count; i++) {
+        if (parts[i].type == ESP_PARTITION_TYPE_APP && parts[i].address == running_address &&
+            _is_grown_app(parts[i]) && i != result.first_app_index) {
+            result.relocate_ms = _relocate_cost_us(model, parts[i].used) / 1000;
+        }
+    }
+    for (int i=0; i<result.count; i++) {
+        result.candidates[i].cost_ms += result.relocate_ms;
+    }
+    // cheapest wins; on a tie, the earlier one
+    for (int i=0; i<result.count; i++) {
+        if (strategy != NULL && strcmp(strategy, result.candidates[i].strategy) != 0) continue;
+        if (result.best < 0 || result.candidates[i].cost_ms < result.candidates[result.best].cost_ms) {
+            result.best = i;
+        }
+    }
+}
+
+void plan_candidate_layout(const plan_part_t *parts, int count, const plan_result_t &result, int n,
+                           _my_partition_planner_t *planner) {
+    int shrink = result.candidates[n].shrink_index;
+    int64_t offset = 0;
+    for (int i=0; i<count; i++) {
+        _plan_part(parts, i, result.first_app_index, offset, (i == shrink) ? parts[i].size - result.size_delta : 0,
+                   planner[i]);
+        if (planner[i].size_new != 0) offset += (int64_t)planner[i].size_new - planner[i].size_old;
+    }
+}
+
+// the old layout by address & by label, to find things in it without going over all of it
+typedef struct {
+    const plan_part_t *by_address[MAX_NUMBER_OF_PARTITIONS];
+    const plan_part_t *by_label[MAX_NUMBER_OF_PARTITIONS];
+    int count;
+} _from_index_t;
+
+static int _cmp_address(const void *a, const void *b) {
+    uint32_t x = (*(const plan_part_t * const *)a)->address, y = (*(const plan_part_t * const *)b)->address;
+    return (x > y) - (x < y);
+}
+
+static int _cmp_label(const void *a, const void *b) {
+    return strcmp((*(const plan_part_t * const *)a)->label, (*(const plan_part_t * const *)b)->label);
+}
+
+static void _index_from(const plan_part_t *from, int from_count, _from_index_t &index) {
+    index.count = from_count;
+    for (int i=0; i<from_count; i++) index.by_address[i] = index.by_label[i] = &from[i];
+    qsort(index.by_address, from_count, sizeof(index.by_address[0]), _cmp_address);
+    qsort(index.by_label, from_count, sizeof(index.by_label[0]), _cmp_label);
+}
+
+// the old partition with that label, type & subtype; NULL if there's none
+static const plan_part_t *_find_source(const _from_index_t &index, const plan_part_t &target) {
+    const plan_part_t *key = &target;
+    const plan_part_t * const *found = (const plan_part_t * const *)
+        bsearch(&key, index.by_label, index.count, sizeof(index.by_label[0]), _cmp_label);
+    if (found == NULL || (*found)->type != target.type || (*found)->subtype != target.subtype) return NULL;
+    return *found;
+}
+
+// first of the old partitions (by address) that ends after addr
+static int _first_ending_after(const _from_index_t &index, uint32_t addr) {
+    int lo = 0, hi = index.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (index.by_address[mid]->address + index.by_address[mid]->size <= addr) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// bytes of [addr, addr+len) that hold data in the old layout, i.e. need erasing
+static uint32_t _dirty_overlap(const _from_index_t &index, uint32_t addr, uint32_t len) {
+    uint32_t dirty = 0;
+    for (int i=_first_ending_after(index, addr); i<index.count && index.by_address[i]->address < addr + len; i++) {
+        const plan_part_t &p = *index.by_address[i];
+        uint32_t a = (p.address > addr) ? p.address : addr;
+        uint32_t b_from = p.address + p.used, b_range = addr + len;
+        uint32_t b = (b_from < b_range) ? b_from : b_range;
+        if (b > a) dirty += b - a;
+    }
+    return dirty;
+}
+
+static bool _overlaps(uint32_t a, uint32_t a_len, uint32_t b, uint32_t b_len) {
+    return a < b + b_len && b < a + a_len;
+}
+
+static bool _plan_transition(const plan_part_t *from, const plan_part_t *to, int to_count,
+                             uint32_t running_address, const plan_cost_model_t &model, const _from_index_t &index,
+                             journal_t &job, plan_candidate_t &summary, char *error, size_t error_len) {
+    static const uint8_t NONE = 0xFF;
+    // moves go to the front of job.steps, in the new table's order, so by destination;
+    // cleans to the back for now
+    journal_step_t *moves = job.steps, *cleans = job.steps + JOURNAL_MAX_STEPS;
+    uint8_t move_of[MAX_NUMBER_OF_PARTITIONS];  // old partition -> its move
+    int move_count = 0, clean_count = 0;
+    bool running_kept = false;
+    uint64_t cost_us = 0;
+    summary.strategy = "target";
+    summary.shrink_index = -1;
+    summary.bytes_moved = 0; summary.bytes_erased = 0; summary.cost_ms = 0;
+    memset(move_of, NONE, sizeof(move_of));
+
+    for (int t=0; t<to_count; t++) {
+        const plan_part_t &target = to[t];
+        if (t > 0 && target.address < to[t-1].address) {
+            snprintf(error, error_len, "%s: the new table isn't in address order", target.label);
+            return false;
+        }
+        const plan_part_t *source = _find_source(index, target);
+        uint32_t keep = 0;
+        if (source != NULL && source->address == running_address) {
+            if (target.address != running_address || target.size < source->used) {
+                snprintf(error, error_len, "%s is the running app; it has to stay at 0x%x with %uK or more",
+                         target.label, running_address, source->used/1024);
+                return false;
+            }
+            running_kept = true;
+            keep = source->used;
+        } else if (source != NULL) {
+            bool dropped_app = source->type == ESP_PARTITION_TYPE_APP && source->size != target.size &&
+                               source->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 &&
+                               source->subtype <= ESP_PARTITION_SUBTYPE_APP_OTA_0 + 15;
+            if (!dropped_app) keep = (source->used < target.size) ? source->used : target.size;
+        }
+        if (keep > 0 && source->address != target.address) {
+            move_of[source - from] = move_count;
+            moves[move_count++] = {JOURNAL_STEP_MOVE, (uint8_t)t, source->address, target.address, keep};
+            summary.bytes_moved += keep;
+        }
+        // in place, the old partition past its data is blank already; only what it grew by isn't
+        uint32_t blank_from = keep;
+        if (source != NULL && keep > 0 && source->address == target.address) {
+            blank_from = (source->size < target.size) ? source->size : target.size;
+        }
+        if (blank_from < target.size) {
+            *--cleans = {JOURNAL_STEP_CLEAN, (uint8_t)t, 0, target.address + blank_from, target.size - blank_from};
+            clean_count++;
+        }
+    }
+    if (!running_kept) {
+        snprintf(error, error_len, "the running app (0x%x) isn't in the new table with the same label & type",
+                 running_address);
+        return false;
+    }
+
+    // a move can go once its destination covers no other pending move's source:
+    // count what each one waits for, then take them as they come free
+    uint8_t waits_for[MAX_NUMBER_OF_PARTITIONS], order[MAX_NUMBER_OF_PARTITIONS];
+    int ready = 0, taken = 0;
+    for (int m=0; m<move_count; m++) {
+        waits_for[m] = 0;
+        for (int i=_first_ending_after(index, moves[m].addr_to);
+             i<index.count && index.by_address[i]->address < moves[m].addr_to + moves[m].size; i++) {
+            uint8_t o = move_of[index.by_address[i] - from];
+            waits_for[m] += (o != NONE && o != m &&
+                             _overlaps(moves[m].addr_to, moves[m].size, moves[o].addr_from, moves[o].size));
+        }
+        if (waits_for[m] == 0) order[ready++] = m;
+    }
+    while (taken < ready) {
+        const journal_step_t &done = moves[order[taken++]];
+        // destinations are in order; find those on top of the source that's free now
+        int lo = 0, hi = move_count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (moves[mid].addr_to + moves[mid].size <= done.addr_from) lo = mid + 1; else hi = mid;
+        }
+        for (int m=lo; m<move_count && moves[m].addr_to < done.addr_from + done.size; m++) {
+            if (&moves[m] != &done && _overlaps(moves[m].addr_to, moves[m].size, done.addr_from, done.size) &&
+                --waits_for[m] == 0) {
+                order[ready++] = m;
+            }
+        }
+    }
+    if (ready < move_count) {
+        snprintf(error, error_len, "partitions swap places; no order of moves keeps their data");
+        return false;
+    }
+
+    // put the moves in that order, one cycle of the permutation at a time
+    bool placed[MAX_NUMBER_OF_PARTITIONS] = {false};
+    for (int p=0; p<move_count; p++) {
+        if (placed[p]) continue;
+        journal_step_t first = moves[p];
+        for (int j=p; ; j=order[j]) {
+            placed[j] = true;
+            if (order[j] == p) {
+                moves[j] = first;
+                break;
+            }
+            moves[j] = moves[order[j]];
+        }
+    }
+    job.step_count = move_count;
+    for (int n=0; n<move_count; n++) {
+        uint32_t dirty = _dirty_overlap(index, moves[n].addr_to, moves[n].size);
+        summary.bytes_erased += dirty;
+        cost_us += 2 * _read_cost_us(model, moves[n].size) + _erase_cost_us(model, dirty) +
+                   (uint64_t)(moves[n].size / 0x100) * model.program_page_us;
+    }
+    // whatever isn't moved data has to end up blank; sources are all copied by now.
+    // The cleans are at the back, last one first: turn them around, then after the moves
+    for (int a=0, b=clean_count-1; a<b; a++, b--) {
+        journal_step_t swap = cleans[a];
+        cleans[a] = cleans[b];
+        cleans[b] = swap;
+    }
+    memmove(job.steps + move_count, cleans, clean_count * sizeof(journal_step_t));
+    for (int n=0; n<clean_count; n++) {
+        const journal_step_t &clean = job.steps[job.step_count++];
+        uint32_t dirty = _dirty_overlap(index, clean.addr_to, clean.size);
+        summary.bytes_erased += dirty;
+        cost_us += _read_cost_us(model, clean.size) + _erase_cost_us(model, dirty);
+    }
+    summary.cost_ms = cost_us / 1000;
+    return true;
+}
+
+bool plan_transition(const plan_part_t *from, int from_count, const plan_part_t *to, int to_count,
+                     uint32_t running_address, const plan_cost_model_t &model,
+                     journal_t &job, plan_candidate_t &summary, char *error, size_t error_len) {
+    if (from_count > MAX_NUMBER_OF_PARTITIONS || to_count > MAX_NUMBER_OF_PARTITIONS) {
+        snprintf(error, error_len, "more than %d partitions", MAX_NUMBER_OF_PARTITIONS);
+        return false;
+    }
+    // two pointers per partition; off the stack of whoever plans
+    _from_index_t *index = (_from_index_t *)malloc(sizeof(_from_index_t));
+    if (index == NULL) {
+        snprintf(error, error_len, "out of memory");
+        return false;
+    }
+    _index_from(from, from_count, *index);
+    bool ok = _plan_transition(from, to, to_count, running_address, model, *index, job, summary, error, error_len);
+    free(index);
+    return ok;
+}
@@ -0,0 +1,80 @@
+#ifndef PART_PLAN_H
+#define PART_PLAN_H
+
+// Planning the new layout: which partitions grow, shrink, move or get erased.
+// Each strategy proposes candidate layouts, the cost model picks the cheapest.
+#include "main.h"
+#include "journal.h"
+
+#define MAX_NUMBER_OF_PARTITIONS 95 // what the 0xC00 byte table holds, with its MD5 entry
+#define PLAN_MAX_CANDIDATES     12  // when there are more, each strategy keeps its cheapest
+
+// a partition as the planner sees it
+typedef struct {
+    uint8_t type;                       /*!< partition type (app/data) */
+    uint8_t subtype;                    /*!< partition subtype */
+    uint32_t address;
+    uint32_t size;
+    uint32_t used;                      /*!< bytes that hold data: the image for apps, else all */
+    const char *label;
+} plan_part_t;
+
+typedef struct {
+    uint32_t address_old;
+    uint32_t address_new;               /*!< 0 = unchanged */
+    uint32_t size_old;
+    uint32_t size_new;                  /*!< 0 = unchanged */
+    bool action_erase;
+    bool action_move;
+} _my_partition_planner_t;
+
+// flash timing the estimates are based on
+typedef struct {
+    uint32_t erase_4k_us;
+    uint32_t erase_64k_us;
+    uint32_t program_page_us;           /*!< per 256 bytes */
+    uint32_t read_4k_us;
+} plan_cost_model_t;
+
+// typical 4MB SPI NOR, same as the host flash simulation
+#define PLAN_COST_MODEL_DEFAULT { 45000, 150000, 700, 800 }
+
+typedef struct {
+    const char *strategy;               /*!< who proposed it */
+    int shrink_index;                   /*!< data partition that gives up space; -1 = free space at the end */
+    uint32_t bytes_moved;
+    uint32_t bytes_erased;
+    uint32_t cost_ms;                   /*!< estimated time for the moves & erases */
+} plan_candidate_t;
+
+typedef struct {
+    uint32_t size_delta;                /*!< how much the apps grow; 0 = nothing to do */
+    int first_app_index;                /*!< first app that grows; it stays in place */
+    uint32_t relocate_ms;               /*!< copying the running firmware to the first app first; in each cost_ms */
+    int count;
+    int best;                           /*!< index into candidates; -1 = no valid layout */
+    plan_candidate_t candidates[PLAN_MAX_CANDIDATES];
+} plan_result_t;
+
+// Find the candidate layouts that grow the OTA apps to RESIZE_APP_PARTITION_SIZE.
+// strategy NULL: best is the cheapest of all, else the cheapest of that strategy.
+// Running from an app that gets erased, the costs include copying it over first.
+// Takes time linear in count, however many data partitions could shrink.
+void plan_layouts(const plan_part_t *parts, int count, uint32_t flash_size, uint32_t running_address,
+                  const plan_cost_model_t &model, const char *strategy, plan_result_t &result);
+// what candidate n of plan_layouts() does to each of the count partitions
+void plan_candidate_layout(const plan_part_t *parts, int count, const plan_result_t &result, int n,
+                           _my_partition_planner_t *planner);
+// Steps from one layout to another: partitions with the same label, type & subtype
+// keep their data (moved if the address changes), everything else ends up blank.
+// Resized OTA apps other than the running one are dropped, as OTA rewrites them.
+// The running app has to stay put. Moves are ordered so that none writes over a
+// source that's still needed; false + error if the layout can't be reached.
+// `to` has to be in address order, like part_table_check() wants it.
+bool plan_transition(const plan_part_t *from, int from_count, const plan_part_t *to, int to_count,
+                     uint32_t running_address, const plan_cost_model_t &model,
+                     journal_t &job, plan_candidate_t &summary, char *error, size_t error_len);
+// name of strategy i, NULL past the last one
+const char *plan_strategy_name(int i);
+
+#endif // PART_PLAN_H
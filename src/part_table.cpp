@@ -0,0 +1,232 @@
+/**
+ * @file part_table.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Parses, checks and encodes partition tables.
+ */
+
+#include "part_table.h"
+#include <MD5Builder.h>
+
+typedef struct {
+    const char *name;
+    uint8_t value;
+} _name_value_t;
+
+static const _name_value_t type_names[] = {
+    {"app", ESP_PARTITION_TYPE_APP}, {"data", ESP_PARTITION_TYPE_DATA},
+};
+static const _name_value_t app_subtypes[] = {
+    {"factory", 0x00}, {"test", 0x20},
+};
+static const _name_value_t data_subtypes[] = {
+    {"ota", 0x00}, {"phy", 0x01}, {"nvs", 0x02}, {"coredump", 0x03}, {"nvs_keys", 0x04},
+    {"efuse", 0x05}, {"undefined", 0x06}, {"esphttpd", 0x80}, {"fat", 0x81},
+    {"spiffs", 0x82}, {"littlefs", 0x83},
+};
+
+// number with optional K / M suffix
+static bool _parse_number(const char *s, uint32_t &value) {
+    if (*s == '\0') return false;
+    char *end;
+    unsigned long v = strtoul(s, &end, 0);
+    if (*end == 'K' || *end == 'k') { v *= 1024; end++; }
+    else if (*end == 'M' || *end == 'm') { v *= 1024 * 1024; end++; }
+    if (*end != '\0') return false;
+    value = v;
+    return true;
+}
+
+static bool _lookup(const _name_value_t *names, size_t n, const char *s, uint8_t &value) {
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(s, names[i].name) == 0) { value = names[i].value; return true; }
+    }
+    uint32_t v;
+    if (!_parse_number(s, v) || v > 0xFF) return false;
+    value = v;
+    return true;
+}
+
+// split off the next comma separated field, trimmed, in place
+static char *_next_field(char *&p) {
+    while (*p == ' ' || *p == '\t') p++;
+    char *field = p;
+    while (*p != '\0' && *p != ',') p++;
+    char *end = p;
+    if (*p == ',') p++;
+    while (end > field && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    *end = '\0';
+    return field;
+}
+
+bool part_table_parse_bin(const uint8_t *data, size_t len, part_table_t &table, char *error, size_t error_len) {
+    table.count = 0;
+    size_t offset = 0;
+    for (; offset + PART_TABLE_ENTRY_SIZE <= len && offset < PART_TABLE_MAX_SIZE; offset += PART_TABLE_ENTRY_SIZE) {
+        const uint8_t *p = data + offset;
+        if (p[0] != 0xAA || p[1] != 0x50) break;
+        if (table.count >= MAX_NUMBER_OF_PARTITIONS) {
+            snprintf(error, error_len, "more than %d partitions", MAX_NUMBER_OF_PARTITIONS);
+            return false;
+        }
+        part_entry_t &e = table.entries[table.count++];
+        e.type = p[2];
+        e.subtype = p[3];
+        memcpy(&e.address, p + 4, 4);
+        memcpy(&e.size, p + 8, 4);
+        memcpy(e.label, p + 12, 16);
+        e.label[16] = '\0';
+        memcpy(&e.flags, p + 28, 4);
+    }
+    if (table.count == 0) {
+        snprintf(error, error_len, "no partition entries");
+        return false;
+    }
+    // the MD5 entry is optional, but if it's there it has to be right
+    if (offset + PART_TABLE_ENTRY_SIZE <= len && data[offset] == 0xEB && data[offset + 1] == 0xEB) {
+        uint8_t digest[16];
+        MD5Builder md5;
+        md5.begin();
+        md5.add((uint8_t *)data, offset);
+        md5.calculate();
+        md5.getBytes(digest);
+        if (memcmp(digest, data + offset + 16, 16) != 0) {
+            snprintf(error, error_len, "table MD5 doesn't match");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool part_table_parse_csv(const char *text, size_t len, uint32_t table_addr, part_table_t &table,
+                          char *error, size_t error_len) {
+    table.count = 0;
+    uint32_t next_offset = table_addr + SPI_FLASH_SEC_SIZE;
+    char line[128];
+    int line_no = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t n = 0;
+        while (pos < len && text[pos] != '\n') {
+            if (n < sizeof(line) - 1) line[n++] = text[pos];
+            pos++;
+        }
+        pos++; // the newline
+        line[n] = '\0';
+        line_no++;
+
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '\r' || *p == '#') continue;
+        if (table.count >= MAX_NUMBER_OF_PARTITIONS) {
+            snprintf(error, error_len, "more than %d partitions", MAX_NUMBER_OF_PARTITIONS);
+            return false;
+        }
+        char *fields[6];
+        for (int f = 0; f < 6; f++) fields[f] = _next_field(p);
+
+        part_entry_t &e = table.entries[table.count];
+        memset(&e, 0, sizeof(e));
+        strncpy(e.label, fields[0], sizeof(e.label) - 1);
+        e.flags = (strstr(fields[5], "encrypted") != NULL) ? 1 : 0;
+        bool ok = _lookup(type_names, sizeof(type_names)/sizeof(type_names[0]), fields[1], e.type);
+        if (ok && e.type == ESP_PARTITION_TYPE_APP && strncmp(fields[2], "ota_", 4) == 0) {
+            e.subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0 + atoi(fields[2] + 4);
+        } else if (ok && e.type == ESP_PARTITION_TYPE_APP) {
+            ok = _lookup(app_subtypes, sizeof(app_subtypes)/sizeof(app_subtypes[0]), fields[2], e.subtype);
+        } else if (ok && e.type == ESP_PARTITION_TYPE_DATA) {
+            ok = _lookup(data_subtypes, sizeof(data_subtypes)/sizeof(data_subtypes[0]), fields[2], e.subtype);
+        } else if (ok) {
+            ok = _lookup(NULL, 0, fields[2], e.subtype);
+        }
+        if (ok) ok = _parse_number(fields[4], e.size);
+        if (ok) {
+            if (*fields[3] == '\0') {
+                uint32_t align = (e.type == ESP_PARTITION_TYPE_APP) ? 0x10000 : SPI_FLASH_SEC_SIZE;
+                e.address = (next_offset + align - 1) & ~(align - 1);
+            } else {
+                ok = _parse_number(fields[3], e.address);
+            }
+        }
+        if (!ok) {
+            snprintf(error, error_len, "bad entry on line %d", line_no);
+            return false;
+        }
+        next_offset = e.address + e.size;
+        table.count++;
+    }
+    if (table.count == 0) {
+        snprintf(error, error_len, "no partitions");
+        return false;
+    }
+    return true;
+}
+
+bool part_table_check(const part_table_t &table, uint32_t table_addr, uint32_t flash_size,
+                      char *error, size_t error_len) {
+    if ((table.count + 1) * PART_TABLE_ENTRY_SIZE > PART_TABLE_MAX_SIZE) {
+        snprintf(error, error_len, "too many partitions for the table");
+        return false;
+    }
+    uint32_t end = table_addr + SPI_FLASH_SEC_SIZE;
+    for (int i = 0; i < table.count; i++) {
+        const part_entry_t &e = table.entries[i];
+        uint32_t align = (e.type == ESP_PARTITION_TYPE_APP) ? 0x10000 : SPI_FLASH_SEC_SIZE;
+        if (e.size == 0 || e.address % align != 0 || e.size % SPI_FLASH_SEC_SIZE != 0) {
+            snprintf(error, error_len, "%s: address or size not aligned to 0x%x", e.label, align);
+            return false;
+        }
+        if (e.address < end) {
+            snprintf(error, error_len, "%s: overlaps the partition table or the partition before", e.label);
+            return false;
+        }
+        if ((uint64_t)e.address + e.size > flash_size) {
+            snprintf(error, error_len, "%s: ends past the flash size (%uK)", e.label, flash_size / 1024);
+            return false;
+        }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(e.label, table.entries[j].label) == 0) {
+                snprintf(error, error_len, "%s: label used twice", e.label);
+                return false;
+            }
+        }
+        end = e.address + e.size;
+    }
+    return true;
+}
+
+void part_table_encode(const part_table_t &table, uint8_t *sector) {
+    memset(sector, 0xFF, SPI_FLASH_SEC_SIZE);
+    uint8_t *p = sector;
+    for (int i = 0; i < table.count; i++) {
+        const part_entry_t &e = table.entries[i];
+        p[0] = 0xAA; p[1] = 0x50; p[2] = e.type; p[3] = e.subtype;
+        memcpy(p + 4, &e.address, 4);
+        memcpy(p + 8, &e.size, 4);
+        memset(p + 12, 0, 16);
+        memcpy(p + 12, e.label, strnlen(e.label, 16));
+        memcpy(p + 28, &e.flags, 4);
+        p += PART_TABLE_ENTRY_SIZE;
+    }
+    // MD5 entry: EB EB, 14x FF, md5 of the entries before it
+    p[0] = 0xEB; p[1] = 0xEB;
+    MD5Builder md5;
+    md5.begin();
+    md5.add(sector, p - sector);
+    md5.calculate();
+    md5.getBytes(p + 16);
+}
+
+int part_table_find_label(const part_table_t &table, const char *label) {
+    for (int i = 0; i < table.count; i++) {
+        if (strncmp(table.entries[i].label, label, sizeof(table.entries[i].label)) == 0) return i;
+    }
+    return -1;
+}
+
+int part_table_find(const part_table_t &table, uint8_t type, uint8_t subtype, int from) {
+    for (int i = (from < 0) ? 0 : from; i < table.count; i++) {
+        const part_entry_t &e = table.entries[i];
+        if (e.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || e.subtype == subtype)) return i;
+    }
+    return -1;
+}
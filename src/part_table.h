@@ -0,0 +1,41 @@
+#ifndef PART_TABLE_H
+#define PART_TABLE_H
+
+// Partition tables as data: parsing CSVs & binary tables, checking & encoding them.
+#include "main.h"
+#include "part_plan.h"
+
+#define PART_TABLE_ENTRY_SIZE   32
+#define PART_TABLE_MAX_SIZE     0x0C00  // what the bootloader reads
+
+typedef struct {
+    uint8_t type;
+    uint8_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    uint32_t flags;
+} part_entry_t;
+
+typedef struct {
+    int count;
+    part_entry_t entries[MAX_NUMBER_OF_PARTITIONS];
+} part_table_t;
+
+// binary table, as in flash (entries, then the MD5 entry); false + error if it isn't one
+bool part_table_parse_bin(const uint8_t *data, size_t len, part_table_t &table, char *error, size_t error_len);
+// CSV like gen_esp32part.py takes; empty offsets follow the previous partition, starting after the table
+bool part_table_parse_csv(const char *text, size_t len, uint32_t table_addr, part_table_t &table,
+                          char *error, size_t error_len);
+// sane for this chip? in order, aligned, not overlapping, after the table, within the flash
+bool part_table_check(const part_table_t &table, uint32_t table_addr, uint32_t flash_size,
+                      char *error, size_t error_len);
+// one flash sector: entries, MD5 entry, 0xFF
+void part_table_encode(const part_table_t &table, uint8_t *sector);
+// index of the entry with that label; -1 if there's none
+int part_table_find_label(const part_table_t &table, const char *label);
+// index of the first entry from `from` on with that type & subtype (ESP_PARTITION_SUBTYPE_ANY
+// for any); -1 if there's none. Pass the last one + 1 to get the next.
+int part_table_find(const part_table_t &table, uint8_t type, uint8_t subtype, int from = 0);
+
+#endif // PART_TABLE_H
@@ -0,0 +1,133 @@
+/**
+ * @file port_task.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Task / queue / mutex wrappers.
+ */
+
+#include "port_task.h"
+
+#ifndef REPART_HOST
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+typedef struct {
+    port_task_fn_t fn;
+    void *arg;
+} _port_task_args_t;
+
+static void _port_task_main(void *param) {
+    _port_task_args_t args = *(_port_task_args_t *)param;
+    free(param);
+    args.fn(args.arg);
+    vTaskDelete(NULL);
+}
+
+static TickType_t _ticks(uint32_t timeout_ms) {
+    return (timeout_ms == PORT_MAX_WAIT) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+}
+
+bool port_task_start(port_task_fn_t fn, void *arg, const char *name, uint32_t stack_size, int core, int priority) {
+    _port_task_args_t *args = (_port_task_args_t *)malloc(sizeof(_port_task_args_t));
+    if (args == NULL) return false;
+    args->fn = fn; args->arg = arg;
+    if (xTaskCreatePinnedToCore(_port_task_main, name, stack_size, args, priority, NULL, core) != pdPASS) {
+        free(args);
+        return false;
+    }
+    return true;
+}
+
+PortQueue::PortQueue(size_t item_size, size_t length) {
+    _handle = xQueueCreate(length, item_size);
+}
+PortQueue::~PortQueue() {
+    if (_handle) vQueueDelete((QueueHandle_t)_handle);
+}
+bool PortQueue::send(const void *item, uint32_t timeout_ms) {
+    return xQueueSend((QueueHandle_t)_handle, item, _ticks(timeout_ms)) == pdTRUE;
+}
+bool PortQueue::receive(void *item, uint32_t timeout_ms) {
+    return xQueueReceive((QueueHandle_t)_handle, item, _ticks(timeout_ms)) == pdTRUE;
+}
+
+PortMutex::PortMutex() {
+    _handle = xSemaphoreCreateMutex();
+}
+PortMutex::~PortMutex() {
+    if (_handle) vSemaphoreDelete((SemaphoreHandle_t)_handle);
+}
+void PortMutex::lock() {
+    xSemaphoreTake((SemaphoreHandle_t)_handle, portMAX_DELAY);
+}
+void PortMutex::unlock() {
+    xSemaphoreGive((SemaphoreHandle_t)_handle);
+}
+
+#else // REPART_HOST
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef struct {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> items;
+    size_t item_size;
+    size_t length;
+} _host_queue_t;
+
+bool port_task_start(port_task_fn_t fn, void *arg, const char *name, uint32_t stack_size, int core, int priority) {
+    std::thread(fn, arg).detach();
+    return true;
+}
+
+PortQueue::PortQueue(size_t item_size, size_t length) {
+    _host_queue_t *q = new _host_queue_t;
+    q->item_size = item_size;
+    q->length = length;
+    _handle = q;
+}
+PortQueue::~PortQueue() {
+    delete (_host_queue_t *)_handle;
+}
+bool PortQueue::send(const void *item, uint32_t timeout_ms) {
+    _host_queue_t *q = (_host_queue_t *)_handle;
+    std::unique_lock<std::mutex> lock(q->lock);
+    auto has_room = [q] { return q->items.size() < q->length; };
+    if (timeout_ms == PORT_MAX_WAIT) q->changed.wait(lock, has_room);
+    else if (!q->changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), has_room)) return false;
+    const uint8_t *p = (const uint8_t *)item;
+    q->items.emplace_back(p, p + q->item_size);
+    q->changed.notify_all();
+    return true;
+}
+bool PortQueue::receive(void *item, uint32_t timeout_ms) {
+    _host_queue_t *q = (_host_queue_t *)_handle;
+    std::unique_lock<std::mutex> lock(q->lock);
+    auto has_item = [q] { return !q->items.empty(); };
+    if (timeout_ms == PORT_MAX_WAIT) q->changed.wait(lock, has_item);
+    else if (!q->changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), has_item)) return false;
+    memcpy(item, q->items.front().data(), q->item_size);
+    q->items.pop_front();
+    q->changed.notify_all();
+    return true;
+}
+
+PortMutex::PortMutex() {
+    _handle = new std::mutex;
+}
+PortMutex::~PortMutex() {
+    delete (std::mutex *)_handle;
+}
+void PortMutex::lock() {
+    ((std::mutex *)_handle)->lock();
+}
+void PortMutex::unlock() {
+    ((std::mutex *)_handle)->unlock();
+}
+#endif
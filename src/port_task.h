@@ -0,0 +1,49 @@
+#ifndef PORT_TASK_H
+#define PORT_TASK_H
+
+// Just enough tasks, queues & mutexes for the mover: FreeRTOS on the ESP32,
+// std::thread and friends on host builds.
+#include "main.h"
+
+#define PORT_MAX_WAIT 0xFFFFFFFF // wait forever
+#define PORT_PRIORITY_LOW       0   // only when nothing else wants the core (idle priority)
+#define PORT_PRIORITY_NORMAL    1   // same as the Arduino loop
+
+typedef void (*port_task_fn_t)(void *arg);
+
+// start fn(arg) in a new task pinned to `core` (core & priority are ignored on host); the task ends when fn returns
+bool port_task_start(port_task_fn_t fn, void *arg, const char *name, uint32_t stack_size, int core,
+                     int priority = PORT_PRIORITY_NORMAL);
+
+// fixed-size item FIFO, safe between tasks
+class PortQueue {
+public:
+    PortQueue(size_t item_size, size_t length);
+    ~PortQueue();
+    bool ok() { return _handle != NULL; }
+    bool send(const void *item, uint32_t timeout_ms);
+    bool receive(void *item, uint32_t timeout_ms);
+private:
+    void *_handle;
+};
+
+class PortMutex {
+public:
+    PortMutex();
+    ~PortMutex();
+    void lock();
+    void unlock();
+private:
+    void *_handle;
+};
+
+// holds a PortMutex for the current scope
+class PortLock {
+public:
+    PortLock(PortMutex &mutex) : _mutex(mutex) { _mutex.lock(); }
+    ~PortLock() { _mutex.unlock(); }
+private:
+    PortMutex &_mutex;
+};
+
+#endif // PORT_TASK_H
@@ -0,0 +1,69 @@
+/**
+ * @file sector_pool.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief Statically reserved sector buffers with scope-bound handles.
+ */
+
+#include "sector_pool.h"
+#include "port_task.h"
+#ifndef REPART_HOST
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#else
+#define DMA_ATTR
+#endif
+
+DMA_ATTR static uint8_t _buffers[SECTOR_POOL_COUNT][SPI_FLASH_SEC_SIZE] __attribute__((aligned(4)));
+
+static struct {
+    uint32_t used;                      // bit per buffer
+    sector_pool_stats_t stats;
+} _pool;
+
+static PortMutex & _pool_mutex() {
+    static PortMutex mutex;
+    return mutex;
+}
+
+bool SectorBuffer::take() {
+    if (_data != NULL) return true;
+    {
+        PortLock lock(_pool_mutex());
+        _pool.stats.takes++;
+        for (int i = 0; i < SECTOR_POOL_COUNT; i++) {
+            if (_pool.used & (1u << i)) continue;
+            _pool.used |= 1u << i;
+            _slot = i;
+            _data = _buffers[i];
+            if (++_pool.stats.in_use > _pool.stats.high_water) _pool.stats.high_water = _pool.stats.in_use;
+            return true;
+        }
+        _pool.stats.fallbacks++;
+    }
+#ifndef REPART_HOST
+    _data = (uint8_t *)heap_caps_malloc(SPI_FLASH_SEC_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+#else
+    _data = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+#endif
+    if (_data == NULL) {
+        PortLock lock(_pool_mutex());
+        _pool.stats.failures++;
+    }
+    return _data != NULL;
+}
+
+SectorBuffer::~SectorBuffer() {
+    if (_slot < 0) {
+        free(_data);
+        return;
+    }
+    PortLock lock(_pool_mutex());
+    _pool.used &= ~(1u << _slot);
+    _pool.stats.in_use--;
+}
+
+void sector_pool_stats(sector_pool_stats_t & stats) {
+    PortLock lock(_pool_mutex());
+    stats = _pool.stats;
+    stats.count = SECTOR_POOL_COUNT;
+}
@@ -0,0 +1,40 @@
+#ifndef SECTOR_POOL_H
+#define SECTOR_POOL_H
+
+// A few 4K sector buffers reserved at link time, in DMA-capable RAM, for the
+// paths that need one for a while: the table copy of a run, the mover's
+// compare buffer, the verifier, erases, and flash reads on the web side. Saves
+// a malloc each (which fails on fragmented heaps) and 4K of someone's stack.
+#include "main.h"
+
+#define SECTOR_POOL_COUNT       5       // a job holds 4 at most, the web server 1
+
+typedef struct {
+    uint32_t count;                     /*!< buffers in the pool */
+    uint32_t in_use;
+    uint32_t high_water;                /*!< most in use at once since boot */
+    uint32_t takes;
+    uint32_t fallbacks;                 /*!< the pool was empty; came from the heap */
+    uint32_t failures;                  /*!< the heap had none either */
+} sector_pool_stats_t;
+
+// one sector buffer for the current scope: from the pool, or the heap if
+// it's empty. data() is NULL if neither had one, or until take() with take_now = false.
+class SectorBuffer {
+public:
+    explicit SectorBuffer(bool take_now = true) : _data(NULL), _slot(-1) { if (take_now) take(); }
+    ~SectorBuffer();
+    // get one, unless it has one already; false if there was none
+    bool take();
+    SectorBuffer(const SectorBuffer &) = delete;
+    SectorBuffer & operator=(const SectorBuffer &) = delete;
+    uint8_t *data() { return _data; }
+    bool ok() { return _data != NULL; }
+private:
+    uint8_t *_data;
+    int _slot;                          // -1 = heap
+};
+
+void sector_pool_stats(sector_pool_stats_t & stats);
+
+#endif // SECTOR_POOL_H
@@ -0,0 +1,445 @@
+/**
+ * @file uart_proto.cpp
+ * @copyright Copyright (c) 2024 John Mueller
+ * @brief The serial bench protocol: frames, and the board's side of it.
+ *
+ * The answer to a command goes out through _UartStream, an OutputSink like
+ * the web pages write to, so the JSON, the dumps & the job's log come from
+ * the same code as theirs. It keeps the frames the client hasn't ACKed yet
+ * (one malloc, the window plus the payload being filled) and resends them
+ * from the oldest when the client NAKs or goes quiet. Runs go through
+ * part_job, so a fix over serial shows on /partition-progress too, and the
+ * other way round.
+ */
+
+#include "uart_proto.h"
+#include "api_json.h"
+#include "digest_cache.h"
+#include "flash_dev.h"
+#include "gz_stream.h"
+#include "metrics.h"
+#include "part_job.h"
+#include "port_task.h"
+
+void uart_put32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+uint32_t uart_get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t uart_frame_encode(uint8_t type, uint8_t seq, const uint8_t *payload, size_t len, uint8_t *out) {
+    out[0] = UART_PROTO_MAGIC0; out[1] = UART_PROTO_MAGIC1;
+    out[2] = type; out[3] = seq;
+    out[4] = len & 0xFF; out[5] = len >> 8;
+    if (len > 0) memcpy(out + UART_PROTO_HEADER_SIZE, payload, len);
+    uart_put32(out + UART_PROTO_HEADER_SIZE + len, gz_crc32(0, out + 2, 4 + len));
+    return UART_PROTO_HEADER_SIZE + len + 4;
+}
+
+// drop n bytes from the front, and what follows them up to the next magic byte
+void UartFrameReader::_drop(size_t n, bool skip) {
+    while (skip && n < _fill && _buf[n] != UART_PROTO_MAGIC0) n++;
+    if (skip) _skipped += n;
+    memmove(_buf, _buf + n, _fill - n);
+    _fill -= n;
+}
+
+// what's in _buf: a frame, a bad one (dropped up to where a good one might start), or not enough yet
+UartFrameReader::result_t UartFrameReader::_parse() {
+    while (_fill >= 2 && _buf[1] != UART_PROTO_MAGIC1) _drop(1, true);
+    if (_fill < UART_PROTO_HEADER_SIZE) return NONE;
+    size_t payload_len = _buf[4] | (_buf[5] << 8);
+    if (payload_len > UART_PROTO_MAX_PAYLOAD) {
+        _drop(1, true);
+        return BAD;
+    }
+    size_t frame_len = UART_PROTO_HEADER_SIZE + payload_len + 4;
+    if (_fill < frame_len) return NONE;
+    if (gz_crc32(0, _buf + 2, 4 + payload_len) != uart_get32(_buf + UART_PROTO_HEADER_SIZE + payload_len)) {
+        _drop(1, true);
+        return BAD;
+    }
+    _frame.type = _buf[2];
+    _frame.seq = _buf[3];
+    _frame.len = payload_len;
+    _frame.payload = _buf + UART_PROTO_HEADER_SIZE;
+    _consumed = frame_len;
+    return FRAME;
+}
+
+UartFrameReader::result_t UartFrameReader::feed(const uint8_t *data, size_t len, size_t & pos) {
+    if (_consumed > 0) {
+        _drop(_consumed, false);
+        _consumed = 0;
+    }
+    while (true) {
+        result_t r = _parse();
+        if (r != NONE || pos >= len) return r;
+        uint8_t b = data[pos++];
+        if (_fill == 0 && b != UART_PROTO_MAGIC0) {
+            _skipped++;
+            continue;
+        }
+        _buf[_fill++] = b;
+    }
+}
+
+bool UartFrameReader::idle() {
+    if (_consumed > 0) {
+        _drop(_consumed, false);
+        _consumed = 0;
+    }
+    if (_fill == 0) return false;
+    _drop(1, true);
+    return true;
+}
+
+// the answer to one command: numbered frames, at most a window of them unACKed
+class _UartStream : public OutputSink {
+public:
+    _UartStream(UartPort & port, UartFrameReader & reader, uint8_t seq)
+        : _port(port), _reader(reader), _pending_type(UART_RSP_DATA), _pending_len(0), _base(seq), _next(seq),
+          _bytes(0), _crc(0), _aborted(false), _gone(false) {
+        _window = (uint8_t *)malloc(UART_PROTO_WINDOW * UART_PROTO_FRAME_MAX + UART_PROTO_MAX_PAYLOAD);
+        _pending = _window + UART_PROTO_WINDOW * UART_PROTO_FRAME_MAX;
+    }
+    ~_UartStream() { free(_window); }
+    bool ok() { return _window != NULL; }
+    // the client stopped listening, or asked us to stop
+    bool done() { return _gone || _aborted; }
+    bool aborted() { return _aborted; }
+
+    // the answer's bytes, as DATA
+    void write(const char *str, size_t len) override {
+        if (done()) return;
+        _add(UART_RSP_DATA, (const uint8_t *)str, len);
+        _bytes += len;
+        _crc = gz_crc32(_crc, (const uint8_t *)str, len);
+    }
+    void log(const char *str, size_t len) { _add(UART_RSP_LOG, (const uint8_t *)str, len); }
+    void flush() override { _send_pending(); }
+    void job_progress(const part_job_status_t & status) {
+        uint8_t payload[12 + 32];
+        uart_put32(payload, status.sectors_done * SPI_FLASH_SEC_SIZE);
+        uart_put32(payload + 4, status.sectors_total * SPI_FLASH_SEC_SIZE);
+        uart_put32(payload + 8, status.bytes_per_s);
+        size_t len = (status.phase != NULL) ? strnlen(status.phase, 32) : 0;
+        if (len > 0) memcpy(payload + 12, status.phase, len);
+        _send_pending();
+        _frame(UART_RSP_PROGRESS, payload, 12 + len);
+    }
+    // the END frame; then wait until the client has everything. False if it's gone.
+    bool end(esp_err_t status, int32_t result = -1) {
+        uint8_t payload[UART_END_SIZE];
+        uart_put32(payload, _aborted ? ESP_ERR_INVALID_STATE : status);
+        uart_put32(payload + 4, _bytes);
+        uart_put32(payload + 8, _crc);
+        uart_put32(payload + 12, result);
+        _aborted = false; // END goes out either way
+        _send_pending();
+        _frame(UART_RSP_END, payload, sizeof(payload));
+        _wait(true);
+        return !_gone;
+    }
+    // take in what the client sends while we wait for something else
+    void poll(uint32_t timeout_ms) {
+        uint8_t buf[32];
+        int n = _port.read(buf, sizeof(buf), timeout_ms);
+        if (n < 0) _gone = true;
+        // a frame that stopped halfway won't finish; maybe there's one behind it
+        if (n < 0 || (n == 0 && (timeout_ms == 0 || !_reader.idle()))) return;
+        size_t pos = 0;
+        UartFrameReader::result_t r;
+        while ((r = _reader.feed(buf, n, pos)) != UartFrameReader::NONE) {
+            if (r != UartFrameReader::FRAME) continue;
+            const uart_frame_t & f = _reader.frame();
+            uint8_t in_flight = _next - _base;
+            uint8_t d = f.seq - _base;
+            if (f.type == UART_CMD_ACK && d < in_flight) {
+                _base = f.seq + 1;
+            } else if (f.type == UART_CMD_NAK && d < in_flight) {
+                _base = f.seq;
+                _resend();
+            } else if (f.type == UART_CMD_ABORT) {
+                _aborted = true;
+            }
+            // anything else is a command sent again while we answer it; ignored
+        }
+    }
+private:
+    void _add(uint8_t type, const uint8_t *data, size_t len) {
+        if (done() || !ok()) return;
+        if (type != _pending_type) _send_pending();
+        _pending_type = type;
+        while (len > 0 && !done()) {
+            size_t n = (len < UART_PROTO_MAX_PAYLOAD - _pending_len) ? len : UART_PROTO_MAX_PAYLOAD - _pending_len;
+            memcpy(_pending + _pending_len, data, n);
+            _pending_len += n;
+            data += n;
+            len -= n;
+            if (_pending_len == UART_PROTO_MAX_PAYLOAD) _send_pending();
+        }
+    }
+    void _send_pending() {
+        if (_pending_len == 0) return;
+        _frame(_pending_type, _pending, _pending_len);
+        _pending_len = 0;
+    }
+    void _frame(uint8_t type, const uint8_t *payload, size_t len) {
+        if (_gone || !ok()) return;
+        poll(0);
+        _wait(false);
+        if (_gone) return;
+        uint8_t *slot = _window + (_next % UART_PROTO_WINDOW) * UART_PROTO_FRAME_MAX;
+        size_t frame_len = uart_frame_encode(type, _next, payload, len, slot);
+        _window_len[_next % UART_PROTO_WINDOW] = frame_len;
+        _next++;
+        if (!_port.write(slot, frame_len)) _gone = true;
+    }
+    // until there's room for another frame, or (all) every frame is ACKed. A client that
+    // talks but doesn't ACK (it sends its next command, say) gets the window again too.
+    void _wait(bool all) {
+        int tries = 0;
+        unsigned long since = millis();
+        while (!_gone && (uint8_t)(_next - _base) >= (all ? 1 : UART_PROTO_WINDOW)) {
+            uint8_t base = _base;
+            poll(UART_PROTO_ACK_TIMEOUT_MS);
+            if (_base != base) {
+                tries = 0;
+                since = millis();
+            } else if (millis() - since >= UART_PROTO_ACK_TIMEOUT_MS) {
+                if (++tries > UART_PROTO_RETRIES) _gone = true;
+                else _resend();
+                since = millis();
+            }
+        }
+    }
+    // go back to the oldest unACKed frame
+    void _resend() {
+        for (uint8_t seq = _base; seq != _next && !_gone; seq++) {
+            const uint8_t *slot = _window + (seq % UART_PROTO_WINDOW) * UART_PROTO_FRAME_MAX;
+            if (!_port.write(slot, _window_len[seq % UART_PROTO_WINDOW])) _gone = true;
+        }
+    }
+    UartPort & _port;
+    UartFrameReader & _reader;
+    uint8_t *_window;                   // UART_PROTO_WINDOW frames, by seq % UART_PROTO_WINDOW
+    uint16_t _window_len[UART_PROTO_WINDOW];
+    uint8_t *_pending;                  // payload being filled, after the window
+    uint8_t _pending_type;
+    size_t _pending_len;
+    uint8_t _base;                      // oldest unACKed seq
+    uint8_t _next;                      // seq of the next frame
+    uint32_t _bytes, _crc;              // of the DATA so far
+    bool _aborted, _gone;
+};
+
+// the log of a run goes out as LOG frames
+class _UartLogSink : public OutputSink {
+public:
+    _UartLogSink(_UartStream & stream) : _stream(stream) {}
+    void write(const char *str, size_t len) override { _stream.log(str, len); }
+private:
+    _UartStream & _stream;
+};
+
+// a run in the background job, or the one that's running already (FIX only):
+// its log & progress while it runs, then its report
+static void _serve_run(_UartStream & out, const uart_proto_hooks_t & hooks, const uart_frame_t & cmd) {
+    bool test_only = (cmd.type == UART_CMD_PLAN);
+    _UartLogSink log(out);
+    if (cmd.len < 2) {
+        out.end(ESP_ERR_INVALID_ARG);
+        return;
+    }
+    part_mgr_opts_t opts = {};
+    opts.keep_fs = (cmd.payload[0] & UART_RUN_KEEP_FS) != 0;
+    opts.verbosity = (cmd.payload[0] & UART_RUN_SUMMARY) ? OUT_VERBOSITY_SUMMARY : OUT_VERBOSITY_SECTORS;
+    opts.move_mode = (cmd.payload[1] == MOVE_MODE_SECTOR || cmd.payload[1] == MOVE_MODE_PIPELINE) ?
+                     (move_mode_t)cmd.payload[1] : MOVE_MODE_BLOCK;
+    size_t len = cmd.len - 2;
+    if (len >= sizeof(opts.strategy)) len = sizeof(opts.strategy) - 1;
+    memcpy(opts.strategy, cmd.payload + 2, len);
+
+    if (part_job_busy()) {
+        if (test_only) {
+            out.end(ESP_ERR_INVALID_STATE);
+            return;
+        }
+        _add_output(log, "A repartition job is running already, showing that one.\n");
+    } else if (!part_job_start(hooks.env(), opts, NULL, 0, test_only)) {
+        _add_output(log, "ERROR: Couldn't start the repartition job.\n");
+        out.end(ESP_FAIL);
+        return;
+    }
+
+    part_job_status_t status;
+    part_job_status(status);
+    uint32_t from = status.log_start;
+    unsigned long last_progress = 0;
+    char buf[256];
+    while (!out.done()) {
+        size_t n;
+        while ((n = part_job_log(from, buf, sizeof(buf))) > 0 && !out.done()) out.log(buf, n);
+        out.flush();
+        part_job_status(status);
+        if (status.state != PART_JOB_RUNNING && from >= status.log_end) break;
+        if (millis() - last_progress >= UART_PROTO_PROGRESS_MS) {
+            out.job_progress(status);
+            last_progress = millis();
+        }
+        out.poll(50);
+    }
+    // the client went away; the job goes on
+    if (out.done() && !out.aborted()) return;
+    part_mgr_report_t *report = part_job_report();
+    if (report != NULL && !out.aborted()) api_json_report(out, *report);
+    free(report);
+    bool reboot = !out.aborted() && !status.test_only && status.result == PART_MGR_DONE;
+    if (out.end(ESP_OK, status.result) && reboot && hooks.reboot != NULL) hooks.reboot();
+}
+
+// flash as it is, or gzipped; not while a job moves things around
+static void _serve_dump(_UartStream & out, const uart_frame_t & cmd) {
+    if (cmd.len < 9) {
+        out.end(ESP_ERR_INVALID_ARG);
+        return;
+    }
+    uint32_t addr = uart_get32(cmd.payload), len = uart_get32(cmd.payload + 4);
+    if (part_job_busy()) {
+        out.end(ESP_ERR_INVALID_STATE);
+        return;
+    }
+    if (addr > flash_dev().size() || len > flash_dev().size() - addr) {
+        out.end(ESP_ERR_INVALID_SIZE);
+        return;
+    }
+    DEBUG_PRINTF("Dumping 0x%x..0x%x over serial\n", addr, addr + len);
+    unsigned long time_start = micros();
+    esp_err_t err;
+    if (cmd.payload[8] & UART_DUMP_GZIP) {
+        GzipSink gz(out);
+        err = flash_dev_stream(addr, len, gz);
+        gz.finish();
+    } else {
+        err = flash_dev_stream(addr, len, out);
+    }
+    out.flush();
+    metrics_record(METRIC_DOWNLOAD, len, micros() - time_start);
+    out.end(err);
+}
+
+static void _serve_command(UartPort & port, UartFrameReader & reader, const uart_proto_hooks_t & hooks,
+                           const uart_frame_t & cmd) {
+    _UartStream out(port, reader, cmd.seq);
+    if (!out.ok()) {
+        // not even the window: say so in a frame of its own
+        uint8_t payload[UART_END_SIZE], frame[UART_PROTO_HEADER_SIZE + UART_END_SIZE + 4];
+        uart_put32(payload, ESP_ERR_NO_MEM);
+        uart_put32(payload + 4, 0);
+        uart_put32(payload + 8, 0);
+        uart_put32(payload + 12, (uint32_t)-1);
+        port.write(frame, uart_frame_encode(UART_RSP_END, cmd.seq, payload, sizeof(payload), frame));
+        return;
+    }
+    switch (cmd.type) {
+    case UART_CMD_HELLO: {
+        uint8_t hello[4] = {UART_PROTO_VERSION, UART_PROTO_MAX_PAYLOAD & 0xFF, UART_PROTO_MAX_PAYLOAD >> 8,
+                            UART_PROTO_WINDOW};
+        out.write((const char *)hello, sizeof(hello));
+        api_json_device(out, hooks.env());
+        out.end(ESP_OK);
+        break;
+    }
+    case UART_CMD_LIST:
+        api_json_table(out);
+        out.end(ESP_OK);
+        break;
+    case UART_CMD_DIGEST:
+        digest_cache_json(out);
+        out.end(ESP_OK);
+        break;
+    case UART_CMD_JOB:
+        api_json_job(out);
+        out.end(ESP_OK);
+        break;
+    case UART_CMD_PLAN:
+    case UART_CMD_FIX:
+        _serve_run(out, hooks, cmd);
+        break;
+    case UART_CMD_DUMP:
+        _serve_dump(out, cmd);
+        break;
+    default:
+        out.end(ESP_ERR_NOT_SUPPORTED);
+        break;
+    }
+}
+
+void uart_proto_serve(UartPort & port, const uart_proto_hooks_t & hooks) {
+    UartFrameReader reader;
+    uint8_t buf[64];
+    int last_type = -1;                 // the command answered last, by type & seq, until the line goes quiet
+    uint8_t last_seq = 0;
+    while (true) {
+        int n = port.read(buf, sizeof(buf), UART_PROTO_ACK_TIMEOUT_MS);
+        if (n < 0) return;
+        if (n == 0) last_type = -1;
+        if (n == 0 && !reader.idle()) continue;
+        size_t pos = 0;
+        UartFrameReader::result_t r;
+        while ((r = reader.feed(buf, n, pos)) != UartFrameReader::NONE) {
+            uint8_t frame[UART_PROTO_HEADER_SIZE + 4];
+            if (r == UartFrameReader::BAD) {
+                port.write(frame, uart_frame_encode(UART_RSP_NAK, 0, NULL, 0, frame));
+                continue;
+            }
+            // ACKs & NAKs left over from an answer the client gave up on
+            if (reader.frame().type >= UART_CMD_ACK && reader.frame().type <= UART_CMD_ABORT) continue;
+            // and that command again, sent before its answer got going; the client has that answer
+            if (reader.frame().type == last_type && reader.frame().seq == last_seq) continue;
+            // the command's payload is in the reader, which the answer reads ACKs with
+            uart_frame_t cmd = reader.frame();
+            uint8_t payload[64];
+            if (cmd.len > sizeof(payload)) cmd.len = sizeof(payload);
+            memcpy(payload, cmd.payload, cmd.len);
+            cmd.payload = payload;
+            _serve_command(port, reader, hooks, cmd);
+            last_type = cmd.type;
+            last_seq = cmd.seq;
+            // the client waits for the END before it sends anything else
+            break;
+        }
+    }
+}
+
+#ifndef REPART_HOST
+class _SerialPort : public UartPort {
+public:
+    int read(uint8_t *data, size_t len, uint32_t timeout_ms) override {
+        unsigned long start = millis();
+        int available;
+        while ((available = Serial.available()) <= 0) {
+            if (millis() - start >= timeout_ms) return 0;
+            delay(1);
+        }
+        return Serial.read(data, ((size_t)available < len) ? available : len);
+    }
+    // one call per frame: the debug log can only come between frames
+    bool write(const uint8_t *data, size_t len) override { return Serial.write(data, len) == len; }
+};
+
+static uart_proto_hooks_t _hooks;
+
+static void _uart_task(void *arg) {
+    _SerialPort port;
+    uart_proto_serve(port, _hooks);
+}
+
+bool uart_proto_start(const uart_proto_hooks_t & hooks) {
+    _hooks = hooks;
+    return port_task_start(_uart_task, NULL, "uart_proto", UART_PROTO_TASK_STACK, UART_PROTO_TASK_CORE);
+}
+#endif
@@ -0,0 +1,129 @@
+#ifndef UART_PROTO_H
+#define UART_PROTO_H
+
+// A binary protocol on the serial port, for benches that have the boards on
+// USB anyway: everything the web pages do for a repair (list, plan, fix,
+// digests, flash dumps), without joining WiFi. One command at a time, the
+// client's; the answer streams back as frames, the last one UART_RSP_END.
+//
+// Frame: A5 5A, type, seq, payload length (16 bit LE), payload, CRC-32 (LE,
+// gz_crc32()) of type..payload. Anything between frames (the debug log shares
+// the port) is skipped. Answer frames are numbered on from the command's seq;
+// the client ACKs each in order, and NAKs the one it's missing if one arrives
+// bad or out of order. The board sends at most UART_PROTO_WINDOW unACKed
+// frames, and resends them all (go-back-N) on a NAK or when ACKs stop coming.
+// The client gives its next command the seq after the last answer's END, so
+// frames of that answer that come again look like what they are, and the
+// board can tell a command sent again from the next one.
+#include "part_mgr.h"
+
+#define UART_PROTO_BAUD             921600  // upload_speed; the debug log shares it
+#define UART_PROTO_VERSION          1
+#define UART_PROTO_MAGIC0           0xA5
+#define UART_PROTO_MAGIC1           0x5A
+#define UART_PROTO_HEADER_SIZE      6
+#define UART_PROTO_MAX_PAYLOAD      1024
+#define UART_PROTO_FRAME_MAX        (UART_PROTO_HEADER_SIZE + UART_PROTO_MAX_PAYLOAD + 4)
+#define UART_PROTO_WINDOW           8       // unACKed frames in flight; 8K at 921600 baud is ~90 ms
+#define UART_PROTO_ACK_TIMEOUT_MS   500     // no ACK for this long: send the window again
+#define UART_PROTO_RETRIES          6       // ... this often, then the client's gone
+#define UART_PROTO_PROGRESS_MS      1000    // progress frames while a job runs, also to keep the line alive
+#define UART_PROTO_TASK_STACK       8192
+#define UART_PROTO_TASK_CORE        1
+
+typedef enum {
+    // client -> board; a command's payload is described with it
+    UART_CMD_HELLO      = 0x01,         /*!< -> DATA: version, max payload, window, device JSON */
+    UART_CMD_LIST       = 0x02,         /*!< -> DATA: the table as JSON, like /api/table */
+    UART_CMD_PLAN       = 0x03,         /*!< run args -> LOG, PROGRESS, DATA: the report JSON; END: result */
+    UART_CMD_FIX        = 0x04,         /*!< run args -> same, for real; the board reboots after a done run */
+    UART_CMD_DIGEST     = 0x05,         /*!< -> DATA: MD5s of the regions, like /digests */
+    UART_CMD_DUMP       = 0x06,         /*!< address, length (32 bit LE), flags -> DATA: the bytes */
+    UART_CMD_JOB        = 0x07,         /*!< -> DATA: the background job, like /api/job */
+    UART_CMD_ACK        = 0x10,         /*!< every answer frame up to seq arrived */
+    UART_CMD_NAK        = 0x11,         /*!< frame seq didn't arrive (right); send again from there */
+    UART_CMD_ABORT      = 0x12,         /*!< stop the answer; END follows with ESP_ERR_INVALID_STATE */
+    // board -> client
+    UART_RSP_DATA       = 0x81,         /*!< the answer's bytes */
+    UART_RSP_LOG        = 0x82,         /*!< log text of a run */
+    UART_RSP_PROGRESS   = 0x83,         /*!< done, total (bytes), bytes/s, all 32 bit LE; then the phase */
+    UART_RSP_END        = 0x84,         /*!< uart_end_t, each field 32 bit LE */
+    UART_RSP_NAK        = 0x85,         /*!< a command arrived bad; send it again */
+} uart_frame_type_t;
+
+// run args for PLAN & FIX: flags, move mode, then the strategy (may be empty)
+#define UART_RUN_KEEP_FS            0x01
+#define UART_RUN_SUMMARY            0x02    // log a line every 10% of a move, not every sector
+// DUMP flags
+#define UART_DUMP_GZIP              0x01    // DATA is a gzip of the range (see GzipSink)
+
+typedef struct {
+    int32_t status;                     /*!< esp_err_t */
+    uint32_t bytes;                     /*!< DATA payload bytes sent */
+    uint32_t crc;                       /*!< gz_crc32() of them */
+    int32_t result;                     /*!< PLAN & FIX: part_mgr_result_t of the run, else -1 */
+} uart_end_t;
+
+#define UART_END_SIZE               16
+
+typedef struct {
+    uint8_t type;
+    uint8_t seq;
+    uint16_t len;
+    const uint8_t *payload;             /*!< in the reader's buffer, until the next feed() or idle() */
+} uart_frame_t;
+
+// the whole frame into `out` (UART_PROTO_FRAME_MAX bytes); returns its length
+size_t uart_frame_encode(uint8_t type, uint8_t seq, const uint8_t *payload, size_t len, uint8_t *out);
+void uart_put32(uint8_t *p, uint32_t v);
+uint32_t uart_get32(const uint8_t *p);
+
+// picks frames out of the byte stream
+class UartFrameReader {
+public:
+    typedef enum {
+        NONE,                           /*!< need more bytes */
+        FRAME,                          /*!< one's complete, see frame() */
+        BAD,                            /*!< one arrived with a wrong CRC or length; skipped */
+    } result_t;
+    UartFrameReader() : _fill(0), _consumed(0), _skipped(0) {}
+    // take bytes from data[pos...len) until a frame is complete (or the bytes run out);
+    // call again until NONE, also with len 0 after idle()
+    result_t feed(const uint8_t *data, size_t len, size_t & pos);
+    // the line went quiet halfway through a frame (its length got garbled, say): drop
+    // that one, as a bad frame; true if there was one
+    bool idle();
+    const uart_frame_t & frame() { return _frame; }
+    uint32_t skipped() { return _skipped; }
+private:
+    result_t _parse();
+    void _drop(size_t n, bool skip);
+    uint8_t _buf[UART_PROTO_FRAME_MAX];
+    size_t _fill;
+    size_t _consumed;                   // the frame handed out last, still at the front of _buf
+    uint32_t _skipped;                  // bytes between frames
+    uart_frame_t _frame;
+};
+
+// the byte pipe: Serial on the board, a tty or pty on host
+class UartPort {
+public:
+    virtual ~UartPort() {}
+    // up to len bytes, waiting up to timeout_ms for the first; 0 on timeout, -1 if the port is gone
+    virtual int read(uint8_t *data, size_t len, uint32_t timeout_ms) = 0;
+    virtual bool write(const uint8_t *data, size_t len) = 0;
+};
+
+typedef struct {
+    part_mgr_env_t (*env)();            /*!< where we run from now */
+    void (*reboot)();                   /*!< after a FIX that's done, once the client has the END */
+} uart_proto_hooks_t;
+
+// answer commands on `port` until it's gone
+void uart_proto_serve(UartPort & port, const uart_proto_hooks_t & hooks);
+#ifndef REPART_HOST
+// serve on Serial in a task of its own, so it works while WiFiManager's portal blocks
+bool uart_proto_start(const uart_proto_hooks_t & hooks);
+#endif
+
+#endif // UART_PROTO_H
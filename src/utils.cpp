@@ -12,7 +12,7 @@ void hex_dump(char *output, int max_len, const uint8_t *data, unsigned int data_
     }
     
     char *ptr = output;
-    for (int i = 0; i < data_len; i++) {
+    for (unsigned int i = 0; i < data_len; i++) {
         // Hex part
         *ptr++ = hex_chars[data[i] >> 4];
         *ptr++ = hex_chars[data[i] & 0x0F];
@@ -28,4 +28,44 @@ void hex_dump(char *output, int max_len, const uint8_t *data, unsigned int data_
         }
     }
     *ptr = '\0';
-}
\ No newline at end of file
+}
+
+// true if the block is all 0xFF, i.e. erased flash
+bool is_blank(const uint8_t *data, size_t data_len) {
+    // word at a time; callers pass sector buffers, which are 4-byte aligned
+    const uint32_t *words = (const uint32_t *)data;
+    for (size_t i = 0; i < data_len / 4; i++) {
+        if (words[i] != 0xFFFFFFFF) return false;
+    }
+    for (size_t i = data_len & ~3; i < data_len; i++) {
+        if (data[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+http_range_t http_range_parse(const char *header, uint32_t total, uint32_t &first, uint32_t &last) {
+    if (header == NULL || strncmp(header, "bytes=", 6) != 0 || strchr(header, ',') != NULL) return HTTP_RANGE_NONE;
+    const char *p = header + 6;
+    char *end;
+    if (*p == '-') {
+        // the last n bytes
+        unsigned long n = strtoul(p + 1, &end, 10);
+        if (end == p + 1 || *end != '\0') return HTTP_RANGE_NONE;
+        if (n == 0 || total == 0) return HTTP_RANGE_UNSATISFIABLE;
+        first = (n < total) ? total - n : 0;
+        last = total - 1;
+        return HTTP_RANGE_OK;
+    }
+    unsigned long a = strtoul(p, &end, 10);
+    if (end == p || *end != '-') return HTTP_RANGE_NONE;
+    p = end + 1;
+    unsigned long b = total ? total - 1 : 0;
+    if (*p != '\0') {
+        b = strtoul(p, &end, 10);
+        if (end == p || *end != '\0' || b < a) return HTTP_RANGE_NONE;
+    }
+    if (a >= total) return HTTP_RANGE_UNSATISFIABLE;
+    first = a;
+    last = (b < total) ? b : total - 1;
+    return HTTP_RANGE_OK;
+}
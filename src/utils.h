@@ -5,5 +5,16 @@
 #include "main.h"
 
 void hex_dump(char *output, int max_len, const uint8_t *data, unsigned int data_len);
+bool is_blank(const uint8_t *data, size_t data_len);
+
+typedef enum {
+    HTTP_RANGE_NONE = 0,                /*!< no (usable) Range header: send it all */
+    HTTP_RANGE_OK,                      /*!< send first..last, inclusive */
+    HTTP_RANGE_UNSATISFIABLE,           /*!< starts past the end: 416 */
+} http_range_t;
+
+// parse a Range header for a resource of `total` bytes; "bytes=a-b", "bytes=a-"
+// and "bytes=-n" work, several ranges or anything odd count as no header
+http_range_t http_range_parse(const char *header, uint32_t total, uint32_t &first, uint32_t &last);
 
 #endif // UTILS_H
\ No newline at end of file